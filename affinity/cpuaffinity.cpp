@@ -0,0 +1,183 @@
+#include <fstream>
+#include <sstream>
+#include <cstdlib>
+#include <cctype>
+
+#include <dirent.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "cpuaffinity.h"
+
+#ifndef MPOL_LOCAL
+#define MPOL_LOCAL 4
+#endif
+
+int CpuAffinity::parse(const std::string &cpuList, cpu_set_t &cpuSet){
+    CPU_ZERO(&cpuSet);
+    std::stringstream ss(cpuList);
+    std::string range;
+    while(std::getline(ss, range, ',')){
+        std::string::size_type dashIndex = range.find('-');
+        std::string first = range.substr(0, dashIndex);
+        std::string last = dashIndex == std::string::npos ? first : range.substr(dashIndex + 1);
+        if(first.empty() || last.empty() || first.find_first_not_of("0123456789") != std::string::npos
+                || last.find_first_not_of("0123456789") != std::string::npos){
+            return -1;
+        }
+        int from = std::atoi(first.c_str()), to = std::atoi(last.c_str());
+        if(from > to || to >= CPU_SETSIZE){
+            return -1;
+        }
+        for(int cpu = from; cpu <= to; ++cpu){
+            CPU_SET(cpu, &cpuSet);
+        }
+    }
+    return CPU_COUNT(&cpuSet) > 0 ? 0 : -1;
+}
+
+std::string CpuAffinity::format(const cpu_set_t &cpuSet){
+    std::ostringstream oss;
+    bool first = true;
+    for(int cpu = 0; cpu < CPU_SETSIZE; ++cpu){
+        if(!CPU_ISSET(cpu, &cpuSet)){
+            continue;
+        }
+        int last = cpu;
+        while(last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, &cpuSet)){
+            ++last;
+        }
+        oss << (first ? "" : ",") << cpu;
+        if(last > cpu){
+            oss << "-" << last;
+        }
+        first = false;
+        cpu = last;
+    }
+    return oss.str();
+}
+
+int CpuAffinity::bindCurrentThread(const cpu_set_t &cpuSet){
+    if(pthread_setaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet) != 0){
+        return -1;
+    }
+    // 之后第一次写入的内存分配在线程当前所在的节点上
+    syscall(SYS_set_mempolicy, MPOL_LOCAL, nullptr, 0);
+    return 0;
+}
+
+int CpuAffinity::numaNodes(){
+    cpu_set_t nodes;
+    if(parse(readLine("/sys/devices/system/node/online"), nodes) != 0){
+        return 1;
+    }
+    return CPU_COUNT(&nodes);
+}
+
+int CpuAffinity::nicDefault(cpu_set_t &cpuSet, std::string &source){
+    if(numaNodes() <= 1){
+        return -1;
+    }
+    cpu_set_t allowed, nicCpus;
+    CPU_ZERO(&nicCpus);
+    if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0){
+        return -1;
+    }
+
+    std::string sources;
+    DIR *netDir = opendir("/sys/class/net");
+    if(netDir == nullptr){
+        return -1;
+    }
+    struct dirent *nic;
+    while((nic = readdir(netDir)) != nullptr){
+        std::string name = nic->d_name;
+        if(name[0] == '.'){
+            continue;
+        }
+        // 只考虑物理网卡：虚拟网卡（lo、bridge、veth 等）没有 device
+        std::string base = "/sys/class/net/" + name;
+        std::string node = readLine(base + "/device/numa_node");
+        if(node.empty()){
+            continue;
+        }
+        cpu_set_t queueCpus;
+        CPU_ZERO(&queueCpus);
+        DIR *queueDir = opendir((base + "/queues").c_str());
+        struct dirent *queue;
+        while(queueDir != nullptr && (queue = readdir(queueDir)) != nullptr){
+            std::string queueName = queue->d_name;
+            std::string file = queueName.compare(0, 3, "rx-") == 0 ? "/rps_cpus" : (queueName.compare(0, 3, "tx-") == 0 ? "/xps_cpus" : "");
+            if(file.empty()){
+                continue;
+            }
+            addMask(readLine(base + "/queues/" + queueName + file), queueCpus);
+        }
+        if(queueDir != nullptr){
+            closedir(queueDir);
+        }
+        CPU_AND(&queueCpus, &queueCpus, &allowed);
+
+        // RPS/XPS 常常设置为所有 CPU（或者所有队列的并集覆盖多个节点），只保留其中和网卡在同一个节点上的 CPU；
+        // 交集为空时使用网卡所在节点的 CPU，网卡没有所属节点（numa_node 为 -1）时才直接使用队列的 CPU
+        cpu_set_t nodeCpus;
+        bool hasNode = std::atoi(node.c_str()) >= 0 && parse(readLine("/sys/devices/system/node/node" + node + "/cpulist"), nodeCpus) == 0;
+        if(hasNode){
+            CPU_AND(&nodeCpus, &nodeCpus, &allowed);
+        }
+        cpu_set_t localCpus;
+        std::string nicSource;
+        if(hasNode){
+            CPU_AND(&localCpus, &queueCpus, &nodeCpus);
+        }
+        if(hasNode && CPU_COUNT(&localCpus) > 0){
+            nicSource = name + "@node" + node + " RPS/XPS";
+        }else if(hasNode && CPU_COUNT(&nodeCpus) > 0){
+            localCpus = nodeCpus;
+            nicSource = name + "@node" + node;
+        }else if(!hasNode && CPU_COUNT(&queueCpus) > 0){
+            localCpus = queueCpus;
+            nicSource = name + " RPS/XPS";
+        }else{
+            continue;
+        }
+        CPU_OR(&nicCpus, &nicCpus, &localCpus);
+        sources += (sources.empty() ? "" : ",") + nicSource;
+    }
+    closedir(netDir);
+
+    if(CPU_COUNT(&nicCpus) == 0){
+        return -1;
+    }
+    cpuSet = nicCpus;
+    source = "NIC-local CPUs of " + sources;
+    return 0;
+}
+
+void CpuAffinity::addMask(const std::string &mask, cpu_set_t &cpuSet){
+    // 最低位在最后，每个十六进制数字表示 4 个 CPU
+    int cpu = 0;
+    for(std::string::const_reverse_iterator it = mask.rbegin(); it != mask.rend(); ++it){
+        if(*it == ','){
+            continue;
+        }
+        if(!std::isxdigit(static_cast<unsigned char>(*it))){
+            break;
+        }
+        int digit = std::isdigit(static_cast<unsigned char>(*it)) ? *it - '0' : std::tolower(static_cast<unsigned char>(*it)) - 'a' + 10;
+        for(int bit = 0; bit < 4 && cpu + bit < CPU_SETSIZE; ++bit){
+            if(digit & (1 << bit)){
+                CPU_SET(cpu + bit, &cpuSet);
+            }
+        }
+        cpu += 4;
+    }
+}
+
+std::string CpuAffinity::readLine(const std::string &path){
+    std::ifstream in(path);
+    std::string line;
+    std::getline(in, line);
+    return line;
+}
@@ -0,0 +1,41 @@
+/*  文件说明：
+ *  1. CPU 集合的解析和格式化，格式与 /sys 中的 cpulist 相同（如 "0-3,8,10-11"）
+ *  2. 将当前线程绑定到 CPU 集合，同时把线程的内存分配策略设置为本地节点（MPOL_LOCAL）：连接的缓冲区、会话和缓存由处理它的线程
+ *     第一次写入，分配在该线程所在的 NUMA 节点上。MPOL_LOCAL 本来就是内核的默认策略，设置它只在进程继承了其他策略时有作用
+ *     （如以 numactl --interleave 启动），否则第一次写入的页面已经分配在本地节点
+ *  3. 默认的 CPU 集合：只有多个 NUMA 节点时才需要绑定。对每块物理网卡，取网卡队列的 RPS/XPS 设置
+ *     （/sys/class/net/<网卡>/queues/rx-N/rps_cpus 和 tx-N/xps_cpus）与网卡所在 NUMA 节点（device/numa_node）的 CPU 的交集；
+ *     RPS/XPS 没有设置或者全部在其他节点上时使用该节点的所有 CPU。结果都与进程允许使用的 CPU 取交集
+ */
+#ifndef CPUAFFINITY_H
+#define CPUAFFINITY_H
+#include <string>
+
+#include <sched.h>
+
+class CpuAffinity{
+public:
+    // 解析 cpulist 格式的 CPU 集合，格式错误或者集合为空时返回 -1
+    static int parse(const std::string &cpuList, cpu_set_t &cpuSet);
+
+    // 将 CPU 集合格式化为 cpulist
+    static std::string format(const cpu_set_t &cpuSet);
+
+    // 将当前线程绑定到 CPU 集合，并设置内存分配策略为本地节点。绑定失败时返回 -1，内存策略设置失败（内核不支持）时忽略
+    static int bindCurrentThread(const cpu_set_t &cpuSet);
+
+    // NUMA 节点的个数，无法获取时返回 1
+    static int numaNodes();
+
+    // 按网卡队列和网卡所在的 NUMA 节点选择默认的 CPU 集合，source 为选择的依据。只有一个 NUMA 节点或者无法确定时返回 -1
+    static int nicDefault(cpu_set_t &cpuSet, std::string &source);
+
+private:
+    // 解析 /sys 中十六进制的 CPU 掩码（如 "00000000,000000ff"），结果加入 cpuSet
+    static void addMask(const std::string &mask, cpu_set_t &cpuSet);
+
+    // 读取文件的第一行，失败时返回空字符串
+    static std::string readLine(const std::string &path);
+};
+
+#endif
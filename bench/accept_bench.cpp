@@ -0,0 +1,245 @@
+/*  文件说明：
+ *  1. 连接突发的基准测试：同时发起指定个数（默认 2000）的非阻塞连接，连接建立后立即发送一个 GET 请求，
+ *     测量从 connect 到收到响应第一个字节的延迟，输出 p50/p99/最大值和超时（10 秒）的连接数
+ *  2. ./accept_bench 地址 端口 [连接数] [路径] [fastopen] 测试运行中的服务器，fastopen 为 1 时使用 TCP_FASTOPEN_CONNECT，
+ *     请求随 SYN 一起发送（需要服务器设置 --fastopen 并且 net.ipv4.tcp_fastopen 允许客户端）
+ *  3. ./accept_bench self [连接数] 在进程内启动两个参考监听套接字作对比：legacy 为 listen(fd, 5)、每次就绪只 accept 一个连接；
+ *     batch 为 backlog 1024、TCP_DEFER_ACCEPT、每次就绪用 accept4 最多接受 64 个连接，用完预算时下一轮继续接受（和服务器的默认值相同）
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#ifndef TCP_FASTOPEN_CONNECT
+#define TCP_FASTOPEN_CONNECT 30
+#endif
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+const int CONNECT_TIMEOUT_MS = 10000;
+
+// 一个客户端连接的状态
+struct ClientConn{
+    int fd = -1;
+    bool sent = false;
+    bool done = false;
+    Clock::time_point start;
+    double latencyMs = -1;
+};
+
+// 同时发起 connNum 个连接，返回每个连接收到响应第一个字节的延迟，超时或失败的连接为 -1
+std::vector<double> burst(const sockaddr_in &addr, int connNum, const std::string &path, bool fastOpen){
+    std::string request = "GET " + path + " HTTP/1.1\r\nHost: bench\r\nConnection: close\r\n\r\n";
+    int epollFd = epoll_create1(0);
+    std::vector<ClientConn> conns(connNum);
+    for(int i = 0; i < connNum; ++i){
+        ClientConn &conn = conns[i];
+        conn.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if(conn.fd == -1){
+            conn.done = true;
+            continue;
+        }
+        int one = 1;
+        if(fastOpen){
+            setsockopt(conn.fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &one, sizeof(one));
+        }
+        conn.start = Clock::now();
+        if(connect(conn.fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0 && errno != EINPROGRESS){
+            close(conn.fd);
+            conn.fd = -1;
+            conn.done = true;
+            continue;
+        }
+        epoll_event event;
+        event.events = EPOLLOUT | EPOLLIN;
+        event.data.u32 = i;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, conn.fd, &event);
+    }
+
+    int remaining = 0;
+    for(int i = 0; i < connNum; ++i){
+        remaining += !conns[i].done;
+    }
+    Clock::time_point deadline = Clock::now() + std::chrono::milliseconds(CONNECT_TIMEOUT_MS);
+    std::vector<epoll_event> events(1024);
+    while(remaining > 0 && Clock::now() < deadline){
+        int n = epoll_wait(epollFd, events.data(), events.size(), 100);
+        for(int i = 0; i < n; ++i){
+            ClientConn &conn = conns[events[i].data.u32];
+            if(conn.done){
+                continue;
+            }
+            if(!conn.sent && (events[i].events & EPOLLOUT)){
+                conn.sent = send(conn.fd, request.c_str(), request.size(), MSG_NOSIGNAL) == static_cast<ssize_t>(request.size());
+                epoll_event event;
+                event.events = EPOLLIN;
+                event.data.u32 = events[i].data.u32;
+                epoll_ctl(epollFd, EPOLL_CTL_MOD, conn.fd, &event);
+            }
+            if(events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)){
+                char buf[512];
+                if(recv(conn.fd, buf, sizeof(buf), 0) > 0){
+                    conn.latencyMs = std::chrono::duration<double, std::milli>(Clock::now() - conn.start).count();
+                }
+                conn.done = true;
+                --remaining;
+                close(conn.fd);
+                conn.fd = -1;
+            }
+        }
+    }
+    close(epollFd);
+
+    std::vector<double> latencies;
+    for(int i = 0; i < connNum; ++i){
+        if(conns[i].fd != -1){
+            close(conns[i].fd);
+        }
+        latencies.push_back(conns[i].latencyMs);
+    }
+    return latencies;
+}
+
+void report(const char *label, std::vector<double> latencies){
+    long long failed = std::count(latencies.begin(), latencies.end(), -1.0);
+    latencies.erase(std::remove(latencies.begin(), latencies.end(), -1.0), latencies.end());
+    if(latencies.empty()){
+        printf("%-7s all %lld connections failed\n", label, failed);
+        return;
+    }
+    std::sort(latencies.begin(), latencies.end());
+    printf("%-7s connections=%zu failed=%lld p50=%.2fms p99=%.2fms max=%.2fms\n", label, latencies.size(), failed,
+            latencies[latencies.size() / 2], latencies[latencies.size() * 99 / 100], latencies.back());
+}
+
+// 进程内的参考服务器：边沿触发监听套接字，batch 为每次就绪最多接受的连接数，收到请求后返回固定的响应
+std::atomic<bool> stopServer(false);
+
+void referenceServer(int listenFd, int batch){
+    static const char response[] = "HTTP/1.1 200 OK\r\nContent-Length: 2\r\nConnection: close\r\n\r\nok";
+    int epollFd = epoll_create1(0);
+    epoll_event event;
+    event.events = EPOLLIN | EPOLLET;
+    event.data.fd = listenFd;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &event);
+    std::vector<epoll_event> events(1025);
+    bool acceptPending = false;
+    while(!stopServer.load()){
+        // 上次用完了预算时监听队列中可能还有连接，边沿触发不会再通知，处理完其他事件后继续接受（和服务器的 acceptPending_ 相同）
+        int n = std::max(0, epoll_wait(epollFd, events.data(), events.size() - 1, acceptPending ? 0 : 50));
+        if(acceptPending){
+            events[n].data.fd = listenFd;
+            ++n;
+            acceptPending = false;
+        }
+        for(int i = 0; i < n; ++i){
+            int fd = events[i].data.fd;
+            if(fd == listenFd){
+                int accepted = 0;
+                for(; accepted < batch; ++accepted){
+                    int clientFd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                    if(clientFd == -1){
+                        break;
+                    }
+                    event.events = EPOLLIN | EPOLLET;
+                    event.data.fd = clientFd;
+                    epoll_ctl(epollFd, EPOLL_CTL_ADD, clientFd, &event);
+                }
+                acceptPending = batch > 1 && accepted == batch;
+                continue;
+            }
+            char buf[1024];
+            if(recv(fd, buf, sizeof(buf), 0) > 0){
+                send(fd, response, sizeof(response) - 1, MSG_NOSIGNAL);
+            }
+            close(fd);
+        }
+    }
+    close(epollFd);
+}
+
+int createListener(int backlog, bool deferAccept, sockaddr_in &addr){
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    socklen_t len = sizeof(addr);
+    if(fd == -1 || bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(fd, backlog) != 0
+            || getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &len) != 0){
+        if(fd != -1){
+            close(fd);
+        }
+        return -1;
+    }
+    int timeout = 5;
+    if(deferAccept){
+        setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &timeout, sizeof(timeout));
+    }
+    return fd;
+}
+
+void runSelf(const char *label, int backlog, bool deferAccept, int batch, int connNum){
+    sockaddr_in addr;
+    int listenFd = createListener(backlog, deferAccept, addr);
+    if(listenFd == -1){
+        perror("create listener");
+        return;
+    }
+    stopServer = false;
+    std::thread server(referenceServer, listenFd, batch);
+    report(label, burst(addr, connNum, "/", false));
+    stopServer = true;
+    server.join();
+    close(listenFd);
+}
+
+}
+
+int main(int argc, char *argv[]){
+    if(argc > 1 && strcmp(argv[1], "self") == 0){
+        int connNum = argc > 2 ? atoi(argv[2]) : 2000;
+        runSelf("legacy", 5, false, 1, connNum);
+        runSelf("batch", 1024, true, 64, connNum);
+        return 0;
+    }
+    if(argc < 3){
+        fprintf(stderr, "usage: %s host port [connections] [path] [fastopen]\n       %s self [connections]\n", argv[0], argv[0]);
+        return 1;
+    }
+    int connNum = argc > 3 ? atoi(argv[3]) : 2000;
+    std::string path = argc > 4 ? argv[4] : "/";
+    bool fastOpen = argc > 5 && atoi(argv[5]) != 0;
+
+    addrinfo hints, *result = nullptr;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if(getaddrinfo(argv[1], argv[2], &hints, &result) != 0 || result == nullptr){
+        fprintf(stderr, "cannot resolve %s:%s\n", argv[1], argv[2]);
+        return 1;
+    }
+    sockaddr_in addr;
+    memcpy(&addr, result->ai_addr, sizeof(addr));
+    freeaddrinfo(result);
+    report(fastOpen ? "tfo" : "burst", burst(addr, connNum, path, fastOpen));
+    return 0;
+}
@@ -0,0 +1,144 @@
+/*  文件说明：
+ *  1. 去重存储（dedup）的基准测试：在临时目录中生成一个指定大小（默认 64 MiB）的伪随机构建产物，
+ *     以不同的文件名保存指定份数（默认 8 份）的变体：第一份为原始内容，之后每份在随机位置改写 4 KiB，奇数份再插入 100 字节
+ *  2. 输出每份的写入吞吐量、新增的物理字节数，以及最终的逻辑字节数、物理字节数和去重率
+ *  3. 再由子进程写入一个新的产物后不提交直接退出（模拟写入中断），父进程调用 sweepOrphans 输出删除的块个数和用时
+ *  4. 用法：./dedup_bench [产物 MiB] [份数]，结束后删除临时目录
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <chrono>
+
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "../storage/storageengine.h"
+#include "../storage/dedupstore.h"
+
+namespace {
+
+double elapsedMillis(std::chrono::steady_clock::time_point start){
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+void fillRandom(std::string &data, unsigned long long seed){
+    unsigned long long state = seed;
+    for(size_t i = 0; i < data.size(); ++i){
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        data[i] = static_cast<char>(state >> 56);
+    }
+}
+
+// 统计块存储中的块文件个数
+long long countChunks(){
+    long long count = 0;
+    DIR *root = opendir(DEDUP_CHUNK_DIR);
+    struct dirent *sub;
+    while(root != nullptr && (sub = readdir(root)) != nullptr){
+        if(sub->d_name[0] == '.'){
+            continue;
+        }
+        DIR *dir = opendir((std::string(DEDUP_CHUNK_DIR) + "/" + sub->d_name).c_str());
+        struct dirent *entry;
+        while(dir != nullptr && (entry = readdir(dir)) != nullptr){
+            count += entry->d_name[0] != '.';
+        }
+        if(dir != nullptr){
+            closedir(dir);
+        }
+    }
+    if(root != nullptr){
+        closedir(root);
+    }
+    return count;
+}
+
+// 从 statsJson 中读取一个整数字段
+long long statsField(const char *field){
+    std::string stats = DedupStore::statsJson();
+    std::string key = std::string("\"") + field + "\":";
+    size_t pos = stats.find(key);
+    return pos == std::string::npos ? -1 : atoll(stats.c_str() + pos + key.size());
+}
+
+// 和上传一样每次追加 1 MiB
+int writeArtifact(DedupWriter &writer, const std::string &data){
+    for(size_t offset = 0; offset < data.size(); offset += 1 << 20){
+        if(writer.update(data.c_str() + offset, std::min<size_t>(1 << 20, data.size() - offset)) != 0){
+            return -1;
+        }
+    }
+    return 0;
+}
+
+}
+
+int main(int argc, char *argv[]){
+    long long artifactMb = argc > 1 ? atoll(argv[1]) : 64;
+    int copies = argc > 2 ? atoi(argv[2]) : 8;
+    if(artifactMb <= 0 || copies <= 0){
+        fprintf(stderr, "usage: %s [artifact MiB] [copies]\n", argv[0]);
+        return 1;
+    }
+
+    char tmpDir[] = "/tmp/dedup_bench.XXXXXX";
+    if(mkdtemp(tmpDir) == nullptr || chdir(tmpDir) != 0 || mkdir("filedir", 0755) != 0){
+        perror("create bench directory");
+        return 1;
+    }
+    if(StorageEngine::select("dedup") != 0){
+        return 1;
+    }
+
+    std::string base(artifactMb << 20, '\0');
+    fillRandom(base, 1);
+    std::string patch(4096, '\0');
+    std::string insert(100, 'x');
+    for(int i = 0; i < copies; ++i){
+        std::string data = base;
+        if(i > 0){
+            fillRandom(patch, i + 1);
+            data.replace((static_cast<size_t>(i) * 7919 * 4096) % (data.size() - patch.size()), patch.size(), patch);
+            if(i % 2 == 1){
+                data.insert((static_cast<size_t>(i) * 104729 * 512) % data.size(), insert);
+            }
+        }
+        long long physicalBefore = statsField("physicalBytes");
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        DedupWriter writer;
+        if(writeArtifact(writer, data) != 0 || writer.finish("artifact-" + std::to_string(i) + ".bin", nullptr) != 0){
+            fprintf(stderr, "store artifact failed\n");
+            return 1;
+        }
+        double costMs = elapsedMillis(start);
+        printf("copy %-3d size=%zu time=%.1fms rate=%.1fMiB/s new_physical=%lld\n", i, data.size(), costMs,
+                data.size() / 1048576.0 / (costMs / 1000), statsField("physicalBytes") - physicalBefore);
+    }
+    printf("logical=%lld physical=%lld ratio=%.2f\n", statsField("logicalBytes"), statsField("physicalBytes"),
+            static_cast<double>(statsField("logicalBytes")) / statsField("physicalBytes"));
+
+    // 子进程写入一个新的产物后不提交，块已经保存但没有清单引用
+    long long chunksBefore = countChunks();
+    pid_t pid = fork();
+    if(pid == 0){
+        std::string data(artifactMb << 20, '\0');
+        fillRandom(data, 1000);
+        DedupWriter writer;
+        writeArtifact(writer, data);
+        _exit(0);
+    }
+    waitpid(pid, nullptr, 0);
+    long long chunksInterrupted = countChunks();
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    long long removed = DedupStore::sweepOrphans();
+    printf("sweep    orphans=%lld removed=%lld time=%.1fms chunks_after=%lld (before interrupted write %lld)\n",
+            chunksInterrupted - chunksBefore, removed, elapsedMillis(start), countChunks(), chunksBefore);
+
+    std::string cleanup = std::string("rm -rf ") + tmpDir;
+    return system(cleanup.c_str()) == 0 ? 0 : 1;
+}
@@ -0,0 +1,175 @@
+/*  文件说明：
+ *  1. 目录占用统计（DirUsage）的基准测试：在临时目录中生成指定个数（默认 50000）的目录和（默认 1000000）个文件，
+ *     目录组成每层最多 64 个子目录的树，文件平均分布在所有目录中，长度用 ftruncate 设置（稀疏文件，不占用磁盘）
+ *  2. 分别用 1 个线程和指定个数（默认 CPU 个数）的线程扫描整个目录树，输出用时和根目录的统计；
+ *     再和 nftw 串行遍历（对每个目录项调用 lstat）的用时和结果比较
+ *  3. 最后输出扫描完成后增量更新（fileWritten）和查询（get）的平均用时
+ *  4. 用法：./dirusage_bench [目录个数] [文件个数] [线程数]，结束后删除临时目录
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+#include <ftw.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "../storage/dirusage.h"
+
+namespace {
+
+double elapsedMillis(std::chrono::steady_clock::time_point start){
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// 执行 DirUsage::scanDir 的简单线程池，代替服务器中的 I/O 线程池
+class ScanPool{
+public:
+    explicit ScanPool(int threadNum) : m_stop(false){
+        for(int i = 0; i < threadNum; ++i){
+            m_threads.push_back(std::thread([this](){ run(); }));
+        }
+    }
+
+    ~ScanPool(){
+        {
+            std::lock_guard<std::mutex> guard(m_lock);
+            m_stop = true;
+        }
+        m_cond.notify_all();
+        for(size_t i = 0; i < m_threads.size(); ++i){
+            m_threads[i].join();
+        }
+    }
+
+    void dispatch(const std::string &dirPath){
+        {
+            std::lock_guard<std::mutex> guard(m_lock);
+            m_queue.push_back(dirPath);
+        }
+        m_cond.notify_one();
+    }
+
+private:
+    void run(){
+        while(1){
+            std::string dirPath;
+            {
+                std::unique_lock<std::mutex> guard(m_lock);
+                m_cond.wait(guard, [this](){ return m_stop || !m_queue.empty(); });
+                if(m_queue.empty()){
+                    return;
+                }
+                dirPath = m_queue.front();
+                m_queue.pop_front();
+            }
+            DirUsage::scanDir(dirPath);
+        }
+    }
+
+private:
+    std::mutex m_lock;
+    std::condition_variable m_cond;
+    std::deque<std::string> m_queue;
+    std::vector<std::thread> m_threads;
+    bool m_stop;
+};
+
+// 用 threadNum 个线程扫描，等待扫描完成
+void runScan(int threadNum){
+    ScanPool pool(threadNum);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    if(DirUsage::scan([&pool](const std::string &dirPath){ pool.dispatch(dirPath); }) != 0){
+        fprintf(stderr, "scan already running\n");
+        return;
+    }
+    while(!DirUsage::isReady()){
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    double costMs = elapsedMillis(start);
+    DirStat root;
+    DirUsage::get("", root);
+    printf("scan     threads=%-3d time=%.1fms bytes=%lld files=%lld dirs=%lld\n", threadNum, costMs, root.bytes, root.files, root.dirs);
+}
+
+long long walkBytes = 0, walkFiles = 0, walkDirs = 0;
+
+int walkEntry(const char *, const struct stat *fileStat, int type, struct FTW *){
+    if(type == FTW_F && S_ISREG(fileStat->st_mode)){
+        walkBytes += fileStat->st_size;
+        ++walkFiles;
+    }else if(type == FTW_D){
+        ++walkDirs;
+    }
+    return 0;
+}
+
+}
+
+int main(int argc, char *argv[]){
+    long long dirCount = argc > 1 ? atoll(argv[1]) : 50000;
+    long long fileCount = argc > 2 ? atoll(argv[2]) : 1000000;
+    int threadNum = argc > 3 ? atoi(argv[3]) : static_cast<int>(std::thread::hardware_concurrency());
+    if(dirCount <= 0 || fileCount < 0 || threadNum <= 0){
+        fprintf(stderr, "usage: %s [dir count] [file count] [threads]\n", argv[0]);
+        return 1;
+    }
+
+    char tmpDir[] = "/tmp/dirusage_bench.XXXXXX";
+    if(mkdtemp(tmpDir) == nullptr || chdir(tmpDir) != 0 || mkdir("filedir", 0755) != 0){
+        perror("create bench directory");
+        return 1;
+    }
+
+    // 目录 i 的父目录为 (i - 1) / 64，目录 0 为 filedir 本身
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::vector<std::string> dirPaths(1, "filedir");
+    for(long long i = 1; i < dirCount; ++i){
+        dirPaths.push_back(dirPaths[(i - 1) / 64] + "/d" + std::to_string(i));
+        if(mkdir(dirPaths.back().c_str(), 0755) != 0){
+            perror("create directory");
+            return 1;
+        }
+    }
+    for(long long i = 0; i < fileCount; ++i){
+        std::string path = dirPaths[i % dirCount] + "/f" + std::to_string(i);
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if(fd == -1 || ftruncate(fd, (i * 2654435761LL) % 65536) != 0 || close(fd) != 0){
+            perror("create file");
+            return 1;
+        }
+    }
+    printf("generate dirs=%lld files=%lld time=%.1fms\n", dirCount, fileCount, elapsedMillis(start));
+
+    runScan(1);
+    runScan(threadNum);
+
+    start = std::chrono::steady_clock::now();
+    nftw("filedir", walkEntry, 64, FTW_PHYS);
+    printf("nftw     threads=1   time=%.1fms bytes=%lld files=%lld dirs=%lld\n", elapsedMillis(start), walkBytes, walkFiles, walkDirs - 1);
+
+    // 增量更新最深的目录中的文件（需要更新所有上级目录）和查询根目录
+    const int rounds = 100000;
+    std::string deepFile = dirPaths.back().substr(8) + "/new";
+    start = std::chrono::steady_clock::now();
+    for(int i = 0; i < rounds; ++i){
+        DirUsage::fileWritten(deepFile, i == 0 ? -1 : 100, 100);
+    }
+    double updateUs = elapsedMillis(start) * 1000 / rounds;
+    DirStat root;
+    start = std::chrono::steady_clock::now();
+    for(int i = 0; i < rounds; ++i){
+        DirUsage::get("", root);
+    }
+    printf("update   avg=%.2fus get_avg=%.2fus files_after=%lld\n", updateUs, elapsedMillis(start) * 1000 / rounds, root.files);
+
+    std::string cleanup = std::string("rm -rf ") + tmpDir;
+    return system(cleanup.c_str()) == 0 ? 0 : 1;
+}
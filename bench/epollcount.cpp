@@ -0,0 +1,48 @@
+/*  文件说明：
+ *  1. 统计服务器调用 epoll_ctl 的次数（沙箱中没有 strace 时代替 strace -c -e epoll_ctl），编译为共享库后用 LD_PRELOAD 加载，
+ *     拦截 epoll_ctl 并按操作（ADD/DEL/MOD）计数，MOD 再按是否注册 EPOLLOUT 区分，进程正常退出时写入结果
+ *  2. 用法：EPOLLCOUNT_OUT=结果文件 LD_PRELOAD=./epollcount.so ./fileserver，发送固定个数的请求后用 SIGTERM 结束服务器，
+ *     结果文件默认为 /tmp/epollcount.txt；不发送请求时的计数为启动时注册监听套接字等的次数，从结果中减去
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <atomic>
+
+#include <dlfcn.h>
+#include <sys/epoll.h>
+
+namespace {
+
+typedef int (*EpollCtlFunc)(int, int, int, epoll_event*);
+
+std::atomic<long long> addCount(0);
+std::atomic<long long> delCount(0);
+std::atomic<long long> modInCount(0);        // 只注册可读事件的 MOD
+std::atomic<long long> modOutCount(0);       // 注册了可写事件的 MOD
+
+struct Reporter{
+    ~Reporter(){
+        const char *path = getenv("EPOLLCOUNT_OUT");
+        FILE *out = fopen(path != nullptr ? path : "/tmp/epollcount.txt", "w");
+        if(out == nullptr){
+            return;
+        }
+        fprintf(out, "add=%lld del=%lld mod=%lld (arm_in=%lld arm_out=%lld)\n", addCount.load(), delCount.load(),
+                modInCount.load() + modOutCount.load(), modInCount.load(), modOutCount.load());
+        fclose(out);
+    }
+} reporter;
+
+}
+
+extern "C" int epoll_ctl(int epollFd, int op, int fd, epoll_event *event){
+    static EpollCtlFunc realEpollCtl = reinterpret_cast<EpollCtlFunc>(dlsym(RTLD_NEXT, "epoll_ctl"));
+    if(op == EPOLL_CTL_ADD){
+        addCount.fetch_add(1);
+    }else if(op == EPOLL_CTL_DEL){
+        delCount.fetch_add(1);
+    }else if(op == EPOLL_CTL_MOD){
+        (event != nullptr && (event->events & EPOLLOUT) ? modOutCount : modInCount).fetch_add(1);
+    }
+    return realEpollCtl(epollFd, op, fd, event);
+}
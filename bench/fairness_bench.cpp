@@ -0,0 +1,133 @@
+/*  文件说明：
+ *  1. 大文件传输时小请求延迟的基准测试（客户端）：先只发送小请求测量基准延迟，再启动指定个数的连接不断下载大文件，
+ *     同时再次测量小请求的延迟，输出两次的 p50/p99/最大值和大文件下载的总吞吐量
+ *  2. 每个请求使用一个新连接（Connection: close），读取到连接关闭为止，延迟包括建立连接
+ *  3. 用于比较服务器设置不同的每个事件收发字节数和时间预算时，大文件传输对文件列表等小请求的影响
+ *  4. 用法：./fairness_bench 地址 端口 大文件路径 小请求路径 [下载连接数] [秒数]，例如
+ *     ./fairness_bench 127.0.0.1 8888 /download/big.iso /list/ 8 10
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+
+#include <unistd.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+sockaddr_in serverAddr;
+std::atomic<bool> stopFlag(false);
+std::atomic<long long> bulkBytes(0);
+
+// 发送一个 GET 请求并读取整个响应，返回读取的字节数，失败时返回 -1
+long long fetch(const std::string &path, bool countBulk){
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(fd == -1){
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if(connect(fd, reinterpret_cast<sockaddr*>(&serverAddr), sizeof(serverAddr)) != 0){
+        close(fd);
+        return -1;
+    }
+    std::string request = "GET " + path + " HTTP/1.1\r\nHost: bench\r\nConnection: close\r\n\r\n";
+    if(send(fd, request.c_str(), request.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(request.size())){
+        close(fd);
+        return -1;
+    }
+    char buf[65536];
+    long long total = 0;
+    ssize_t len;
+    while((len = recv(fd, buf, sizeof(buf), 0)) > 0){
+        total += len;
+        if(countBulk){
+            bulkBytes.fetch_add(len);
+        }
+        if(countBulk && stopFlag.load()){
+            break;
+        }
+    }
+    close(fd);
+    return total;
+}
+
+// 在 seconds 秒内依次发送小请求，输出延迟分布
+void measureSmall(const char *label, const std::string &path, int seconds){
+    std::vector<double> costs;
+    long long failed = 0;
+    Clock::time_point end = Clock::now() + std::chrono::seconds(seconds);
+    while(Clock::now() < end){
+        Clock::time_point start = Clock::now();
+        if(fetch(path, false) <= 0){
+            ++failed;
+            continue;
+        }
+        costs.push_back(std::chrono::duration<double, std::milli>(Clock::now() - start).count());
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    if(costs.empty()){
+        printf("%-9s no request succeeded (failed=%lld)\n", label, failed);
+        return;
+    }
+    std::sort(costs.begin(), costs.end());
+    printf("%-9s requests=%zu failed=%lld p50=%.2fms p99=%.2fms max=%.2fms\n", label, costs.size(), failed,
+            costs[costs.size() / 2], costs[costs.size() * 99 / 100], costs.back());
+}
+
+}
+
+int main(int argc, char *argv[]){
+    if(argc < 5){
+        fprintf(stderr, "usage: %s host port bulk-path small-path [bulk connections] [seconds]\n", argv[0]);
+        return 1;
+    }
+    int bulkConns = argc > 5 ? atoi(argv[5]) : 8;
+    int seconds = argc > 6 ? atoi(argv[6]) : 10;
+
+    addrinfo hints, *result = nullptr;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if(getaddrinfo(argv[1], argv[2], &hints, &result) != 0 || result == nullptr){
+        fprintf(stderr, "cannot resolve %s:%s\n", argv[1], argv[2]);
+        return 1;
+    }
+    memcpy(&serverAddr, result->ai_addr, sizeof(serverAddr));
+    freeaddrinfo(result);
+
+    measureSmall("idle", argv[4], seconds);
+
+    std::vector<std::thread> bulkThreads;
+    std::string bulkPath = argv[3];
+    for(int i = 0; i < bulkConns; ++i){
+        bulkThreads.push_back(std::thread([bulkPath](){
+            while(!stopFlag.load() && fetch(bulkPath, true) >= 0){
+            }
+        }));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    long long bytesBefore = bulkBytes.load();
+    Clock::time_point start = Clock::now();
+    measureSmall("loaded", argv[4], seconds);
+    double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    long long bytes = bulkBytes.load() - bytesBefore;
+    stopFlag = true;
+    for(size_t i = 0; i < bulkThreads.size(); ++i){
+        bulkThreads[i].join();
+    }
+    printf("bulk      connections=%d throughput=%.1fMiB/s\n", bulkConns, bytes / 1048576.0 / elapsed);
+    return 0;
+}
@@ -0,0 +1,102 @@
+/*  文件说明：
+ *  1. 线程池交互和批量两个队列（webserver::ThreadPool）的基准测试：所有线程都被批量任务占满时，测量交互任务从提交到开始执行的延迟
+ *  2. 批量任务模拟大文件传输的后续事件：每个任务阻塞指定毫秒（等待套接字可写）后重新提交自己，同时在途的任务数为线程数的两倍；
+ *     交互任务每毫秒提交一个，执行 50 微秒
+ *  3. 模式 fifo 把批量任务也作为交互任务提交（只有一个队列时的行为），模式 lanes 作为批量任务提交，输出交互任务延迟的 p50/p99/最大值
+ *     和完成的批量任务个数
+ *  4. 用法：./lane_bench [线程数] [秒数] [批量任务毫秒]
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <stdexcept>
+
+#include "../src/threadpool/thread_pool.h"
+
+using webserver::ThreadPool;
+using webserver::TaskPriority;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+std::atomic<bool> stopFlag(false);
+std::atomic<long long> bulkDone(0);
+
+void spinFor(std::chrono::microseconds duration){
+    Clock::time_point end = Clock::now() + duration;
+    while(Clock::now() < end){
+    }
+}
+
+// 一个批量传输：每次执行阻塞 chunkMs 毫秒，没有停止时作为新任务重新提交
+void submitBulk(ThreadPool &pool, TaskPriority priority, int chunkMs){
+    pool.submitWithPriority(priority, [&pool, priority, chunkMs](){
+        std::this_thread::sleep_for(std::chrono::milliseconds(chunkMs));
+        bulkDone.fetch_add(1);
+        if(!stopFlag.load()){
+            try{
+                submitBulk(pool, priority, chunkMs);
+            }catch(const std::runtime_error &){
+                // 线程池正在关闭
+            }
+        }
+    });
+}
+
+void runMode(const char *mode, TaskPriority bulkPriority, size_t threadNum, int seconds, int chunkMs){
+    stopFlag = false;
+    bulkDone = 0;
+    std::vector<double> delays;
+    std::mutex delayLock;
+    {
+        ThreadPool pool(threadNum);
+        // 过载检测只用于服务器拒绝新请求，这里关闭
+        pool.setQueueDelayTarget(std::chrono::milliseconds(0), std::chrono::milliseconds(100));
+        for(size_t i = 0; i < threadNum * 2; ++i){
+            submitBulk(pool, bulkPriority, chunkMs);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+        Clock::time_point end = Clock::now() + std::chrono::seconds(seconds);
+        while(Clock::now() < end){
+            Clock::time_point submitted = Clock::now();
+            pool.submitWithPriority(TaskPriority::Interactive, [submitted, &delays, &delayLock](){
+                double delayMs = std::chrono::duration<double, std::milli>(Clock::now() - submitted).count();
+                spinFor(std::chrono::microseconds(50));
+                std::lock_guard<std::mutex> guard(delayLock);
+                delays.push_back(delayMs);
+            });
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        stopFlag = true;
+    }
+
+    std::sort(delays.begin(), delays.end());
+    if(delays.empty()){
+        printf("%-6s no interactive task finished\n", mode);
+        return;
+    }
+    printf("%-6s threads=%zu interactive=%zu p50=%.3fms p99=%.3fms max=%.3fms bulk_done=%lld\n", mode, threadNum, delays.size(),
+            delays[delays.size() / 2], delays[delays.size() * 99 / 100], delays.back(), bulkDone.load());
+}
+
+}
+
+int main(int argc, char *argv[]){
+    size_t threadNum = argc > 1 ? static_cast<size_t>(atoi(argv[1])) : 8;
+    int seconds = argc > 2 ? atoi(argv[2]) : 5;
+    int chunkMs = argc > 3 ? atoi(argv[3]) : 5;
+    if(threadNum == 0 || seconds <= 0 || chunkMs <= 0){
+        fprintf(stderr, "usage: %s [threads] [seconds] [bulk task ms]\n", argv[0]);
+        return 1;
+    }
+    runMode("fifo", TaskPriority::Interactive, threadNum, seconds, chunkMs);
+    runMode("lanes", TaskPriority::Bulk, threadNum, seconds, chunkMs);
+    return 0;
+}
@@ -0,0 +1,97 @@
+/*  文件说明：
+ *  1. CPU 绑定（CpuAffinity）的基准测试：启动和工作线程个数相同的线程，每个线程第一次写入自己的缓冲区后反复随机读写，
+ *     模拟工作线程访问连接的缓冲区和会话，输出每秒的访问次数
+ *  2. 模式 none 不绑定；nic 使用 CpuAffinity::nicDefault 选择的网卡本地 CPU（单节点或无法确定时使用进程允许的所有 CPU）；
+ *     其他参数作为 cpulist 绑定。绑定时同时设置 MPOL_LOCAL
+ *  3. 跨节点访问的次数需要用 perf stat 观察，见 numa_bench.sh
+ *  4. 用法：./numa_bench [none|nic|cpulist] [线程数] [秒数] [每个线程的缓冲区 MiB]
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+
+#include <sched.h>
+
+#include "../affinity/cpuaffinity.h"
+
+namespace {
+
+std::atomic<bool> stopFlag(false);
+
+void worker(const cpu_set_t *cpuSet, size_t bufferBytes, unsigned seed, unsigned long long *accesses){
+    if(cpuSet != nullptr && CpuAffinity::bindCurrentThread(*cpuSet) != 0){
+        fprintf(stderr, "bind failed\n");
+    }
+    // 由当前线程第一次写入，页面分配在当前线程所在的节点上（或者继承的内存策略指定的节点上）
+    std::vector<unsigned long long> buffer(bufferBytes / sizeof(unsigned long long), 1);
+    size_t mask = 1;
+    while(mask * 2 <= buffer.size()){
+        mask *= 2;
+    }
+    --mask;
+    unsigned long long count = 0;
+    unsigned long long state = seed;
+    while(!stopFlag.load(std::memory_order_relaxed)){
+        for(int i = 0; i < 4096; ++i){
+            state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+            buffer[(state >> 20) & mask] += i;
+        }
+        count += 4096;
+    }
+    *accesses = count + buffer[seed & mask] % 2;
+}
+
+}
+
+int main(int argc, char *argv[]){
+    std::string mode = argc > 1 ? argv[1] : "nic";
+    int threadNum = argc > 2 ? atoi(argv[2]) : 0;
+    int seconds = argc > 3 ? atoi(argv[3]) : 10;
+    long long bufferMb = argc > 4 ? atoll(argv[4]) : 64;
+
+    cpu_set_t cpuSet;
+    const cpu_set_t *bindSet = nullptr;
+    std::string source = "not bound";
+    if(mode == "nic"){
+        if(CpuAffinity::nicDefault(cpuSet, source) != 0){
+            sched_getaffinity(0, sizeof(cpuSet), &cpuSet);
+            source = "allowed CPUs (single node or no NIC-local CPUs)";
+        }
+        bindSet = &cpuSet;
+    }else if(mode != "none"){
+        if(CpuAffinity::parse(mode, cpuSet) != 0){
+            fprintf(stderr, "usage: %s [none|nic|cpulist] [threads] [seconds] [buffer MiB per thread]\n", argv[0]);
+            return 1;
+        }
+        source = "cpulist";
+        bindSet = &cpuSet;
+    }
+    if(threadNum <= 0){
+        if(bindSet == nullptr){
+            sched_getaffinity(0, sizeof(cpuSet), &cpuSet);
+        }
+        threadNum = CPU_COUNT(&cpuSet);
+    }
+
+    printf("mode=%s cpus=%s source=%s threads=%d nodes=%d\n", mode.c_str(), bindSet != nullptr ? CpuAffinity::format(*bindSet).c_str() : "-",
+            source.c_str(), threadNum, CpuAffinity::numaNodes());
+    std::vector<unsigned long long> accesses(threadNum, 0);
+    std::vector<std::thread> threads;
+    for(int i = 0; i < threadNum; ++i){
+        threads.push_back(std::thread(worker, bindSet, static_cast<size_t>(bufferMb) * 1024 * 1024, i + 1, &accesses[i]));
+    }
+    std::this_thread::sleep_for(std::chrono::seconds(seconds));
+    stopFlag = true;
+    unsigned long long total = 0;
+    for(int i = 0; i < threadNum; ++i){
+        threads[i].join();
+        total += accesses[i];
+    }
+    printf("accesses=%llu rate=%.1fM/s\n", total, total / 1e6 / seconds);
+    return 0;
+}
@@ -0,0 +1,12 @@
+#!/bin/bash
+# 用 perf stat 比较不绑定和绑定到网卡本地 CPU 时的跨节点内存访问（node-load-misses）和每周期指令数
+# 用法：./numa_bench.sh [线程数] [秒数]；以 numactl --interleave=all ./numa_bench.sh 运行时可以观察 MPOL_LOCAL 的作用
+THREADS=${1:-0}
+SECONDS_RUN=${2:-10}
+EVENTS=cycles,instructions,cache-misses,node-loads,node-load-misses,node-stores,node-store-misses
+
+make -s numa_bench || exit 1
+for mode in none nic; do
+    echo "== $mode"
+    perf stat -e $EVENTS ./numa_bench $mode $THREADS $SECONDS_RUN
+done
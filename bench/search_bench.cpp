@@ -0,0 +1,114 @@
+/*  文件说明：
+ *  1. 文件名搜索索引（SearchIndex）的基准测试：在临时目录中创建指定个数（默认 1000000）的空文件，使用 flat 存储引擎建立索引
+ *  2. 输出建立索引的用时、建立前后进程的常驻内存，以及前缀查询、子串查询和深分页查询的 p50/p99 延迟
+ *  3. 用法：./search_bench [文件个数] [每种查询的次数]，结束后删除临时目录
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "../storage/storageengine.h"
+#include "../storage/searchindex.h"
+
+namespace {
+
+// 进程当前的常驻内存（KiB）
+long long residentKb(){
+    FILE *fp = fopen("/proc/self/status", "r");
+    if(fp == nullptr){
+        return -1;
+    }
+    char line[256];
+    long long kb = -1;
+    while(fgets(line, sizeof(line), fp) != nullptr){
+        if(strncmp(line, "VmRSS:", 6) == 0){
+            kb = atoll(line + 6);
+            break;
+        }
+    }
+    fclose(fp);
+    return kb;
+}
+
+double elapsedMicros(std::chrono::steady_clock::time_point start){
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+}
+
+// 执行 rounds 次查询，输出 p50 和 p99 延迟
+void runQueries(const char *label, const std::vector<std::string> &queries, long long offset, long long limit){
+    std::vector<double> costs;
+    long long totalMatches = 0;
+    for(size_t i = 0; i < queries.size(); ++i){
+        std::vector<std::string> matches;
+        long long total = 0;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        SearchIndex::search(queries[i], offset, limit, matches, total);
+        costs.push_back(elapsedMicros(start));
+        totalMatches += total;
+    }
+    std::sort(costs.begin(), costs.end());
+    printf("%-10s queries=%zu avg_total=%lld p50=%.1fus p99=%.1fus\n", label, costs.size(),
+            totalMatches / static_cast<long long>(costs.size()), costs[costs.size() / 2], costs[costs.size() * 99 / 100]);
+}
+
+}
+
+int main(int argc, char *argv[]){
+    long long fileCount = argc > 1 ? atoll(argv[1]) : 1000000;
+    long long rounds = argc > 2 ? atoll(argv[2]) : 1000;
+    if(fileCount <= 0 || rounds <= 0){
+        fprintf(stderr, "usage: %s [file count] [queries per kind]\n", argv[0]);
+        return 1;
+    }
+
+    // 在临时目录中创建 filedir，文件名类似 report-000123-q3.pdf，前缀和子串查询都有足够多的结果
+    char tmpDir[] = "/tmp/search_bench.XXXXXX";
+    if(mkdtemp(tmpDir) == nullptr || chdir(tmpDir) != 0 || mkdir("filedir", 0755) != 0){
+        perror("create bench directory");
+        return 1;
+    }
+    static const char *prefixes[] = { "report", "photo", "backup", "invoice", "notes" };
+    static const char *suffixes[] = { ".pdf", ".jpg", ".tar.gz", ".txt", ".docx" };
+    char name[128];
+    for(long long i = 0; i < fileCount; ++i){
+        snprintf(name, sizeof(name), "filedir/%s-%06lld-q%lld%s", prefixes[i % 5], i, i % 4 + 1, suffixes[(i / 5) % 5]);
+        int fd = open(name, O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if(fd == -1){
+            perror("create file");
+            return 1;
+        }
+        close(fd);
+    }
+    if(StorageEngine::select("flat") != 0){
+        return 1;
+    }
+
+    long long rssBefore = residentKb();
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    SearchIndex::build();
+    printf("build      files=%lld time=%.1fms rss_delta=%lldKiB\n", fileCount, elapsedMicros(start) / 1000, residentKb() - rssBefore);
+
+    // 前缀查询（两次二分查找）、子串查询（三元组倒排列表）和很大的 offset（应被调整到文件个数，不会溢出）
+    std::vector<std::string> prefixQueries, substringQueries;
+    for(long long i = 0; i < rounds; ++i){
+        snprintf(name, sizeof(name), "%s-%03lld", prefixes[i % 5], i % 1000);
+        prefixQueries.push_back(name);
+        snprintf(name, sizeof(name), "%04lld-q%lld", i % 10000, i % 4 + 1);
+        substringQueries.push_back(name);
+    }
+    runQueries("prefix", prefixQueries, 0, SEARCH_DEFAULT_LIMIT);
+    runQueries("substring", substringQueries, 0, SEARCH_DEFAULT_LIMIT);
+    runQueries("deep-page", prefixQueries, 0x7fffffffffffffffLL, SEARCH_MAX_LIMIT);
+
+    // 删除临时目录
+    std::string cleanup = std::string("rm -rf ") + tmpDir;
+    return system(cleanup.c_str()) == 0 ? 0 : 1;
+}
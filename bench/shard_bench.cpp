@@ -0,0 +1,105 @@
+/*  文件说明：
+ *  1. 存储引擎 sharded 文件列表的基准测试：在临时目录中通过 importFile 保存指定个数（默认 100000）的空文件，
+ *     输出 list 的用时和存在的子目录个数；再删除到只剩指定个数（默认 100）的文件，重复输出
+ *  2. 删除子目录中最后一个文件时子目录一起被删除，文件很少时 list 只读取少量子目录，用时应和文件个数成正比
+ *  3. 用法：./shard_bench [文件个数] [删除后保留的文件个数] [list 的次数]，结束后删除临时目录
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "../storage/storageengine.h"
+#include "../storage/shardedstore.h"
+
+namespace {
+
+// 统计存在的一级和二级子目录个数
+long long countShardDirs(){
+    long long count = 0;
+    DIR *root = opendir(SHARDED_ROOT_DIR);
+    if(root == nullptr){
+        return 0;
+    }
+    struct dirent *first;
+    while((first = readdir(root)) != nullptr){
+        if(first->d_name[0] == '.'){
+            continue;
+        }
+        ++count;
+        DIR *dir = opendir((std::string(SHARDED_ROOT_DIR) + "/" + first->d_name).c_str());
+        struct dirent *second;
+        while(dir != nullptr && (second = readdir(dir)) != nullptr){
+            count += second->d_name[0] != '.';
+        }
+        if(dir != nullptr){
+            closedir(dir);
+        }
+    }
+    closedir(root);
+    return count;
+}
+
+// 执行 rounds 次 list，输出 p50 用时
+void runList(const char *label, long long rounds){
+    std::vector<double> costs;
+    size_t listed = 0;
+    for(long long i = 0; i < rounds; ++i){
+        std::vector<std::string> names;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        StorageEngine::current()->list(names);
+        costs.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+        listed = names.size();
+    }
+    std::sort(costs.begin(), costs.end());
+    printf("%-8s files=%zu shard_dirs=%lld list_p50=%.2fms\n", label, listed, countShardDirs(), costs[costs.size() / 2]);
+}
+
+}
+
+int main(int argc, char *argv[]){
+    long long fileCount = argc > 1 ? atoll(argv[1]) : 100000;
+    long long keepCount = argc > 2 ? atoll(argv[2]) : 100;
+    long long rounds = argc > 3 ? atoll(argv[3]) : 20;
+    if(fileCount <= 0 || keepCount < 0 || keepCount > fileCount || rounds <= 0){
+        fprintf(stderr, "usage: %s [file count] [files kept] [list rounds]\n", argv[0]);
+        return 1;
+    }
+
+    char tmpDir[] = "/tmp/shard_bench.XXXXXX";
+    if(mkdtemp(tmpDir) == nullptr || chdir(tmpDir) != 0 || mkdir("filedir", 0755) != 0){
+        perror("create bench directory");
+        return 1;
+    }
+    if(StorageEngine::select("sharded") != 0){
+        return 1;
+    }
+
+    char name[64];
+    for(long long i = 0; i < fileCount; ++i){
+        snprintf(name, sizeof(name), "file-%08lld.dat", i);
+        std::string tmpPath = std::string("filedir/.tmp-") + name;
+        int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(fd == -1 || close(fd) != 0 || StorageEngine::current()->importFile(tmpPath, name, nullptr) != 0){
+            perror("import file");
+            return 1;
+        }
+    }
+    runList("full", rounds);
+
+    for(long long i = keepCount; i < fileCount; ++i){
+        snprintf(name, sizeof(name), "file-%08lld.dat", i);
+        StorageEngine::current()->remove(name);
+    }
+    runList("pruned", rounds);
+
+    std::string cleanup = std::string("rm -rf ") + tmpDir;
+    return system(cleanup.c_str()) == 0 ? 0 : 1;
+}
@@ -0,0 +1,288 @@
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <vector>
+
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#include "checksum.h"
+
+namespace {
+
+// 查表法计算 CRC32C 使用的表，多项式 0x82F63B78 为 Castagnoli 多项式的反射形式
+struct Crc32cTable{
+    uint32_t table[256];
+    Crc32cTable(){
+        for(uint32_t i = 0; i < 256; ++i){
+            uint32_t crc = i;
+            for(int j = 0; j < 8; ++j){
+                crc = (crc & 1) ? (crc >> 1) ^ 0x82F63B78u : crc >> 1;
+            }
+            table[i] = crc;
+        }
+    }
+};
+
+const Crc32cTable crcTable;
+
+uint32_t crc32cSoftware(uint32_t crc, const unsigned char *data, size_t len){
+    for(size_t i = 0; i < len; ++i){
+        crc = crcTable.table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+// 使用 SSE4.2 的 crc32 指令，每次处理 8 个字节
+__attribute__((target("sse4.2")))
+uint32_t crc32cHardware(uint32_t crc, const unsigned char *data, size_t len){
+    uint64_t crc64 = crc;
+    while(len >= 8){
+        uint64_t value;
+        memcpy(&value, data, 8);
+        crc64 = _mm_crc32_u64(crc64, value);
+        data += 8;
+        len -= 8;
+    }
+    crc = static_cast<uint32_t>(crc64);
+    while(len > 0){
+        crc = _mm_crc32_u8(crc, *data);
+        ++data;
+        --len;
+    }
+    return crc;
+}
+
+const bool hasSse42 = __builtin_cpu_supports("sse4.2");
+#endif
+
+const uint32_t sha256K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+inline uint32_t rotr(uint32_t x, int n){
+    return (x >> n) | (x << (32 - n));
+}
+
+std::string base64Encode(const unsigned char *data, size_t len){
+    const char chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string res;
+    for(size_t i = 0; i < len; i += 3){
+        uint32_t value = data[i] << 16;
+        if(i + 1 < len) value |= data[i + 1] << 8;
+        if(i + 2 < len) value |= data[i + 2];
+        res += chars[(value >> 18) & 0x3F];
+        res += chars[(value >> 12) & 0x3F];
+        res += (i + 1 < len) ? chars[(value >> 6) & 0x3F] : '=';
+        res += (i + 2 < len) ? chars[value & 0x3F] : '=';
+    }
+    return res;
+}
+
+std::string hexEncode(const unsigned char *data, size_t len){
+    const char chars[] = "0123456789abcdef";
+    std::string res;
+    for(size_t i = 0; i < len; ++i){
+        res += chars[data[i] >> 4];
+        res += chars[data[i] & 0xF];
+    }
+    return res;
+}
+
+} // namespace
+
+void Crc32c::update(const char *data, size_t len){
+    const unsigned char *bytes = reinterpret_cast<const unsigned char*>(data);
+#if defined(__x86_64__)
+    if(hasSse42){
+        m_crc = crc32cHardware(m_crc, bytes, len);
+        return;
+    }
+#endif
+    m_crc = crc32cSoftware(m_crc, bytes, len);
+}
+
+Sha256::Sha256() : m_bufferLen(0), m_totalLen(0){
+    const uint32_t init[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    memcpy(m_state, init, sizeof(m_state));
+}
+
+void Sha256::update(const char *data, size_t len){
+    const unsigned char *bytes = reinterpret_cast<const unsigned char*>(data);
+    m_totalLen += len;
+
+    // 先补全缓冲区中不完整的数据块
+    if(m_bufferLen > 0){
+        size_t fillLen = std::min(len, sizeof(m_buffer) - m_bufferLen);
+        memcpy(m_buffer + m_bufferLen, bytes, fillLen);
+        m_bufferLen += fillLen;
+        bytes += fillLen;
+        len -= fillLen;
+        if(m_bufferLen < sizeof(m_buffer)){
+            return;
+        }
+        transform(m_buffer);
+        m_bufferLen = 0;
+    }
+
+    // 完整的数据块直接处理，剩余的数据保存到缓冲区
+    while(len >= 64){
+        transform(bytes);
+        bytes += 64;
+        len -= 64;
+    }
+    memcpy(m_buffer, bytes, len);
+    m_bufferLen = len;
+}
+
+void Sha256::finish(unsigned char digest[32]){
+    // 填充一个 0x80，然后填充 0 直到长度模 64 为 56，最后 8 个字节为以比特为单位的消息长度（大端）
+    uint64_t bitLen = m_totalLen * 8;
+    unsigned char padding[72] = {0x80};
+    size_t padLen = (m_bufferLen < 56) ? (56 - m_bufferLen) : (120 - m_bufferLen);
+    for(int i = 0; i < 8; ++i){
+        padding[padLen + i] = static_cast<unsigned char>(bitLen >> (56 - 8 * i));
+    }
+    update(reinterpret_cast<const char*>(padding), padLen + 8);
+
+    for(int i = 0; i < 8; ++i){
+        digest[4 * i] = static_cast<unsigned char>(m_state[i] >> 24);
+        digest[4 * i + 1] = static_cast<unsigned char>(m_state[i] >> 16);
+        digest[4 * i + 2] = static_cast<unsigned char>(m_state[i] >> 8);
+        digest[4 * i + 3] = static_cast<unsigned char>(m_state[i]);
+    }
+}
+
+void Sha256::transform(const unsigned char *block){
+    uint32_t w[64];
+    for(int i = 0; i < 16; ++i){
+        w[i] = (uint32_t(block[4 * i]) << 24) | (uint32_t(block[4 * i + 1]) << 16) | (uint32_t(block[4 * i + 2]) << 8) | uint32_t(block[4 * i + 3]);
+    }
+    for(int i = 16; i < 64; ++i){
+        uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = m_state[0], b = m_state[1], c = m_state[2], d = m_state[3];
+    uint32_t e = m_state[4], f = m_state[5], g = m_state[6], h = m_state[7];
+    for(int i = 0; i < 64; ++i){
+        uint32_t s1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+        uint32_t ch = (e & f) ^ (~e & g);
+        uint32_t t1 = h + s1 + ch + sha256K[i] + w[i];
+        uint32_t s0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+        uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+        uint32_t t2 = s0 + maj;
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    m_state[0] += a; m_state[1] += b; m_state[2] += c; m_state[3] += d;
+    m_state[4] += e; m_state[5] += f; m_state[6] += g; m_state[7] += h;
+}
+
+std::string FileDigest::etag() const{
+    return "\"" + hexEncode(sha256, sizeof(sha256)) + "\"";
+}
+
+std::string FileDigest::digestHeader() const{
+    unsigned char crcBytes[4] = {
+        static_cast<unsigned char>(crc32c >> 24), static_cast<unsigned char>(crc32c >> 16),
+        static_cast<unsigned char>(crc32c >> 8), static_cast<unsigned char>(crc32c)
+    };
+    return "sha-256=" + base64Encode(sha256, sizeof(sha256)) + ",crc32c=" + base64Encode(crcBytes, sizeof(crcBytes));
+}
+
+FileDigest DigestBuilder::finish(){
+    FileDigest digest;
+    digest.crc32c = m_crc.value();
+    m_sha.finish(digest.sha256);
+    return digest;
+}
+
+int DigestStore::save(const std::string &filePath, const FileDigest &digest){
+    struct stat fileStat;
+    if(stat(filePath.c_str(), &fileStat) != 0){
+        return -1;
+    }
+    // 格式：长度 修改时间(秒) 修改时间(纳秒) crc32c sha256，读取时长度或修改时间不一致表示文件已经被改写
+    char value[160];
+    int valueLen = snprintf(value, sizeof(value), "%lld %lld %ld %08x %s", static_cast<long long>(fileStat.st_size),
+                            static_cast<long long>(fileStat.st_mtim.tv_sec), static_cast<long>(fileStat.st_mtim.tv_nsec),
+                            digest.crc32c, hexEncode(digest.sha256, sizeof(digest.sha256)).c_str());
+    return setxattr(filePath.c_str(), DIGEST_XATTR_NAME, value, valueLen, 0);
+}
+
+int DigestStore::load(int fd, FileDigest &digest){
+    char value[160];
+    ssize_t valueLen = fgetxattr(fd, DIGEST_XATTR_NAME, value, sizeof(value) - 1);
+    if(valueLen <= 0){
+        return -1;
+    }
+    value[valueLen] = '\0';
+
+    long long size = 0, mtimeSec = 0;
+    long mtimeNsec = 0;
+    unsigned int crc = 0;
+    char shaHex[65];
+    if(sscanf(value, "%lld %lld %ld %8x %64s", &size, &mtimeSec, &mtimeNsec, &crc, shaHex) != 5 || strlen(shaHex) != 64){
+        return -1;
+    }
+
+    struct stat fileStat;
+    if(fstat(fd, &fileStat) != 0 || fileStat.st_size != size || fileStat.st_mtim.tv_sec != mtimeSec || fileStat.st_mtim.tv_nsec != mtimeNsec){
+        return -1;
+    }
+
+    digest.crc32c = crc;
+    for(int i = 0; i < 32; ++i){
+        unsigned int byte = 0;
+        sscanf(shaHex + 2 * i, "%2x", &byte);
+        digest.sha256[i] = static_cast<unsigned char>(byte);
+    }
+    return 0;
+}
+
+void DigestStore::remove(const std::string &filePath){
+    removexattr(filePath.c_str(), DIGEST_XATTR_NAME);
+}
+
+int DigestStore::compute(int fd, FileDigest &digest){
+    DigestBuilder builder;
+    if(computeFrom(fd, 0, builder) != 0){
+        return -1;
+    }
+    digest = builder.finish();
+    return 0;
+}
+
+int DigestStore::computeFrom(int fd, long long offset, DigestBuilder &builder){
+    std::vector<char> buf(1 << 20);
+    while(1){
+        ssize_t readLen = pread(fd, buf.data(), buf.size(), offset);
+        if(readLen < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            return -1;
+        }
+        if(readLen == 0){
+            break;
+        }
+        builder.update(buf.data(), readLen);
+        offset += readLen;
+    }
+    return 0;
+}
@@ -0,0 +1,94 @@
+/*  文件说明：
+ *  1. 上传文件时边接收边计算 CRC32C 和 SHA-256，避免上传完成后再读一遍文件计算校验值
+ *  2. CRC32C 在支持 SSE4.2 的 CPU 上使用 crc32 指令计算，否则使用查表法
+ *  3. 计算结果和文件的长度、修改时间一起保存在文件的扩展属性（xattr）中，下载时直接读取扩展属性作为 ETag 和 Digest 首部，
+ *     文件长度或修改时间和扩展属性中的不同时，认为校验值已经失效
+ */
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+#define DIGEST_XATTR_NAME "user.webfileserver.digest"    // 保存校验值的扩展属性名
+
+// 增量计算 CRC32C（Castagnoli 多项式）
+class Crc32c{
+public:
+    Crc32c() : m_crc(0xFFFFFFFFu){ }
+
+    void update(const char *data, size_t len);
+
+    uint32_t value() const { return ~m_crc; }
+
+private:
+    uint32_t m_crc;
+};
+
+// 增量计算 SHA-256
+class Sha256{
+public:
+    Sha256();
+
+    void update(const char *data, size_t len);
+
+    // 计算最终的摘要，保存到 digest 的 32 个字节中。调用后不能再 update
+    void finish(unsigned char digest[32]);
+
+private:
+    // 处理一个 64 字节的数据块
+    void transform(const unsigned char *block);
+
+private:
+    uint32_t m_state[8];
+    unsigned char m_buffer[64];   // 还不够一个数据块的数据
+    size_t m_bufferLen;
+    uint64_t m_totalLen;          // 已经处理的总字节数
+};
+
+// 一个文件的校验值
+struct FileDigest{
+    uint32_t crc32c = 0;
+    unsigned char sha256[32] = {0};
+
+    // ETag 首部的值，使用 SHA-256 的十六进制表示
+    std::string etag() const;
+
+    // Digest 首部的值，格式为 sha-256=<base64>,crc32c=<base64>
+    std::string digestHeader() const;
+};
+
+// 边接收数据边计算文件的校验值
+class DigestBuilder{
+public:
+    void update(const char *data, size_t len){
+        m_crc.update(data, len);
+        m_sha.update(data, len);
+    }
+
+    FileDigest finish();
+
+private:
+    Crc32c m_crc;
+    Sha256 m_sha;
+};
+
+class DigestStore{
+public:
+    // 将校验值和文件当前的长度、修改时间一起保存到文件的扩展属性中，成功时返回 0
+    static int save(const std::string &filePath, const FileDigest &digest);
+
+    // 读取文件描述符对应文件的校验值，扩展属性不存在或者已经失效时返回 -1
+    static int load(int fd, FileDigest &digest);
+
+    // 删除文件的校验值，文件内容被改写之前调用
+    static void remove(const std::string &filePath);
+
+    // 读取整个文件计算校验值，只用于无法边接收边计算的情况（如并行分片上传）
+    static int compute(int fd, FileDigest &digest);
+
+    // 从 offset 开始读取到文件末尾，继续计算 builder 中的校验值。边接收边计算只覆盖了文件的前一部分时用于补齐剩余的部分
+    static int computeFrom(int fd, long long offset, DigestBuilder &builder);
+};
+
+#endif
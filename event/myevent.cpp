@@ -1,11 +1,36 @@
 #include <string>
 #include <sstream>
+#include <cstring>
 #include <iomanip>
+#include <algorithm>
+#include <sys/statvfs.h>
+#include <sys/uio.h>
 #include "myevent.h"
+#include "../threadpool/threadpool.h"
+#include "../ratelimit/ratelimiter.h"
 
 // 类外初始化静态成员
 std::unordered_map<int, Request> EventBase::requestStatus;
 std::unordered_map<int, Response> EventBase::responseStatus;
+std::mutex EventBase::responseLock;
+std::mutex EventBase::stateLock;
+std::unordered_map<int, UploadProgress> EventBase::uploadStatus;
+std::unordered_map<int, DigestBuilder> EventBase::uploadDigest;
+std::unordered_map<int, std::unique_ptr<StorageWriter> > EventBase::uploadWriter;
+std::unordered_map<int, DownloadProgress> EventBase::downloadStatus;
+std::unordered_map<int, DeltaProgress> EventBase::deltaUpload;
+std::unordered_map<int, DrainProgress> EventBase::drainStatus;
+long long EventBase::maxUploadSize = 100 * 1024 * 1024;
+ThreadPool *EventBase::ioPool = nullptr;
+std::mutex EventBase::bulkLock;
+std::unordered_set<int> EventBase::bulkConns;
+int EventBase::retryAfterSeconds = 1;
+long long EventBudget::maxBytes = 1024 * 1024;
+long long EventBudget::maxMicros = 10 * 1000;
+long long HandleSend::inlineMaxBytes = INLINE_MAX_BYTES;
+int AcceptConn::acceptBatch = ACCEPT_BATCH;
+bool AcceptConn::exclusiveListen = false;
+long long HandleSend::inlineMaxMicros = INLINE_MAX_MICROS;
 
 
 std::string urlDecode(const std::string& encoded) {
@@ -30,59 +55,189 @@ std::string urlDecode(const std::string& encoded) {
     return decoded;
 }
 
+// 从查询字符串（如 q=abc&offset=10）中取出参数 key 的值并进行 URL 解码，参数不存在时返回空字符串
+std::string queryParam(const std::string& query, const std::string& key) {
+    size_t start = 0;
+    while (start <= query.size()) {
+        size_t end = query.find('&', start);
+        if (end == std::string::npos) {
+            end = query.size();
+        }
+        size_t eq = query.find('=', start);
+        if (eq != std::string::npos && eq < end && query.compare(start, eq - start, key) == 0 && eq - start == key.size()) {
+            return urlDecode(query.substr(eq + 1, end - eq - 1));
+        }
+        start = end + 1;
+    }
+    return "";
+}
+
+// 将首部中的十进制数字转换为 long long，格式错误或为负数时返回 false
+bool parseNumber(const std::string& str, long long &value) {
+    if (str.empty() || str.find_first_not_of("0123456789") != std::string::npos) {
+        return false;
+    }
+    try {
+        value = std::stoll(str);
+    } catch (const std::exception&) {
+        return false;
+    }
+    return true;
+}
+
+Response *EventBase::findResponse(int fd){
+    std::lock_guard<std::mutex> guard(responseLock);
+    std::unordered_map<int, Response>::iterator it = responseStatus.find(fd);
+    return it == responseStatus.end() ? nullptr : &it->second;
+}
+
+Response &EventBase::responseOf(int fd){
+    std::lock_guard<std::mutex> guard(responseLock);
+    return responseStatus[fd];
+}
+
+void EventBase::eraseResponse(int fd){
+    std::lock_guard<std::mutex> guard(responseLock);
+    responseStatus.erase(fd);
+}
+
+void EventBase::setBulk(int fd, bool bulk){
+    std::lock_guard<std::mutex> guard(bulkLock);
+    if(bulk){
+        bulkConns.insert(fd);
+    }else{
+        bulkConns.erase(fd);
+    }
+}
+
+EventPriority EventBase::priorityOf(int fd){
+    std::lock_guard<std::mutex> guard(bulkLock);
+    return bulkConns.find(fd) != bulkConns.end() ? PRIORITY_BULK : PRIORITY_INTERACTIVE;
+}
+
 // 用于接受客户端连接的事件
 void AcceptConn::process(){
-    // 接受连接
-    clientAddrLen = sizeof(clientAddr);
-    int accFd = accept(m_listenFd, (sockaddr*)&clientAddr, &clientAddrLen);
-    if(accFd == -1){
-        std::cout << outHead("error") << "接受新连接失败" << std::endl;
-        return;
+    // 循环接受监听队列中的连接，直到队列为空或者用完本次的预算，连接直接以非阻塞的方式创建
+    int accepted = 0;
+    while(accepted < acceptBatch){
+        clientAddrLen = sizeof(clientAddr);
+        accetpFd = accept4(m_listenFd, (sockaddr*)&clientAddr, &clientAddrLen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(accetpFd == -1){
+            if(errno == EINTR || errno == ECONNABORTED){
+                continue;
+            }
+            if(errno != EAGAIN && errno != EWOULDBLOCK){
+                std::cout << outHead("error") << "接受新连接失败 (errno = " << errno << ")" << std::endl;
+            }
+            return;
+        }
+        ++accepted;
+
+        // 设置了限速时创建连接的令牌桶
+        RateLimiter::attach(accetpFd, clientAddr);
+
+        // 将连接加入到监听，客户端套接字都设置为 EPOLLET 和 EPOLLONESHOT
+        addWaitFd(m_epollFd, accetpFd, true, true);
+        std::cout << outHead("info") << "接受新连接 " << accetpFd << " 成功" << std::endl;
     }
 
-    // 将连接设置为非阻塞
-    setNonBlocking(accFd);
+    // 用完预算时队列中可能还有连接，重新注册后由内核检查队列，不为空时再产生一个事件
+    std::cout << outHead("info") << "本次已接受 " << accepted << " 个连接，重新注册监听套接字" << std::endl;
+    rearmListenFd();
+}
+
+int AcceptConn::addListenFd(int epollFd, int listenFd){
+    epoll_event event;
+    event.data.fd = listenFd;
+    event.events = EPOLLIN | EPOLLET;
+    if(exclusiveListen){
+        event.events |= EPOLLEXCLUSIVE;
+    }
+    return epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &event) == 0 ? 0 : -1;
+}
 
-    // 将连接加入到监听，客户端套接字都设置为 EPOLLET 和 EPOLLONESHOT
-    addWaitFd(m_epollFd, accFd, true, true);
-    std::cout << outHead("info") << "接受新连接 " << accFd << " 成功" << std::endl;
+void AcceptConn::rearmListenFd(){
+    if(!exclusiveListen){
+        modifyWaitFd(m_epollFd, m_listenFd, true, false, false);
+        return;
+    }
+    epoll_ctl(m_epollFd, EPOLL_CTL_DEL, m_listenFd, nullptr);
+    if(addListenFd(m_epollFd, m_listenFd) != 0){
+        std::cout << outHead("error") << "重新注册监听套接字失败 (errno = " << errno << ")" << std::endl;
+    }
 }
 
 // 处理客户端发送的请求
 void HandleRecv::process(){
     std::cout << outHead("info") << "开始处理客户端 " << m_clientFd << " 的一个 HandleRecv 事件" << std::endl;
+    // 上传已经被拒绝，丢弃客户端还在发送的消息体
+    if(findState(drainStatus, m_clientFd) != nullptr){
+        drainRejected();
+        return;
+    }
+    // 线程池过载时不再开始新的请求，已经开始处理的请求继续处理
+    if(m_shed && findState(requestStatus, m_clientFd) == nullptr){
+        rejectOverloaded();
+        return;
+    }
+
     // 获取 Request 对象，保存到m_clientFd索引的requestStatus中（没有时会自动创建一个新的）
-    requestStatus[m_clientFd];
+    Request &request = stateOf(requestStatus, m_clientFd);
 
     // 读取输入，检测是否是断开连接，否则处理请求
     char buf[2048];
     int recvLen = 0;
+    EventBudget budget;
     
+    // 从网络线程转交到 I/O 线程池时，网络线程已经接收的数据还没有处理（没有消息体的请求也还没有处理），先处理再继续接收
+    bool resumeBuffered = m_onIoPool;
+    bool ioPoolBusy = false;      // 转交给 I/O 线程池失败，本次事件在当前线程中继续处理
     while(1){
-        // 循环接收数据，直到缓冲区读取不到数据或请求消息处理完成时退出循环
-        recvLen = recv(m_clientFd, buf, 2048, 0);
+        if(resumeBuffered){
+            resumeBuffered = false;
+        }else{
+            // 本次事件的预算已经用完，已经收到的数据都处理过了，重新注册可读事件后让出线程，下次从保存的状态继续接收
+            if(budget.exhausted()){
+                modifyWaitFd(m_epollFd, m_clientFd, true, true, false);
+                std::cout << outHead("info") << "客户端 " << m_clientFd << " 本次事件的接收预算已用完，让出线程" << std::endl;
+                break;
+            }
 
-        // 对方关闭连接，直接断开连接，设置当前状态为 HANDLE_ERROR，再退出循环
-        if(recvLen == 0){
-            std::cout << outHead("info") << "客户端 " << m_clientFd << " 关闭连接" << std::endl;
-            requestStatus[m_clientFd].status = HANDLE_ERROR;
-            break;
-        }
+            // 按连接和 IP 限速，令牌不足时不重新注册可读事件，由定时器在令牌足够时重新注册
+            long long waitMicros = 0;
+            long long recvLimit = RateLimiter::acquire(m_clientFd, false, sizeof(buf), waitMicros);
+            if(waitMicros > 0){
+                RateLimiter::defer(m_epollFd, m_clientFd, false, waitMicros);
+                break;
+            }
+
+            // 循环接收数据，直到缓冲区读取不到数据或请求消息处理完成时退出循环
+            recvLen = recv(m_clientFd, buf, recvLimit, 0);
 
-        //如果缓冲区的数据已经读完，退出读数据的状态
-        if(recvLen == -1){
-            if(errno != EAGAIN){    // 如果不是缓冲区为空，设置状态为错误，并退出循环
-                requestStatus[m_clientFd].status = HANDLE_ERROR;
-                std::cout << outHead("error") << "接收数据时返回 -1 (errno = " << errno << ")" << std::endl;
+            // 对方关闭连接，直接断开连接，设置当前状态为 HANDLE_ERROR，再退出循环
+            if(recvLen == 0){
+                std::cout << outHead("info") << "客户端 " << m_clientFd << " 关闭连接" << std::endl;
+                request.status = HANDLE_ERROR;
+                break;
+            }
+
+            //如果缓冲区的数据已经读完，退出读数据的状态
+            if(recvLen == -1){
+                if(errno != EAGAIN){    // 如果不是缓冲区为空，设置状态为错误，并退出循环
+                    request.status = HANDLE_ERROR;
+                    std::cout << outHead("error") << "接收数据时返回 -1 (errno = " << errno << ")" << std::endl;
+                    break;
+                }
+                // 如果是缓冲区为空，表示需要等待数据发送，由于是 EPOLLONESHOT，再退出循环，等再发来数据时再来处理
+                modifyWaitFd(m_epollFd, m_clientFd, true, true, false);
                 break;
             }
-            // 如果是缓冲区为空，表示需要等待数据发送，由于是 EPOLLONESHOT，再退出循环，等再发来数据时再来处理
-            modifyWaitFd(m_epollFd, m_clientFd, true, true, false);
-            break;
-        }
 
-        // 将收到的数据拼接到之前收到的数据后面，由于在处理文件时，里面可能有 \0，所以使用 append 将 buf 内的所有字符都保存到 recvMsg 中
-        requestStatus[m_clientFd].recvMsg.append(buf, recvLen);
+            // 将收到的数据拼接到之前收到的数据后面，由于在处理文件时，里面可能有 \0，所以使用 append 将 buf 内的所有字符都保存到 recvMsg 中
+            request.recvMsg.append(buf, recvLen);
+            budget.consume(recvLen);
+            RateLimiter::consume(m_clientFd, false, recvLen);
+        }
 
         // 边接收数据边处理
         // 根据请求报文的状态执行操作，以下操作中，如果成功了，则解析请求报文的下个部分，如果某个部分还没有完全接收，会退出当前处理步骤，等再次收到数据后根据这次解析的状态继续处理
@@ -92,15 +247,15 @@ void HandleRecv::process(){
         
         // 如果是初始状态，获取请求行
         // POST /upload HTTP/1.1\r\n,setRequestLine 会解析出 requestMethod="POST"，requestResourse="/upload"，httpVersion="HTTP/1.1"。
-        if(requestStatus[m_clientFd].status == HANDLE_INIT){
+        if(request.status == HANDLE_INIT){
 
-            endIndex = requestStatus[m_clientFd].recvMsg.find("\r\n");       // 查找请求行的结束边界
+            endIndex = request.recvMsg.find("\r\n");       // 查找请求行的结束边界
 
             if(endIndex != std::string::npos){
                 // 保存请求行  
-                requestStatus[m_clientFd].setRequestLine(requestStatus[m_clientFd].recvMsg.substr(0, endIndex + 2) ); // std::cout << requestStatus[m_clientFd].recvMsg.substr(0, endIndex + 2);
-                requestStatus[m_clientFd].recvMsg.erase(0, endIndex + 2);    // 删除收到的数据中的请求行
-                requestStatus[m_clientFd].status = HANDLE_HEAD;              // 将状态设置为处理消息首部
+                request.setRequestLine(request.recvMsg.substr(0, endIndex + 2) ); // std::cout << request.recvMsg.substr(0, endIndex + 2);
+                request.recvMsg.erase(0, endIndex + 2);    // 删除收到的数据中的请求行
+                request.status = HANDLE_HEAD;              // 将状态设置为处理消息首部
                 std::cout << outHead("info") << "处理客户端 " << m_clientFd << " 的请求行完成" << std::endl;
             }
 
@@ -109,186 +264,291 @@ void HandleRecv::process(){
         
         // 如果是处理首部的状态，逐行解析首部字段，直至遇到空行
         //请求头可能包含 Content-Type: multipart/form-data; boundary=----WebKitFormBoundaryxxx，addHeaderOpt 会解析出 Content-Type 和 boundary（用于后续文件边界判断）。
-        if(requestStatus[m_clientFd].status == HANDLE_HEAD){
+        if(request.status == HANDLE_HEAD){
             
             std::string curLine;       // 用于暂存获取的一行数据
 
             while(1){
                 
-                endIndex = requestStatus[m_clientFd].recvMsg.find("\r\n");            // 获取一行的边界
+                endIndex = request.recvMsg.find("\r\n");            // 获取一行的边界
                 if(endIndex == std::string::npos){                                    // 如果没有找到边界，表示后面的数据还没有接收完整，退出循环，等待下次接收后处理
                     break;
                 }
 
-                curLine = requestStatus[m_clientFd].recvMsg.substr(0, endIndex + 2);  // 将该行的内容取出
-                requestStatus[m_clientFd].recvMsg.erase(0, endIndex + 2);             // 删除收到的数据中的该行数据
+                curLine = request.recvMsg.substr(0, endIndex + 2);  // 将该行的内容取出
+                request.recvMsg.erase(0, endIndex + 2);             // 删除收到的数据中的该行数据
 
                 if(curLine == "\r\n"){
-                    requestStatus[m_clientFd].status = HANDLE_BODY;                                       // 如果是空行，将状态修改为等待解析消息体
-                    if(requestStatus[m_clientFd].msgHeader["Content-Type"] == "multipart/form-data"){     // 如果接收的是文件，设置消息体中文件的处理状态
-                        requestStatus[m_clientFd].fileMsgStatus = FILE_BEGIN_FLAG;
+                    request.status = HANDLE_BODY;                                       // 如果是空行，将状态修改为等待解析消息体
+                    if(request.msgHeader["Content-Type"] == "multipart/form-data"){     // 如果接收的是文件，设置消息体中文件的处理状态
+                        request.fileMsgStatus = FILE_BEGIN_FLAG;
                     }
                     std::cout << outHead("info") << "处理客户端 " << m_clientFd << " 的消息首部完成" << std::endl;
-                    if(requestStatus[m_clientFd].requestMethod == "POST"){
+                    if(request.requestMethod == "POST"){
                         std::cout << outHead("info") << "客户端 " << m_clientFd << " 发送 POST 请求，开始处理请求体" << std::endl;
                     }
                     break;                                                                                // 退出首部字段循环
                 }
                 
-                requestStatus[m_clientFd].addHeaderOpt(curLine);                      // 如果不是空行，需要将该首部保存
+                request.addHeaderOpt(curLine);                      // 如果不是空行，需要将该首部保存
+            }
+
+            // 首部接收完成后，在接收消息体之前检查上传大小和磁盘剩余空间，拒绝时关闭连接，不会创建任何文件
+            if(request.status == HANDLE_BODY && !checkUploadHeaders()){
+                break;
             }
         }
 
         // 如果是处理消息体的状态，根据请求类型执行特定的操作
-        if(requestStatus[m_clientFd].status == HANDLE_BODY){
+        if(request.status == HANDLE_BODY){
+            // 需要写入磁盘的请求（上传、可续传上传、增量同步）转交给 I/O 线程池继续接收和处理，网络线程不等待磁盘。
+            // 转交之后该连接的状态只由 I/O 线程访问（EPOLLONESHOT 的事件还没有重新注册），当前线程直接返回
+            if(!m_onIoPool && !ioPoolBusy && ioPool != nullptr && bodyNeedsFileIo()){
+                if(ioPool->appendEvent(new HandleRecv(m_clientFd, m_epollFd, true), "上传 I/O 事件", priorityOf(m_clientFd)) == 0){
+                    return;
+                }
+                // 增量同步需要读取整个已有文件复制块并落盘，I/O 线程池繁忙时不在网络线程中处理，和 GET 一样返回 503
+                if(request.requestResourse.compare(0, 7, "/delta/") == 0){
+                    std::cout << outHead("warn") << "客户端 " << m_clientFd << " 的增量同步需要访问文件系统，但是 I/O 线程池繁忙，返回 503" << std::endl;
+                    rejectUpload("503", "Service Unavailable", "Retry-After: " + std::to_string(retryAfterSeconds) + "\r\n");
+                    break;
+                }
+                // I/O 线程池队列已满，普通上传已经开始接收，在当前线程继续处理
+                std::cout << outHead("warn") << "客户端 " << m_clientFd << " 的上传需要写入磁盘，但是 I/O 线程池繁忙，在网络线程中处理" << std::endl;
+                ioPoolBusy = true;
+            }
+
+            // 资源路径以 /uploads/ 开头时为可续传上传协议，PATCH 的消息体可能需要多次接收，处理未完成时继续接收数据
+            if(request.requestResourse.compare(0, 9, "/uploads/") == 0){
+                processResumableUpload();
+                if(request.status == HADNLE_COMPLATE || request.status == HANDLE_ERROR){
+                    break;
+                }
+                continue;
+            }
+
+            // POST /delta 为增量同步的指令流，消息体可能需要多次接收（GET /delta 获取签名和其他 GET 请求一样交给 HandleSend）
+            if(request.requestMethod == "POST" && request.requestResourse.compare(0, 7, "/delta/") == 0){
+                processDeltaUpload();
+                if(request.status == HADNLE_COMPLATE || request.status == HANDLE_ERROR){
+                    break;
+                }
+                continue;
+            }
+
             // GET 操作时表示请求数据，将请求的资源路径交给 HandleSend 事件处理
-            if(requestStatus[m_clientFd].requestMethod == "GET"){
+            if(request.requestMethod == "GET"){
                 // 设置响应消息的资源路径，在 HandleSend 中根据请求资源构建整个响应消息并发送
-                responseStatus[m_clientFd].bodyFileName = requestStatus[m_clientFd].requestResourse;
+                responseOf(m_clientFd).bodyFileName = request.requestResourse;
 
-                // 设置监听套接字的可写事件，当套接字写缓冲区有空闲数据时，会产生 HandleSend 事件，将 m_clientFd 索引的 responseStatus 中的数据发送
-                modifyWaitFd(m_epollFd, m_clientFd, true, true, true);
-                requestStatus[m_clientFd].status = HADNLE_COMPLATE;
+                // 请求处理完成后在当前线程直接构建并发送响应，发送缓冲区满时 HandleSend 才注册可写事件
+                m_sendReady = true;
+                request.status = HADNLE_COMPLATE;
                 std::cout << outHead("info") << "客户端 " << m_clientFd << " 发送 GET 请求，已将请求资源构成 Response 写事件等待发送数据" << std::endl; 
                 break;
             }
 
             // POST 表示上传数据，执行接收数据的操作
-            if(requestStatus[m_clientFd].requestMethod == "POST"){
+            if(request.requestMethod == "POST"){
                 // 记录未处理的数据长度，用于当前 if 步骤处理结束时，计算处理了多少消息体数据，处理非文件时用来判断数据边界（文件使用 boundary 确定边界）
-                std::string::size_type beginSize = requestStatus[m_clientFd].recvMsg.size();
-                if(requestStatus[m_clientFd].msgHeader["Content-Type"] == "multipart/form-data"){  // 如果发送的是文件
-                    // 如果处于等待处理文件开始标志的状态，查找 \r\n 判断标志部分是否已经接收
-                    if(requestStatus[m_clientFd].fileMsgStatus == FILE_BEGIN_FLAG){
-                        std::cout << outHead("info") << "客户端 " << m_clientFd << " 的 POST 请求用于上传文件，寻找文件头开始边界..." << std::endl;
-                        // 查找 \r\n
-                        endIndex = requestStatus[m_clientFd].recvMsg.find("\r\n");
-
-                        // 当前状态下，\r\n 前的数据必然是文件信息开始的标志
-                        if(endIndex != std::string::npos){
-                            std::string flagStr = requestStatus[m_clientFd].recvMsg.substr(0, endIndex);
-
-                            if(flagStr == "--" +requestStatus[m_clientFd].msgHeader["boundary"]){  // 如果等于 "--" 加边界，进入下一个状态
-                                requestStatus[m_clientFd].fileMsgStatus = FILE_HEAD;               // 进入下一个状态
-                                requestStatus[m_clientFd].recvMsg.erase(0, endIndex + 2);          // 将开始标志行删除（包括 /r/n）
-                                std::cout << outHead("info") << "客户端 " << m_clientFd << " 的 POST 请求体中找到文件头开始边界，正在处理文件头..." << std::endl;
-                            }else{
+                std::string::size_type beginSize = request.recvMsg.size();
+                if(request.msgHeader["Content-Type"] == "multipart/form-data"){  // 如果发送的是文件
+                    // 消息体中可以包含任意多个部分，每个部分以 "--boundary\r\n" 开始，以 "\r\n--boundary" 结束，最后一个部分后面跟 "--" 表示消息体结束
+                    // 带有 filename 的部分保存为单独的文件，其他普通表单字段直接丢弃。循环处理，直到缓冲区中的数据不足以继续处理时退出，等待接收更多数据
+                    const std::string boundary = request.msgHeader["boundary"];
+                    const std::string partDelimiter = "\r\n--" + boundary;      // 一个部分内容结束的标志
+                    bool waitMoreData = false;                                   // 当前数据不足以继续处理时置为 true，退出循环
+
+                    while(!waitMoreData && request.fileMsgStatus != FILE_COMPLATE){
+
+                        // 如果处于等待处理第一个部分开始标志的状态，查找 \r\n 判断标志部分是否已经接收
+                        if(request.fileMsgStatus == FILE_BEGIN_FLAG){
+                            std::cout << outHead("info") << "客户端 " << m_clientFd << " 的 POST 请求用于上传文件，寻找文件头开始边界..." << std::endl;
+                            endIndex = request.recvMsg.find("\r\n");
+                            if(endIndex == std::string::npos){
+                                waitMoreData = true;
+                                break;
+                            }
+
+                            // 当前状态下，\r\n 前的数据必然是第一个部分的开始标志
+                            if(request.recvMsg.compare(0, endIndex, "--" + boundary) != 0){
                                 // 如果和边界不同，表示出错，直接返回重定向报文，重新请求文件列表
-                                responseStatus[m_clientFd].bodyFileName = "/redirect"; 
-                                modifyWaitFd(m_epollFd, m_clientFd, true, true, true);   // 重置可读事件和可写事件，用于发送重定向回复报文
-                                requestStatus[m_clientFd].status = HADNLE_COMPLATE;
                                 std::cout << outHead("error") << "客户端 " << m_clientFd << " 的 POST 请求体中没有找到文件头开始边界，添加重定向 Response 写事件，使客户端重定向到文件列表" << std::endl;
                                 break;
                             }
+                            request.recvMsg.erase(0, endIndex + 2);          // 将开始标志行删除（包括 \r\n）
+                            request.recvFileName.clear();                    // 每个部分开始时清空上一个部分的文件名
+                            request.fileMsgStatus = FILE_HEAD;
+                            std::cout << outHead("info") << "客户端 " << m_clientFd << " 的 POST 请求体中找到文件头开始边界，正在处理文件头..." << std::endl;
                         }
-                    }
 
-                    // 如果处于等待接收并处理消息体中文件头部信息的状态，从中提取文件名
-                    if(requestStatus[m_clientFd].fileMsgStatus == FILE_HEAD){
-                        std::string strLine;
-                        while(1){
-                            // 查找 \r\n 表示一行数据
-                            endIndex = requestStatus[m_clientFd].recvMsg.find("\r\n");
-                            if(endIndex != std::string::npos){
-                                strLine = requestStatus[m_clientFd].recvMsg.substr(0, endIndex + 2);  // 获取这一行的数据信息
-                                requestStatus[m_clientFd].recvMsg.erase(0, endIndex + 2);             // 删除这一行信息
+                        // 如果处于等待接收并处理当前部分头部信息的状态，从中提取文件名
+                        if(request.fileMsgStatus == FILE_HEAD){
+                            std::string strLine;
+                            while(1){
+                                // 查找 \r\n 表示一行数据，如果没有找到，表示消息还没有接收完整，退出，等待下一轮的事件中继续处理
+                                endIndex = request.recvMsg.find("\r\n");
+                                if(endIndex == std::string::npos){
+                                    waitMoreData = true;
+                                    break;
+                                }
+                                strLine = request.recvMsg.substr(0, endIndex + 2);  // 获取这一行的数据信息
+                                request.recvMsg.erase(0, endIndex + 2);             // 删除这一行信息
 
-                                // 检测是否为空行，如果是空行，修改状态，退出
+                                // 检测是否为空行，如果是空行，表示部分头部结束，进入内容状态
                                 if(strLine == "\r\n"){
-                                    requestStatus[m_clientFd].fileMsgStatus = FILE_CONTENT;
-                                    std::cout << outHead("info") << "客户端 " << m_clientFd << " 的 POST 请求体中文件头处理成功，正在接收并保存文件内容..." << std::endl;
+                                    request.fileMsgStatus = FILE_CONTENT;
+                                    if(request.recvFileName.empty()){
+                                        std::cout << outHead("info") << "客户端 " << m_clientFd << " 的 POST 请求体中当前部分不是文件，跳过该部分内容..." << std::endl;
+                                    }else{
+                                        // 通过存储引擎写入，文件接收完成并提交后才会出现，同名文件被原子地替换，不会和旧内容拼接在一起
+                                        StorageWriter *writer = StorageEngine::current()->createWriter(request.recvFileName);
+                                        if(writer == nullptr){
+                                            std::cout << outHead("error") << "客户端 " << m_clientFd << " 上传的文件名 " << request.recvFileName << " 无效或无法创建文件，跳过该部分内容..." << std::endl;
+                                            request.recvFileName.clear();
+                                            break;
+                                        }
+                                        stateOf(uploadWriter, m_clientFd).reset(writer);
+                                        stateOf(uploadDigest, m_clientFd) = DigestBuilder();
+                                        std::cout << outHead("info") << "客户端 " << m_clientFd << " 的 POST 请求体中文件头处理成功，正在接收并保存文件 " << request.recvFileName << " 的内容..." << std::endl;
+                                    }
                                     break;
                                 }
-                                // 查找 strLine 是否包含 filename
-                                endIndex = strLine.find("filename");
+
+                                // 查找 strLine 是否包含 filename="，普通表单字段没有该参数
+                                endIndex = strLine.find("filename=\"");
                                 if(endIndex != std::string::npos){
                                     strLine.erase(0, endIndex + std::string("filename=\"").size());          // 将真正 filename 前的所有字符删除
-                                    for(int i = 0; strLine[i] != '\"'; ++i){                                 // 保存文件名
-                                        requestStatus[m_clientFd].recvFileName += strLine[i];
+                                    std::string fileName = strLine.substr(0, strLine.find('\"'));
+                                    // 部分浏览器会携带客户端的完整路径，只保留最后一级文件名，同时避免写到 filedir 之外
+                                    std::string::size_type slashIndex = fileName.find_last_of("/\\");
+                                    if(slashIndex != std::string::npos){
+                                        fileName.erase(0, slashIndex + 1);
+                                    }
+                                    if(fileName == "." || fileName == ".."){
+                                        fileName.clear();
                                     }
-                                    std::cout << outHead("info") << "客户端 " << m_clientFd << " 的 POST 请求体中找到文件名字 " << requestStatus[m_clientFd].recvFileName << " ，继续处理文件头..." << std::endl; 
+                                    // POST /upload/目录 时保存到该目录中
+                                    if(!fileName.empty() && request.requestResourse.compare(0, 8, "/upload/") == 0){
+                                        fileName = urlDecode(request.requestResourse.substr(8)) + "/" + fileName;
+                                    }
+                                    // 没有选择文件时 filename 为空，当作普通字段跳过
+                                    request.recvFileName = fileName;
+                                    std::cout << outHead("info") << "客户端 " << m_clientFd << " 的 POST 请求体中找到文件名字 " << request.recvFileName << " ，继续处理文件头..." << std::endl;
                                 }
-                            }else{   // 如果没有找到，表示消息还没有接收完整，退出，等待下一轮的事件中继续处理
+                            }
+                            if(waitMoreData){
                                 break;
                             }
                         }
-                    }
 
-                    // 如果处于等待并处消息体中文件内容部分
-                    // 循环检索是否有 \r\n ，将 \r\n 之前的内容全部保存。如果存在\r\n，根据后面的内容判断是否到达文件边界
-                    if(requestStatus[m_clientFd].fileMsgStatus == FILE_CONTENT){
-                        // 首先以二进制追加的方式打开文件
-                        std::ofstream ofs("filedir/" + requestStatus[m_clientFd].recvFileName, std::ios::out | std::ios::app | std::ios::binary);
-                        if(!ofs){
-                            std::cout << outHead("error") << "客户端 " << m_clientFd << " 的 POST 请求体所需要保存的文件打开失败，正在重新打开文件..." << std::endl;
-                            break;
-                        }
-
-                        while(1){
-                            int saveLen = requestStatus[m_clientFd].recvMsg.size();        // 该变量用来保存 根据\r的位置决定向文件中写入多少字符，初始为所有字符长度
-                            if(saveLen == 0){                                              // 长度为空时退出循环，等待接收到数据时再处理
-                                break;
+                        // 如果处于处理当前部分内容的状态，将分隔符 "\r\n--boundary" 之前的数据全部保存（非文件部分直接丢弃）
+                        // 找到分隔符后根据其后的两个字符判断：\r\n 表示还有下一个部分，-- 表示整个消息体结束
+                        if(request.fileMsgStatus == FILE_CONTENT){
+                            std::string::size_type saveLen = 0;        // 本轮可以确定属于当前部分内容的数据长度
+                            endIndex = request.recvMsg.find(partDelimiter);
+                            if(endIndex != std::string::npos){
+                                saveLen = endIndex;
+                            }else if(request.recvMsg.size() >= partDelimiter.size()){
+                                // 没有找到分隔符时，末尾可能是一个不完整的分隔符，保留最后 partDelimiter.size() - 1 个字节等待后续数据
+                                saveLen = request.recvMsg.size() - partDelimiter.size() + 1;
                             }
-                            // 在剩余的字符中搜索标志 \r
-                            endIndex = requestStatus[m_clientFd].recvMsg.find('\r');
-                                        
-                            if(endIndex != std::string::npos){   // 如果有\r，后面有可能是文件结束标识
-                                // 首先判断 \r 后的数据是否满足结束标识的长度，是否大于等于 sizeof(\r\n + "--" + boundary + "--" + \r\n)
-                                int boundarySecLen = requestStatus[m_clientFd].msgHeader["boundary"].size() + 8;
-                                if(requestStatus[m_clientFd].recvMsg.size() - endIndex >= boundarySecLen){
-                                    // 判断后面这部分数据是否为结束边界"\r\n"
-                                    if(requestStatus[m_clientFd].recvMsg.substr(endIndex, boundarySecLen) ==
-                                                    "\r\n--" + requestStatus[m_clientFd].msgHeader["boundary"] + "--\r\n"){
-                                        if(endIndex == 0){                  // 表示边界前的数据都已经写入文件，设置文件接收完成，进入下一个状态
-                                            std::cout << outHead("info") << "客户端 " << m_clientFd << " 的 POST 请求体中的文件数据接收并保存完成" << std::endl;
-                                            requestStatus[m_clientFd].fileMsgStatus = FILE_COMPLATE;
-                                            break;
-                                        }
-
-                                        // 如果后面不是结束标识，先将 \r 之前的所有数据写入文件，在循环的下一轮会进到上一个if，结束整个处理
-                                        saveLen = endIndex;
-                                        
-                                    }else{  
-                                        // 如果不是边界，在 \r 后再次搜索 \r，如果搜索到了，写入的数据截至到第二个 \r，否则将所有数据写入
-                                        endIndex = requestStatus[m_clientFd].recvMsg.find('\r', endIndex + 1);
-                                        if(endIndex != std::string::npos){
-                                            saveLen = endIndex;
-                                        }
-                                    }
 
-                                }else{  
-                                    // 如果长度还不够，将 /r 前面的数据写入文件，并等待接收后面的数据
+                            if(saveLen > 0){
+                                if(!request.recvFileName.empty()){
+                                    StorageWriter &writer = *stateOf(uploadWriter, m_clientFd);
 
-                                    // 如果 /r 之前的数据已经写入文件，退出循环，等待接收更多数据后再进入该循环
-                                    if(endIndex == 0){   
+                                    // 没有 Content-Length 或者一个请求中包含多个文件时，首部检查无法限制单个文件的大小，写入前再检查一次
+                                    // 超过最大文件大小时返回 413 并关闭连接，已经写入的部分在连接关闭时丢弃
+                                    if(writer.size() + static_cast<long long>(saveLen) > maxUploadSize){
+                                        std::cout << outHead("error") << "客户端 " << m_clientFd << " 上传的文件 " << request.recvFileName << " 超过最大文件大小" << std::endl;
+                                        rejectUpload("413", "Payload Too Large");
+                                        break;
+                                    }
+                                    if(writer.write(request.recvMsg.c_str(), saveLen) != 0){
+                                        std::cout << outHead("error") << "客户端 " << m_clientFd << " 上传的文件 " << request.recvFileName << " 写入失败 (errno = " << errno << ")" << std::endl;
+                                        rejectUpload("500", "Internal Server Error");
                                         break;
                                     }
+                                    // 边写入边计算校验值，上传完成后不需要再读一遍文件
+                                    stateOf(uploadDigest, m_clientFd).update(request.recvMsg.c_str(), saveLen);
+                                }
+                                request.recvMsg.erase(0, saveLen);
+                            }
+
+                            // 分隔符还没有完整出现，或者分隔符后的两个字符还没有接收，等待接收更多数据
+                            if(endIndex == std::string::npos || request.recvMsg.size() < partDelimiter.size() + 2){
+                                waitMoreData = true;
+                                break;
+                            }
 
-                                    // 否则将 endIndex 前的数据写入文件
-                                    saveLen = endIndex;
+                            std::string delimiterSuffix = request.recvMsg.substr(partDelimiter.size(), 2);
+                            if(!request.recvFileName.empty()){
+                                // 文件内容接收完成，提交到存储引擎，计算好的校验值和文件一起保存，下载时直接读取
+                                FileDigest digest = stateOf(uploadDigest, m_clientFd).finish();
+                                int commitRet = stateOf(uploadWriter, m_clientFd)->commit(&digest);
+                                int commitErrno = errno;
+                                eraseState(uploadWriter, m_clientFd);
+                                eraseState(uploadDigest, m_clientFd);
+                                if(commitRet != 0){
+                                    // 文件没有保存，不能返回成功的重定向，磁盘已满时返回 507，其他错误返回 500，之后关闭连接
+                                    std::cout << outHead("error") << "客户端 " << m_clientFd << " 上传的文件 " << request.recvFileName << " 保存失败 (errno = " << commitErrno << ")" << std::endl;
+                                    if(commitErrno == ENOSPC || commitErrno == EDQUOT){
+                                        rejectUpload("507", "Insufficient Storage");
+                                    }else{
+                                        rejectUpload("500", "Internal Server Error");
+                                    }
+                                    break;
                                 }
+                                MetaIndex::update(request.recvFileName);
+                                SearchIndex::add(request.recvFileName);
+                                std::cout << outHead("info") << "客户端 " << m_clientFd << " 的 POST 请求体中的文件 " << request.recvFileName << " 接收并保存完成" << std::endl;
+                            }
+                            if(delimiterSuffix == "--"){
+                                // 结束边界，之后的数据（如果有）只可能是结尾的 \r\n，全部丢弃
+                                request.recvMsg.clear();
+                                request.fileMsgStatus = FILE_COMPLATE;
+                                std::cout << outHead("info") << "客户端 " << m_clientFd << " 的 POST 请求体中的所有部分处理完成" << std::endl;
+                            }else if(delimiterSuffix == "\r\n"){
+                                // 还有下一个部分，删除分隔符行，进入下一个部分的头部处理
+                                request.recvMsg.erase(0, partDelimiter.size() + 2);
+                                request.recvFileName.clear();
+                                request.fileMsgStatus = FILE_HEAD;
+                            }else{
+                                // 分隔符后既不是 \r\n 也不是 --，消息体格式错误
+                                std::cout << outHead("error") << "客户端 " << m_clientFd << " 的 POST 请求体中分隔符格式错误" << std::endl;
+                                break;
                             }
-                            // 如果没有退出表示当前仍是数据部分，将 saveLen 字节的数据存入文件，并将这些数据从 recvMsg 数据中删除
-                            ofs.write(requestStatus[m_clientFd].recvMsg.c_str(), saveLen);
-                            requestStatus[m_clientFd].recvMsg.erase(0, saveLen);
                         }
-                        ofs.close();
                     }
-                    // std::cout << "已退出文件接收函数" << std::endl;
+
+                    // 上传的文件超过限制被拒绝，连接会被关闭
+                    if(request.status == HANDLE_ERROR){
+                        break;
+                    }
+
+                    // 没有因为数据不足而退出，且没有处理完成，表示消息体格式错误，直接返回重定向报文，重新请求文件列表
+                    if(!waitMoreData && request.fileMsgStatus != FILE_COMPLATE){
+                        responseOf(m_clientFd).bodyFileName = "/redirect";
+                        m_sendReady = true;      // 请求处理完成后发送重定向回复报文
+                        request.status = HADNLE_COMPLATE;
+                        break;
+                    }
                     // 如果文件已经处理完成，设置消息体为完成状态
-                    if(requestStatus[m_clientFd].fileMsgStatus == FILE_COMPLATE){
-                        // 设置响应消息的资源路径，在 HandleSend 中根据请求资源构建整个响应消息并发送
-                        responseStatus[m_clientFd].bodyFileName = "/redirect"; 
-                        modifyWaitFd(m_epollFd, m_clientFd, true, true, true);   // 完成后重置可读事件和可写事件，用于发送重定向回复报文
-                        requestStatus[m_clientFd].status = HADNLE_COMPLATE;
+                    if(request.fileMsgStatus == FILE_COMPLATE){
+                        // 设置响应消息的资源路径，在 HandleSend 中根据请求资源构建整个响应消息并发送，上传到目录时重定向到该目录
+                        responseOf(m_clientFd).bodyFileName = request.requestResourse.compare(0, 8, "/upload/") == 0
+                                ? "/redirect/" + request.requestResourse.substr(8) : "/redirect";
+                        m_sendReady = true;      // 请求处理完成后发送重定向回复报文
+                        request.status = HADNLE_COMPLATE;
                         std::cout << outHead("info") << "客户端 " << m_clientFd << " 的 POST 请求体处理完成，添加 Response 写事件，发送重定向报文刷新文件列表" << std::endl;
                         break;
                     }
                 }else{    // POST 是其他类型的数据
                     // 其他 POST 类型的数据时，直接返回重定向报文，获取文件列表
-                    responseStatus[m_clientFd].bodyFileName = "/redirect";
-                    modifyWaitFd(m_epollFd, m_clientFd, true, true, true);
-                    requestStatus[m_clientFd].status = HADNLE_COMPLATE;
+                    responseOf(m_clientFd).bodyFileName = "/redirect";
+                    m_sendReady = true;
+                    request.status = HADNLE_COMPLATE;
                     std::cout << outHead("error") << "客户端 " << m_clientFd << " 的 POST 请求中接收到不能处理的数据，添加 Response 写事件，返回重定向到文件列表的报文" << std::endl;
                     break;
                 }
@@ -299,206 +559,930 @@ void HandleRecv::process(){
     }
 
     
-    if(requestStatus[m_clientFd].status == HADNLE_COMPLATE){     // 如果请求处理完成，将该套接字对应的请求删除
+    // 请求结束（出错或消息体格式错误）时还有没有提交的上传文件，丢弃已经写入的数据
+    if(request.status == HADNLE_COMPLATE || request.status == HANDLE_ERROR){
+        setBulk(m_clientFd, false);
+        std::unique_ptr<StorageWriter> *writer = findState(uploadWriter, m_clientFd);
+        if(writer != nullptr){
+            (*writer)->abort();
+            eraseState(uploadWriter, m_clientFd);
+        }
+        // 没有完成的增量同步删除临时文件
+        DeltaProgress *delta = findState(deltaUpload, m_clientFd);
+        if(delta != nullptr){
+            delta->applier.abort();
+            eraseState(deltaUpload, m_clientFd);
+        }
+    }
+
+    if(request.status == HADNLE_COMPLATE){     // 如果请求处理完成，将该套接字对应的请求删除
         std::cout << outHead("info") << "客户端 " << m_clientFd << " 的请求消息处理成功" << std::endl;
-        requestStatus.erase(m_clientFd);
-    }else if(requestStatus[m_clientFd].status == HANDLE_ERROR){        
+        eraseState(requestStatus, m_clientFd);
+    }else if(request.status == HANDLE_ERROR){        
         // 请求处理错误，关闭该文件描述符，将该套接字对应的请求删除，从监听列表中删除该文件描述符
         std::cout << outHead("error") << "客户端 " << m_clientFd << " 的请求消息处理失败，关闭连接" << std::endl;
-        // 先删除监听的文件描述符
-        deleteWaitFd(m_epollFd, m_clientFd);
-        // 再关闭文件描述符
-        shutdown(m_clientFd, SHUT_RDWR);
-        close(m_clientFd);
-        requestStatus.erase(m_clientFd);
+        // 如果正在向上传会话追加数据，关闭暂存文件。已经写入的数据保留在暂存文件中，客户端可以通过 HEAD 查询偏移后继续上传
+        UploadProgress *progress = findState(uploadStatus, m_clientFd);
+        if(progress != nullptr){
+            close(progress->partFd);
+            UploadSession::release(progress->info.id, progress->partNumber == 0);
+            eraseState(uploadStatus, m_clientFd);
+        }
+        eraseState(uploadDigest, m_clientFd);
+        eraseState(requestStatus, m_clientFd);
+        if(findState(drainStatus, m_clientFd) != nullptr){
+            // 已经发送了拒绝上传的响应并半关闭，读取并丢弃剩余的消息体之后再关闭
+            drainRejected();
+        }else{
+            // 关闭文件描述符，close 时内核会将它从 epoll 中删除，EPOLLONESHOT 的事件已经触发，不需要先 EPOLL_CTL_DEL
+            RateLimiter::detach(m_clientFd);
+            shutdown(m_clientFd, SHUT_RDWR);
+            close(m_clientFd);
+        }
+    }
+
+    if(m_sendReady){
+        // 请求的状态删除之后才发送：发送完成时会重新注册可读事件，之后其他线程可能开始处理该连接上的下一个请求。
+        // 套接字通常可写，直接发送可以省去注册可写事件和等待下一次 epoll_wait
+        HandleSend handleSend(m_clientFd, m_epollFd);
+        handleSend.process();
     }
     
 }
 
-// 处理向客户端发送数据
-void HandleSend::process(){
-    std::cout << outHead("info") << "开始处理客户端 " << m_clientFd << " 的一个 HandleSend 事件" << std::endl;
-    // 如果该套接字没有需要处理的 Response 消息，直接退出
-    if(responseStatus.find(m_clientFd) == responseStatus.end()){
-        std::cout << outHead("info") << "客户端 " << m_clientFd << " 没有要处理的响应消息" << std::endl;
+// 消息体需要写入磁盘的请求：可续传上传（包括创建会话、查询进度和提交）、multipart 上传和增量同步
+bool HandleRecv::bodyNeedsFileIo(){
+    Request &request = stateOf(requestStatus, m_clientFd);
+    if(request.requestResourse.compare(0, 9, "/uploads/") == 0){
+        return true;
+    }
+    return request.requestMethod == "POST" && (request.msgHeader["Content-Type"] == "multipart/form-data" || request.requestResourse.compare(0, 7, "/delta/") == 0);
+}
+
+// 线程池过载时拒绝新的请求
+void HandleRecv::rejectOverloaded(){
+    // 先读出已经收到的请求，关闭时接收缓冲区中还有数据会发送 RST，客户端可能收不到 503
+    char buf[2048];
+    for(int i = 0; i < 32 && recv(m_clientFd, buf, sizeof(buf), MSG_DONTWAIT) > 0; ++i){
+    }
+    std::string msg = "HTTP/1.1 503 Service Unavailable\r\nRetry-After: " + std::to_string(retryAfterSeconds)
+            + "\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    send(m_clientFd, msg.c_str(), msg.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+    std::cout << outHead("warn") << "线程池过载，客户端 " << m_clientFd << " 的新请求返回 503，关闭连接" << std::endl;
+
+    RateLimiter::detach(m_clientFd);
+    shutdown(m_clientFd, SHUT_RDWR);
+    close(m_clientFd);
+}
+
+// 处理 /uploads 下的可续传上传请求：POST 创建会话或提交分片清单、HEAD 查询进度、PATCH 顺序追加数据、PUT 并行写入分片
+void HandleRecv::processResumableUpload(){
+    Request &request = stateOf(requestStatus, m_clientFd);
+    // 去掉 "/uploads/" 前缀，创建会话时为文件名，其他情况下为 会话id 或 会话id/分片号 或 会话id/complete
+    std::string target = request.requestResourse.size() > 9 ? request.requestResourse.substr(9) : "";
+    std::string sessionId = target.substr(0, target.find('/'));
+    std::string subTarget = target.find('/') != std::string::npos ? target.substr(target.find('/') + 1) : "";
+
+    if(request.requestMethod == "POST" && target.find('/') == std::string::npos){
+        // 创建上传会话，携带 Upload-Part-Size 时创建并行分片会话
+        std::string fileName = urlDecode(target);
+        long long length = 0;
+        long long partSize = 0;
+        bool isParallel = request.msgHeader.find("Upload-Part-Size") != request.msgHeader.end();
+        if(!UploadSession::isValidFileName(fileName) || !parseNumber(request.msgHeader["Upload-Length"], length)
+                || (isParallel && (!parseNumber(request.msgHeader["Upload-Part-Size"], partSize) || partSize == 0))){
+            std::cout << outHead("error") << "客户端 " << m_clientFd << " 创建上传会话的文件名、Upload-Length 或 Upload-Part-Size 无效" << std::endl;
+            sendDirectResponse("400", "Bad Request");
+            return;
+        }
+        UploadSessionInfo info;
+        int ret = isParallel ? UploadSession::createParallel(fileName, length, partSize, info) : UploadSession::create(fileName, length, info);
+        if(ret != 0){
+            sendDirectResponse("500", "Internal Server Error");
+            return;
+        }
+        // 长度为 0 的文件不需要再追加数据，直接完成
+        if(length == 0 && UploadSession::complete(info) != 0){
+            sendDirectResponse("500", "Internal Server Error");
+            return;
+        }
+        std::cout << outHead("info") << "客户端 " << m_clientFd << " 创建上传会话 " << info.id << " ，文件 " << fileName << " 的长度为 " << length << std::endl;
+        std::string header = "Location: /uploads/" + info.id + "\r\nUpload-Length: " + std::to_string(length) + "\r\n";
+        header += isParallel ? "Upload-Part-Size: " + std::to_string(partSize) + "\r\n" : "Upload-Offset: 0\r\n";
+        sendDirectResponse("201", "Created", header);
         return;
     }
 
-    // 根据 Response 对象的状态执行特定的处理
+    if(request.requestMethod == "POST" && subTarget == "complete"){
+        // 提交并行分片会话的分片清单，消息体为所有分片号（以空白字符或逗号分隔），需要等待消息体全部接收
+        long long bodyLen = 0;
+        if(!parseNumber(request.msgHeader["Content-Length"], bodyLen)){
+            sendDirectResponse("400", "Bad Request");
+            return;
+        }
+        if(static_cast<long long>(request.recvMsg.size()) < bodyLen){
+            return;
+        }
+        // 独占会话，提交期间不会有新的分片写入，也不会被当作过期会话删除
+        if(!UploadSession::acquire(sessionId, true)){
+            sendDirectResponse("409", "Conflict");
+            return;
+        }
+        UploadSessionInfo info;
+        if(UploadSession::load(sessionId, info) != 0 || info.partSize == 0){
+            UploadSession::release(sessionId, true);
+            sendDirectResponse("404", "Not Found");
+            return;
+        }
 
-    // 如果处于初始状态，根据请求的文件构建不同类型的发送数据
-    if(responseStatus[m_clientFd].status == HANDLE_INIT){
-        // 首先分离操作方法和文件
-        std::string opera, filename;
-        if(responseStatus[m_clientFd].bodyFileName == "/"){
-            // 如果是访问根目录，下面会直接返回文件列表
-            opera = "/";
+        std::string manifest = request.recvMsg.substr(0, bodyLen);
+        request.recvMsg.erase(0, bodyLen);
+        std::replace(manifest.begin(), manifest.end(), ',', ' ');
+        std::istringstream iss(manifest);
+        std::set<long long> manifestParts;
+        long long partNumber = 0;
+        while(iss >> partNumber){
+            manifestParts.insert(partNumber);
+        }
+
+        // 清单必须正好包含 1 到分片个数的所有分片，并且这些分片都已经写入完成
+        std::set<long long> doneParts;
+        UploadSession::loadDoneParts(info, doneParts);
+        bool isComplete = static_cast<long long>(manifestParts.size()) == info.partCount()
+                && (manifestParts.empty() || (*manifestParts.begin() == 1 && *manifestParts.rbegin() == info.partCount()));
+        for(std::set<long long>::const_iterator it = manifestParts.begin(); isComplete && it != manifestParts.end(); ++it){
+            isComplete = doneParts.count(*it) > 0;
+        }
+        if(!isComplete){
+            UploadSession::release(sessionId, true);
+            std::cout << outHead("error") << "客户端 " << m_clientFd << " 提交的上传会话 " << sessionId << " 的分片清单不完整" << std::endl;
+            sendDirectResponse("409", "Conflict", "Upload-Parts: " + std::to_string(doneParts.size()) + "/" + std::to_string(info.partCount()) + "\r\n"
+                    + "Upload-Parts-Done: " + UploadSession::formatParts(doneParts) + "\r\n");
+            return;
+        }
+        // 每个分片在完成时已经落盘，这里只需要原子地重命名
+        int ret = UploadSession::complete(info);
+        UploadSession::release(sessionId, true);
+        if(ret != 0){
+            sendDirectResponse("500", "Internal Server Error");
+            return;
+        }
+        std::cout << outHead("info") << "客户端 " << m_clientFd << " 的并行上传会话 " << info.id << " 提交完成，保存为文件 " << info.fileName << std::endl;
+        sendDirectResponse("204", "No Content");
+        return;
+    }
+
+    if(request.requestMethod == "HEAD" && subTarget.empty()){
+        // 查询会话的进度：顺序追加的会话返回已经提交的偏移，并行分片会话返回已经完成的分片个数和分片号
+        UploadSessionInfo info;
+        if(UploadSession::load(sessionId, info) != 0){
+            sendDirectResponse("404", "Not Found");
+            return;
+        }
+        std::string header = "Upload-Length: " + std::to_string(info.length) + "\r\nCache-Control: no-store\r\n";
+        if(info.partSize > 0){
+            std::set<long long> doneParts;
+            UploadSession::loadDoneParts(info, doneParts);
+            header += "Upload-Part-Size: " + std::to_string(info.partSize) + "\r\n";
+            header += "Upload-Parts: " + std::to_string(doneParts.size()) + "/" + std::to_string(info.partCount()) + "\r\n";
+            header += "Upload-Parts-Done: " + UploadSession::formatParts(doneParts) + "\r\n";
         }else{
-            // 如果不是访问根目录，根据 / 对URL中的路径（如 /delete/filename）进行分隔，找到要执行的操作和操作的文件
+            header += "Upload-Offset: " + std::to_string(info.offset) + "\r\n";
+        }
+        sendDirectResponse("200", "OK", header);
+        return;
+    }
+
+    if(!(request.requestMethod == "PATCH" && subTarget.empty()) && !(request.requestMethod == "PUT" && !subTarget.empty())){
+        sendDirectResponse("405", "Method Not Allowed", "Allow: POST, HEAD, PATCH, PUT\r\n");
+        return;
+    }
 
-            // 文件名的查找中间 / 的索引
-            int i = 1;
-            while(i < responseStatus[m_clientFd].bodyFileName.size() && responseStatus[m_clientFd].bodyFileName[i] != '/'){
-                ++i;
+    // PATCH 或 PUT 第一次进入时检查会话和写入位置，并打开暂存文件
+    if(findState(uploadStatus, m_clientFd) == nullptr){
+        long long bodyLen = 0;
+        if(!parseNumber(request.msgHeader["Content-Length"], bodyLen)){
+            sendDirectResponse("400", "Bad Request");
+            return;
+        }
+        // PATCH 独占会话，之后再加载会话并检查偏移：两个连接不会都认为自己的偏移正确而写到同一个位置。并行分片的 PUT 共享会话
+        bool exclusive = request.requestMethod == "PATCH";
+        if(!UploadSession::acquire(sessionId, exclusive)){
+            std::cout << outHead("error") << "客户端 " << m_clientFd << " 的上传会话 " << sessionId << " 正在被其他连接使用" << std::endl;
+            sendDirectResponse("409", "Conflict");
+            return;
+        }
+        UploadProgress progress;
+        std::string statusCode, statusDes, extraHeader;
+        if(UploadSession::load(sessionId, progress.info) != 0){
+            statusCode = "404";
+            statusDes = "Not Found";
+        }else if(request.requestMethod == "PATCH"){
+            // 顺序追加：客户端的偏移和已经提交的偏移不同时，返回当前偏移，由客户端从该位置重新发送
+            long long clientOffset = 0;
+            if(progress.info.partSize > 0 || !parseNumber(request.msgHeader["Upload-Offset"], clientOffset)
+                    || progress.info.offset + bodyLen > progress.info.length){
+                statusCode = "400";
+                statusDes = "Bad Request";
+            }else if(clientOffset != progress.info.offset){
+                std::cout << outHead("error") << "客户端 " << m_clientFd << " 的上传偏移 " << clientOffset << " 和会话 " << sessionId << " 已提交的偏移 " << progress.info.offset << " 不一致" << std::endl;
+                statusCode = "409";
+                statusDes = "Conflict";
+                extraHeader = "Upload-Offset: " + std::to_string(progress.info.offset) + "\r\n";
             }
-            // 检查是否包含操作和对应的文件名，如果不满足 操作+文件名 的格式，设置为重定向操作，将页面重定向到文件列表页面
-            if(i < responseStatus[m_clientFd].bodyFileName.size() - 1){
-                opera = responseStatus[m_clientFd].bodyFileName.substr(1, i - 1);
-                filename = responseStatus[m_clientFd].bodyFileName.substr(i+1);
-            }else{
-                opera = "redirect";
+            progress.writeOffset = progress.info.offset;
+        }else{
+            // 并行分片：分片 n 写到 (n - 1) * partSize，消息体长度必须等于该分片的长度
+            long long partNumber = 0;
+            if(progress.info.partSize == 0 || !parseNumber(subTarget, partNumber) || partNumber < 1 || partNumber > progress.info.partCount()
+                    || bodyLen != std::min(progress.info.partSize, progress.info.length - (partNumber - 1) * progress.info.partSize)){
+                statusCode = "400";
+                statusDes = "Bad Request";
             }
+            progress.partNumber = partNumber;
+            progress.writeOffset = (partNumber - 1) * progress.info.partSize;
+        }
 
+        if(statusCode.empty()){
+            progress.partFd = UploadSession::openPart(progress.info);
+            if(progress.partFd == -1){
+                statusCode = "500";
+                statusDes = "Internal Server Error";
+            }
         }
-        
+        if(!statusCode.empty()){
+            UploadSession::release(sessionId, exclusive);
+            sendDirectResponse(statusCode, statusDes, extraHeader);
+            return;
+        }
+        progress.bodyRemain = bodyLen;
+        stateOf(uploadStatus, m_clientFd) = progress;
+    }
 
-        // 初始状态中，根据资操作确定所发送数据的内容
-        if(opera == "/"){                   //如果是根目录，返回文件夹中的所有文件名字
-            // 添加状态行
-            responseStatus[m_clientFd].beforeBodyMsg = getStatusLine("HTTP/1.1", "200", "OK");
+    // 将已经接收的消息体数据用 pwrite 写到暂存文件中的最终位置，不同连接的分片可以由不同的线程同时写入
+    UploadProgress &progress = stateOf(uploadStatus, m_clientFd);
+    long long writeLen = std::min<long long>(request.recvMsg.size(), progress.bodyRemain);
+    long long hasWriteLen = 0;
+    while(hasWriteLen < writeLen){
+        ssize_t ret = pwrite(progress.partFd, request.recvMsg.c_str() + hasWriteLen, writeLen - hasWriteLen, progress.writeOffset + hasWriteLen);
+        if(ret == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            std::cout << outHead("error") << "客户端 " << m_clientFd << " 向上传会话 " << progress.info.id << " 写入数据失败 (errno = " << errno << ")" << std::endl;
+            close(progress.partFd);
+            UploadSession::release(progress.info.id, progress.partNumber == 0);
+            eraseState(uploadStatus, m_clientFd);
+            sendDirectResponse("500", "Internal Server Error");
+            return;
+        }
+        // 从暂存文件开头连续写入的数据边写入边计算校验值，提交时不需要再读取这部分
+        UploadSession::hashWritten(progress.info.id, progress.writeOffset + hasWriteLen, request.recvMsg.c_str() + hasWriteLen, ret);
+        hasWriteLen += ret;
+    }
+    request.recvMsg.erase(0, writeLen);
+    progress.writeOffset += writeLen;
+    progress.bodyRemain -= writeLen;
 
-            // 先创建响应体对应的数据
-            // 函数中先获取 /filedir 文件夹中的所有文件，然后根据 filelist.html 的页面结构，所有文件项加入页面，最终的HTML页面以字符串形式保存到 msgBody 中
-            getFileListPage(responseStatus[m_clientFd].msgBody);
-            // 记录页面的字节个数，即消息体长度
-            responseStatus[m_clientFd].msgBodyLen = responseStatus[m_clientFd].msgBody.size();
+    // 消息体还没有接收完成，等待接收更多数据
+    if(progress.bodyRemain > 0){
+        return;
+    }
 
+    // 当前 PATCH 或 PUT 处理完成。并行分片和最后一次顺序追加需要先将数据落盘，再记录分片完成或重命名文件
+    UploadProgress finished = progress;
+    bool isLastAppend = finished.partNumber == 0 && finished.writeOffset == finished.info.length;
+    bool synced = true;
+    if(finished.partNumber > 0 || isLastAppend){
+        synced = fdatasync(finished.partFd) == 0;
+    }
+    close(finished.partFd);
+    eraseState(uploadStatus, m_clientFd);
+
+    // 记录分片完成或保存文件之后才释放会话
+    if(finished.partNumber > 0){
+        bool isDone = synced && UploadSession::markPartDone(finished.info, finished.partNumber) == 0;
+        UploadSession::release(finished.info.id, false);
+        if(!isDone){
+            sendDirectResponse("500", "Internal Server Error");
+            return;
+        }
+        std::cout << outHead("info") << "客户端 " << m_clientFd << " 的上传会话 " << finished.info.id << " 的分片 " << finished.partNumber << " 接收完成" << std::endl;
+        sendDirectResponse("204", "No Content");
+        return;
+    }
 
-            // 根据消息体的数据长度添加头部信息
-            responseStatus[m_clientFd].beforeBodyMsg += getMessageHeader(std::to_string(responseStatus[m_clientFd].msgBodyLen), "html");
-            // 加入空行
-            responseStatus[m_clientFd].beforeBodyMsg += "\r\n";
+    bool isSaved = !isLastAppend || (synced && UploadSession::complete(finished.info) == 0);
+    UploadSession::release(finished.info.id, true);
+    if(!isSaved){
+        sendDirectResponse("500", "Internal Server Error");
+        return;
+    }
+    if(isLastAppend){
+        std::cout << outHead("info") << "客户端 " << m_clientFd << " 的上传会话 " << finished.info.id << " 接收完成，保存为文件 " << finished.info.fileName << std::endl;
+    }
+    sendDirectResponse("204", "No Content", "Upload-Offset: " + std::to_string(finished.writeOffset) + "\r\n");
+}
 
-            responseStatus[m_clientFd].beforeBodyMsgLen = responseStatus[m_clientFd].beforeBodyMsg.size();
+// 首部接收完成后检查上传是否允许
+bool HandleRecv::checkUploadHeaders(){
+    Request &request = stateOf(requestStatus, m_clientFd);
+    if(request.requestMethod != "POST" && request.requestMethod != "PUT" && request.requestMethod != "PATCH"){
+        return true;
+    }
 
+    // 创建上传会话时检查文件的总长度，其他情况下检查消息体的长度。没有长度信息时在写入文件时再检查
+    long long uploadLen = 0;
+    std::string lengthHeader = request.msgHeader.find("Upload-Length") != request.msgHeader.end() ? "Upload-Length" : "Content-Length";
+    if(!parseNumber(request.msgHeader[lengthHeader], uploadLen)){
+        return true;
+    }
 
-            // 设置标识，转换到发送数据的状态
-            responseStatus[m_clientFd].bodyType = HTML_TYPE;      // 设置消息体的类型
-            responseStatus[m_clientFd].status = HANDLE_HEAD;      // 设置状态为等待发送消息头
-            responseStatus[m_clientFd].curStatusHasSendLen = 0;   // 设置当前已发送的数据长度为0
-            std::cout << outHead("info") << "客户端 " << m_clientFd << " 的响应消息用来返回文件列表页面，状态行和消息体已构建完成" << std::endl;
-
-        }else if(opera == "download"){      // 下载文件
-            // 构建下载文件的响应，向用户发送文件
-
-            // 添加状态行
-            responseStatus[m_clientFd].beforeBodyMsg = getStatusLine("HTTP/1.1", "200", "OK");
-
-            // 添加URL解码逻辑（示例）
-            std::string decodedFilename = urlDecode(filename);  // 新增：对文件名进行 URL 解码
-            // responseStatus[m_clientFd].fileMsgFd = open(("filedir/" + filename).c_str(), O_RDONLY);
-            // 使用解码后的文件名打开文件
-            responseStatus[m_clientFd].fileMsgFd = open(("filedir/" + decodedFilename).c_str(), O_RDONLY);
-            // 获取所传递文件的描述符
-            if(responseStatus[m_clientFd].fileMsgFd == -1){                  // 文件打开失败时，退出当前函数（避免下面关闭文件造成错误），并重置写事件，在下次进入时回复重定向报文
-                std::cout << outHead("error") << "客户端 " << m_clientFd << " 的请求消息要下载文件 " << filename << " ，但是文件打开失败，退出当前函数，重新进入用于返回重定向报文，重定向到文件列表" << std::endl;
-                responseStatus[m_clientFd] = Response();                     // 重置 Response
-                responseStatus[m_clientFd].bodyFileName = "/redirect";
-                modifyWaitFd(m_epollFd, m_clientFd, true, true, true);       // 重置写事件
-                return;
-            }else{    // 文件打开成功时才构建响应体
-                // 获取文件信息
-                struct stat fileStat;
-                fstat(responseStatus[m_clientFd].fileMsgFd, &fileStat);
-                
-                // 获取文件长度，作为消息体长度
-                responseStatus[m_clientFd].msgBodyLen = fileStat.st_size;
-                
-                // 根据消息体构建消息首部
-                responseStatus[m_clientFd].beforeBodyMsg += getMessageHeader(std::to_string(responseStatus[m_clientFd].msgBodyLen), "file", std::to_string(responseStatus[m_clientFd].msgBodyLen - 1));
-                // 加入空行
-                responseStatus[m_clientFd].beforeBodyMsg += "\r\n";
-                responseStatus[m_clientFd].beforeBodyMsgLen = responseStatus[m_clientFd].beforeBodyMsg.size();
-                
-                // 设置标识，转换到发送数据的状态
-                responseStatus[m_clientFd].bodyType = FILE_TYPE;      // 设置消息体的类型
-                responseStatus[m_clientFd].status = HANDLE_HEAD;      // 设置状态为处理消息头
-                responseStatus[m_clientFd].curStatusHasSendLen = 0;   // 设置当前已发送的数据长度为0
+    // multipart 的消息体可以包含多个文件，最大文件大小限制的是每个文件，在写入每个部分时检查，这里只检查剩余空间
+    bool isMultipart = request.msgHeader["Content-Type"] == "multipart/form-data";
+    if(!isMultipart && uploadLen > maxUploadSize){
+        std::cout << outHead("error") << "客户端 " << m_clientFd << " 上传的数据长度 " << uploadLen << " 超过最大文件大小 " << maxUploadSize << " ，拒绝上传" << std::endl;
+        rejectUpload("413", "Payload Too Large");
+        return false;
+    }
 
-                std::cout << outHead("info") << "客户端 " << m_clientFd << " 的请求消息要下载文件 " << filename << " ，文件打开成功，根据文件构建响应消息状态行和头部信息成功" << std::endl;
-                
-            }
+    // 检查文件目录所在文件系统的剩余空间（普通用户可用的部分）
+    struct statvfs fsStat;
+    if(statvfs("filedir", &fsStat) == 0 && static_cast<unsigned long long>(uploadLen) > static_cast<unsigned long long>(fsStat.f_bavail) * fsStat.f_frsize){
+        std::cout << outHead("error") << "客户端 " << m_clientFd << " 上传的数据长度 " << uploadLen << " 超过磁盘剩余空间，拒绝上传" << std::endl;
+        rejectUpload("507", "Insufficient Storage");
+        return false;
+    }
 
-        }else if(opera == "delete"){        // 删除文件
-            // 在本地删除文件
-            int ret = remove(("filedir/" + filename).c_str());
-            if(ret != 0){
-                std::cout << outHead("error") << "客户端 " << m_clientFd << " 的请求消息要删除文件 " << filename << " 但是文件删除失败" << std::endl;
+    // 允许上传，客户端在等待 100 Continue 时才发送消息体
+    std::string expect = request.msgHeader["Expect"];
+    std::transform(expect.begin(), expect.end(), expect.begin(), ::tolower);
+    if(expect == "100-continue" && uploadLen > 0){
+        const std::string continueMsg = "HTTP/1.1 100 Continue\r\n\r\n";
+        send(m_clientFd, continueMsg.c_str(), continueMsg.size(), MSG_NOSIGNAL);
+        std::cout << outHead("info") << "客户端 " << m_clientFd << " 的上传请求检查通过，已发送 100 Continue" << std::endl;
+    }
+
+    // 消息体较大时按批量传输调度，之后该连接的可读事件放入批量队列
+    long long bodyLen = 0;
+    if(parseNumber(request.msgHeader["Content-Length"], bodyLen) && bodyLen >= BULK_TRANSFER_SIZE){
+        setBulk(m_clientFd, true);
+    }
+    return true;
+}
+
+// 处理 POST /delta/文件名 的增量同步请求，消息体为复制已有块和写入新数据的指令流，边接收边重建文件
+void HandleRecv::processDeltaUpload(){
+    Request &request = stateOf(requestStatus, m_clientFd);
+
+    // 第一次进入时检查首部，打开已有文件并创建临时文件
+    if(findState(deltaUpload, m_clientFd) == nullptr){
+        std::string fileName = urlDecode(request.requestResourse.substr(7));
+        long long bodyLen = 0;
+        long long targetLength = 0;
+        if(!StorageEngine::isValidName(fileName) || !parseNumber(request.msgHeader["Content-Length"], bodyLen)
+                || !parseNumber(request.msgHeader["Delta-Length"], targetLength) || request.msgHeader["Delta-Base"].empty()){
+            sendDirectResponse("400", "Bad Request");
+            return;
+        }
+        if(targetLength > maxUploadSize){
+            rejectUpload("413", "Payload Too Large");
+            return;
+        }
+        if(StorageEngine::current()->localPath(fileName).empty()){
+            // 文件没有保存为完整的普通文件（去重存储或段中的小文件），没有可以复制的块，客户端使用普通上传
+            sendDirectResponse("404", "Not Found");
+            return;
+        }
+
+        DeltaProgress &progress = stateOf(deltaUpload, m_clientFd);
+        progress.bodyRemain = bodyLen;
+        progress.targetLength = targetLength;
+        int ret = progress.applier.begin(fileName, request.msgHeader["Delta-Base"], maxUploadSize);
+        if(ret != DELTA_OK){
+            eraseState(deltaUpload, m_clientFd);
+            if(ret == DELTA_NOT_FOUND){
+                sendDirectResponse("404", "Not Found");
+            }else if(ret == DELTA_BASE_CHANGED){
+                // 已有文件在获取签名之后被修改，客户端需要重新获取签名
+                sendDirectResponse("412", "Precondition Failed");
             }else{
-                std::cout << outHead("info") << "客户端 " << m_clientFd << " 的请求消息要删除文件 " << filename << " 且文件删除成功" << std::endl;
+                sendDirectResponse("500", "Internal Server Error");
             }
+            return;
+        }
+        std::cout << outHead("info") << "客户端 " << m_clientFd << " 开始增量同步文件 " << fileName << " ，新文件长度为 " << targetLength << std::endl;
+    }
 
-            // 不管文件删除成功还是失败，都重定向到文件列表页面
-            responseStatus[m_clientFd] = Response();                     // 重置 Response
-            responseStatus[m_clientFd].bodyFileName = "/redirect";       // 设置为重定向报文
+    // 处理已经接收的指令流，复制块和写入新数据都直接作用到临时文件
+    DeltaProgress &progress = stateOf(deltaUpload, m_clientFd);
+    long long handleLen = std::min<long long>(request.recvMsg.size(), progress.bodyRemain);
+    int ret = progress.applier.update(request.recvMsg.c_str(), handleLen);
+    request.recvMsg.erase(0, handleLen);
+    progress.bodyRemain -= handleLen;
+    if(ret == DELTA_OK && progress.bodyRemain > 0){
+        return;
+    }
+    if(ret == DELTA_OK){
+        ret = progress.applier.finish(progress.targetLength);
+    }else{
+        progress.applier.abort();
+    }
 
-            std::cout << outHead("info") << "客户端 " << m_clientFd << " 的请求消息处理完成，发送重定向报文" << std::endl;
+    DeltaProgress finished = progress;
+    eraseState(deltaUpload, m_clientFd);
+    if(ret == DELTA_BAD_REQUEST){
+        std::cout << outHead("error") << "客户端 " << m_clientFd << " 的增量同步指令流无效" << std::endl;
+        sendDirectResponse("400", "Bad Request");
+    }else if(ret == DELTA_TOO_LARGE){
+        rejectUpload("413", "Payload Too Large");
+    }else if(ret != DELTA_OK){
+        sendDirectResponse("500", "Internal Server Error");
+    }else{
+        MetaIndex::update(finished.applier.fileName());
+        std::cout << outHead("info") << "客户端 " << m_clientFd << " 增量同步完成，接收新数据 " << finished.applier.literalBytes() << " 字节，复制已有数据 " << finished.applier.copiedBytes() << " 字节" << std::endl;
+        sendDirectResponse("204", "No Content", "Delta-Literal-Bytes: " + std::to_string(finished.applier.literalBytes())
+                + "\r\nDelta-Copied-Bytes: " + std::to_string(finished.applier.copiedBytes()) + "\r\n");
+    }
+}
 
-            // 重置 EPOLLONESHOT，之后直接退出函数，使得可以再次进入函数重新构建文件列表的响应消息
-            modifyWaitFd(m_epollFd, m_clientFd, true, true, true);
+// 拒绝上传请求：直接发送错误响应，并将请求设置为出错状态，之后丢弃剩余的消息体并关闭连接
+void HandleRecv::rejectUpload(const std::string &statusCode, const std::string &statusDes, const std::string &extraHeader){
+    // 响应很短，连接上此时没有其他待发送的数据，直接在当前线程发送，不需要再等待写事件
+    std::string rejectMsg = "HTTP/1.1 " + statusCode + " " + statusDes + "\r\nContent-Length: 0\r\n" + extraHeader + "Connection: close\r\n\r\n";
+    send(m_clientFd, rejectMsg.c_str(), rejectMsg.size(), MSG_NOSIGNAL);
+
+    // 客户端通常还在发送消息体，接收缓冲区中有未读数据时 close 会发送 RST，客户端可能在读到响应之前就收到连接重置。
+    // 先半关闭，响应之后发送 FIN；再读取并丢弃客户端发送的数据，直到客户端关闭、超过 REJECT_DRAIN_MAX 字节或者 REJECT_DRAIN_SECONDS 秒
+    shutdown(m_clientFd, SHUT_WR);
+    stateOf(drainStatus, m_clientFd).deadline = std::chrono::steady_clock::now() + std::chrono::seconds(REJECT_DRAIN_SECONDS);
+    stateOf(requestStatus, m_clientFd).status = HANDLE_ERROR;
+}
+
+// 读取并丢弃被拒绝的上传剩余的消息体，没有数据时重新注册可读事件，结束时关闭连接
+void HandleRecv::drainRejected(){
+    DrainProgress &progress = stateOf(drainStatus, m_clientFd);
+    char buf[4096];
+    while(1){
+        ssize_t recvLen = recv(m_clientFd, buf, sizeof(buf), 0);
+        bool inTime = std::chrono::steady_clock::now() < progress.deadline;
+        if(recvLen > 0){
+            progress.drained += recvLen;
+            if(progress.drained < REJECT_DRAIN_MAX && inTime){
+                continue;
+            }
+        }else if(recvLen == -1 && errno == EAGAIN && inTime){
+            modifyWaitFd(m_epollFd, m_clientFd, true, true, false);
             return;
-        }else{                              // 对于其他的请求，将页面全部重定向到文件列表页面
-            // 添加状态行
-            responseStatus[m_clientFd].beforeBodyMsg = getStatusLine("HTTP/1.1", "302", "Moved Temporarily");
+        }
+        break;
+    }
+    std::cout << outHead("info") << "客户端 " << m_clientFd << " 被拒绝的上传丢弃了 " << progress.drained << " 字节，关闭连接" << std::endl;
+    eraseState(drainStatus, m_clientFd);
+    RateLimiter::detach(m_clientFd);
+    close(m_clientFd);
+}
+
+// 构建一个不需要 HandleSend 解析资源路径的响应报文，同时将请求设置为处理完成
+void HandleRecv::sendDirectResponse(const std::string &statusCode, const std::string &statusDes, const std::string &extraHeader){
+    responseOf(m_clientFd) = Response();
+    responseOf(m_clientFd).responseHttpVersion = "HTTP/1.1";
+    responseOf(m_clientFd).responseStatusCode = statusCode;
+    responseOf(m_clientFd).responseStatusDes = statusDes;
+
+    // 构建状态行和消息首部，响应没有消息体
+    responseOf(m_clientFd).beforeBodyMsg = "HTTP/1.1 " + statusCode + " " + statusDes + "\r\n";
+    responseOf(m_clientFd).beforeBodyMsg += extraHeader;
+    responseOf(m_clientFd).beforeBodyMsg += "Content-Length: 0\r\nConnection: keep-alive\r\n\r\n";
+    responseOf(m_clientFd).beforeBodyMsgLen = responseOf(m_clientFd).beforeBodyMsg.size();
+
+    // 直接进入发送消息头的状态，HandleSend 中会跳过根据资源路径构建响应的步骤
+    responseOf(m_clientFd).bodyType = EMPTY_TYPE;
+    responseOf(m_clientFd).status = HANDLE_HEAD;
+    responseOf(m_clientFd).curStatusHasSendLen = 0;
+
+    m_sendReady = true;
+    stateOf(requestStatus, m_clientFd).status = HADNLE_COMPLATE;
+}
 
-            // 构建重定向的消息首部
-            responseStatus[m_clientFd].beforeBodyMsg += getMessageHeader("0", "html", "/", "");
+// 根据请求的资源构建响应消息的状态行、首部和消息体。响应被重置为重定向（如删除文件后）时返回 false，需要再调用一次
+bool HandleSend::buildResponse(){
+    // 首先分离操作方法和文件
+    std::string opera, filename;
+    if(responseOf(m_clientFd).bodyFileName == "/"){
+        // 如果是访问根目录，下面会直接返回文件列表
+        opera = "/";
+    }else{
+        // 如果不是访问根目录，根据 / 对URL中的路径（如 /delete/filename）进行分隔，找到要执行的操作和操作的文件
+
+        // 文件名的查找中间 / 的索引
+        int i = 1;
+        while(i < responseOf(m_clientFd).bodyFileName.size() && responseOf(m_clientFd).bodyFileName[i] != '/'){
+            ++i;
+        }
+        // 检查是否包含操作和对应的文件名，如果不满足 操作+文件名 的格式，设置为重定向操作，将页面重定向到文件列表页面
+        if(i < responseOf(m_clientFd).bodyFileName.size() - 1){
+            opera = responseOf(m_clientFd).bodyFileName.substr(1, i - 1);
+            filename = responseOf(m_clientFd).bodyFileName.substr(i+1);
+        }else{
+            opera = "redirect";
+        }
 
-            // 加入空行
-            responseStatus[m_clientFd].beforeBodyMsg += "\r\n";
+    }
+    
+
+    // 初始状态中，根据资操作确定所发送数据的内容
+    if(opera == "list" && getFileListPage(responseOf(m_clientFd).msgBody, urlDecode(filename)) != 0){
+        // 目录不存在或者存储引擎不支持目录，重定向到根目录的文件列表
+        responseOf(m_clientFd).msgBody.clear();
+        opera = "redirect";
+        filename.clear();
+    }
+    if(opera == "/" || opera == "list"){    //如果是根目录或者其他目录，返回目录中的所有文件名字
+        // 添加状态行
+        responseOf(m_clientFd).beforeBodyMsg = getStatusLine("HTTP/1.1", "200", "OK");
+
+        // 先创建响应体对应的数据（其他目录的页面已经在上面创建）
+        // 函数中先从存储引擎获取所有文件，然后根据 filelist.html 的页面结构，所有文件项加入页面，最终的HTML页面以字符串形式保存到 msgBody 中
+        if(opera == "/"){
+            getFileListPage(responseOf(m_clientFd).msgBody);
+        }
+        // 记录页面的字节个数，即消息体长度
+        responseOf(m_clientFd).msgBodyLen = responseOf(m_clientFd).msgBody.size();
+
+
+        // 根据消息体的数据长度添加头部信息
+        responseOf(m_clientFd).beforeBodyMsg += getMessageHeader(std::to_string(responseOf(m_clientFd).msgBodyLen), "html");
+        // 加入空行
+        responseOf(m_clientFd).beforeBodyMsg += "\r\n";
+
+        responseOf(m_clientFd).beforeBodyMsgLen = responseOf(m_clientFd).beforeBodyMsg.size();
+
+
+        // 设置标识，转换到发送数据的状态
+        responseOf(m_clientFd).bodyType = HTML_TYPE;      // 设置消息体的类型
+        responseOf(m_clientFd).status = HANDLE_HEAD;      // 设置状态为等待发送消息头
+        responseOf(m_clientFd).curStatusHasSendLen = 0;   // 设置当前已发送的数据长度为0
+        std::cout << outHead("info") << "客户端 " << m_clientFd << " 的响应消息用来返回文件列表页面，状态行和消息体已构建完成" << std::endl;
+
+    }else if(opera == "stats" && filename == "pools"){     // 线程池的队列长度等统计信息
+        responseOf(m_clientFd).beforeBodyMsg = getStatusLine("HTTP/1.1", "200", "OK");
+
+        responseOf(m_clientFd).msgBody = ThreadPool::statsJson();
+        responseOf(m_clientFd).msgBodyLen = responseOf(m_clientFd).msgBody.size();
+        responseOf(m_clientFd).beforeBodyMsg += getMessageHeader(std::to_string(responseOf(m_clientFd).msgBodyLen), "json");
+        responseOf(m_clientFd).beforeBodyMsg += "\r\n";
+        responseOf(m_clientFd).beforeBodyMsgLen = responseOf(m_clientFd).beforeBodyMsg.size();
 
-            responseStatus[m_clientFd].beforeBodyMsgLen = responseStatus[m_clientFd].beforeBodyMsg.size();
+        responseOf(m_clientFd).bodyType = HTML_TYPE;
+        responseOf(m_clientFd).status = HANDLE_HEAD;
+        responseOf(m_clientFd).curStatusHasSendLen = 0;
+        std::cout << outHead("info") << "客户端 " << m_clientFd << " 的响应消息用来返回线程池统计信息，状态行和消息体已构建完成" << std::endl;
 
+    }else if(opera == "stats" && filename == "dedup"){     // 去重存储的统计信息
+        responseOf(m_clientFd).beforeBodyMsg = getStatusLine("HTTP/1.1", "200", "OK");
+
+        responseOf(m_clientFd).msgBody = DedupStore::statsJson();
+        responseOf(m_clientFd).msgBodyLen = responseOf(m_clientFd).msgBody.size();
+        responseOf(m_clientFd).beforeBodyMsg += getMessageHeader(std::to_string(responseOf(m_clientFd).msgBodyLen), "json");
+        responseOf(m_clientFd).beforeBodyMsg += "\r\n";
+        responseOf(m_clientFd).beforeBodyMsgLen = responseOf(m_clientFd).beforeBodyMsg.size();
+
+        // 消息体保存在内存中，和文件列表页面的发送方法相同
+        responseOf(m_clientFd).bodyType = HTML_TYPE;
+        responseOf(m_clientFd).status = HANDLE_HEAD;
+        responseOf(m_clientFd).curStatusHasSendLen = 0;
+        std::cout << outHead("info") << "客户端 " << m_clientFd << " 的响应消息用来返回去重统计信息，状态行和消息体已构建完成" << std::endl;
+
+    }else if(opera == "api" && filename == "files"){      // 所有文件的元数据（JSON）
+        if(MetaIndex::isOpen()){
+            responseOf(m_clientFd).beforeBodyMsg = getStatusLine("HTTP/1.1", "200", "OK");
+            responseOf(m_clientFd).msgBody = MetaIndex::listJson();
+        }else{
+            // 没有启用元数据索引时无法提供文件的长度和校验值
+            responseOf(m_clientFd).beforeBodyMsg = getStatusLine("HTTP/1.1", "503", "Service Unavailable");
+            responseOf(m_clientFd).msgBody = "[]";
+        }
+        responseOf(m_clientFd).msgBodyLen = responseOf(m_clientFd).msgBody.size();
+        responseOf(m_clientFd).beforeBodyMsg += getMessageHeader(std::to_string(responseOf(m_clientFd).msgBodyLen), "json");
+        responseOf(m_clientFd).beforeBodyMsg += "\r\n";
+        responseOf(m_clientFd).beforeBodyMsgLen = responseOf(m_clientFd).beforeBodyMsg.size();
+
+        responseOf(m_clientFd).bodyType = HTML_TYPE;
+        responseOf(m_clientFd).status = HANDLE_HEAD;
+        responseOf(m_clientFd).curStatusHasSendLen = 0;
+        std::cout << outHead("info") << "客户端 " << m_clientFd << " 的响应消息用来返回文件元数据，状态行和消息体已构建完成" << std::endl;
+
+    }else if(opera == "api" && filename.compare(0, 5, "usage") == 0 && (filename.size() == 5 || filename[5] == '/')){     // 目录占用统计（JSON）
+        if(DirUsage::usageJson(filename.size() > 6 ? urlDecode(filename.substr(6)) : "", responseOf(m_clientFd).msgBody) == 0){
+            responseOf(m_clientFd).beforeBodyMsg = getStatusLine("HTTP/1.1", "200", "OK");
+        }else if(DirUsage::isReady()){
+            responseOf(m_clientFd).beforeBodyMsg = getStatusLine("HTTP/1.1", "404", "Not Found");
+            responseOf(m_clientFd).msgBody = "{}";
+        }else{
+            // 扫描还没有完成，或者当前的存储引擎不支持目录
+            responseOf(m_clientFd).beforeBodyMsg = getStatusLine("HTTP/1.1", "503", "Service Unavailable");
+            responseOf(m_clientFd).msgBody = "{}";
+        }
+        responseOf(m_clientFd).msgBodyLen = responseOf(m_clientFd).msgBody.size();
+        responseOf(m_clientFd).beforeBodyMsg += getMessageHeader(std::to_string(responseOf(m_clientFd).msgBodyLen), "json");
+        responseOf(m_clientFd).beforeBodyMsg += "\r\n";
+        responseOf(m_clientFd).beforeBodyMsgLen = responseOf(m_clientFd).beforeBodyMsg.size();
+
+        responseOf(m_clientFd).bodyType = HTML_TYPE;
+        responseOf(m_clientFd).status = HANDLE_HEAD;
+        responseOf(m_clientFd).curStatusHasSendLen = 0;
+        std::cout << outHead("info") << "客户端 " << m_clientFd << " 的响应消息用来返回目录占用统计，状态行和消息体已构建完成" << std::endl;
+
+    }else if(opera == "api" && filename.compare(0, 6, "search") == 0 && (filename.size() == 6 || filename[6] == '?')){     // 按文件名搜索（JSON）
+        std::string query = filename.size() > 7 ? filename.substr(7) : "";
+        long long offset = 0, limit = SEARCH_DEFAULT_LIMIT;
+        parseNumber(queryParam(query, "offset"), offset);
+        parseNumber(queryParam(query, "limit"), limit);
+        limit = std::min<long long>(std::max<long long>(limit, 1), SEARCH_MAX_LIMIT);
+
+        responseOf(m_clientFd).beforeBodyMsg = getStatusLine("HTTP/1.1", "200", "OK");
+        responseOf(m_clientFd).msgBody = SearchIndex::searchJson(queryParam(query, "q"), offset, limit);
+        responseOf(m_clientFd).msgBodyLen = responseOf(m_clientFd).msgBody.size();
+        responseOf(m_clientFd).beforeBodyMsg += getMessageHeader(std::to_string(responseOf(m_clientFd).msgBodyLen), "json");
+        responseOf(m_clientFd).beforeBodyMsg += "\r\n";
+        responseOf(m_clientFd).beforeBodyMsgLen = responseOf(m_clientFd).beforeBodyMsg.size();
+
+        responseOf(m_clientFd).bodyType = HTML_TYPE;
+        responseOf(m_clientFd).status = HANDLE_HEAD;
+        responseOf(m_clientFd).curStatusHasSendLen = 0;
+        std::cout << outHead("info") << "客户端 " << m_clientFd << " 的响应消息用来返回文件名搜索结果，状态行和消息体已构建完成" << std::endl;
+
+    }else if(opera == "delta"){         // 增量同步：返回已有文件的块签名
+        std::string decodedFilename = urlDecode(filename);
+        std::string sigText, baseToken;
+        long long blockSize = 0, fileLength = 0;
+        int ret = !StorageEngine::isValidName(decodedFilename) || StorageEngine::current()->localPath(decodedFilename).empty() ? DELTA_NOT_FOUND
+                : DeltaSync::signatures(decodedFilename, sigText, blockSize, fileLength, baseToken);
+        if(ret != DELTA_OK){
+            responseOf(m_clientFd).beforeBodyMsg = ret == DELTA_NOT_FOUND ? getStatusLine("HTTP/1.1", "404", "Not Found") : getStatusLine("HTTP/1.1", "500", "Internal Server Error");
+            responseOf(m_clientFd).beforeBodyMsg += getMessageHeader("0", "");
+            responseOf(m_clientFd).beforeBodyMsg += "\r\n";
+            responseOf(m_clientFd).bodyType = EMPTY_TYPE;
+        }else{
+            responseOf(m_clientFd).beforeBodyMsg = getStatusLine("HTTP/1.1", "200", "OK");
+            responseOf(m_clientFd).msgBody.swap(sigText);
+            responseOf(m_clientFd).msgBodyLen = responseOf(m_clientFd).msgBody.size();
+            responseOf(m_clientFd).beforeBodyMsg += getMessageHeader(std::to_string(responseOf(m_clientFd).msgBodyLen), "text");
+            responseOf(m_clientFd).beforeBodyMsg += "Delta-Block-Size: " + std::to_string(blockSize) + "\r\n";
+            responseOf(m_clientFd).beforeBodyMsg += "Delta-Base-Length: " + std::to_string(fileLength) + "\r\n";
+            responseOf(m_clientFd).beforeBodyMsg += "Delta-Base: " + baseToken + "\r\n";
+            responseOf(m_clientFd).beforeBodyMsg += "\r\n";
+            // 签名保存在内存中，和文件列表页面的发送方法相同
+            responseOf(m_clientFd).bodyType = HTML_TYPE;
+        }
+        responseOf(m_clientFd).beforeBodyMsgLen = responseOf(m_clientFd).beforeBodyMsg.size();
+        responseOf(m_clientFd).status = HANDLE_HEAD;
+        responseOf(m_clientFd).curStatusHasSendLen = 0;
+        std::cout << outHead("info") << "客户端 " << m_clientFd << " 请求文件 " << filename << " 的增量同步签名，响应消息构建完成" << std::endl;
+
+    }else if(opera == "download"){      // 下载文件
+        // 构建下载文件的响应，向用户发送文件
+
+        // 添加状态行
+        responseOf(m_clientFd).beforeBodyMsg = getStatusLine("HTTP/1.1", "200", "OK");
+
+        // 添加URL解码逻辑（示例）
+        std::string decodedFilename = urlDecode(filename);  // 新增：对文件名进行 URL 解码
+        // 通过存储引擎打开文件，之后由存储引擎从文件所在的位置发送数据
+        StorageReader *reader = StorageEngine::current()->openReader(decodedFilename);
+        if(reader == nullptr){                  // 文件打开失败时，退出当前函数，并重置写事件，在下次进入时回复重定向报文
+            std::cout << outHead("error") << "客户端 " << m_clientFd << " 的请求消息要下载文件 " << filename << " ，但是文件打开失败，退出当前函数，重新进入用于返回重定向报文，重定向到文件列表" << std::endl;
+            responseOf(m_clientFd) = Response();                     // 重置 Response
+            responseOf(m_clientFd).bodyFileName = "/redirect";
+            return false;
+        }else{    // 文件打开成功时才构建响应体
+            DownloadProgress &download = stateOf(downloadStatus, m_clientFd);
+            download.reader.reset(reader);
+            download.prefetched = false;
+
+            // 有 I/O 线程池时当前在 I/O 线程中，发送消息首部之前先把文件开头的数据读入页缓存
+            if(ioPool != nullptr){
+                reader->prefetch(PAGE_CACHE_PREFETCH_SIZE);
+            }
+
+            // 获取文件长度，作为消息体长度
+            responseOf(m_clientFd).msgBodyLen = reader->length();
+
+            // 大文件按批量传输调度，之后该连接的可写事件放入批量队列
+            if(responseOf(m_clientFd).msgBodyLen >= BULK_TRANSFER_SIZE){
+                setBulk(m_clientFd, true);
+            }
+            
+            // 根据消息体构建消息首部
+            responseOf(m_clientFd).beforeBodyMsg += getMessageHeader(std::to_string(responseOf(m_clientFd).msgBodyLen), "file", std::to_string(responseOf(m_clientFd).msgBodyLen - 1));
+
+            // 上传时计算的校验值和文件一起保存，存在且没有失效时作为 ETag 和 Digest 首部返回，不需要读取文件内容
+            FileDigest digest;
+            if(reader->digest(digest)){
+                responseOf(m_clientFd).beforeBodyMsg += "ETag: " + digest.etag() + "\r\n";
+                responseOf(m_clientFd).beforeBodyMsg += "Digest: " + digest.digestHeader() + "\r\n";
+            }
+            // 加入空行
+            responseOf(m_clientFd).beforeBodyMsg += "\r\n";
+            responseOf(m_clientFd).beforeBodyMsgLen = responseOf(m_clientFd).beforeBodyMsg.size();
+            
             // 设置标识，转换到发送数据的状态
-            responseStatus[m_clientFd].bodyType = EMPTY_TYPE;    // 设置消息体的类型
-            responseStatus[m_clientFd].status = HANDLE_HEAD;     // 设置状态为处理消息头
-            responseStatus[m_clientFd].curStatusHasSendLen = 0;   // 设置当前已发送的数据长度为0
-            std::cout << outHead("info") << "客户端 " << m_clientFd << " 的响应报文是重定向报文，状态行和消息首部已构建完成" << std::endl;
+            responseOf(m_clientFd).bodyType = FILE_TYPE;      // 设置消息体的类型
+            responseOf(m_clientFd).status = HANDLE_HEAD;      // 设置状态为处理消息头
+            responseOf(m_clientFd).curStatusHasSendLen = 0;   // 设置当前已发送的数据长度为0
+
+            std::cout << outHead("info") << "客户端 " << m_clientFd << " 的请求消息要下载文件 " << filename << " ，文件打开成功，根据文件构建响应消息状态行和头部信息成功" << std::endl;
+            
+        }
+
+    }else if(opera == "mkdir"){         // 创建目录，之后重定向到父目录的文件列表
+        if(StorageEngine::current()->makeDir(urlDecode(filename)) != 0){
+            std::cout << outHead("error") << "客户端 " << m_clientFd << " 的请求消息要创建目录 " << filename << " 但是目录创建失败 (errno = " << errno << ")" << std::endl;
+        }else{
+            std::cout << outHead("info") << "客户端 " << m_clientFd << " 的请求消息要创建目录 " << filename << " 且目录创建成功" << std::endl;
+        }
+
+        std::string::size_type slashIndex = filename.rfind('/');
+        responseOf(m_clientFd) = Response();
+        responseOf(m_clientFd).bodyFileName = slashIndex == std::string::npos ? "/redirect" : "/redirect/" + filename.substr(0, slashIndex);
+        return false;
+    }else if(opera == "delete"){        // 删除文件（或者空目录）
+        // 通过存储引擎删除文件，同时删除增量同步的签名缓存
+        int ret = StorageEngine::current()->remove(urlDecode(filename));
+        DeltaSync::removeSignatures(urlDecode(filename));
+        if(ret != 0){
+            std::cout << outHead("error") << "客户端 " << m_clientFd << " 的请求消息要删除文件 " << filename << " 但是文件删除失败" << std::endl;
+        }else{
+            MetaIndex::remove(urlDecode(filename));
+            SearchIndex::remove(urlDecode(filename));
+            std::cout << outHead("info") << "客户端 " << m_clientFd << " 的请求消息要删除文件 " << filename << " 且文件删除成功" << std::endl;
+        }
+
+        // 不管文件删除成功还是失败，都重定向到文件所在目录的文件列表页面
+        std::string::size_type slashIndex = filename.rfind('/');
+        responseOf(m_clientFd) = Response();                     // 重置 Response
+        responseOf(m_clientFd).bodyFileName = slashIndex == std::string::npos ? "/redirect" : "/redirect/" + filename.substr(0, slashIndex);
+
+        std::cout << outHead("info") << "客户端 " << m_clientFd << " 的请求消息处理完成，发送重定向报文" << std::endl;
+
+        // 退出函数，由调用者再次调用，构建重定向的响应消息
+        return false;
+    }else{                              // 对于其他的请求，将页面全部重定向到文件列表页面
+        // 添加状态行
+        responseOf(m_clientFd).beforeBodyMsg = getStatusLine("HTTP/1.1", "302", "Moved Temporarily");
+
+        // 构建重定向的消息首部，/redirect/目录 重定向到该目录的文件列表
+        responseOf(m_clientFd).beforeBodyMsg += getMessageHeader("0", "html", opera == "redirect" && !filename.empty() ? "/list/" + filename : "/", "");
+
+        // 加入空行
+        responseOf(m_clientFd).beforeBodyMsg += "\r\n";
+
+        responseOf(m_clientFd).beforeBodyMsgLen = responseOf(m_clientFd).beforeBodyMsg.size();
+
+        // 设置标识，转换到发送数据的状态
+        responseOf(m_clientFd).bodyType = EMPTY_TYPE;    // 设置消息体的类型
+        responseOf(m_clientFd).status = HANDLE_HEAD;     // 设置状态为处理消息头
+        responseOf(m_clientFd).curStatusHasSendLen = 0;   // 设置当前已发送的数据长度为0
+        std::cout << outHead("info") << "客户端 " << m_clientFd << " 的响应报文是重定向报文，状态行和消息首部已构建完成" << std::endl;
+    }
+    return true;
+}
+
+// 处理向客户端发送数据
+void HandleSend::process(){
+    std::cout << outHead("info") << "开始处理客户端 " << m_clientFd << " 的一个 HandleSend 事件" << std::endl;
+    // 如果该套接字没有需要处理的 Response 消息，直接退出
+    if(findResponse(m_clientFd) == nullptr){
+        std::cout << outHead("info") << "客户端 " << m_clientFd << " 没有要处理的响应消息" << std::endl;
+        return;
+    }
+
+    // 根据 Response 对象的状态执行特定的处理
+
+    // 如果处于初始状态，根据请求的文件构建不同类型的发送数据
+    if(responseOf(m_clientFd).status == HANDLE_INIT){
+        // 需要访问文件系统的请求交给 I/O 线程池构建响应，完成后重新注册可写事件，下次进入时直接发送
+        if(ioPool != nullptr && needsFileIo(responseOf(m_clientFd).bodyFileName)){
+            int ret = ioPool->appendEvent(new FileIoEvent(m_clientFd, m_epollFd), "文件 I/O 事件");
+            if(ret == 0){
+                return;
+            }
+            // I/O 线程池队列已满，不在网络线程中访问磁盘，直接返回 503
+            std::cout << outHead("warn") << "客户端 " << m_clientFd << " 的请求需要访问文件系统，但是 I/O 线程池繁忙，返回 503" << std::endl;
+            responseOf(m_clientFd).beforeBodyMsg = getStatusLine("HTTP/1.1", "503", "Service Unavailable");
+            responseOf(m_clientFd).beforeBodyMsg += getMessageHeader("0", "");
+            responseOf(m_clientFd).beforeBodyMsg += "Retry-After: " + std::to_string(retryAfterSeconds) + "\r\n";
+            responseOf(m_clientFd).beforeBodyMsg += "\r\n";
+            responseOf(m_clientFd).beforeBodyMsgLen = responseOf(m_clientFd).beforeBodyMsg.size();
+            responseOf(m_clientFd).bodyType = EMPTY_TYPE;
+            responseOf(m_clientFd).status = HANDLE_HEAD;
+            responseOf(m_clientFd).curStatusHasSendLen = 0;
+        }else if(!buildResponse()){
+            // 响应重置为重定向，第二次构建不会再返回 false
+            buildResponse();
         }
     }
 
+    EventBudget budget;
+    bool throttled = false;     // 是否因为限速需要等待
+    long long waitMicros = 0;   // 限速时需要等待的时间
     while(1){
+        // 本次事件的预算已经用完，退出循环，下面会重置 EPOLLOUT 事件，排在后面的其他连接的事件处理之后再继续发送
+        if(budget.exhausted()){
+            std::cout << outHead("info") << "客户端 " << m_clientFd << " 本次事件的发送预算已用完，让出线程" << std::endl;
+            break;
+        }
+
         long long sentLen = 0;
         // 发送响应消息头
-        if(responseStatus[m_clientFd].status == HANDLE_HEAD){
-            // 开始发送消息体之前的所有数据
-            sentLen = responseStatus[m_clientFd].curStatusHasSendLen;
-            sentLen = send(m_clientFd, responseStatus[m_clientFd].beforeBodyMsg.c_str() + sentLen, responseStatus[m_clientFd].beforeBodyMsgLen - sentLen, 0);
+        if(responseOf(m_clientFd).status == HANDLE_HEAD){
+            Response &response = responseOf(m_clientFd);
+            // 内存中的消息体和消息首部用一次 sendmsg 发送（scatter-gather），小响应只需要一次系统调用，通常只有一个 TCP 段，
+            // 不会因为 Nagle 算法等待第一个段的 ACK 后才发送消息体
+            long long headLeft = response.beforeBodyMsgLen - response.curStatusHasSendLen;
+            long long bodyLeft = response.bodyType == HTML_TYPE ? response.msgBodyLen : 0;
+            long long sendLimit = RateLimiter::acquire(m_clientFd, true, headLeft + bodyLeft, waitMicros);
+            if(waitMicros > 0){
+                throttled = true;
+                break;
+            }
+            iovec iov[2];
+            iov[0].iov_base = const_cast<char*>(response.beforeBodyMsg.data()) + response.curStatusHasSendLen;
+            iov[0].iov_len = std::min(headLeft, sendLimit);
+            iov[1].iov_base = const_cast<char*>(response.msgBody.data());
+            iov[1].iov_len = sendLimit - iov[0].iov_len;
+            msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = iov[1].iov_len > 0 ? 2 : 1;
+
+            // 消息体是文件、并且文件数据会在这一次事件中紧接着发送时，消息首部带 MSG_MORE 发送，内核暂时保留不完整的段，
+            // 和接下来 sendfile 的数据合并发送。文件数据需要交给 I/O 线程池预读、或者限速令牌只够发送消息首部时，
+            // 消息首部会在内核中一直等到下一次事件，这时不带 MSG_MORE 立即发送
+            int flags = 0;
+            if(response.bodyType == FILE_TYPE && response.msgBodyLen > 0 && sendLimit >= headLeft){
+                long long fileWait = 0;
+                long long fileLimit = RateLimiter::acquire(m_clientFd, true, headLeft + PAGE_CACHE_WINDOW_SIZE, fileWait) - headLeft;
+                DownloadProgress *download = findState(downloadStatus, m_clientFd);
+                bool fileFollows = fileWait == 0 && fileLimit >= std::min(static_cast<long long>(PAGE_CACHE_WINDOW_SIZE), static_cast<long long>(RATE_LIMIT_MIN_GRANT))
+                        && download != nullptr && (download->prefetched || ioPool == nullptr || download->reader->cachedLength(fileLimit) > 0);
+                flags = fileFollows ? MSG_MORE : 0;
+            }
+            sentLen = sendmsg(m_clientFd, &msg, flags);
             if(sentLen == -1) {
                 if(errno != EAGAIN){
                     // 如果不是缓冲区满，设置发送失败状态，并退出循环
-                    requestStatus[m_clientFd].status = HANDLE_ERROR;
+                    response.status = HANDLE_ERROR;
                     std::cout << outHead("error") << "发送响应体和消息首部时返回 -1 (errno = " << errno << ")" << std::endl;
                     break;
                 }
                 // 如果缓冲区已满，退出循环，下面会重置 EPOLLOUT 事件，等待下次进入函数继续发送
                 break;
             }
-            responseStatus[m_clientFd].curStatusHasSendLen += sentLen;
-            // 如果数据已经发送完成，将状态设置为发送消息体
-            if(responseStatus[m_clientFd].curStatusHasSendLen >= responseStatus[m_clientFd].beforeBodyMsgLen){
-                responseStatus[m_clientFd].status = HANDLE_BODY;     // 设置为正在处理消息体的状态
-                responseStatus[m_clientFd].curStatusHasSendLen = 0;   // 设置已经发送的数据长度为 0
+            // 发送的字节数（包括同时发送的消息体）在这里计入预算和限速，下面的分支不会再经过循环末尾
+            budget.consume(sentLen);
+            RateLimiter::consume(m_clientFd, true, sentLen);
+            if(sentLen < headLeft){
+                response.curStatusHasSendLen += sentLen;
+            }else{
+                // 消息首部发送完成，超出的部分是同时发送的消息体
+                response.status = HANDLE_BODY;
+                response.curStatusHasSendLen = sentLen - headLeft;
                 std::cout << outHead("info") << "客户端 " << m_clientFd << " 响应消息的状态行和消息首部发送完成，正在发送消息体..." << std::endl;
+
+                if(response.bodyType == HTML_TYPE && response.curStatusHasSendLen >= response.msgBodyLen){
+                    response.status = HADNLE_COMPLATE;
+                    response.curStatusHasSendLen = 0;
+                    std::cout << outHead("info") << "客户端 " << m_clientFd << " 的消息首部和消息体在一次 sendmsg 中发送完成" << std::endl;
+                    break;
+                }
             }
 
             // 如果发送的是文件，输出提示信息
-            if(responseStatus[m_clientFd].bodyType == FILE_TYPE){
-                std::cout << outHead("info") << "客户端 " << m_clientFd << " 请求的是文件，开始发送文件 " << responseStatus[m_clientFd].bodyFileName << " ..." << std::endl;
+            if(response.bodyType == FILE_TYPE){
+                std::cout << outHead("info") << "客户端 " << m_clientFd << " 请求的是文件，开始发送文件 " << response.bodyFileName << " ..." << std::endl;
             }
+            // 消息体从下一轮循环开始发送，不能直接进入下面的分支，否则 sentLen 会被覆盖
+            continue;
         }
 
         // 发送响应消息体
-        if(responseStatus[m_clientFd].status == HANDLE_BODY){
+        if(responseOf(m_clientFd).status == HANDLE_BODY){
             // 根据发送数据的类型执行特定的发送操作
-            if(responseStatus[m_clientFd].bodyType == HTML_TYPE){
+            if(responseOf(m_clientFd).bodyType == HTML_TYPE){
                 // 消息体为 HTML 页面时的发送方法
-                sentLen = responseStatus[m_clientFd].curStatusHasSendLen;
-                sentLen = send(m_clientFd, responseStatus[m_clientFd].msgBody.c_str() + sentLen, responseStatus[m_clientFd].msgBodyLen - sentLen, 0);
+                sentLen = responseOf(m_clientFd).curStatusHasSendLen;
+                long long sendLimit = RateLimiter::acquire(m_clientFd, true, responseOf(m_clientFd).msgBodyLen - sentLen, waitMicros);
+                if(waitMicros > 0){
+                    throttled = true;
+                    break;
+                }
+                sentLen = send(m_clientFd, responseOf(m_clientFd).msgBody.c_str() + sentLen, sendLimit, 0);
                 if(sentLen == -1){
                     if(errno != EAGAIN){
                         // 如果不是缓冲区满，设置发送失败状态，并退出循环
-                        requestStatus[m_clientFd].status = HANDLE_ERROR;
+                        responseOf(m_clientFd).status = HANDLE_ERROR;
                         std::cout << outHead("error") << "发送 HTML 消息体时返回 -1 (errno = " << errno << ")" << std::endl;
                         break;
                     }
@@ -506,28 +1490,46 @@ void HandleSend::process(){
                     // 如果缓冲区已满，退出循环，下面会重置 EPOLLOUT 事件，等待下次进入函数继续发送
                     break;
                 }
-                responseStatus[m_clientFd].curStatusHasSendLen += sentLen;
+                responseOf(m_clientFd).curStatusHasSendLen += sentLen;
                 
                 // 如果数据已经发送完成，将状态设置为发送消息体
-                if(responseStatus[m_clientFd].curStatusHasSendLen >= responseStatus[m_clientFd].msgBodyLen){
-                    responseStatus[m_clientFd].status = HADNLE_COMPLATE;     // 设置为正在处理消息体的状态
-                    responseStatus[m_clientFd].curStatusHasSendLen = 0;   // 设置已经发送的数据长度为 0
+                if(responseOf(m_clientFd).curStatusHasSendLen >= responseOf(m_clientFd).msgBodyLen){
+                    responseOf(m_clientFd).status = HADNLE_COMPLATE;     // 设置为正在处理消息体的状态
+                    responseOf(m_clientFd).curStatusHasSendLen = 0;   // 设置已经发送的数据长度为 0
                     std::cout << outHead("info") << "客户端 " << m_clientFd << " 请求的是 HTML 文件，文件发送成功" << std::endl;
                     break;
                 }
 
-            }else if(responseStatus[m_clientFd].bodyType == FILE_TYPE){
+            }else if(responseOf(m_clientFd).bodyType == FILE_TYPE){
                 // 消息体是文件时的发送方法
                 
-                // 获取已经发送的字节数，用来控制下面函数从哪个地方开始发送
-                sentLen = responseStatus[m_clientFd].curStatusHasSendLen;
-                
-                // 使用 sendfile 函数，实现零拷贝的发送数据，提高效率
-                sentLen = sendfile(m_clientFd, responseStatus[m_clientFd].fileMsgFd, (off_t *)&sentLen, responseStatus[m_clientFd].msgBodyLen - sentLen);
+                // 只发送已经在页缓存中的数据，sendfile 不会在网络线程中等待磁盘。接下来的数据不在页缓存中时交给 I/O 线程池预读，
+                // 预读完成后重新注册可写事件继续发送，冷文件不会占用网络线程而增加其他下载的延迟
+                long long sendLimit = RateLimiter::acquire(m_clientFd, true, PAGE_CACHE_WINDOW_SIZE, waitMicros);
+                if(waitMicros > 0){
+                    throttled = true;
+                    break;
+                }
+                DownloadProgress &download = stateOf(downloadStatus, m_clientFd);
+                long long sendLen = download.reader->cachedLength(sendLimit);
+                if(sendLen == 0){
+                    if(!download.prefetched && ioPool != nullptr
+                            && ioPool->appendEvent(new PrefetchEvent(m_clientFd, m_epollFd), "文件预读事件", priorityOf(m_clientFd)) == 0){
+                        std::cout << outHead("info") << "客户端 " << m_clientFd << " 下载的文件数据不在页缓存中，等待 I/O 线程池预读" << std::endl;
+                        return;
+                    }
+                    // 没有 I/O 线程池、队列已满，或者刚预读过的数据已经被换出（异步预读还没有完成）时，在当前线程中直接发送，
+                    // 每个窗口最多交给 I/O 线程池一次，连接不会在两个线程池之间反复转交
+                    sendLen = sendLimit;
+                }
+                download.prefetched = false;
+
+                // 存储引擎从上次发送到的位置继续发送，普通文件和段中的小文件使用 sendfile，实现零拷贝的发送数据
+                sentLen = download.reader->sendTo(m_clientFd, sendLen);
                 if(sentLen == -1){
                     if(errno != EAGAIN){
                         // 如果不是缓冲区满，设置发送失败状态
-                        requestStatus[m_clientFd].status = HANDLE_ERROR;
+                        responseOf(m_clientFd).status = HANDLE_ERROR;
                         std::cout << outHead("error") << "发送文件时返回 -1 (errno = " << errno << ")" << std::endl;
                         break;
                     }
@@ -536,47 +1538,58 @@ void HandleSend::process(){
                 }
                 
                 // 累加已发送的数据长度
-                responseStatus[m_clientFd].curStatusHasSendLen += sentLen;
+                responseOf(m_clientFd).curStatusHasSendLen += sentLen;
 
                 // 文件发送完成后，重置 Response 为访问根目录的响应，向客户端传递文件列表
-                if(responseStatus[m_clientFd].curStatusHasSendLen >= responseStatus[m_clientFd].msgBodyLen){
-                    responseStatus[m_clientFd].status = HADNLE_COMPLATE;     // 设置为事件处理完成
-                    responseStatus[m_clientFd].curStatusHasSendLen = 0;       // 设置已经发送的数据长度为 0
+                if(responseOf(m_clientFd).curStatusHasSendLen >= responseOf(m_clientFd).msgBodyLen){
+                    responseOf(m_clientFd).status = HADNLE_COMPLATE;     // 设置为事件处理完成
+                    responseOf(m_clientFd).curStatusHasSendLen = 0;       // 设置已经发送的数据长度为 0
 
                     std::cout << outHead("info") << "客户端 " << m_clientFd << " 请求的文件发送完成" << std::endl;
                     break;
                 }
 
-            }else if(responseStatus[m_clientFd].bodyType == EMPTY_TYPE){
+            }else if(responseOf(m_clientFd).bodyType == EMPTY_TYPE){
                 // 消息体为空时直接进入下个状态，目前用于重定向报文的消息体发送
-                responseStatus[m_clientFd].status = HADNLE_COMPLATE;       // 设置为事件处理完成
-                responseStatus[m_clientFd].curStatusHasSendLen = 0;         // 设置已经发送的数据长度为 0
+                responseOf(m_clientFd).status = HADNLE_COMPLATE;       // 设置为事件处理完成
+                responseOf(m_clientFd).curStatusHasSendLen = 0;         // 设置已经发送的数据长度为 0
                 std::cout << outHead("info") << "客户端 " << m_clientFd << " 的重定向报文发送成功" << std::endl;
                 break;
             }
         }
 
-        if(responseStatus[m_clientFd].status == HANDLE_ERROR){    // 如果是出错状态，退出 while 处理
+        if(responseOf(m_clientFd).status == HANDLE_ERROR){    // 如果是出错状态，退出 while 处理
             break;
         }
+        budget.consume(sentLen);
+        RateLimiter::consume(m_clientFd, true, sentLen);
     }
     
 
+    // 发送完成或失败时关闭发送的文件
+    if(responseOf(m_clientFd).status == HADNLE_COMPLATE || responseOf(m_clientFd).status == HANDLE_ERROR){
+        eraseState(downloadStatus, m_clientFd);
+        RateLimiter::finishSend(m_clientFd);
+        setBulk(m_clientFd, false);
+    }
+
     // 判断发送最终状态执行特定的操作
-    if(responseStatus[m_clientFd].status == HADNLE_COMPLATE){
+    if(responseOf(m_clientFd).status == HADNLE_COMPLATE){
         // 完成发送数据后删除该响应
-        responseStatus.erase(m_clientFd);
+        eraseResponse(m_clientFd);
         modifyWaitFd(m_epollFd, m_clientFd, true, true, false);                            // 不再监听写事件
         std::cout << outHead("info") << "客户端 " << m_clientFd << " 的响应报文发送成功" << std::endl;
-    }else if(responseStatus[m_clientFd].status == HANDLE_ERROR){
+    }else if(responseOf(m_clientFd).status == HANDLE_ERROR){
         // 如果发送失败，删除该响应，删除监听该文件描述符，关闭连接
-        responseStatus.erase(m_clientFd);
-        // 不再监听写事件
-        modifyWaitFd(m_epollFd, m_clientFd, true, false, false);
-        // 关闭文件描述符
+        eraseResponse(m_clientFd);
+        // 关闭文件描述符，close 时内核会将它从 epoll 中删除，不需要先修改监听的事件
+        RateLimiter::detach(m_clientFd);
         shutdown(m_clientFd, SHUT_WR);
         close(m_clientFd);
         std::cout << outHead("error") << "客户端 " << m_clientFd << " 的响应报文发送失败，关闭相关的文件描述符" << std::endl;
+    }else if(throttled){        // 因为限速需要等待时，由定时器在令牌足够时重置 EPOLLOUT 事件
+        RateLimiter::defer(m_epollFd, m_clientFd, true, waitMicros);
+        return;
     }else{                      // 如果不是完成了数据传输或出错，应该重置 EPOLLSHOT 事件，保证写事件可以继续产生，继续传输数据
         modifyWaitFd(m_epollFd, m_clientFd, true, true, true);
 
@@ -584,20 +1597,15 @@ void HandleSend::process(){
         return;
     }
 
-    // 处理成功或非文件打开失败时需要关闭文件
-    if(responseStatus[m_clientFd].bodyType == FILE_TYPE){
-        close(responseStatus[m_clientFd].fileMsgFd);
-    }
-
 }
 
 // 用于构建状态行，参数分别表示状态行的三个部分
 std::string HandleSend::getStatusLine(const std::string &httpVersion, const std::string &statusCode, const std::string &statusDes){
     std::string statusLine;
     // 记录状态行相关的参数
-    responseStatus[m_clientFd].responseHttpVersion = httpVersion;
-    responseStatus[m_clientFd].responseStatusCode = statusCode;
-    responseStatus[m_clientFd].responseStatusDes = statusDes;
+    responseOf(m_clientFd).responseHttpVersion = httpVersion;
+    responseOf(m_clientFd).responseStatusCode = statusCode;
+    responseOf(m_clientFd).responseStatusDes = statusDes;
     // 构建状态行
     statusLine = httpVersion + " ";
     statusLine += statusCode + " ";
@@ -606,32 +1614,66 @@ std::string HandleSend::getStatusLine(const std::string &httpVersion, const std:
     return statusLine;
 }
 
-// 以下两个函数用来构建文件列表的页面，最终结果保存到 fileListHtml 中
-void HandleSend::getFileListPage(std::string &fileListHtml){
-    // 结果保存到 fileListHtml
+// 构建目录 dirPath 的文件列表页面，最终结果保存到 fileListHtml 中
+int HandleSend::getFileListPage(std::string &fileListHtml, const std::string &dirPath){
+    // 获取目录中的文件和子目录，启用元数据索引时文件直接从内存中的索引获取
+    std::vector<std::string> fileVec, dirVec;
+    if(StorageEngine::current()->listDir(dirPath, fileVec, dirVec) != 0){
+        return -1;
+    }
+    std::string prefix = dirPath.empty() ? "" : dirPath + "/";
+    if(MetaIndex::isOpen()){
+        // 索引中是所有文件的完整路径，只保留直接位于该目录中的文件
+        std::vector<std::string> indexVec;
+        MetaIndex::list(indexVec);
+        fileVec.clear();
+        for(const auto &path : indexVec){
+            if(path.compare(0, prefix.size(), prefix) == 0 && path.find('/', prefix.size()) == std::string::npos){
+                fileVec.push_back(path.substr(prefix.size()));
+            }
+        }
+    }
+    std::sort(dirVec.begin(), dirVec.end());
 
-    // 将指定目录内的所有文件保存到 fileVec 中
-    std::vector<std::string> fileVec;
-    getFileVec("filedir", fileVec);
-    
     // 构建页面
     std::ifstream fileListStream("html/filelist.html", std::ios::in);
     std::string tempLine;
-    // 首先读取文件列表的 <!--filelist_label--> 注释前的语句
+    // 首先读取文件列表的 <!--filelist_label--> 注释前的语句，上传表单提交到当前目录
     while(1){
         getline(fileListStream, tempLine);
         if(tempLine == "<!--filelist_label-->"){
             break;
         }
+        std::string::size_type actionIndex = tempLine.find("action=\"upload\"");
+        if(!dirPath.empty() && actionIndex != std::string::npos){
+            tempLine.replace(actionIndex, 15, "action=\"/upload/" + dirPath + "\"");
+        }
         fileListHtml += tempLine + "\n";
     }
 
+    // 不是根目录时，第一项返回上一级目录
+    if(!dirPath.empty()){
+        std::string::size_type slashIndex = dirPath.rfind('/');
+        fileListHtml += "            <tr><td class=\"col1\"><a href=\"" + (slashIndex == std::string::npos ? "/" : "/list/" + dirPath.substr(0, slashIndex)) +
+                    "\">../</a></td> <td class=\"col2\"></td> <td class=\"col3\"></td></tr>\n";
+    }
+
+    // 子目录：点击进入目录，只能删除空目录；目录占用统计扫描完成后显示目录中的文件个数和总大小
+    for(const auto &dirname : dirVec){
+        DirStat dirStat;
+        std::string usage = DirUsage::get(prefix + dirname, dirStat) == 0
+                ? std::to_string(dirStat.files) + " 个文件，" + std::to_string(dirStat.bytes) + " 字节" : "";
+        fileListHtml += "            <tr><td class=\"col1\"><a href=\"/list/" + prefix + dirname + "\">" + dirname +
+                    "/</a></td> <td class=\"col2\">" + usage + "</td> <td class=\"col3\"><a href=\"/delete/" + prefix + dirname +
+                    "\" onclick=\"return confirmDelete();\">删除</a></td></tr>" + "\n";
+    }
+
     // 根据如下标签，将将文件夹中的所有文件项添加到返回页面中
-    //             <tr><td class="col1">filenamename</td> <td class="col2"><a href="file/filename">下载</a></td> <td class="col3"><a href="delete/filename">删除</a></td></tr>
+    //             <tr><td class="col1">filenamename</td> <td class="col2"><a href="/download/filename">下载</a></td> <td class="col3"><a href="/delete/filename">删除</a></td></tr>
     for(const auto &filename : fileVec){
         fileListHtml += "            <tr><td class=\"col1\">" + filename +
-                    "</td> <td class=\"col2\"><a href=\"download/" + filename +
-                    "\">下载</a></td> <td class=\"col3\"><a href=\"delete/" + filename +
+                    "</td> <td class=\"col2\"><a href=\"/download/" + prefix + filename +
+                    "\">下载</a></td> <td class=\"col3\"><a href=\"/delete/" + prefix + filename +
                     "\" onclick=\"return confirmDelete();\">删除</a></td></tr>" + "\n";
     }
 
@@ -639,7 +1681,7 @@ void HandleSend::getFileListPage(std::string &fileListHtml){
     while(getline(fileListStream, tempLine)){
         fileListHtml += tempLine + "\n";
     }
-    
+    return 0;
 }
 /**
  * @brief 获取指定目录下的所有文件名并存储在结果向量中
@@ -649,25 +1691,6 @@ void HandleSend::getFileListPage(std::string &fileListHtml){
  * @param dirName 指定目录的路径
  * @param resVec 用于存储获取到的文件名的结果向量
  */
-void HandleSend::getFileVec(const std::string dirName, std::vector<std::string> &resVec){
-    // 使用 dirent 获取文件目录下的所有文件
-    DIR *dir;   // 目录指针
-    dir = opendir(dirName.c_str());
-    struct dirent *stdinfo;
-    while (1)
-    {
-        // 获取文件夹中的一个文件
-        stdinfo = readdir(dir);
-        if (stdinfo == nullptr){
-            break;
-        }
-        resVec.push_back(stdinfo->d_name);
-        if(resVec.back() == "." || resVec.back() == ".."){
-            resVec.pop_back();
-        }
-    }
-}
-
 // 构建头部字段：
 // contentLength        : 指定消息体的长度
 // contentType          : 指定消息体的类型
@@ -699,6 +1722,10 @@ std::string HandleSend::getMessageHeader(const std::string contentLength, const
             headerOpt += "Content-Type: text/html;charset=UTF-8\r\n";     // 发送网页时指定的类型
         }else if(contentType == "file"){
             headerOpt += "Content-Type: application/octet-stream\r\n";    // 发送文件时指定的类型
+        }else if(contentType == "json"){
+            headerOpt += "Content-Type: application/json\r\n";            // 发送统计信息时指定的类型
+        }else if(contentType == "text"){
+            headerOpt += "Content-Type: text/plain;charset=UTF-8\r\n";    // 发送增量同步签名时指定的类型
         }
     }
 
@@ -716,3 +1743,87 @@ std::string HandleSend::getMessageHeader(const std::string contentLength, const
 
     return headerOpt;
 }
+
+bool HandleSend::needsFileIo(const std::string &resource){
+    static const char *prefixes[] = { "/list/", "/download/", "/delete/", "/mkdir/", "/delta/", "/api/usage", "/api/search" };
+    if(resource == "/"){
+        return true;
+    }
+    for(size_t i = 0; i < sizeof(prefixes) / sizeof(prefixes[0]); ++i){
+        if(resource.compare(0, strlen(prefixes[i]), prefixes[i]) == 0){
+            return true;
+        }
+    }
+    return false;
+}
+
+bool HandleSend::tryInline(int clientFd, int epollFd){
+    // 限速时发送的字节数由令牌决定，可能需要等待定时器，交给线程池
+    if(inlineMaxBytes <= 0 || RateLimiter::enabled()){
+        return false;
+    }
+    // 工作线程可能同时在为其他连接插入或删除响应状态，查找时需要持有 responseLock
+    Response *found = findResponse(clientFd);
+    if(found == nullptr){
+        return false;
+    }
+    HandleSend handleSend(clientFd, epollFd);
+    if(found->status == HANDLE_INIT){
+        // 只构建不访问文件系统的响应（重定向、线程池和去重的统计信息），/api 下的元数据和搜索结果可能很大，交给线程池
+        const std::string &resource = found->bodyFileName;
+        if(needsFileIo(resource) || resource.compare(0, 5, "/api/") == 0){
+            return false;
+        }
+        if(!handleSend.buildResponse()){
+            handleSend.buildResponse();
+        }
+    }
+
+    // 剩余的数据在内存中且不超过最大字节数时才直接发送，已经构建好的大响应由线程池继续发送
+    const Response &response = *found;
+    long long remaining = 0;
+    if(response.bodyType == FILE_TYPE){
+        return false;
+    }else if(response.status == HANDLE_HEAD){
+        remaining = response.beforeBodyMsgLen - response.curStatusHasSendLen + (response.bodyType == HTML_TYPE ? response.msgBodyLen : 0);
+    }else if(response.status == HANDLE_BODY && response.bodyType == HTML_TYPE){
+        remaining = response.msgBodyLen - response.curStatusHasSendLen;
+    }else{
+        return false;
+    }
+    if(remaining > inlineMaxBytes){
+        return false;
+    }
+    // 套接字是非阻塞的，发送缓冲区满时 process 重新注册可写事件后返回
+    handleSend.process();
+    return true;
+}
+
+// 构建响应，删除文件等请求的响应被重置为重定向时再构建一次，完成后注册可写事件
+void FileIoEvent::process(){
+    HandleSend handleSend(m_clientFd, m_epollFd);
+    if(!handleSend.buildResponse()){
+        handleSend.buildResponse();
+    }
+    modifyWaitFd(m_epollFd, m_clientFd, true, true, true);
+}
+
+// 预读下载的文件接下来的数据，并记录已经预读过，HandleSend 下次不再因为数据不在页缓存中而转交
+void PrefetchEvent::process(){
+    DownloadProgress *download = findState(downloadStatus, m_clientFd);
+    if(download != nullptr){
+        download->reader->prefetch(PAGE_CACHE_PREFETCH_SIZE);
+        download->prefetched = true;
+    }
+    modifyWaitFd(m_epollFd, m_clientFd, true, true, true);
+}
+
+// 扫描一个目录并更新目录占用统计
+void ScanDirEvent::process(){
+    DirUsage::scanDir(m_dirPath);
+}
+
+// 建立文件名搜索索引
+void SearchBuildEvent::process(){
+    SearchIndex::build();
+}
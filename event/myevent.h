@@ -2,12 +2,26 @@
  *  1. 当主线程监听到事件时，根据事件类型构建一个特定类型的事件对象，加入线程池的待处理事件对象中等待被处理
  *  2. 线程池中会调用事件的 process 函数，函数中会根据对消息的处理状态执行对应的操作
  *  3. EventBase 表示所有事件的基类，其中包含两个 map 静态成员 requestStatus 和 responseStatus，使用套接字作为key，保存该套接字对应的请求消息(Request)或响应消息(Response)处理的状态
- *  4. AcceptConn 中的 process 函数用于接收新的连接并加入 epoll_wait 中
+ *  4. AcceptConn 中的 process 函数用于接收新的连接并加入 epoll_wait 中：每次监听套接字就绪时用 accept4 循环接受，最多接受
+ *     acceptBatch 个，用完预算时监听队列中可能还有连接，重新注册监听套接字使内核再产生一个事件（边缘触发不会再次通知）
  *  5. HandleSig 中的 process 函数用于处理产生的各种事件
  *  6. 由于是静态成员，即使请求消息或响应消息没有接收完整或退出，下次产生事件时还会根据处理的状态继续执行下一步操作
  *  7. requestStatus 保存所有套接字当前对请求消息接收并处理了多少，根据请求消息的状态在 process 函数中对请求消息继续处理
  *  8. responseStatus 保存所有套接字当前对响应消息构建并发送了多少，根据请求消息的状态在 process 函数中对请求消息继续处理
  *  9. 如果某个套接字没有任何事件产生，requestStatus 和 responseStatus 中保存的事件会被清空
+ *  10. 每次处理收发事件时有字节数和时间的预算（EventBudget），大文件的上传或下载用完预算后保存状态、重新注册事件并让出线程，
+ *      线程池先处理排在后面的其他连接的事件，单个连接不会长时间占用一个线程
+ *  11. 正在上传或下载大文件（不小于 BULK_TRANSFER_SIZE）的连接标记为批量传输，主线程分发事件时按标记放入线程池的批量队列，
+ *      文件列表、删除、元数据和小文件等交互请求在交互队列中优先处理
+ *  12. 线程池过载时，排队太久的事件被标记为丢弃（m_shed），其中新的请求不再处理，直接返回 503 和 Retry-After 后关闭连接，
+ *      已经开始处理的请求（上传、下载）不受影响
+ *  13. 重定向、统计信息和已经由 I/O 线程池构建好的小响应，由主线程在可写事件中直接非阻塞地发送（HandleSend::tryInline），
+ *      不创建事件、不经过线程池的队列；超过字节数或本轮用时的预算、或者需要访问文件系统时仍然交给线程池
+ *  14. 只在状态真正需要时调用 epoll_ctl：请求处理完成后在当前线程直接发送响应，发送缓冲区满时才注册可写事件；删除文件等请求的
+ *      重定向在同一个事件中构建；关闭连接前不再修改或删除监听的事件（close 时内核自动删除）。客户端套接字仍然使用 EPOLLONESHOT，
+ *      它保证同一个连接同时只有一个线程处理，限速、I/O 线程池和预读期间也依赖它暂停连接的事件
+ *  15. 消息体需要写入磁盘的请求（multipart 上传、/uploads 下的可续传上传、增量同步）在首部接收完成后转交给 I/O 线程池，
+ *      之后该请求的接收、写入、落盘、计算校验值和更新元数据索引都在 I/O 线程中进行，网络线程不会因为磁盘阻塞
  *  🔄 核心思想：事件驱动 + 非阻塞 IO + 状态保留
  *  服务器用 epoll 监听套接字事件，每当某个连接产生事件，就构建对应的 EventBase 派生类对象，并将其交给线程池执行 process()。
  */
@@ -16,6 +30,10 @@
 #include <dirent.h>
 #include <fstream>
 #include <vector>
+#include <memory>
+#include <chrono>
+#include <mutex>
+#include <unordered_set>
 #include <cstdio>
 
 #include <sys/stat.h>
@@ -26,11 +44,80 @@
 
 #include "../message/message.h"
 #include "../utils/utils.h"
+#include "../upload/uploadsession.h"
+#include "../checksum/checksum.h"
+#include "../storage/storageengine.h"
+#include "../storage/dedupstore.h"
+#include "../storage/deltasync.h"
+#include "../storage/metaindex.h"
+#include "../storage/searchindex.h"
+#include "../storage/dirusage.h"
+#include "../storage/pagecache.h"
 
 // 所有事件的基类
+class ThreadPool;
+
+#define BULK_TRANSFER_SIZE (1024 * 1024)     // 上传或下载的数据不小于该长度时按批量传输调度
+#define INLINE_MAX_BYTES (16 * 1024)         // 主线程中直接发送的响应的最大字节数
+#define INLINE_MAX_MICROS 200                // 每次 epoll_wait 返回后，主线程直接发送响应的最长总用时（微秒）
+#define ACCEPT_BATCH 64                      // 每次监听套接字就绪时最多接受的连接数
+#define REJECT_DRAIN_MAX (1024 * 1024)       // 拒绝上传后最多读取并丢弃的字节数
+#define REJECT_DRAIN_SECONDS 5               // 拒绝上传后最多等待客户端停止发送的秒数
+
+// 事件的调度优先级：交互请求优先处理，批量传输（大文件的上传和下载）使用单独的队列
+enum EventPriority{
+    PRIORITY_INTERACTIVE,
+    PRIORITY_BULK
+};
+
+// 一次收发事件的 I/O 预算，收发的字节数或者用时超过预算后 exhausted 返回 true，事件需要重新注册后让出线程
+class EventBudget{
+public:
+    EventBudget() : m_bytes(0), m_start(std::chrono::steady_clock::now()){ }
+
+    // 记录本次收发的字节数
+    void consume(long long bytes){
+        if(bytes > 0){
+            m_bytes += bytes;
+        }
+    }
+
+    bool exhausted() const {
+        if(maxBytes > 0 && m_bytes >= maxBytes){
+            return true;
+        }
+        return maxMicros > 0 && std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - m_start).count() >= maxMicros;
+    }
+
+    // 设置每次事件最多收发的字节数和最长的时间（微秒），0 表示不限制
+    static void setLimits(long long bytes, long long micros){
+        maxBytes = bytes;
+        maxMicros = micros;
+    }
+
+private:
+    long long m_bytes;                                  // 本次事件已经收发的字节数
+    std::chrono::steady_clock::time_point m_start;      // 本次事件开始的时间
+
+    static long long maxBytes;
+    static long long maxMicros;
+};
+
+// 拒绝上传之后丢弃剩余消息体的状态
+struct DrainProgress{
+    long long drained = 0;                                  // 已经丢弃的字节数
+    std::chrono::steady_clock::time_point deadline;         // 超过该时间后直接关闭连接
+};
+
+// 下载文件的连接的状态：存储引擎读取器记录文件数据的位置和发送进度
+struct DownloadProgress{
+    std::unique_ptr<StorageReader> reader;
+    bool prefetched = false;        // I/O 线程池刚为该连接预读过，接下来的数据仍不在页缓存中时直接发送，不再交给 I/O 线程池
+};
+
 class EventBase{
 public:
-    EventBase(){
+    EventBase() : m_shed(false){
 
     }
     virtual ~EventBase(){
@@ -41,15 +128,122 @@ protected:
     static std::unordered_map<int, Request> requestStatus;
 
     // 保存文件描述符对应的发送数据的状态，一次proces中非阻塞的写数据可能无法将数据全部传过去，所以保存当前数据发送的状态，可以继续传递数据
+    // 主线程直接发送小响应时也会查找，查找、插入和删除都由 responseLock 保护，通过 findResponse、responseOf 和 eraseResponse 访问。
+    // 插入和 rehash 不会使元素的引用失效，同一个连接同时只有一个线程处理（EPOLLONESHOT），取得引用后不需要持有锁
     static std::unordered_map<int, Response> responseStatus;
+    static std::mutex responseLock;
     //所以即使一次 read() 或 send() 没完成，也能“断点续传”。
 
+    // 查找连接的响应状态，没有时返回空指针
+    static Response *findResponse(int fd);
+
+    // 获取连接的响应状态，没有时创建一个
+    static Response &responseOf(int fd);
+
+    // 删除连接的响应状态
+    static void eraseResponse(int fd);
+
+    // 保存正在通过 PATCH 向上传会话追加数据的连接的状态，消息体接收完成或连接出错时删除
+    static std::unordered_map<int, UploadProgress> uploadStatus;
+
+    // 保存正在通过 multipart 上传文件的连接中当前文件的校验值计算状态，文件接收完成时保存到文件的扩展属性中
+    static std::unordered_map<int, DigestBuilder> uploadDigest;
+
+    // 保存正在通过 multipart 上传文件的连接中当前文件的存储引擎写入器，文件接收完成时提交
+    static std::unordered_map<int, std::unique_ptr<StorageWriter> > uploadWriter;
+
+    // 保存正在下载文件的连接的状态，文件发送完成或连接出错时删除
+    static std::unordered_map<int, DownloadProgress> downloadStatus;
+
+    // 保存正在通过 POST /delta 上传增量指令流的连接的状态，消息体接收完成或连接出错时删除
+    static std::unordered_map<int, DeltaProgress> deltaUpload;
+
+    // 保存上传被拒绝、正在丢弃剩余消息体的连接的状态，连接关闭时删除
+    static std::unordered_map<int, DrainProgress> drainStatus;
+
+    // 网络线程和 I/O 线程池同时在为不同的连接插入和删除以上的请求、上传、下载、增量同步和丢弃状态，插入时的 rehash 会移动其他连接的节点链表，
+    // 所以这些表的查找、插入和删除都由 stateLock 保护，通过 findState、stateOf 和 eraseState 访问。和 responseStatus 相同，
+    // 元素的引用在 rehash 后仍然有效，同一个连接同时只有一个线程处理（EPOLLONESHOT 或者转交给 I/O 线程池之后），取得引用后不需要持有锁
+    static std::mutex stateLock;
+
+    // 查找连接在 states 中的状态，没有时返回空指针
+    template<typename T>
+    static T *findState(std::unordered_map<int, T> &states, int fd){
+        std::lock_guard<std::mutex> guard(stateLock);
+        typename std::unordered_map<int, T>::iterator it = states.find(fd);
+        return it == states.end() ? nullptr : &it->second;
+    }
+
+    // 获取连接在 states 中的状态，没有时创建一个
+    template<typename T>
+    static T &stateOf(std::unordered_map<int, T> &states, int fd){
+        std::lock_guard<std::mutex> guard(stateLock);
+        return states[fd];
+    }
+
+    // 删除连接在 states 中的状态。状态在释放锁之后才析构，写入器等析构时访问磁盘不会阻塞其他线程
+    template<typename T>
+    static void eraseState(std::unordered_map<int, T> &states, int fd){
+        T removed;
+        {
+            std::lock_guard<std::mutex> guard(stateLock);
+            typename std::unordered_map<int, T>::iterator it = states.find(fd);
+            if(it == states.end()){
+                return;
+            }
+            removed = std::move(it->second);
+            states.erase(it);
+        }
+    }
+
+    // 允许上传的最大文件大小，默认和 ServerConfig::maxFileSize 相同，multipart 上传按每个文件检查。超过时返回 413，且不会创建文件
+    static long long maxUploadSize;
+
+    // 执行会阻塞的文件系统操作的线程池，为空时在处理网络事件的线程中直接执行
+    static ThreadPool *ioPool;
+
+    // 正在进行批量传输的连接，主线程分发事件时读取，由 bulkLock 保护
+    static std::mutex bulkLock;
+    static std::unordered_set<int> bulkConns;
+
+    // 标记或者取消标记连接正在进行批量传输
+    static void setBulk(int fd, bool bulk);
+
+    // 过载时返回 503 的 Retry-After（秒）
+    static int retryAfterSeconds;
+
+    // 线程池过载，该事件在队列中等待太久，需要丢弃
+    bool m_shed;
+
 public:
     // 不同类型事件中重写该函数，执行不同的处理方法
     virtual void process(){
         
     }
 
+    // 设置允许上传的最大文件大小，在服务器启动时根据配置设置
+    static void setMaxUploadSize(long long maxFileSize){
+        maxUploadSize = maxFileSize;
+    }
+
+    // 设置执行文件系统操作的线程池，在服务器启动时设置
+    static void setIoPool(ThreadPool *pool){
+        ioPool = pool;
+    }
+
+    // 连接上的事件的调度优先级，主线程分发事件时调用
+    static EventPriority priorityOf(int fd);
+
+    // 线程池过载时标记该事件需要丢弃，在线程池取出事件时调用
+    void markShed(){
+        m_shed = true;
+    }
+
+    // 设置过载时返回 503 的 Retry-After（秒）
+    static void setRetryAfter(int seconds){
+        retryAfterSeconds = seconds;
+    }
+
 };
 
 
@@ -63,7 +257,23 @@ public:
 public:
     virtual void process() override;
 
+    // 设置每次最多接受的连接数，以及监听套接字是否使用 EPOLLEXCLUSIVE（多个 epoll 共享同一个监听套接字时，一个连接只唤醒其中一个）
+    static void setOptions(int batch, bool exclusive){
+        acceptBatch = batch;
+        exclusiveListen = exclusive;
+    }
+
+    // 将监听套接字以边缘触发的方式加入 epoll，设置了 EPOLLEXCLUSIVE 时同时加上该标志。失败时返回 -1
+    static int addListenFd(int epollFd, int listenFd);
+
 private:
+    // 监听队列中还有连接时重新注册监听套接字。EPOLLEXCLUSIVE 的套接字不能 EPOLL_CTL_MOD，先删除后重新加入
+    void rearmListenFd();
+
+private:
+    static int acceptBatch;
+    static bool exclusiveListen;
+
     int m_listenFd;              // 保存监听套接字 
     int m_epollFd;               // 接收连接后加入的 epoll
     int accetpFd;                // 保存接受的连接
@@ -89,16 +299,44 @@ private:
 // 处理客户端发送的请求
 class HandleRecv : public EventBase{
 public:
-    HandleRecv(int clientFd, int epollFd) : m_clientFd(clientFd), m_epollFd(epollFd){ };
+    HandleRecv(int clientFd, int epollFd, bool onIoPool = false) : m_clientFd(clientFd), m_epollFd(epollFd), m_sendReady(false), m_onIoPool(onIoPool){ };
     virtual ~HandleRecv(){ };
 public:
     virtual void process() override;
 
 private:
-    int m_clientFd;   // 客户端套接字，从该客户端读取数据
-    int m_epollFd;    // epoll 文件描述符，在需要重置事件或关闭连接时使用
+    // 处理 /uploads 下的可续传上传请求：POST 创建会话或提交分片清单、HEAD 查询进度、PATCH 顺序追加数据、PUT 并行写入分片
+    void processResumableUpload();
+
+    // 处理 POST /delta/文件名 的增量同步请求：根据消息体中的指令流，用已有文件和新数据重建文件
+    void processDeltaUpload();
+
+    // 构建一个不需要 HandleSend 解析资源路径的响应报文，同时将请求设置为处理完成，请求处理结束后直接发送
+    // extraHeader 中的每个首部都需要以 \r\n 结尾
+    void sendDirectResponse(const std::string &statusCode, const std::string &statusDes, const std::string &extraHeader = "");
 
+    // 首部接收完成后检查上传是否允许：超过最大文件大小返回 413，磁盘剩余空间不足返回 507，
+    // 允许且客户端携带 Expect: 100-continue 时发送 100 Continue。拒绝时返回 false，连接会被关闭
+    bool checkUploadHeaders();
 
+    // 拒绝上传请求：直接发送错误响应（extraHeader 为附加的首部，如 Retry-After）并将请求设置为出错状态，
+    // 之后半关闭连接并丢弃剩余的消息体，客户端不会因为 RST 读不到响应
+    void rejectUpload(const std::string &statusCode, const std::string &statusDes, const std::string &extraHeader = "");
+
+    // 读取并丢弃被拒绝的上传剩余的消息体，客户端关闭、超过字节数或时间上限后关闭连接
+    void drainRejected();
+
+    // 线程池过载时拒绝新的请求：丢弃已经收到的数据，返回 503 和 Retry-After 后关闭连接
+    void rejectOverloaded();
+
+    // 首部接收完成后，请求的处理是否需要写入磁盘。这些请求的消息体在 I/O 线程池中接收和处理
+    bool bodyNeedsFileIo();
+
+private:
+    int m_clientFd;   // 客户端套接字，从该客户端读取数据
+    int m_epollFd;    // epoll 文件描述符，在需要重置事件或关闭连接时使用
+    bool m_sendReady; // 请求处理完成且响应已经设置，process 结束前在当前线程直接发送，发送不完时才注册可写事件
+    bool m_onIoPool;  // 在 I/O 线程池中处理，网络线程在首部接收完成后转交，可以直接访问磁盘
 };
 
 // 处理向客户端发送数据
@@ -109,14 +347,33 @@ public:
 
 public:
     virtual void process() override;
+
+    // 根据请求的资源构建响应消息，响应被重置为重定向（删除、创建目录、下载的文件打开失败）时返回 false，需要再调用一次
+    bool buildResponse();
+
+    // 请求的资源是否需要访问文件系统（文件列表、下载、删除等），这些请求在 I/O 线程池中构建响应
+    static bool needsFileIo(const std::string &resource);
+
+    // 在主线程中直接处理一个可写事件：响应已经构建完成、或者是不需要访问文件系统的重定向和统计信息，且剩余的数据不超过
+    // 最大字节数时，构建并非阻塞地发送，发送不完时重新注册可写事件。不满足条件时返回 false，由线程池处理
+    static bool tryInline(int clientFd, int epollFd);
+
+    // 设置主线程直接发送的响应的最大字节数（0 表示关闭）和每轮事件的最长用时（微秒）
+    static void setInlineLimits(long long maxBytes, long long maxMicros){
+        inlineMaxBytes = maxBytes;
+        inlineMaxMicros = maxMicros;
+    }
+
+    // 每轮事件中主线程直接发送响应的最长用时（微秒）
+    static long long inlineMicros(){
+        return inlineMaxMicros;
+    }
     
     // 用于构建状态行，参数分别表示状态行的三个部分
     std::string getStatusLine(const std::string &httpVersion, const std::string &statusCode, const std::string &statusDes);
 
-    // 以下两个函数用来构建文件列表的页面，最终结果保存到 fileListHtml 中
-    void getFileListPage(std::string &fileListHtml);
-
-    void getFileVec(const std::string dirName, std::vector<std::string> &resVec);
+    // 用来构建目录 dirPath（空字符串表示根目录）的文件列表页面，最终结果保存到 fileListHtml 中，目录不存在时返回 -1
+    int getFileListPage(std::string &fileListHtml, const std::string &dirPath = "");
 
     // 构建头部字段：
     // contentLength        : 指定消息体的长度
@@ -125,10 +382,63 @@ public:
     // contentRange = ""    : 如果是下载文件的响应报文，指定当前发送的文件范围。空字符串表示不添加该首部。
     std::string getMessageHeader(const std::string contentLength, const std::string contentType, const std::string redirectLoction = "", const std::string contentRange = "");
 
-
 private:
     int m_clientFd;   // 客户端套接字，向该客户端写数据
     int m_epollFd;    // epoll 文件描述符，在需要重置事件或关闭连接时使用
+
+    static long long inlineMaxBytes;
+    static long long inlineMaxMicros;
+};
+
+// 在 I/O 线程池中为一个连接构建需要访问文件系统的响应，完成后重新注册可写事件，由 HandleSend 继续发送
+class FileIoEvent : public EventBase{
+public:
+    FileIoEvent(int clientFd, int epollFd) : m_clientFd(clientFd), m_epollFd(epollFd){ };
+    virtual ~FileIoEvent(){ };
+
+public:
+    virtual void process() override;
+
+private:
+    int m_clientFd;   // 客户端套接字，构建响应期间该套接字不会触发任何事件
+    int m_epollFd;    // epoll 文件描述符，完成后重新注册可写事件
+};
+
+// 下载的文件数据不在页缓存中时，在 I/O 线程池中预读，完成后重新注册可写事件，由 HandleSend 继续发送
+class PrefetchEvent : public EventBase{
+public:
+    PrefetchEvent(int clientFd, int epollFd) : m_clientFd(clientFd), m_epollFd(epollFd){ };
+    virtual ~PrefetchEvent(){ };
+
+public:
+    virtual void process() override;
+
+private:
+    int m_clientFd;   // 正在下载文件的客户端套接字，预读期间该套接字不会触发任何事件
+    int m_epollFd;    // epoll 文件描述符，完成后重新注册可写事件
+};
+
+// 统计目录占用时扫描一个目录，扫描到的子目录作为新的事件加入线程池
+class ScanDirEvent : public EventBase{
+public:
+    ScanDirEvent(const std::string &dirPath) : m_dirPath(dirPath){ };
+    virtual ~ScanDirEvent(){ };
+
+public:
+    virtual void process() override;
+
+private:
+    std::string m_dirPath;   // 相对 filedir 的目录路径，空字符串表示 filedir
+};
+
+// 服务器启动时在 I/O 线程池中建立文件名搜索索引，第一次搜索不需要等待
+class SearchBuildEvent : public EventBase{
+public:
+    SearchBuildEvent(){ };
+    virtual ~SearchBuildEvent(){ };
+
+public:
+    virtual void process() override;
 };
 
 #endif
\ No newline at end of file
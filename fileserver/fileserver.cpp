@@ -1,6 +1,6 @@
 #include "fileserver.h"
 
-WebServer::WebServer(){
+WebServer::WebServer() : threadPool(nullptr), ioPool(nullptr){
 
 }
 WebServer::~WebServer(){ 
@@ -8,7 +8,7 @@ WebServer::~WebServer(){
 }
 
 // 创建套接字等待客户端连接，并开启监听
-int WebServer::createListenFd(int port, const char* ip){
+int WebServer::createListenFd(int port, const char* ip, int backlog){
     // 指定地址
     bzero(&m_serverAddr, sizeof(m_serverAddr));
     m_serverAddr.sin_family = AF_INET;
@@ -44,13 +44,40 @@ int WebServer::createListenFd(int port, const char* ip){
         return -3;
     }
 
-    // 开启监听
-    ret = listen(m_listenfd, 5);
+    // 开启监听，连接突发时未接受的连接在监听队列中等待，队列满时新的 SYN 会被丢弃
+    ret = listen(m_listenfd, backlog);
     if(ret != 0){
         std::cout << outHead("error") << "套接字开启监听失败" << std::endl;
         return -4;
     }
 
+    // 默认收到请求数据后才唤醒 accept，只建立连接不发送数据的客户端不会占用事件和线程
+    int deferAccept = DEFER_ACCEPT_TIMEOUT;
+    if(setsockopt(m_listenfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &deferAccept, sizeof(deferAccept)) != 0){
+        std::cout << outHead("warn") << "设置 TCP_DEFER_ACCEPT 失败，连接建立后立即唤醒 accept" << std::endl;
+    }
+
+    return 0;
+}
+
+// 设置接受连接的方式
+int WebServer::setAcceptOptions(int batch, int deferAccept, int fastOpen, bool exclusive){
+    if(batch <= 0 || deferAccept < 0 || fastOpen < 0){
+        std::cout << outHead("error") << "每次接受的连接数需要大于 0，TCP_DEFER_ACCEPT 和 TCP_FASTOPEN 不能小于 0" << std::endl;
+        return -1;
+    }
+    if(setsockopt(m_listenfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &deferAccept, sizeof(deferAccept)) != 0){
+        std::cout << outHead("error") << "设置 TCP_DEFER_ACCEPT 失败 (errno = " << errno << ")" << std::endl;
+        return -2;
+    }
+    // 内核的 net.ipv4.tcp_fastopen 需要包含服务端的标志（2），否则设置成功但不生效
+    if(fastOpen > 0 && setsockopt(m_listenfd, IPPROTO_TCP, TCP_FASTOPEN, &fastOpen, sizeof(fastOpen)) != 0){
+        std::cout << outHead("error") << "设置 TCP_FASTOPEN 失败 (errno = " << errno << ")" << std::endl;
+        return -3;
+    }
+    AcceptConn::setOptions(batch, exclusive);
+    std::cout << outHead("info") << "每次最多接受 " << batch << " 个连接，TCP_DEFER_ACCEPT " << deferAccept << " 秒，TCP_FASTOPEN 队列 "
+              << fastOpen << (exclusive ? "，监听套接字使用 EPOLLEXCLUSIVE" : "") << std::endl;
     return 0;
 }
 
@@ -69,7 +96,7 @@ int WebServer::epollAddListenFd(){
     // ListenFd 设置为 边沿触发、非阻塞
     setNonBlocking(m_listenfd);
     // 因为需要将连接客户端的任务交给子线程处理，所以设置为边沿触发，避免子线程还没有接受连接时事件一直产生
-    int ret = addWaitFd(m_epollfd, m_listenfd, true, false);
+    int ret = AcceptConn::addListenFd(m_epollfd, m_listenfd);
     if(ret != 0){
         std::cout << outHead("error") << "添加监控 Listen 套接字失败" << std::endl;
         return -1;
@@ -179,21 +206,39 @@ int WebServer::waitEpoll(){
     // 创建事件保存事件的临时指针
     EventBase *event = nullptr;
 
+    // 线程池过载时暂停接受新连接，连接留在内核的监听队列中
+    bool acceptPaused = false;
+
     while(!isStop){
-        int resNum = epoll_wait(m_epollfd, resEvents, MAX_RESEVENT_SIZE, -1);
+        int resNum = epoll_wait(m_epollfd, resEvents, MAX_RESEVENT_SIZE, acceptPaused ? ACCEPT_RETRY_INTERVAL : -1);
         // 如果 epoll_wait 执行出错，直接退出（因为事件发生导致返回 -1 时，errno会置 ENITR，需要在事件处理函数中保留 errno）
         if(resNum < 0 && errno != EINTR ){
             std::cout << outHead("error") << "epoll_wait 执行错误" << std::endl;
             return -1;
         }
         std::string eventType;
+        // 本轮事件中主线程直接发送响应的用时，超过预算后剩下的可写事件都交给线程池
+        std::chrono::steady_clock::time_point inlineStart = std::chrono::steady_clock::now();
+        bool inlineOpen = true;
         for(int i = 0; i < resNum; ++i){
             int resfd = resEvents[i].data.fd;
+            EventPriority priority = PRIORITY_INTERACTIVE;
             if(resfd == m_listenfd){
+                if(threadPool->overloaded()){
+                    if(!acceptPaused){
+                        std::cout << outHead("warn") << "线程池过载，暂停接受新连接" << std::endl;
+                    }
+                    acceptPaused = true;
+                    continue;
+                }
                 std::cout << outHead("info") << "有新的连接请求" << std::endl;
                 // 构建接受连接的事件
                 event = new AcceptConn(m_listenfd, m_epollfd);
                 eventType = "新连接事件";
+            }else if(resfd == RateLimiter::timerFd()){
+                // 限速的定时器到期，重新注册等待结束的连接的事件
+                RateLimiter::fireTimers();
+                continue;
             }else if((resfd == eventHandlerPipe[0]) && (resEvents[i].events & EPOLLIN)){
                 // 如果有事件发生，执行事件处理函数
                 
@@ -202,27 +247,55 @@ int WebServer::waitEpoll(){
                 // 构建读取客户端数据的事件
                 event = new HandleRecv(resEvents[i].data.fd, m_epollfd);
                 eventType = "新可读事件";
+                priority = EventBase::priorityOf(resfd);
 
             }else if(resEvents[i].events & EPOLLOUT){
+                // 重定向和已经构建好的小响应直接在主线程中发送，省去事件的创建、入队、唤醒线程
+                if(inlineOpen && HandleSend::tryInline(resfd, m_epollfd)){
+                    inlineOpen = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - inlineStart).count() < HandleSend::inlineMicros();
+                    continue;
+                }
                 // 套接字可以发送数据，构建可以发送数据的事件
                 event = new HandleSend(resEvents[i].data.fd, m_epollfd);
                 eventType = "新可写事件";
+                priority = EventBase::priorityOf(resfd);
             }
             if(event == nullptr){
                 continue;
             }
-            // 将事件加入线程池的待处理队列。在线程池中，事件执行完后销毁事件，可以修改为智能指针自动释放
-            threadPool->appendEvent(event, eventType);
+            // 将事件加入线程池的待处理队列，大文件的传输放入批量队列。在线程池中，事件执行完后销毁事件，可以修改为智能指针自动释放
+            if(threadPool->appendEvent(event, eventType, priority) != 0){
+                // 队列已满时事件没有加入队列，释放事件。EPOLLONESHOT 的客户端套接字需要重新注册，否则不会再产生事件
+                delete event;
+                if(resfd == m_listenfd){
+                    acceptPaused = true;
+                }else{
+                    modifyWaitFd(m_epollfd, resfd, true, true, (resEvents[i].events & EPOLLOUT) != 0);
+                }
+            }
             
             // 将 event 置空
             event = nullptr;
         }
+
+        // 过载结束后继续接受监听队列中的连接
+        if(acceptPaused && !threadPool->overloaded()){
+            acceptPaused = false;
+            std::cout << outHead("info") << "线程池恢复，继续接受新连接" << std::endl;
+            if(threadPool->appendEvent(new AcceptConn(m_listenfd, m_epollfd), "新连接事件") != 0){
+                acceptPaused = true;
+            }
+        }
     }
     return 0;
 }
 
 // 创建线程池
-int WebServer::createThreadPool(int threadNum){
+int WebServer::createThreadPool(int threadNum, int maxThreadNum){
+    if(threadNum <= 0){
+        threadNum = ThreadPool::availableCpus();
+        std::cout << outHead("info") << "按可以使用的 CPU 数创建 " << threadNum << " 个线程" << std::endl;
+    }
     try{
         threadPool = new ThreadPool(threadNum);
     }catch(std::runtime_error &err){
@@ -232,9 +305,174 @@ int WebServer::createThreadPool(int threadNum){
         std::cout << outHead("error") << "线程池创建失败" << std::endl;
         return -1;
     }
+    threadPool->setQueueDelayTarget(QUEUE_DELAY_TARGET, QUEUE_DELAY_INTERVAL);
+    if(threadPool->setAdaptive(threadNum, maxThreadNum > 0 ? maxThreadNum : threadNum * POOL_MAX_FACTOR) != 0){
+        std::cout << outHead("warn") << "线程数上限 " << maxThreadNum << " 小于初始线程数，不自适应调整" << std::endl;
+    }
+    return 0;
+}
+
+// 创建 I/O 线程池，网络线程中需要访问文件系统的请求交给该线程池执行
+int WebServer::createIoPool(int threadNum, int maxQueueSize, int maxThreadNum){
+    try{
+        ioPool = new ThreadPool(threadNum, "io", maxQueueSize);
+    }catch(std::runtime_error &err){
+        std::cout << err.what() << std::endl;
+    }
+    if(ioPool == nullptr){
+        std::cout << outHead("error") << "I/O 线程池创建失败" << std::endl;
+        return -1;
+    }
+    if(ioPool->setAdaptive(threadNum, maxThreadNum > 0 ? maxThreadNum : threadNum * POOL_MAX_FACTOR) != 0){
+        std::cout << outHead("warn") << "I/O 线程数上限 " << maxThreadNum << " 小于初始线程数，不自适应调整" << std::endl;
+    }
+    EventBase::setIoPool(ioPool);
     return 0;
 }
 
+// 设置过载控制
+int WebServer::setOverloadControl(long long targetMicros, long long intervalMicros, int retryAfter){
+    if(threadPool == nullptr){
+        std::cout << outHead("error") << "线程池还没有创建，无法设置过载控制" << std::endl;
+        return -1;
+    }
+    if(targetMicros < 0 || intervalMicros < 0 || retryAfter <= 0){
+        std::cout << outHead("error") << "过载控制参数无效" << std::endl;
+        return -2;
+    }
+    threadPool->setQueueDelayTarget(targetMicros, intervalMicros);
+    EventBase::setRetryAfter(retryAfter);
+    return 0;
+}
+
+// 绑定主线程和线程池的线程到 CPU 集合
+int WebServer::setCpuAffinity(const std::string &reactorCpus, const std::string &workerCpus){
+    if(threadPool == nullptr){
+        std::cout << outHead("error") << "线程池还没有创建，无法绑定 CPU" << std::endl;
+        return -1;
+    }
+    cpu_set_t nicCpus;
+    std::string source;
+    bool hasDefault = (reactorCpus.empty() || workerCpus.empty()) && CpuAffinity::nicDefault(nicCpus, source) == 0;
+    if(hasDefault){
+        std::cout << outHead("info") << "按 " << source << " 选择默认的 CPU " << CpuAffinity::format(nicCpus) << std::endl;
+    }
+
+    // 先绑定线程池：线程池中新增的线程继承创建它的线程的绑定，主线程绑定后再按可用 CPU 计算线程数会变小
+    cpu_set_t cpuSet;
+    if(workerCpus.empty() ? hasDefault : workerCpus != "none"){
+        if(!workerCpus.empty() && CpuAffinity::parse(workerCpus, cpuSet) != 0){
+            std::cout << outHead("error") << "无效的 CPU 集合：" << workerCpus << std::endl;
+            return -2;
+        }
+        threadPool->setCpuAffinity(workerCpus.empty() ? nicCpus : cpuSet);
+        if(ioPool != nullptr){
+            ioPool->setCpuAffinity(workerCpus.empty() ? nicCpus : cpuSet);
+        }
+    }
+    if(reactorCpus.empty() ? hasDefault : reactorCpus != "none"){
+        if(!reactorCpus.empty() && CpuAffinity::parse(reactorCpus, cpuSet) != 0){
+            std::cout << outHead("error") << "无效的 CPU 集合：" << reactorCpus << std::endl;
+            return -2;
+        }
+        if(CpuAffinity::bindCurrentThread(reactorCpus.empty() ? nicCpus : cpuSet) != 0){
+            std::cout << outHead("error") << "主线程绑定 CPU 失败" << std::endl;
+            return -3;
+        }
+        std::cout << outHead("info") << "主线程绑定到 CPU " << CpuAffinity::format(reactorCpus.empty() ? nicCpus : cpuSet) << std::endl;
+    }
+    return 0;
+}
+
+// 设置每次收发事件的预算
+int WebServer::setEventBudget(long long maxBytes, long long maxMicros){
+    if(maxBytes < 0 || maxMicros < 0){
+        std::cout << outHead("error") << "事件预算不能小于 0" << std::endl;
+        return -1;
+    }
+    EventBudget::setLimits(maxBytes, maxMicros);
+    return 0;
+}
+
+// 设置主线程直接发送小响应的预算
+int WebServer::setInlineLimits(long long maxBytes, long long maxMicros){
+    if(maxBytes < 0 || maxMicros < 0){
+        std::cout << outHead("error") << "主线程直接发送的预算不能小于 0" << std::endl;
+        return -1;
+    }
+    HandleSend::setInlineLimits(maxBytes, maxMicros);
+    return 0;
+}
+
+// 设置限速，限速的定时器注册到 epoll 中，由主线程在到期时重新注册等待中的连接的事件
+int WebServer::setRateLimit(long long connRate, long long ipRate, long long totalRate, long long burst){
+    bool registered = RateLimiter::timerFd() != -1;
+    if(RateLimiter::configure(connRate, ipRate, totalRate, burst) != 0){
+        std::cout << outHead("error") << "设置限速失败 (errno = " << errno << ")" << std::endl;
+        return -1;
+    }
+    std::cout << outHead("info") << "限速：每个连接 " << connRate << " 字节/秒，每个 IP " << ipRate << " 字节/秒，总发送 "
+              << totalRate << " 字节/秒（0 表示不限制）" << std::endl;
+    if(!registered && addWaitFd(m_epollfd, RateLimiter::timerFd()) != 0){
+        std::cout << outHead("error") << "添加监控限速定时器失败" << std::endl;
+        return -2;
+    }
+    return 0;
+}
+
+// 设置允许上传的最大文件大小
+int WebServer::setMaxFileSize(long long maxFileSize){
+    if(maxFileSize <= 0){
+        std::cout << outHead("error") << "最大文件大小必须大于 0" << std::endl;
+        return -1;
+    }
+    EventBase::setMaxUploadSize(maxFileSize);
+    return 0;
+}
+
+// 选择保存文件的存储引擎
+int WebServer::setStorageEngine(const std::string &engineName){
+    return StorageEngine::select(engineName);
+}
+
+// 启用元数据索引
+int WebServer::openMetaIndex(){
+    return MetaIndex::open();
+}
+
+// 开始扫描目录占用统计，每个目录作为一个事件分发给线程池
+int WebServer::scanDirUsage(){
+    if(threadPool == nullptr){
+        std::cout << outHead("error") << "线程池还没有创建，无法扫描目录占用统计" << std::endl;
+        return -1;
+    }
+    if(std::string(StorageEngine::current()->name()) != "flat"){
+        std::cout << outHead("warn") << "存储引擎 " << StorageEngine::current()->name() << " 不支持目录，不统计目录占用" << std::endl;
+        return -1;
+    }
+    ThreadPool *pool = threadPool;
+    return DirUsage::scan([pool](const std::string &dirPath){
+        pool->appendEvent(new ScanDirEvent(dirPath), "目录扫描事件", PRIORITY_BULK);
+    });
+}
+// 定期删除过期的上传会话
+int WebServer::setUploadSessionTtl(long long ttlSeconds){
+    if(ttlSeconds <= 0){
+        std::cout << outHead("error") << "上传会话的保留时间必须大于 0" << std::endl;
+        return -1;
+    }
+    UploadSession::startCleanup(ttlSeconds);
+    return 0;
+}
+
+// 在 I/O 线程池中建立文件名搜索索引
+int WebServer::buildSearchIndex(){
+    if(ioPool == nullptr){
+        std::cout << outHead("error") << "I/O 线程池还没有创建，无法建立文件名搜索索引" << std::endl;
+        return -1;
+    }
+    return ioPool->appendEvent(new SearchBuildEvent(), "搜索索引建立事件", PRIORITY_BULK);
+}
 
 
 
@@ -4,17 +4,30 @@
 #include <sys/types.h>
 #include <stdexcept>
 #include <errno.h>
+#include <netinet/tcp.h>
 
 #include "../threadpool/threadpool.h"
+#include "../ratelimit/ratelimiter.h"
 
 #define MAX_RESEVENT_SIZE 1024   // 事件的最大个数
+#define QUEUE_DELAY_TARGET 5000         // 线程池排队时间的默认目标（微秒），一个时间窗口内一直超过时进入过载状态
+#define QUEUE_DELAY_INTERVAL 100000     // 过载检测的默认时间窗口（微秒）
+#define POOL_MAX_FACTOR 4               // 没有指定时，自适应线程数的上限为初始线程数的倍数
+#define ACCEPT_RETRY_INTERVAL 10        // 过载暂停接受连接时，检查是否可以恢复的间隔（毫秒）
+#define LISTEN_BACKLOG 1024             // 监听队列的默认长度（实际不超过 net.core.somaxconn）
+#define DEFER_ACCEPT_TIMEOUT 5          // TCP_DEFER_ACCEPT 的默认时间（秒），超过时没有收到数据的连接也会被接受
 
 class WebServer{
 public:
     WebServer();
     
-    // 创建套接字等待客户端连接，并开启监听
-    int createListenFd(int port, const char* ip = nullptr );
+    // 创建套接字等待客户端连接，并开启监听，backlog 为监听队列的长度。默认设置 TCP_DEFER_ACCEPT，收到请求数据后才唤醒 accept
+    int createListenFd(int port, const char* ip = nullptr, int backlog = LISTEN_BACKLOG);
+
+    // 设置接受连接的方式：每次监听套接字就绪时最多接受 batch 个连接，TCP_DEFER_ACCEPT 的秒数（0 表示关闭），
+    // TCP_FASTOPEN 的队列长度（0 表示不启用），exclusive 为 true 时监听套接字使用 EPOLLEXCLUSIVE（多个进程各自的 epoll 共享监听套接字时）。
+    // 需要在 createListenFd 之后、epollAddListenFd 之前调用
+    int setAcceptOptions(int batch = ACCEPT_BATCH, int deferAccept = DEFER_ACCEPT_TIMEOUT, int fastOpen = 0, bool exclusive = false);
     
     // 创建 epoll 例程用于监听套接字
     int createEpoll();
@@ -34,8 +47,50 @@ public:
     // 主线程中负责监听所有事件
     int waitEpoll();
 
-    // 创建线程池
-    int createThreadPool(int threadNum = 8);
+    // 创建线程池，threadNum 为 0 时按可以使用的 CPU 数（cgroup cpu.max 和 CPU 亲和性）创建。
+    // 线程数在 [threadNum, maxThreadNum] 内自适应调整，maxThreadNum 为 0 时为 threadNum 的 POOL_MAX_FACTOR 倍，等于 threadNum 时不调整
+    int createThreadPool(int threadNum = 0, int maxThreadNum = 0);
+
+    // 创建执行文件系统操作（文件列表、打开下载的文件、删除等）的 I/O 线程池，maxQueueSize 为队列中最多的事件个数，队列满时返回 503。
+    // 线程数的自适应调整同 createThreadPool
+    int createIoPool(int threadNum = 4, int maxQueueSize = 1024, int maxThreadNum = 0);
+
+    // 将主线程（reactor）和线程池的线程绑定到 CPU 集合（cpulist 格式，如 "0-7,16-23"），"none" 表示不绑定。
+    // 为空时使用网卡队列（RPS/XPS）或网卡所在 NUMA 节点的 CPU，只有一个 NUMA 节点时不绑定。
+    // 绑定后连接的缓冲区在线程所在的节点上分配。需要在 createThreadPool 和 createIoPool 之后、waitEpoll 之前由主线程调用
+    int setCpuAffinity(const std::string &reactorCpus = "", const std::string &workerCpus = "");
+
+    // 设置每次收发事件的预算：最多收发 maxBytes 字节、最长 maxMicros 微秒（0 表示不限制），用完后重新注册事件并让出线程
+    int setEventBudget(long long maxBytes = 1024 * 1024, long long maxMicros = 10 * 1000);
+
+    // 设置主线程直接发送小响应（重定向、统计信息、已经构建好的文件列表等）的预算：剩余数据不超过 maxBytes 字节的响应在主线程中
+    // 非阻塞地发送，每轮事件中直接发送的总用时超过 maxMicros 微秒后交给线程池。maxBytes 为 0 时全部交给线程池
+    int setInlineLimits(long long maxBytes = INLINE_MAX_BYTES, long long maxMicros = INLINE_MAX_MICROS);
+
+    // 设置限速（字节/秒，0 表示不限制）：每个连接和每个客户端 IP 的收发速率，以及所有下载按 DRR 平分的总发送速率。需要在 createEpoll 之后调用
+    int setRateLimit(long long connRate, long long ipRate = 0, long long totalRate = 0, long long burst = RATE_LIMIT_DEFAULT_BURST);
+
+    // 设置过载控制：线程池排队时间的目标和时间窗口（微秒，target 为 0 时关闭），过载时新的请求返回 503，Retry-After 为 retryAfter 秒。
+    // createThreadPool 时使用默认值，需要在 createThreadPool 之后调用
+    int setOverloadControl(long long targetMicros = QUEUE_DELAY_TARGET, long long intervalMicros = QUEUE_DELAY_INTERVAL, int retryAfter = 1);
+
+    // 设置允许上传的最大文件大小（字节），超过时在接收消息体之前返回 413
+    int setMaxFileSize(long long maxFileSize = 100 * 1024 * 1024);
+
+    // 选择保存文件的存储引擎：flat（默认，每个文件一个普通文件）、dedup（去重存储）、packed（小文件追加到段文件）
+    int setStorageEngine(const std::string &engineName);
+
+    // 启用持久化的元数据索引，文件列表和 /api/files 从内存中的索引返回。需要在 setStorageEngine 之后调用
+    int openMetaIndex();
+
+    // 在线程池中并行扫描 filedir，建立目录占用统计（只支持 flat 引擎）。需要在 createThreadPool 和 setStorageEngine 之后调用
+    int scanDirUsage();
+
+    // 启动后台线程，定期删除超过 ttlSeconds 秒没有写入的上传会话
+    int setUploadSessionTtl(long long ttlSeconds);
+
+    // 在 I/O 线程池中建立文件名搜索索引。需要在 createIoPool 和 setStorageEngine（启用元数据索引时在 openMetaIndex）之后调用
+    int buildSearchIndex();
     
     ~WebServer();
 private:
@@ -49,6 +104,7 @@ private:
     epoll_event resEvents[MAX_RESEVENT_SIZE]; // 保存 epoll_wait 结果的数组
     
     ThreadPool *threadPool;
+    ThreadPool *ioPool;
 };
 
 #endif
\ No newline at end of file
@@ -28,11 +28,25 @@ void printUsage(const char* programName) {
     std::cout << "Usage: " << programName << " [options]\n"
               << "Options:\n"
               << "  -p, --port <port>        Listen port (default: 8888)\n"
-              << "  -t, --threads <count>    Thread pool size (default: CPU cores)\n"
+              << "  -t, --threads <count>    Initial thread pool size (default: CPUs allowed by cgroup cpu.max and affinity)\n"
+              << "  --min-threads <count>    Lower bound for adaptive pool sizing (default: initial size)\n"
+              << "  --max-threads <count>    Upper bound for adaptive pool sizing (default: 4x initial size)\n"
               << "  -d, --document-root <path>  Document root directory (default: ./filedir)\n"
               << "  -l, --log-level <level>  Log level (debug|info|warn|error, default: info)\n"
               << "  -f, --log-file <file>    Log file path (default: console output)\n"
               << "  -c, --config <file>      Configuration file path\n"
+              << "  --conn-rate <bytes/s>    Per-connection bandwidth limit (default: 0, unlimited)\n"
+              << "  --ip-rate <bytes/s>      Per-client-IP bandwidth limit (default: 0, unlimited)\n"
+              << "  --total-rate <bytes/s>   Aggregate download bandwidth, shared fairly (default: 0, unlimited)\n"
+              << "  --max-file-size <bytes>  Largest accepted upload, per file for multipart (default: 104857600, 0 unlimited)\n"
+              << "  --reactor-cpus <list>    CPUs for the event loop, e.g. 0-7 (default: NIC-local CPUs on NUMA hosts, \"none\" disables)\n"
+              << "  --worker-cpus <list>     CPUs for worker threads (default: same as above)\n"
+              << "  --queue-delay <ms>       Queue delay target before shedding new requests (default: 5, 0 disables)\n"
+              << "  --backlog <count>        Listen backlog (default: 1024, capped by net.core.somaxconn)\n"
+              << "  --accept-batch <count>   Connections accepted per listen-socket wakeup (default: 64)\n"
+              << "  --defer-accept <s>       TCP_DEFER_ACCEPT timeout, wake accept only once request bytes arrive (default: 5, 0 disables)\n"
+              << "  --fastopen <count>       TCP Fast Open queue length (default: 0, disabled)\n"
+              << "  --exclusive-accept       Register the listen socket with EPOLLEXCLUSIVE (multi-acceptor setups)\n"
               << "  -h, --help               Show this help message\n"
               << std::endl;
 }
@@ -69,6 +83,15 @@ int main(int argc, char* argv[]) {
                     std::cerr << "Error: " << arg << " requires a value" << std::endl;
                     return 1;
                 }
+            } else if (arg == "--min-threads" || arg == "--max-threads") {
+                if (i + 1 < argc) {
+                    int threads = std::stoi(argv[++i]);
+                    if (arg == "--min-threads") config.minThreads = threads;
+                    else config.maxThreads = threads;
+                } else {
+                    std::cerr << "Error: " << arg << " requires a value" << std::endl;
+                    return 1;
+                }
             } else if (arg == "-d" || arg == "--document-root") {
                 if (i + 1 < argc) {
                     config.documentRoot = argv[++i];
@@ -98,6 +121,51 @@ int main(int argc, char* argv[]) {
                     std::cerr << "Error: " << arg << " requires a value" << std::endl;
                     return 1;
                 }
+            } else if (arg == "--conn-rate" || arg == "--ip-rate" || arg == "--total-rate") {
+                if (i + 1 < argc) {
+                    size_t rate = std::stoull(argv[++i]);
+                    if (arg == "--conn-rate") config.connectionRateLimit = rate;
+                    else if (arg == "--ip-rate") config.ipRateLimit = rate;
+                    else config.totalRateLimit = rate;
+                } else {
+                    std::cerr << "Error: " << arg << " requires a value" << std::endl;
+                    return 1;
+                }
+            } else if (arg == "--max-file-size") {
+                if (i + 1 < argc) {
+                    config.maxFileSize = std::stoull(argv[++i]);
+                } else {
+                    std::cerr << "Error: " << arg << " requires a value" << std::endl;
+                    return 1;
+                }
+            } else if (arg == "--reactor-cpus" || arg == "--worker-cpus") {
+                if (i + 1 < argc) {
+                    if (arg == "--reactor-cpus") config.reactorCpus = argv[++i];
+                    else config.workerCpus = argv[++i];
+                } else {
+                    std::cerr << "Error: " << arg << " requires a value" << std::endl;
+                    return 1;
+                }
+            } else if (arg == "--queue-delay") {
+                if (i + 1 < argc) {
+                    config.queueDelayTarget = std::chrono::milliseconds(std::stoll(argv[++i]));
+                } else {
+                    std::cerr << "Error: " << arg << " requires a value" << std::endl;
+                    return 1;
+                }
+            } else if (arg == "--backlog" || arg == "--accept-batch" || arg == "--defer-accept" || arg == "--fastopen") {
+                if (i + 1 < argc) {
+                    int value = std::stoi(argv[++i]);
+                    if (arg == "--backlog") config.backlog = value;
+                    else if (arg == "--accept-batch") config.acceptBatch = value;
+                    else if (arg == "--defer-accept") config.deferAccept = std::chrono::seconds(value);
+                    else config.fastOpenQueue = value;
+                } else {
+                    std::cerr << "Error: " << arg << " requires a value" << std::endl;
+                    return 1;
+                }
+            } else if (arg == "--exclusive-accept") {
+                config.exclusiveAccept = true;
             } else if (arg == "-c" || arg == "--config") {
                 if (i + 1 < argc) {
                     try {
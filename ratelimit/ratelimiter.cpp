@@ -0,0 +1,344 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <ctime>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "ratelimiter.h"
+
+#ifndef SO_MAX_PACING_RATE
+#define SO_MAX_PACING_RATE 47
+#endif
+
+std::mutex RateLimiter::lock;
+std::atomic<bool> RateLimiter::active(false);
+long long RateLimiter::connRate = 0;
+long long RateLimiter::ipRate = 0;
+long long RateLimiter::burstSize = RATE_LIMIT_DEFAULT_BURST;
+TokenBucket RateLimiter::total;
+unsigned long long RateLimiter::nextGeneration = 0;
+std::unordered_map<int, RateLimiter::Flow> RateLimiter::flows;
+std::unordered_map<uint32_t, RateLimiter::IpState> RateLimiter::ips;
+std::deque<int> RateLimiter::round;
+std::priority_queue<RateLimiter::Timer, std::vector<RateLimiter::Timer>, std::greater<RateLimiter::Timer> > RateLimiter::timers;
+int RateLimiter::timer = -1;
+long long RateLimiter::armedDeadline = 0;
+
+namespace {
+
+// 按令牌桶限制本次收发的长度：令牌少于 need 时 allow 置为 0，并用需要等待的时间更新 waitMicros
+void limitByBucket(TokenBucket &bucket, long long curTime, long long need, long long &allow, long long &waitMicros){
+    if(bucket.rate <= 0){
+        return;
+    }
+    bucket.refill(curTime);
+    // 容量小于 need 时永远等不到，最多等到令牌桶装满
+    need = std::min(need, bucket.burst);
+    if(bucket.tokens < need){
+        allow = 0;
+        waitMicros = std::max(waitMicros, bucket.waitFor(need));
+        return;
+    }
+    allow = std::min(allow, static_cast<long long>(bucket.tokens));
+}
+
+// 重新注册客户端套接字的事件（EPOLLET | EPOLLONESHOT，和两个服务器注册客户端套接字的方式相同）
+void rearmClient(int epollFd, int fd, bool enableWrite){
+    epoll_event event;
+    event.data.fd = fd;
+    event.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
+    if(enableWrite){
+        event.events |= EPOLLOUT;
+    }
+    epoll_ctl(epollFd, EPOLL_CTL_MOD, fd, &event);
+}
+
+}
+
+void TokenBucket::reset(long long newRate, long long newBurst, long long now){
+    rate = newRate;
+    burst = newBurst;
+    tokens = newBurst;
+    last = now;
+}
+
+void TokenBucket::refill(long long now){
+    if(now > last){
+        tokens = std::min(static_cast<double>(burst), tokens + static_cast<double>(now - last) * rate / 1000000);
+        last = now;
+    }
+}
+
+long long TokenBucket::waitFor(long long need) const {
+    if(rate <= 0 || tokens >= need){
+        return 0;
+    }
+    return static_cast<long long>((need - tokens) * 1000000 / rate) + 1;
+}
+
+long long RateLimiter::now(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<long long>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+int RateLimiter::configure(long long perConnRate, long long perIpRate, long long totalRate, long long burst){
+    if(perConnRate < 0 || perIpRate < 0 || totalRate < 0 || burst <= 0){
+        errno = EINVAL;
+        return -1;
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    if(timer == -1){
+        timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if(timer == -1){
+            return -1;
+        }
+    }
+    long long curTime = now();
+    connRate = perConnRate;
+    ipRate = perIpRate;
+    burstSize = burst;
+    total.reset(totalRate, std::max(burst, static_cast<long long>(RATE_LIMIT_DRR_QUANTUM)), curTime);
+    // 已经建立的连接按新的限制重新开始，保留代数，等待中的定时器仍然有效
+    for(std::unordered_map<int, Flow>::iterator it = flows.begin(); it != flows.end(); ++it){
+        it->second.bucket.reset(connRate, burstSize, curTime);
+        it->second.deficit = 0;
+        it->second.inRound = false;
+    }
+    for(std::unordered_map<uint32_t, IpState>::iterator it = ips.begin(); it != ips.end(); ++it){
+        it->second.bucket.reset(ipRate, burstSize, curTime);
+    }
+    round.clear();
+    active = connRate > 0 || ipRate > 0 || totalRate > 0;
+    return 0;
+}
+
+bool RateLimiter::enabled(){
+    return active;
+}
+
+RateLimiter::Flow &RateLimiter::attachLocked(int fd, uint32_t ip){
+    std::unordered_map<int, Flow>::iterator it = flows.find(fd);
+    if(it != flows.end()){
+        // fd 被新的连接复用，先删除原来的连接
+        leaveRoundLocked(fd, it->second);
+        std::unordered_map<uint32_t, IpState>::iterator ipIt = ips.find(it->second.ip);
+        if(ipIt != ips.end() && --ipIt->second.refs <= 0){
+            ips.erase(ipIt);
+        }
+        flows.erase(it);
+    }
+
+    long long curTime = now();
+    Flow &flow = flows[fd];
+    flow.ip = ip;
+    flow.generation = ++nextGeneration;
+    flow.bucket.reset(connRate, burstSize, curTime);
+
+    IpState &ipState = ips[ip];
+    if(ipState.refs++ == 0){
+        ipState.bucket.reset(ipRate, burstSize, curTime);
+    }
+
+    // 发送速率优先交给内核的 pacing 限制，不支持时（旧内核）在用户态限制
+    if(connRate > 0){
+        unsigned int pacingRate = static_cast<unsigned int>(std::min(connRate, static_cast<long long>(UINT32_MAX - 1)));
+        flow.kernelPaced = setsockopt(fd, SOL_SOCKET, SO_MAX_PACING_RATE, &pacingRate, sizeof(pacingRate)) == 0;
+    }
+    return flow;
+}
+
+RateLimiter::Flow &RateLimiter::flowLocked(int fd){
+    std::unordered_map<int, Flow>::iterator it = flows.find(fd);
+    if(it != flows.end()){
+        return it->second;
+    }
+    sockaddr_in addr;
+    socklen_t addrLen = sizeof(addr);
+    uint32_t ip = 0;
+    if(getpeername(fd, reinterpret_cast<sockaddr*>(&addr), &addrLen) == 0 && addr.sin_family == AF_INET){
+        ip = addr.sin_addr.s_addr;
+    }
+    return attachLocked(fd, ip);
+}
+
+void RateLimiter::attach(int fd, const sockaddr_in &addr){
+    if(!active){
+        return;
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    attachLocked(fd, addr.sin_addr.s_addr);
+}
+
+void RateLimiter::detach(int fd){
+    std::lock_guard<std::mutex> guard(lock);
+    std::unordered_map<int, Flow>::iterator it = flows.find(fd);
+    if(it == flows.end()){
+        return;
+    }
+    leaveRoundLocked(fd, it->second);
+    std::unordered_map<uint32_t, IpState>::iterator ipIt = ips.find(it->second.ip);
+    if(ipIt != ips.end() && --ipIt->second.refs <= 0){
+        ips.erase(ipIt);
+    }
+    flows.erase(it);
+}
+
+void RateLimiter::leaveRoundLocked(int fd, Flow &flow){
+    if(flow.inRound){
+        round.erase(std::find(round.begin(), round.end(), fd));
+        flow.inRound = false;
+    }
+    flow.deficit = 0;
+}
+
+void RateLimiter::dealLocked(long long curTime){
+    total.refill(curTime);
+    // 从上次停下的位置开始轮询，每个连接最多补充到一个 quantum，总令牌用完时停止，下次从下一个连接开始
+    for(size_t visited = 0; visited < round.size() && total.tokens >= 1; ++visited){
+        int fd = round.front();
+        round.pop_front();
+        round.push_back(fd);
+        Flow &flow = flows[fd];
+        long long give = std::min(static_cast<long long>(RATE_LIMIT_DRR_QUANTUM) - flow.deficit, static_cast<long long>(total.tokens));
+        if(give > 0){
+            flow.deficit += give;
+            total.tokens -= give;
+        }
+    }
+}
+
+long long RateLimiter::acquire(int fd, bool sending, long long wanted, long long &waitMicros){
+    waitMicros = 0;
+    if(!active || wanted <= 0){
+        return wanted;
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    long long curTime = now();
+    Flow &flow = flowLocked(fd);
+    long long need = std::min(wanted, static_cast<long long>(RATE_LIMIT_MIN_GRANT));
+    long long allow = wanted;
+
+    if(!(sending && flow.kernelPaced)){
+        limitByBucket(flow.bucket, curTime, need, allow, waitMicros);
+    }
+    std::unordered_map<uint32_t, IpState>::iterator ipIt = ips.find(flow.ip);
+    if(ipIt != ips.end()){
+        limitByBucket(ipIt->second.bucket, curTime, need, allow, waitMicros);
+    }
+
+    if(sending && total.rate > 0){
+        if(!flow.inRound){
+            round.push_back(fd);
+            flow.inRound = true;
+        }
+        dealLocked(curTime);
+        if(flow.deficit < need){
+            // 差额不足，至少等到总令牌桶补充一个 quantum，期间其他连接按轮询顺序发送
+            allow = 0;
+            waitMicros = std::max(waitMicros, total.waitFor(RATE_LIMIT_DRR_QUANTUM));
+        }else{
+            allow = std::min(allow, flow.deficit);
+        }
+    }
+
+    if(allow == 0){
+        waitMicros = std::max(waitMicros, static_cast<long long>(RATE_LIMIT_MIN_WAIT));
+    }
+    return allow;
+}
+
+void RateLimiter::consume(int fd, bool sending, long long used){
+    if(!active || used <= 0){
+        return;
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    Flow &flow = flowLocked(fd);
+    if(!(sending && flow.kernelPaced) && flow.bucket.rate > 0){
+        flow.bucket.tokens -= used;
+    }
+    std::unordered_map<uint32_t, IpState>::iterator ipIt = ips.find(flow.ip);
+    if(ipIt != ips.end() && ipIt->second.bucket.rate > 0){
+        ipIt->second.bucket.tokens -= used;
+    }
+    if(sending && total.rate > 0){
+        flow.deficit -= used;
+    }
+}
+
+void RateLimiter::finishSend(int fd){
+    std::lock_guard<std::mutex> guard(lock);
+    std::unordered_map<int, Flow>::iterator it = flows.find(fd);
+    if(it != flows.end()){
+        leaveRoundLocked(fd, it->second);
+    }
+}
+
+void RateLimiter::armLocked(long long deadline){
+    struct itimerspec spec;
+    spec.it_interval.tv_sec = 0;
+    spec.it_interval.tv_nsec = 0;
+    spec.it_value.tv_sec = deadline / 1000000;
+    spec.it_value.tv_nsec = (deadline % 1000000) * 1000;
+    if(timerfd_settime(timer, TFD_TIMER_ABSTIME, &spec, nullptr) == 0){
+        armedDeadline = deadline;
+    }
+}
+
+void RateLimiter::defer(int epollFd, int fd, bool enableWrite, long long waitMicros){
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        std::unordered_map<int, Flow>::iterator it = flows.find(fd);
+        if(timer != -1 && it != flows.end()){
+            Timer entry;
+            entry.deadline = now() + std::max(waitMicros, static_cast<long long>(RATE_LIMIT_MIN_WAIT));
+            entry.fd = fd;
+            entry.generation = it->second.generation;
+            entry.epollFd = epollFd;
+            entry.enableWrite = enableWrite;
+            timers.push(entry);
+            if(armedDeadline == 0 || entry.deadline < armedDeadline){
+                armLocked(entry.deadline);
+            }
+            return;
+        }
+    }
+    // 没有定时器时立即重新注册，不会丢失事件
+    rearmClient(epollFd, fd, enableWrite);
+}
+
+int RateLimiter::timerFd(){
+    return timer;
+}
+
+void RateLimiter::fireTimers(){
+    uint64_t expirations;
+    while(read(timer, &expirations, sizeof(expirations)) > 0){
+    }
+
+    std::vector<Timer> due;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        long long curTime = now();
+        armedDeadline = 0;
+        while(!timers.empty() && timers.top().deadline <= curTime){
+            const Timer &entry = timers.top();
+            // 连接已经关闭或者 fd 被新的连接复用时丢弃
+            std::unordered_map<int, Flow>::const_iterator it = flows.find(entry.fd);
+            if(it != flows.end() && it->second.generation == entry.generation){
+                due.push_back(entry);
+            }
+            timers.pop();
+        }
+        if(!timers.empty()){
+            armLocked(timers.top().deadline);
+        }
+    }
+    for(size_t i = 0; i < due.size(); ++i){
+        rearmClient(due[i].epollFd, due[i].fd, due[i].enableWrite);
+    }
+}
@@ -0,0 +1,140 @@
+/*  文件说明：
+ *  1. 按连接和按客户端 IP 的令牌桶限速，用于发送和接收：每次收发之前用 acquire 获取本次最多可以收发的字节数，收发之后用 consume 扣除实际的字节数。
+ *     令牌不足时 acquire 返回 0 和需要等待的时间，连接的事件不立即重新注册，而是交给定时器，到期后由主线程重新注册
+ *  2. 内核支持 SO_MAX_PACING_RATE 时，每个连接的发送速率由内核的 pacing 限制，用户态只检查按 IP 和总速率的限制；
+ *     接收总是在用户态限制（暂停读取后接收窗口变小，客户端会自动降速）
+ *  3. 设置了总发送速率时，总令牌按 DRR（差额轮询）分配给正在发送的连接：每轮给每个连接最多补充到一个 quantum 的差额，
+ *     连接只能发送自己差额内的数据，先开始的大下载不会占满总带宽，同时进行的下载平分总速率
+ *  4. 定时器是一个 timerfd，注册在主线程的 epoll 中，总是设置为最早的到期时间
+ *  5. 连接关闭后 fd 可能被新的连接复用，每个连接有一个代数，定时器到期时代数不同的记录直接丢弃
+ *  6. 旧服务器（fileserver）和 src 中的服务器共用该模块，它不依赖任何一方的工具函数，不输出日志，错误通过返回值和 errno 交给调用者
+ */
+#ifndef RATELIMITER_H
+#define RATELIMITER_H
+#include <mutex>
+#include <deque>
+#include <queue>
+#include <vector>
+#include <atomic>
+#include <functional>
+#include <cstdint>
+#include <unordered_map>
+
+#include <netinet/in.h>
+
+#define RATE_LIMIT_DEFAULT_BURST (256 * 1024)     // 令牌桶的默认容量（允许的突发字节数）
+#define RATE_LIMIT_MIN_GRANT (16 * 1024)          // 令牌少于该值时等待，避免令牌不足时每次只收发很少的数据
+#define RATE_LIMIT_DRR_QUANTUM (64 * 1024)        // DRR 每轮给每个连接补充的最大差额
+#define RATE_LIMIT_MIN_WAIT 1000                  // 最短的等待时间（微秒）
+
+// 令牌桶，rate 为每秒补充的字节数，为 0 时不限制。令牌可以为负数（并发收发时多扣的部分），之后需要等待更久
+struct TokenBucket{
+    long long rate = 0;
+    long long burst = 0;
+    double tokens = 0;
+    long long last = 0;       // 上次补充令牌的时间（微秒）
+
+    // 设置速率和容量，令牌桶装满
+    void reset(long long newRate, long long newBurst, long long now);
+
+    // 按经过的时间补充令牌
+    void refill(long long now);
+
+    // 还需要等待多少微秒才有 need 个令牌
+    long long waitFor(long long need) const;
+};
+
+class RateLimiter{
+public:
+    // 设置每个连接、每个 IP 和所有连接的总发送速率（字节/秒，0 表示不限制），第一次调用时创建定时器。失败时返回 -1，errno 表示原因
+    static int configure(long long perConnRate, long long perIpRate, long long totalRate, long long burst = RATE_LIMIT_DEFAULT_BURST);
+
+    // 是否设置了任何限制
+    static bool enabled();
+
+    // 新连接：创建连接的令牌桶，并尝试设置内核的 pacing
+    static void attach(int fd, const sockaddr_in &addr);
+
+    // 连接关闭：删除连接的状态，该连接还没有到期的定时器会被丢弃
+    static void detach(int fd);
+
+    // 本次最多可以收发的字节数（不超过 wanted）。需要等待时返回 0，waitMicros 为需要等待的时间，不需要等待时 waitMicros 为 0
+    static long long acquire(int fd, bool sending, long long wanted, long long &waitMicros);
+
+    // 扣除实际收发的字节数
+    static void consume(int fd, bool sending, long long used);
+
+    // 响应发送完成，连接退出 DRR 的轮询
+    static void finishSend(int fd);
+
+    // 等待 waitMicros 微秒后重新注册连接的事件，enableWrite 表示同时注册可写事件
+    static void defer(int epollFd, int fd, bool enableWrite, long long waitMicros);
+
+    // 定时器的文件描述符，没有创建时为 -1
+    static int timerFd();
+
+    // 定时器到期，在主线程中调用，重新注册所有到期的连接的事件
+    static void fireTimers();
+
+private:
+    // 一个连接的限速状态
+    struct Flow{
+        TokenBucket bucket;                 // 连接的令牌桶，内核 pacing 生效时只用于接收
+        uint32_t ip = 0;                    // 客户端 IP（网络字节序）
+        bool kernelPaced = false;           // 发送速率是否由内核的 SO_MAX_PACING_RATE 限制
+        long long deficit = 0;              // DRR 中可以发送的差额
+        bool inRound = false;               // 是否在 DRR 的轮询队列中
+        unsigned long long generation = 0;  // 连接的代数
+    };
+
+    // 一个客户端 IP 的令牌桶，由该 IP 的所有连接共享
+    struct IpState{
+        TokenBucket bucket;
+        int refs = 0;
+    };
+
+    // 一个等待中的连接
+    struct Timer{
+        long long deadline;
+        int fd;
+        unsigned long long generation;
+        int epollFd;
+        bool enableWrite;
+        bool operator>(const Timer &other) const { return deadline > other.deadline; }
+    };
+
+    // 当前时间（微秒，CLOCK_MONOTONIC）
+    static long long now();
+
+    // 获取连接的状态，不存在时（如设置限速之前已经建立的连接）用对端地址创建，调用前需要持有 lock
+    static Flow &flowLocked(int fd);
+
+    // 创建连接的状态，调用前需要持有 lock
+    static Flow &attachLocked(int fd, uint32_t ip);
+
+    // 连接退出 DRR 的轮询，调用前需要持有 lock
+    static void leaveRoundLocked(int fd, Flow &flow);
+
+    // 按 DRR 把总令牌补充到轮询队列中各个连接的差额，调用前需要持有 lock
+    static void dealLocked(long long curTime);
+
+    // 将定时器设置为 deadline 到期，调用前需要持有 lock
+    static void armLocked(long long deadline);
+
+private:
+    static std::mutex lock;
+    static std::atomic<bool> active;                        // 是否设置了任何限制，没有限制时 acquire 不加锁
+    static long long connRate;
+    static long long ipRate;
+    static long long burstSize;
+    static TokenBucket total;                               // 所有连接共享的总发送令牌桶
+    static unsigned long long nextGeneration;
+    static std::unordered_map<int, Flow> flows;             // fd -> 连接的状态
+    static std::unordered_map<uint32_t, IpState> ips;       // IP -> 令牌桶
+    static std::deque<int> round;                           // DRR 的轮询队列，保存正在发送的连接
+    static std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer> > timers;
+    static int timer;                                       // timerfd
+    static long long armedDeadline;                         // 定时器当前的到期时间，0 表示没有设置
+};
+
+#endif
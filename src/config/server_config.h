@@ -15,12 +15,27 @@ struct ServerConfig {
     int port{8888};                                    ///< 监听端口
     std::string bindAddress{"0.0.0.0"};              ///< 绑定地址
     int backlog{1024};                                ///< 监听队列长度
+    int acceptBatch{64};                              ///< 每次监听套接字就绪时最多接受的连接数，剩余的连接处理完本轮事件后继续接受
+    std::chrono::seconds deferAccept{5};              ///< TCP_DEFER_ACCEPT：收到请求数据后才唤醒accept，0表示关闭
+    int fastOpenQueue{0};                             ///< TCP_FASTOPEN的队列长度，0表示不启用
+    bool exclusiveAccept{false};                      ///< 监听套接字使用EPOLLEXCLUSIVE，多个进程共享监听套接字时一个连接只唤醒一个
     int maxConnections{10000};                        ///< 最大连接数
     
     // 线程池配置
-    int threadCount{std::thread::hardware_concurrency()}; ///< 工作线程数
+    int threadCount{0};                               ///< 工作线程数，0表示按可以使用的CPU数（cgroup cpu.max和CPU亲和性）
+    int minThreads{0};                                ///< 自适应线程数的下限，0表示等于初始线程数
+    int maxThreads{0};                                ///< 自适应线程数的上限，0表示初始线程数的4倍，等于下限时不调整
+    
+    // CPU绑定（cpulist格式，如"0-7,16-23"），"none"表示不绑定，为空时在多NUMA节点的主机上按网卡队列（RPS/XPS）或网卡所在节点选择
+    std::string reactorCpus;                          ///< 事件循环线程的CPU集合
+    std::string workerCpus;                           ///< 工作线程的CPU集合
     int maxQueueSize{10000};                          ///< 任务队列最大长度
     
+    // 过载控制（交互任务的排队时间持续超过目标时，新请求直接返回503并暂停接受连接）
+    std::chrono::milliseconds queueDelayTarget{5};    ///< 排队时间目标，0表示关闭过载控制
+    std::chrono::milliseconds queueDelayInterval{100}; ///< 判断过载的时间窗口
+    std::chrono::seconds retryAfter{1};               ///< 503响应中Retry-After的秒数
+    
     // 超时配置
     std::chrono::seconds connectionTimeout{30};       ///< 连接超时时间
     std::chrono::seconds keepAliveTimeout{60};        ///< Keep-Alive超时时间
@@ -47,6 +62,12 @@ struct ServerConfig {
     bool enableKeepalive{true};                       ///< 启用HTTP Keep-Alive
     bool enableGzip{false};                           ///< 启用Gzip压缩
     
+    // 限速配置（字节/秒，0 表示不限制）
+    size_t connectionRateLimit{0};                    ///< 每个连接的收发速率上限（优先使用内核的 SO_MAX_PACING_RATE）
+    size_t ipRateLimit{0};                            ///< 每个客户端IP的收发速率上限
+    size_t totalRateLimit{0};                         ///< 所有下载共享的总发送速率，按DRR平分给正在发送的连接
+    size_t rateLimitBurst{256 * 1024};                ///< 令牌桶容量（允许的突发字节数）
+    
     /**
      * @brief 从配置文件加载配置
      * @param configFile 配置文件路径
@@ -1,19 +1,73 @@
 #include "server.h"
 #include "../utils/socket_utils.h"
 #include "../event/event_factory.h"
+#include "../../ratelimit/ratelimiter.h"
+#include "../../affinity/cpuaffinity.h"
 
 #include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <linux/tcp.h>
+#include <linux/sockios.h>
 #include <sys/signalfd.h>
 #include <signal.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <cerrno>
 #include <cstring>
+#include <climits>
+#include <cstddef>
+#include <algorithm>
+#include <vector>
 #include <stdexcept>
 #include <iostream>
 
 namespace webserver {
 
+namespace {
+
+/**
+ * @brief 获取内核统计的连接累计接收字节数和对方已经确认的发送字节数
+ * @return false表示获取失败或者内核不支持（4.1之前）
+ */
+bool tcpTransferred(int fd, uint64_t& received, uint64_t& acked) noexcept {
+    tcp_info info{};
+    socklen_t len = sizeof(info);
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) != 0 ||
+        len < offsetof(tcp_info, tcpi_bytes_received) + sizeof(info.tcpi_bytes_received)) {
+        return false;
+    }
+    received = info.tcpi_bytes_received;
+    acked = info.tcpi_bytes_acked;
+    return true;
+}
+
+/**
+ * @brief 获取连接已经被读取的字节数：内核统计的累计接收字节数减去接收队列中还没有读取的字节数
+ * @param consumed 输出已经被读取的字节数
+ * @param queued 输出接收队列中的字节数
+ * @return false表示获取失败，或者数据一直在到达（两次查询接收队列的结果不同）
+ */
+bool tcpConsumed(int fd, uint64_t& consumed, size_t& queued) noexcept {
+    for (int i = 0; i < 3; ++i) {
+        int before = 0;
+        int after = 0;
+        uint64_t received = 0;
+        uint64_t acked = 0;
+        if (ioctl(fd, SIOCINQ, &before) != 0 || !tcpTransferred(fd, received, acked) ||
+            ioctl(fd, SIOCINQ, &after) != 0) {
+            return false;
+        }
+        if (before == after && received >= static_cast<uint64_t>(after)) {
+            queued = static_cast<size_t>(after);
+            consumed = received - static_cast<uint64_t>(after);
+            return true;
+        }
+    }
+    return false;
+}
+
+} // namespace
+
 // 静态成员初始化
 std::atomic<bool> WebServer::signalReceived_{false};
 int WebServer::signalPipe_[2] = {-1, -1};
@@ -28,11 +82,31 @@ WebServer::WebServer(const ServerConfig& config)
     
     try {
         // 初始化线程池
-        threadPool_ = std::make_unique<ThreadPool>(config_.threadCount);
+        threadPool_ = std::make_unique<ThreadPool>(config_.threadCount, config_.maxQueueSize);
+        size_t initialThreads = threadPool_->getThreadCount();
+        size_t minThreads = config_.minThreads > 0 ? static_cast<size_t>(config_.minThreads) : initialThreads;
+        size_t maxThreads = config_.maxThreads > 0 ? static_cast<size_t>(config_.maxThreads) : initialThreads * 4;
+        threadPool_->setAdaptiveBounds(minThreads, std::max(minThreads, maxThreads));
+        logger_->info("Thread pool: {} threads ({} CPUs available), adaptive range [{}, {}]",
+                      initialThreads, ThreadPool::availableCpus(), minThreads, std::max(minThreads, maxThreads));
+        threadPool_->setQueueDelayTarget(config_.queueDelayTarget, config_.queueDelayInterval);
         
         // 初始化连接管理器
         connMgr_ = std::make_unique<ConnectionManager>(config_.maxConnections);
         
+        // 初始化限速
+        if (config_.connectionRateLimit > 0 || config_.ipRateLimit > 0 || config_.totalRateLimit > 0) {
+            if (RateLimiter::configure(config_.connectionRateLimit, config_.ipRateLimit,
+                                       config_.totalRateLimit, config_.rateLimitBurst) != 0) {
+                throw std::runtime_error("Failed to configure rate limits: " + std::string(strerror(errno)));
+            }
+            logger_->info("Rate limits: per connection {} B/s, per IP {} B/s, total send {} B/s",
+                          config_.connectionRateLimit, config_.ipRateLimit, config_.totalRateLimit);
+        }
+        if (config_.maxFileSize > 0) {
+            logger_->info("Upload size limit: {} bytes per file", config_.maxFileSize);
+        }
+        
         // 设置信号处理
         setupSignalHandling();
         
@@ -78,6 +152,7 @@ void WebServer::start() {
     try {
         initializeListenSocket();
         initializeEpoll();
+        setupCpuAffinity();
         
         running_.store(true);
         shouldStop_.store(false);
@@ -121,6 +196,7 @@ void WebServer::stop(bool graceful) noexcept {
 std::string WebServer::getStats() const {
     auto uptime = std::chrono::steady_clock::now() - startTime_;
     auto uptimeSeconds = std::chrono::duration_cast<std::chrono::seconds>(uptime).count();
+    auto adaptive = threadPool_->getAdaptiveStats();
     
     return fmt::format(
         "Server Stats:\n"
@@ -128,12 +204,22 @@ std::string WebServer::getStats() const {
         "  Total Connections: {}\n"
         "  Active Connections: {}\n"
         "  Total Requests: {}\n"
-        "  Thread Pool Size: {}",
+        "  Shed Requests: {}\n"
+        "  Overloaded: {}\n"
+        "  Thread Pool Size: {} (spawned {}, range [{}, {}], {} CPUs)\n"
+        "  Thread Pool Adjustments: grown {}, shrunk {}, last {}\n"
+        "  Thread Pool Blocked/Utilization: {}% / {}%\n"
+        "  Worker CPU Affinity: {}",
         uptimeSeconds,
         totalConnections_.load(),
         activeConnections_.load(),
         totalRequests_.load(),
-        config_.threadCount
+        shedRequests_.load(),
+        threadPool_->isOverloaded(),
+        adaptive.threads, adaptive.spawnedThreads, adaptive.minThreads, adaptive.maxThreads, adaptive.cpus,
+        adaptive.grown, adaptive.shrunk, adaptive.lastAdjust,
+        adaptive.blockedPercent, adaptive.utilization,
+        threadPool_->getCpuAffinity().empty() ? "none" : threadPool_->getCpuAffinity()
     );
 }
 
@@ -164,6 +250,17 @@ void WebServer::initializeListenSocket() {
             throw std::runtime_error("Failed to listen: " + std::string(strerror(errno)));
         }
         
+        // 收到请求数据后才唤醒accept，只建立连接不发送数据的客户端不占用事件
+        int deferAccept = static_cast<int>(config_.deferAccept.count());
+        if (setsockopt(listenFd_, IPPROTO_TCP, TCP_DEFER_ACCEPT, &deferAccept, sizeof(deferAccept)) < 0) {
+            logger_->warn("Failed to set TCP_DEFER_ACCEPT: {}", strerror(errno));
+        }
+        // 内核的net.ipv4.tcp_fastopen需要包含服务端的标志（2）才生效
+        if (config_.fastOpenQueue > 0 &&
+            setsockopt(listenFd_, IPPROTO_TCP, TCP_FASTOPEN, &config_.fastOpenQueue, sizeof(config_.fastOpenQueue)) < 0) {
+            logger_->warn("Failed to enable TCP_FASTOPEN: {}", strerror(errno));
+        }
+        
         logger_->info("Listen socket created and bound to port {}", config_.port);
         
     } catch (...) {
@@ -183,6 +280,9 @@ void WebServer::initializeEpoll() {
         // 添加监听套接字到epoll
         epoll_event event{};
         event.events = EPOLLIN | EPOLLET;  // 边缘触发
+        if (config_.exclusiveAccept) {
+            event.events |= EPOLLEXCLUSIVE;
+        }
         event.data.fd = listenFd_;
         
         if (epoll_ctl(epollFd_, EPOLL_CTL_ADD, listenFd_, &event) < 0) {
@@ -190,6 +290,17 @@ void WebServer::initializeEpoll() {
                                    std::string(strerror(errno)));
         }
         
+        // 添加限速定时器到epoll，到期时重新注册等待令牌的连接
+        if (RateLimiter::timerFd() >= 0) {
+            event.events = EPOLLIN;
+            event.data.fd = RateLimiter::timerFd();
+            
+            if (epoll_ctl(epollFd_, EPOLL_CTL_ADD, RateLimiter::timerFd(), &event) < 0) {
+                throw std::runtime_error("Failed to add rate limit timer to epoll: " + 
+                                       std::string(strerror(errno)));
+            }
+        }
+        
         // 添加信号管道到epoll
         if (signalPipe_[0] >= 0) {
             event.events = EPOLLIN;
@@ -233,6 +344,43 @@ void WebServer::setupSignalHandling() {
     logger_->info("Signal handling setup completed");
 }
 
+void WebServer::setupCpuAffinity() {
+    cpu_set_t nicCpus;
+    std::string source;
+    bool hasDefault = (config_.reactorCpus.empty() || config_.workerCpus.empty()) &&
+                      CpuAffinity::nicDefault(nicCpus, source) == 0;
+    if (hasDefault) {
+        logger_->info("Default CPU set {} chosen from {}", CpuAffinity::format(nicCpus), source);
+    }
+    
+    // 先绑定工作线程：之后增加的线程继承创建它的线程的绑定
+    auto resolve = [&](const std::string& cpuList, cpu_set_t& cpuSet) {
+        if (cpuList.empty()) {
+            cpuSet = nicCpus;
+            return hasDefault;
+        }
+        if (cpuList == "none") {
+            return false;
+        }
+        if (CpuAffinity::parse(cpuList, cpuSet) != 0) {
+            throw std::runtime_error("Invalid CPU list: " + cpuList);
+        }
+        return true;
+    };
+    
+    cpu_set_t cpuSet;
+    if (resolve(config_.workerCpus, cpuSet)) {
+        threadPool_->setCpuAffinity(cpuSet);
+        logger_->info("Worker threads bound to CPUs {}", CpuAffinity::format(cpuSet));
+    }
+    if (resolve(config_.reactorCpus, cpuSet)) {
+        if (CpuAffinity::bindCurrentThread(cpuSet) != 0) {
+            throw std::runtime_error("Failed to bind event loop to CPUs " + CpuAffinity::format(cpuSet));
+        }
+        logger_->info("Event loop bound to CPUs {}", CpuAffinity::format(cpuSet));
+    }
+}
+
 void WebServer::eventLoop() {
     const int maxEvents = 1024;
     std::vector<epoll_event> events(maxEvents);
@@ -241,7 +389,9 @@ void WebServer::eventLoop() {
     
     while (running_.load() && !shouldStop_.load()) {
         try {
-            int numEvents = epoll_wait(epollFd_, events.data(), maxEvents, 1000); // 1秒超时
+            // 暂停接受连接时缩短超时，及时检查过载是否结束；监听队列中还有没接受的连接时不等待
+            int timeout = acceptPending_ ? 0 : (acceptPaused_ ? kAcceptRetryIntervalMs : 1000);
+            int numEvents = epoll_wait(epollFd_, events.data(), maxEvents, timeout);
             
             if (numEvents < 0) {
                 if (errno == EINTR) {
@@ -251,6 +401,16 @@ void WebServer::eventLoop() {
                 break;
             }
             
+            // 过载结束，继续接受积压在监听队列中的连接（边缘触发不会再次通知）
+            if (acceptPaused_ && !threadPool_->isOverloaded()) {
+                acceptPaused_ = false;
+                logger_->info("Queue delay recovered, resuming accept");
+                handleNewConnection();
+            } else if (acceptPending_) {
+                // 上一轮用完了接受连接的预算，边缘触发不会再通知，在其他连接的事件之间继续接受
+                handleNewConnection();
+            }
+            
             if (numEvents == 0) {
                 // 超时，检查是否需要清理连接
                 connMgr_->cleanupIdleConnections();
@@ -264,6 +424,8 @@ void WebServer::eventLoop() {
                 
                 if (fd == listenFd_) {
                     handleNewConnection();
+                } else if (fd == RateLimiter::timerFd()) {
+                    RateLimiter::fireTimers();
                 } else if (fd == signalPipe_[0]) {
                     // 处理信号
                     char buffer[256];
@@ -289,7 +451,22 @@ void WebServer::eventLoop() {
 }
 
 void WebServer::handleNewConnection() {
-    while (true) {
+    acceptPending_ = false;
+    for (int accepted = 0; ; ++accepted) {
+        if (accepted >= config_.acceptBatch) {
+            acceptPending_ = true;
+            break;
+        }
+        
+        // 过载时新连接留在监听队列中，由内核的backlog承担排队
+        if (threadPool_->isOverloaded()) {
+            if (!acceptPaused_) {
+                logger_->warn("Queue delay above target, pausing accept");
+            }
+            acceptPaused_ = true;
+            break;
+        }
+        
         sockaddr_in clientAddr{};
         socklen_t clientLen = sizeof(clientAddr);
         
@@ -314,6 +491,7 @@ void WebServer::handleNewConnection() {
             
             // 创建连接对象
             auto connection = connMgr_->createConnection(clientFd, clientAddr);
+            RateLimiter::attach(clientFd, clientAddr);
             
             // 添加到epoll监听
             epoll_event event{};
@@ -348,24 +526,68 @@ void WebServer::handleClientEvent(int fd, uint32_t events) {
             return;
         }
         
-        // 创建事件处理器并提交到线程池
+        // 创建事件处理器并提交到线程池，正在传输大文件的连接放入批量队列
+        TaskPriority priority = connection->isBulkTransfer() ? TaskPriority::Bulk : TaskPriority::Interactive;
+        if (!(events & (EPOLLHUP | EPOLLERR)) && !admitRateLimited(fd, events)) {
+            return;
+        }
         if (events & EPOLLIN) {
+            // 过载时只拒绝新请求，已经开始的请求继续处理，避免浪费已经完成的工作。
+            // 连接刚建立或者上一个请求已经进入发送阶段时，这次可读事件是一个新请求的开始；
+            // 正在读取时（如上传的消息体分多次到达）继续交给接收处理器
+            bool newRequest = connection->getState() != ConnectionState::READING;
+            if (newRequest && threadPool_->isOverloaded()) {
+                rejectOverloaded(fd);
+                return;
+            }
+            if (config_.maxFileSize > 0 && !inspectUpload(*connection, newRequest)) {
+                return;
+            }
+            if (newRequest) {
+                // 上一个响应已经发送完成，连接退出总发送速率的轮询，新请求重新按交互请求调度
+                RateLimiter::finishSend(fd);
+                uint64_t received = 0;
+                uint64_t acked = 0;
+                tcpTransferred(fd, received, acked);
+                connection->beginRequest(received, acked);
+                priority = TaskPriority::Interactive;
+            }
+            connection->setState(ConnectionState::READING);
             auto handler = EventFactory::createReceiveHandler(fd, epollFd_);
-            threadPool_->submit([handler = std::move(handler)]() {
-                handler->process();
-            });
+            try {
+                threadPool_->submitWithPriority(priority, [handler = std::move(handler), connection]() {
+                    handler->process();
+                    accountTransfer(*connection, false);
+                });
+            } catch (const std::runtime_error&) {
+                // 队列已满
+                rejectOverloaded(fd);
+                return;
+            }
             totalRequests_.fetch_add(1);
         }
         
         if (events & EPOLLOUT) {
+            // 请求已经接收完成，之后的可读事件属于下一个请求
+            connection->setState(ConnectionState::WRITING);
             auto handler = EventFactory::createSendHandler(fd, epollFd_);
-            threadPool_->submit([handler = std::move(handler)]() {
-                handler->process();
-            });
+            try {
+                threadPool_->submitWithPriority(priority, [handler = std::move(handler), connection]() {
+                    handler->process();
+                    accountTransfer(*connection, true);
+                });
+            } catch (const std::runtime_error&) {
+                // 队列已满，重新注册可写事件（EPOLLONESHOT已经触发，不重新注册的话连接不会再有事件）
+                epoll_event event{};
+                event.events = EPOLLOUT | EPOLLET | EPOLLONESHOT;
+                event.data.fd = fd;
+                epoll_ctl(epollFd_, EPOLL_CTL_MOD, fd, &event);
+            }
         }
         
         if (events & (EPOLLHUP | EPOLLERR)) {
             logger_->debug("Connection closed or error: fd={}", fd);
+            RateLimiter::detach(fd);
             connMgr_->removeConnection(fd);
             activeConnections_.fetch_sub(1);
         }
@@ -377,6 +599,142 @@ void WebServer::handleClientEvent(int fd, uint32_t events) {
     }
 }
 
+bool WebServer::admitRateLimited(int fd, uint32_t events) {
+    if (!RateLimiter::enabled()) {
+        return true;
+    }
+    // 至少有一次最小分配的令牌时才分发，处理器收发的字节数在执行之后按内核的统计扣除，令牌可能变为负数，之后等待更久
+    long long waitMicros = 0;
+    long long wait = 0;
+    if (events & EPOLLIN) {
+        RateLimiter::acquire(fd, false, RATE_LIMIT_MIN_GRANT, wait);
+        waitMicros = std::max(waitMicros, wait);
+    }
+    if (events & EPOLLOUT) {
+        RateLimiter::acquire(fd, true, RATE_LIMIT_MIN_GRANT, wait);
+        waitMicros = std::max(waitMicros, wait);
+    }
+    if (waitMicros == 0) {
+        return true;
+    }
+    // EPOLLONESHOT已经触发，由定时器到期后重新注册
+    RateLimiter::defer(epollFd_, fd, (events & EPOLLOUT) != 0, waitMicros);
+    return false;
+}
+
+void WebServer::accountTransfer(Connection& connection, bool sending) noexcept {
+    if (connection.isClosed()) {
+        return;
+    }
+    uint64_t received = 0;
+    uint64_t acked = 0;
+    if (!tcpTransferred(connection.getFd(), received, acked)) {
+        return;
+    }
+    uint64_t total = sending ? acked : received;
+    if (RateLimiter::enabled()) {
+        uint64_t used = connection.advanceTransferred(sending, total);
+        if (used > 0) {
+            RateLimiter::consume(connection.getFd(), sending, static_cast<long long>(used));
+        }
+    }
+    // 请求完成后由下一个请求的开始清除标记
+    if (!connection.isBulkTransfer() && connection.requestTransferred(sending, total) >= kBulkTransferSize) {
+        connection.setBulkTransfer(true);
+    }
+}
+
+void WebServer::rejectOverloaded(int fd) noexcept {
+    // 丢弃已经到达的请求数据，否则close时内核会发送RST，客户端可能收不到503
+    char discard[4096];
+    for (int i = 0; i < 32 && recv(fd, discard, sizeof(discard), MSG_DONTWAIT) > 0; ++i) {
+    }
+    
+    std::string response = "HTTP/1.1 503 Service Unavailable\r\nRetry-After: " +
+                           std::to_string(config_.retryAfter.count()) +
+                           "\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    send(fd, response.data(), response.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+    
+    epoll_ctl(epollFd_, EPOLL_CTL_DEL, fd, nullptr);
+    RateLimiter::detach(fd);
+    connMgr_->removeConnection(fd);
+    activeConnections_.fetch_sub(1);
+    shedRequests_.fetch_add(1);
+}
+
+bool WebServer::inspectUpload(Connection& connection, bool newRequest) noexcept {
+    int fd = connection.getFd();
+    UploadLimit& limit = connection.uploadLimit();
+    uint64_t consumed = 0;
+    size_t queued = 0;
+    if (!tcpConsumed(fd, consumed, queued)) {
+        return true;
+    }
+    // 等待请求头期间没有分发处理器，连接状态不变，这次可读事件仍然属于同一个请求
+    bool awaiting = limit.awaitingHeaders();
+    if (newRequest && !awaiting) {
+        limit.reset(config_.maxFileSize, consumed);
+    } else if (limit.getVerdict() != UploadLimit::Verdict::PENDING) {
+        return true;
+    }
+    
+    // 处理器在上次检查之后读取的数据没有经过检查，按上限计入当前部分
+    if (consumed > limit.position()) {
+        limit.skip(consumed - limit.position());
+    }
+    uint64_t checked = limit.position();
+    if (limit.getVerdict() == UploadLimit::Verdict::PENDING && queued > 0) {
+        std::vector<char> data(queued);
+        ssize_t len = recv(fd, data.data(), data.size(), MSG_PEEK | MSG_DONTWAIT);
+        uint64_t seen = checked - consumed;
+        if (len > 0 && static_cast<uint64_t>(len) > seen) {
+            limit.feed(data.data() + seen, static_cast<size_t>(len) - seen);
+        }
+    }
+    
+    if (limit.getVerdict() == UploadLimit::Verdict::TOO_LARGE) {
+        logger_->warn("Rejecting upload of {} bytes (limit {}): fd={}",
+                      limit.getRejectedSize(), config_.maxFileSize, fd);
+        rejectOversized(fd);
+        return false;
+    }
+    if (limit.awaitingHeaders() && limit.position() > checked) {
+        // 请求头还没有完整到达，不分发处理器（处理器会读取请求头，之后无法再检查）。
+        // 接收队列中的数据多于已有的数据时才再次通知，连接关闭时也会通知，此时没有新数据，交给处理器
+        int lowat = static_cast<int>(std::min<size_t>(queued + 1, INT_MAX));
+        setsockopt(fd, SOL_SOCKET, SO_RCVLOWAT, &lowat, sizeof(lowat));
+        epoll_event event{};
+        event.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
+        event.data.fd = fd;
+        epoll_ctl(epollFd_, EPOLL_CTL_MOD, fd, &event);
+        return false;
+    }
+    if (awaiting) {
+        int lowat = 1;
+        setsockopt(fd, SOL_SOCKET, SO_RCVLOWAT, &lowat, sizeof(lowat));
+    }
+    return true;
+}
+
+void WebServer::rejectOversized(int fd) noexcept {
+    // 先发送响应并关闭写方向，再丢弃已经到达的消息体（不超过kRejectDrainMax），
+    // 接收缓冲区中还有数据时close会发送RST，客户端可能收不到413
+    std::string response = "HTTP/1.1 413 Payload Too Large\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    send(fd, response.data(), response.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+    shutdown(fd, SHUT_WR);
+    char discard[4096];
+    size_t drained = 0;
+    ssize_t len;
+    while (drained < kRejectDrainMax && (len = recv(fd, discard, sizeof(discard), MSG_DONTWAIT)) > 0) {
+        drained += static_cast<size_t>(len);
+    }
+    
+    epoll_ctl(epollFd_, EPOLL_CTL_DEL, fd, nullptr);
+    RateLimiter::detach(fd);
+    connMgr_->removeConnection(fd);
+    activeConnections_.fetch_sub(1);
+}
+
 void WebServer::signalHandler(int signum) {
     signalReceived_.store(true);
     
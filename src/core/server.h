@@ -83,13 +83,19 @@ private:
      */
     void setupSignalHandling();
     
+    /**
+     * @brief 绑定事件循环线程（当前线程）和工作线程的CPU集合，连接的缓冲区随之分配在线程所在的NUMA节点上
+     * @throws std::runtime_error CPU集合无效或者绑定失败时抛出异常
+     */
+    void setupCpuAffinity();
+    
     /**
      * @brief 主事件循环
      */
     void eventLoop();
     
     /**
-     * @brief 处理新连接
+     * @brief 处理新连接，每次最多接受config_.acceptBatch个，用完预算时设置acceptPending_
      */
     void handleNewConnection();
     
@@ -100,6 +106,44 @@ private:
      */
     void handleClientEvent(int fd, uint32_t events);
     
+    /**
+     * @brief 过载时拒绝新请求：返回503和Retry-After后关闭连接
+     * @param fd 客户端套接字
+     */
+    void rejectOverloaded(int fd) noexcept;
+    
+    /**
+     * @brief 分发接收处理器之前检查连接上新到达的请求数据是否超过config_.maxFileSize：
+     *        请求头到达之后检查Content-Length，multipart请求继续逐个部分检查消息体（见UploadLimit），
+     *        请求头还没有完整到达时不分发处理器，等待更多数据
+     * @param connection 客户端连接
+     * @param newRequest 这次可读事件是否为一个新请求的开始
+     * @return true表示可以分发处理器，false表示已经拒绝并关闭了连接或者正在等待请求头
+     */
+    bool inspectUpload(Connection& connection, bool newRequest) noexcept;
+    
+    /**
+     * @brief 上传超过config_.maxFileSize时返回413并关闭连接
+     * @param fd 客户端套接字
+     */
+    void rejectOversized(int fd) noexcept;
+    
+    /**
+     * @brief 限速时检查连接是否还有令牌，令牌不足时不分发处理器，由限速定时器在令牌足够时重新注册事件
+     * @param fd 客户端套接字
+     * @param events 就绪的事件
+     * @return true表示可以分发处理器
+     */
+    bool admitRateLimited(int fd, uint32_t events);
+    
+    /**
+     * @brief 处理器执行之后按内核统计的收发字节数记账：扣除连接的限速令牌，
+     *        当前请求（上传或下载）收发超过kBulkTransferSize时标记为批量传输，之后的事件放入批量队列
+     * @param connection 处理的连接
+     * @param sending true表示发送处理器
+     */
+    static void accountTransfer(Connection& connection, bool sending) noexcept;
+    
     /**
      * @brief 信号处理函数
      * @param signum 信号编号
@@ -118,14 +162,21 @@ private:
     
     std::atomic<bool> running_{false};             ///< 运行状态
     std::atomic<bool> shouldStop_{false};          ///< 停止标志
+    bool acceptPaused_{false};                     ///< 过载时暂停接受连接，只在主线程中访问
+    bool acceptPending_{false};                    ///< 上次接受连接用完了预算，监听队列中可能还有连接，只在主线程中访问
     
     // 统计信息
     std::atomic<uint64_t> totalConnections_{0};    ///< 总连接数
     std::atomic<uint64_t> activeConnections_{0};   ///< 活跃连接数
     std::atomic<uint64_t> totalRequests_{0};       ///< 总请求数
+    std::atomic<uint64_t> shedRequests_{0};        ///< 过载时拒绝的请求数
     
     std::chrono::steady_clock::time_point startTime_; ///< 启动时间
     
+    static constexpr int kAcceptRetryIntervalMs = 10; ///< 暂停接受连接时检查过载是否结束的间隔
+    static constexpr uint64_t kBulkTransferSize = 1024 * 1024; ///< 一个请求收发超过该字节数时按批量传输调度
+    static constexpr size_t kRejectDrainMax = 1024 * 1024;     ///< 拒绝超大上传时最多丢弃的已到达字节数
+    
     static std::atomic<bool> signalReceived_;       ///< 信号接收标志
     static int signalPipe_[2];                     ///< 信号管道
 };
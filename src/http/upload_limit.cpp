@@ -0,0 +1,232 @@
+#include "upload_limit.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+
+namespace webserver {
+
+namespace {
+
+/**
+ * @brief 转换为小写，用于不区分大小写地匹配头部名称和取值
+ */
+std::string toLower(std::string text) {
+    std::transform(text.begin(), text.end(), text.begin(),
+                   [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+    return text;
+}
+
+/**
+ * @brief 去掉首尾的空白字符
+ */
+std::string trim(const std::string& text) {
+    size_t begin = text.find_first_not_of(" \t");
+    if (begin == std::string::npos) {
+        return "";
+    }
+    size_t end = text.find_last_not_of(" \t");
+    return text.substr(begin, end - begin + 1);
+}
+
+/**
+ * @brief 从Content-Type中取出multipart的boundary（区分大小写，可以带引号）
+ * @return boundary，不是multipart/form-data或者没有boundary时返回空字符串
+ */
+std::string parseBoundary(const std::string& contentType) {
+    std::string lower = toLower(contentType);
+    if (lower.compare(0, 19, "multipart/form-data") != 0) {
+        return "";
+    }
+    size_t pos = lower.find("boundary=");
+    if (pos == std::string::npos) {
+        return "";
+    }
+    std::string boundary = contentType.substr(pos + 9);
+    if (!boundary.empty() && boundary[0] == '"') {
+        size_t quote = boundary.find('"', 1);
+        return quote == std::string::npos ? "" : boundary.substr(1, quote - 1);
+    }
+    return boundary.substr(0, boundary.find_first_of("; \t"));
+}
+
+} // namespace
+
+void UploadLimit::reset(size_t maxFileSize, uint64_t streamOffset) {
+    maxFileSize_ = maxFileSize;
+    streamOffset_ = streamOffset;
+    position_ = streamOffset;
+    verdict_ = Verdict::PENDING;
+    stage_ = Stage::HEADERS;
+    buffer_.clear();
+    delimiter_.clear();
+    lengthKnown_ = false;
+    bodyRemaining_ = 0;
+    partBytes_ = 0;
+    rejectedSize_ = 0;
+}
+
+UploadLimit::Verdict UploadLimit::feed(const char* data, size_t length) {
+    position_ += length;
+    if (verdict_ != Verdict::PENDING) {
+        return verdict_;
+    }
+    if (stage_ != Stage::HEADERS) {
+        scanBody(data, length);
+        return verdict_;
+    }
+
+    // 请求头可能分多次到达，从上次结尾的前3个字节开始查找空行
+    size_t searchFrom = buffer_.size() >= 3 ? buffer_.size() - 3 : 0;
+    buffer_.append(data, length);
+    size_t headerEnd = buffer_.find("\r\n\r\n", searchFrom);
+    if (headerEnd == std::string::npos) {
+        if (buffer_.size() > kMaxHeaderBytes) {
+            finish(Verdict::ALLOWED);
+        }
+        return verdict_;
+    }
+    std::string body = buffer_.substr(headerEnd + 4);
+    parseHeaders(buffer_.substr(0, headerEnd));
+    if (verdict_ == Verdict::PENDING) {
+        scanBody(body.data(), body.size());
+    }
+    return verdict_;
+}
+
+UploadLimit::Verdict UploadLimit::skip(uint64_t length) {
+    position_ += length;
+    if (verdict_ != Verdict::PENDING) {
+        return verdict_;
+    }
+    if (stage_ == Stage::HEADERS) {
+        // 请求头已经被读取，无法再检查
+        finish(Verdict::ALLOWED);
+        return verdict_;
+    }
+    if (lengthKnown_) {
+        length = std::min(length, bodyRemaining_);
+        bodyRemaining_ -= length;
+    }
+    // 跳过的数据中可能有分隔符，全部当作当前部分（或者下一个部分）的内容
+    buffer_.clear();
+    if (stage_ != Stage::PART_CONTENT) {
+        stage_ = Stage::PART_CONTENT;
+        partBytes_ = 0;
+    }
+    addPartBytes(length);
+    if (verdict_ == Verdict::PENDING && lengthKnown_ && bodyRemaining_ == 0) {
+        finish(Verdict::ALLOWED);
+    }
+    return verdict_;
+}
+
+void UploadLimit::parseHeaders(const std::string& headers) {
+    buffer_.clear();
+    std::string boundary;
+    size_t lineStart = headers.find("\r\n");
+    while (lineStart != std::string::npos) {
+        lineStart += 2;
+        size_t lineEnd = headers.find("\r\n", lineStart);
+        std::string line = headers.substr(lineStart, lineEnd == std::string::npos ? std::string::npos : lineEnd - lineStart);
+        lineStart = lineEnd;
+
+        size_t colon = line.find(':');
+        if (colon == std::string::npos) {
+            continue;
+        }
+        std::string name = toLower(trim(line.substr(0, colon)));
+        std::string value = trim(line.substr(colon + 1));
+        if (name == "content-length") {
+            char* end = nullptr;
+            unsigned long long contentLength = std::strtoull(value.c_str(), &end, 10);
+            if (end != value.c_str() && value[0] != '-') {
+                lengthKnown_ = true;
+                bodyRemaining_ = contentLength;
+            }
+        } else if (name == "content-type") {
+            boundary = parseBoundary(value);
+        }
+    }
+
+    if (boundary.empty()) {
+        if (lengthKnown_ && bodyRemaining_ > maxFileSize_) {
+            rejectedSize_ = bodyRemaining_;
+            finish(Verdict::TOO_LARGE);
+        } else {
+            finish(Verdict::ALLOWED);
+        }
+        return;
+    }
+    // multipart的Content-Length包含所有部分和分隔符，不超过限制时其中的文件也不会超过
+    if (lengthKnown_ && bodyRemaining_ <= maxFileSize_) {
+        finish(Verdict::ALLOWED);
+        return;
+    }
+    // 第一个分隔符前面没有\r\n，补上之后所有分隔符的格式相同
+    delimiter_ = "\r\n--" + boundary;
+    buffer_ = "\r\n";
+    stage_ = Stage::PART_CONTENT;
+    partBytes_ = 0;
+}
+
+void UploadLimit::scanBody(const char* data, size_t length) {
+    if (lengthKnown_) {
+        length = static_cast<size_t>(std::min<uint64_t>(length, bodyRemaining_));
+        bodyRemaining_ -= length;
+    }
+    buffer_.append(data, length);
+
+    while (verdict_ == Verdict::PENDING) {
+        if (stage_ == Stage::PART_CONTENT) {
+            size_t pos = buffer_.find(delimiter_);
+            if (pos == std::string::npos) {
+                // 结尾可能是分隔符的开头，留到下次和新数据一起查找
+                size_t keep = std::min(buffer_.size(), delimiter_.size() - 1);
+                addPartBytes(buffer_.size() - keep);
+                buffer_.erase(0, buffer_.size() - keep);
+                break;
+            }
+            addPartBytes(pos);
+            buffer_.erase(0, pos + delimiter_.size());
+            stage_ = Stage::PART_DELIMITER;
+        } else if (stage_ == Stage::PART_DELIMITER) {
+            if (buffer_.size() < 2) {
+                break;
+            }
+            if (buffer_.compare(0, 2, "--") == 0) {
+                // 最后一个分隔符，之后的数据不属于任何部分
+                finish(Verdict::ALLOWED);
+                return;
+            }
+            buffer_.erase(0, 2);
+            stage_ = Stage::PART_HEADERS;
+        } else {
+            // 没有头部的部分只有一个空行
+            size_t headerEnd = buffer_.compare(0, 2, "\r\n") == 0 ? 0 : buffer_.find("\r\n\r\n");
+            if (headerEnd == std::string::npos) {
+                if (buffer_.size() > kMaxHeaderBytes) {
+                    finish(Verdict::ALLOWED);
+                }
+                break;
+            }
+            buffer_.erase(0, headerEnd == 0 ? 2 : headerEnd + 4);
+            stage_ = Stage::PART_CONTENT;
+            partBytes_ = 0;
+        }
+    }
+
+    if (verdict_ == Verdict::PENDING && lengthKnown_ && bodyRemaining_ == 0) {
+        finish(Verdict::ALLOWED);
+    }
+}
+
+void UploadLimit::addPartBytes(uint64_t length) {
+    partBytes_ += length;
+    if (partBytes_ > maxFileSize_) {
+        rejectedSize_ = partBytes_;
+        finish(Verdict::TOO_LARGE);
+    }
+}
+
+} // namespace webserver
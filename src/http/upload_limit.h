@@ -0,0 +1,117 @@
+#pragma once
+
+#include <string>
+#include <cstddef>
+#include <cstdint>
+
+namespace webserver {
+
+/**
+ * @brief 按请求检查上传的文件大小
+ *
+ * 按顺序输入连接上收到的请求数据（可以分任意多次），请求头完整之后：
+ * 普通请求检查Content-Length；multipart/form-data请求的Content-Length包含所有部分，
+ * 不超过限制时直接通过，否则继续检查消息体，每个部分的内容超过限制时拒绝
+ */
+class UploadLimit {
+public:
+    /**
+     * @brief 检查结果
+     */
+    enum class Verdict {
+        PENDING,     ///< 还需要更多数据才能判断
+        ALLOWED,     ///< 请求没有超过限制，不再需要检查
+        TOO_LARGE    ///< 请求或者其中的一个文件超过限制
+    };
+
+    /**
+     * @brief 开始检查一个新请求
+     * @param maxFileSize 最大文件大小
+     * @param streamOffset 请求的第一个字节在连接接收的字节流中的位置
+     */
+    void reset(size_t maxFileSize, uint64_t streamOffset);
+
+    /**
+     * @brief 输入接着已经检查过的数据之后收到的请求数据
+     * @return 检查结果
+     */
+    Verdict feed(const char* data, size_t length);
+
+    /**
+     * @brief 跳过一段没有检查就被读取的数据，全部计入当前部分的大小（只会多算，不会漏掉超过限制的文件）
+     * @return 检查结果
+     */
+    Verdict skip(uint64_t length);
+
+    /**
+     * @brief 获取当前的检查结果
+     */
+    Verdict getVerdict() const noexcept { return verdict_; }
+
+    /**
+     * @brief 是否已经收到了请求头的一部分，正在等待其余的请求头
+     */
+    bool awaitingHeaders() const noexcept {
+        return verdict_ == Verdict::PENDING && stage_ == Stage::HEADERS && position_ > streamOffset_;
+    }
+
+    /**
+     * @brief 已经检查（或跳过）的数据结束在连接接收的字节流中的位置
+     */
+    uint64_t position() const noexcept { return position_; }
+
+    /**
+     * @brief 超过限制的大小：普通请求为Content-Length，multipart为超过限制时该部分已经收到的字节数
+     */
+    uint64_t getRejectedSize() const noexcept { return rejectedSize_; }
+
+private:
+    /**
+     * @brief 检查阶段
+     */
+    enum class Stage {
+        HEADERS,          ///< 请求头
+        PART_HEADERS,     ///< multipart中一个部分的头部
+        PART_CONTENT,     ///< multipart中一个部分的内容
+        PART_DELIMITER    ///< 分隔符之后的两个字节（\r\n表示还有下一个部分，--表示结束）
+    };
+
+    /**
+     * @brief 解析完整的请求头，决定是否需要继续检查消息体
+     * @param headers 请求行和所有头部，不包括结尾的空行
+     */
+    void parseHeaders(const std::string& headers);
+
+    /**
+     * @brief 检查消息体中的数据，Content-Length之后的数据属于下一个请求，不检查
+     */
+    void scanBody(const char* data, size_t length);
+
+    /**
+     * @brief 累加当前部分的大小，超过限制时拒绝
+     */
+    void addPartBytes(uint64_t length);
+
+    void finish(Verdict verdict) noexcept {
+        verdict_ = verdict;
+        buffer_.clear();
+    }
+
+private:
+    size_t maxFileSize_{0};
+    uint64_t streamOffset_{0};
+    uint64_t position_{0};
+    Verdict verdict_{Verdict::ALLOWED};
+    Stage stage_{Stage::HEADERS};
+
+    std::string buffer_;            ///< 还没有完整的请求头、部分头部，或者可能是分隔符开头的数据
+    std::string delimiter_;         ///< 部分之间的分隔符"\r\n--boundary"
+    bool lengthKnown_{false};       ///< 请求有Content-Length
+    uint64_t bodyRemaining_{0};     ///< 消息体中还没有检查的字节数
+    uint64_t partBytes_{0};         ///< 当前部分已经收到的内容字节数
+    uint64_t rejectedSize_{0};
+
+    static constexpr size_t kMaxHeaderBytes = 64 * 1024;   ///< 请求头或部分头部超过该长度时不再检查，由接收处理器报告错误
+};
+
+} // namespace webserver
@@ -6,6 +6,8 @@
 #include <string>
 #include <netinet/in.h>
 
+#include "../http/upload_limit.h"
+
 namespace webserver {
 
 /**
@@ -130,6 +132,57 @@ public:
      */
     uint64_t getRequestCount() const noexcept { return requestCount_.load(); }
     
+    /**
+     * @brief 标记连接是否正在进行批量传输（大文件上传或下载）
+     * @param bulk true表示正在批量传输
+     */
+    void setBulkTransfer(bool bulk) noexcept { bulkTransfer_.store(bulk); }
+    
+    /**
+     * @brief 检查连接是否正在进行批量传输，分发事件时用于选择线程池队列
+     * @return true表示正在批量传输
+     */
+    bool isBulkTransfer() const noexcept { return bulkTransfer_.load(); }
+    
+    /**
+     * @brief 记录内核统计的累计收发字节数，返回和上次记录之间的差值，用于按实际收发的字节数扣除限速令牌
+     * @param sending true表示发送（对方已经确认的字节数），false表示接收
+     * @param total 内核统计的累计字节数
+     * @return 上次记录之后新收发的字节数，累计值变小（fd被新的连接复用）时返回0
+     */
+    uint64_t advanceTransferred(bool sending, uint64_t total) noexcept {
+        uint64_t last = (sending ? bytesSent_ : bytesReceived_).exchange(total);
+        return total > last ? total - last : 0;
+    }
+    
+    /**
+     * @brief 新请求开始时记录内核统计的累计收发字节数，并清除上一个请求的批量传输标记
+     * @param received 累计接收字节数
+     * @param sent 累计发送（已确认）字节数
+     */
+    void beginRequest(uint64_t received, uint64_t sent) noexcept {
+        requestStartReceived_.store(received);
+        requestStartSent_.store(sent);
+        bulkTransfer_.store(false);
+    }
+    
+    /**
+     * @brief 当前请求已经收发的字节数
+     * @param sending true表示发送
+     * @param total 内核统计的累计字节数
+     * @return 请求开始之后收发的字节数
+     */
+    uint64_t requestTransferred(bool sending, uint64_t total) const noexcept {
+        uint64_t start = (sending ? requestStartSent_ : requestStartReceived_).load();
+        return total > start ? total - start : 0;
+    }
+    
+    /**
+     * @brief 当前请求的上传大小检查，只由主线程在分发接收处理器之前使用
+     * @return 上传大小检查
+     */
+    UploadLimit& uploadLimit() noexcept { return uploadLimit_; }
+    
     /**
      * @brief 关闭连接
      */
@@ -152,6 +205,12 @@ private:
     std::chrono::steady_clock::time_point lastActivity_;      ///< 最后活动时间
     
     std::atomic<uint64_t> requestCount_{0};                   ///< 请求计数
+    std::atomic<bool> bulkTransfer_{false};                   ///< 是否正在批量传输
+    std::atomic<uint64_t> bytesReceived_{0};                  ///< 上次扣除令牌时内核统计的累计接收字节数
+    std::atomic<uint64_t> bytesSent_{0};                      ///< 上次扣除令牌时内核统计的累计发送（已确认）字节数
+    std::atomic<uint64_t> requestStartReceived_{0};           ///< 当前请求开始时的累计接收字节数
+    std::atomic<uint64_t> requestStartSent_{0};               ///< 当前请求开始时的累计发送字节数
+    UploadLimit uploadLimit_;                                  ///< 当前请求的上传大小检查
 };
 
 } // namespace webserver
\ No newline at end of file
@@ -1,25 +1,85 @@
 #include "thread_pool.h"
+#include "../../affinity/cpuaffinity.h"
 #include <iostream>
+#include <fstream>
+#include <string>
+#include <algorithm>
+#include <stdexcept>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 namespace webserver {
 
+namespace {
+
+/**
+ * @brief 保留四分之一（至少一个）线程只执行交互任务，只有一个线程时无法保留
+ */
+size_t bulkLimitFor(size_t threads) noexcept {
+    return threads > 1 ? threads - std::max<size_t>(1, threads / 4) : 1;
+}
+
+/**
+ * @brief 读取当前线程使用CPU和在运行队列中等待CPU的时间（微秒）
+ * @param schedFd 线程的/proc/thread-self/schedstat，不可用时用CLOCK_THREAD_CPUTIME_ID，等待时间为0
+ */
+void sampleThreadTime(int schedFd, int64_t& cpuMicros, int64_t& waitMicros) noexcept {
+    char buffer[128];
+    ssize_t n = schedFd < 0 ? -1 : pread(schedFd, buffer, sizeof(buffer) - 1, 0);
+    if (n > 0) {
+        buffer[n] = '\0';
+        long long cpuNanos = 0;
+        long long waitNanos = 0;
+        if (std::sscanf(buffer, "%lld %lld", &cpuNanos, &waitNanos) == 2) {
+            cpuMicros = cpuNanos / 1000;
+            waitMicros = waitNanos / 1000;
+            return;
+        }
+    }
+    timespec ts{};
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    cpuMicros = static_cast<int64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+    waitMicros = 0;
+}
+
+/**
+ * @brief 读取cgroup v2的cpu.max
+ * @return 配额对应的CPU数（向上取整），没有限制或者读取失败时返回0
+ */
+size_t readCpuMax(const std::string& path) {
+    std::ifstream in(path);
+    std::string quota;
+    long long period = 0;
+    if (!(in >> quota >> period) || quota == "max" || period <= 0) {
+        return 0;
+    }
+    long long quotaMicros = std::atoll(quota.c_str());
+    if (quotaMicros <= 0) {
+        return 0;
+    }
+    return static_cast<size_t>(std::max(1LL, (quotaMicros + period - 1) / period));
+}
+
+} // namespace
+
 ThreadPool::ThreadPool(size_t numThreads, size_t maxQueueSize)
-    : maxQueueSize_(maxQueueSize) {
+    : cpus_(availableCpus())
+    , maxQueueSize_(maxQueueSize) {
     
     if (numThreads == 0) {
-        numThreads = std::thread::hardware_concurrency();
-        if (numThreads == 0) {
-            numThreads = 4; // 默认值
-        }
+        numThreads = cpus_;
     }
     
-    threads_.reserve(numThreads);
-    
+    std::unique_lock<std::mutex> lock(queueMutex_);
     try {
-        for (size_t i = 0; i < numThreads; ++i) {
-            threads_.emplace_back(&ThreadPool::workerThread, this);
-        }
+        resizeLocked(numThreads);
     } catch (...) {
+        lock.unlock();
         shutdown(false);
         throw;
     }
@@ -63,33 +123,268 @@ void ThreadPool::shutdown(bool waitForCompletion) noexcept {
 
 size_t ThreadPool::getQueueSize() const noexcept {
     std::unique_lock<std::mutex> lock(queueMutex_);
-    return tasks_.size();
+    return tasks_.size() + bulkTasks_.size();
+}
+
+bool ThreadPool::hasRunnableTask() const noexcept {
+    return !tasks_.empty() || (!bulkTasks_.empty() && bulkActive_ < bulkLimit_);
+}
+
+void ThreadPool::setQueueDelayTarget(std::chrono::microseconds target, std::chrono::microseconds interval) {
+    std::unique_lock<std::mutex> lock(queueMutex_);
+    delayTarget_ = std::max(target, std::chrono::microseconds(0));
+    delayInterval_ = std::max(interval, delayTarget_);
+    intervalEnd_ = std::chrono::steady_clock::now() + delayInterval_;
+    minDelay_ = std::chrono::microseconds::max();
+    overloaded_ = false;
+}
+
+bool ThreadPool::isOverloaded() {
+    std::unique_lock<std::mutex> lock(queueMutex_);
+    if (delayTarget_.count() == 0) {
+        return false;
+    }
+    auto now = std::chrono::steady_clock::now();
+    auto headDelay = tasks_.empty() ? std::chrono::microseconds(0)
+                                    : std::chrono::duration_cast<std::chrono::microseconds>(now - tasks_.front().enqueued);
+    // 过载状态只在取出交互任务时更新，暂停接受连接后可能不再有任务取出，窗口结束且队首没有超过目标时直接退出
+    if (overloaded_ && now >= intervalEnd_ && headDelay <= delayTarget_) {
+        overloaded_ = false;
+        minDelay_ = std::chrono::microseconds::max();
+        intervalEnd_ = now + delayInterval_;
+    }
+    return overloaded_ || headDelay > delayInterval_;
+}
+
+void ThreadPool::trackQueueDelay(std::chrono::microseconds sojourn, std::chrono::steady_clock::time_point now) noexcept {
+    if (delayTarget_.count() == 0) {
+        return;
+    }
+    // 取出后队列为空，说明积压已经排空
+    minDelay_ = std::min(minDelay_, tasks_.empty() ? std::chrono::microseconds(0) : sojourn);
+    if (now >= intervalEnd_) {
+        // 整个时间窗口内最短的排队时间都超过目标，说明队列一直没有排空
+        overloaded_ = minDelay_ != std::chrono::microseconds::max() && minDelay_ > delayTarget_;
+        minDelay_ = std::chrono::microseconds::max();
+        intervalEnd_ = now + delayInterval_;
+    }
+}
+
+void ThreadPool::setAdaptiveBounds(size_t minThreads, size_t maxThreads) {
+    if (minThreads == 0 || minThreads > maxThreads) {
+        throw std::invalid_argument("Invalid adaptive thread bounds");
+    }
+    std::unique_lock<std::mutex> lock(queueMutex_);
+    adaptive_ = true;
+    minThreads_ = minThreads;
+    maxThreads_ = maxThreads;
+    adjustEnd_ = std::chrono::steady_clock::now() + kAdjustInterval;
+    adjustMinDelay_ = std::chrono::microseconds::max();
+    busyMicros_.store(0);
+    blockedMicros_.store(0);
+    // 同时唤醒等待中的线程，之后按调整周期超时等待
+    resizeLocked(std::clamp(targetThreads_.load(), minThreads, maxThreads));
+}
+
+ThreadPool::AdaptiveStats ThreadPool::getAdaptiveStats() const {
+    std::unique_lock<std::mutex> lock(queueMutex_);
+    return AdaptiveStats{targetThreads_.load(), threads_.size(), minThreads_, maxThreads_, cpus_,
+                         grown_, shrunk_, blockedPercent_, utilization_, lastAdjust_};
+}
+
+size_t ThreadPool::availableCpus() {
+    size_t cpus = 0;
+    cpu_set_t cpuSet;
+    CPU_ZERO(&cpuSet);
+    if (sched_getaffinity(0, sizeof(cpuSet), &cpuSet) == 0) {
+        cpus = static_cast<size_t>(CPU_COUNT(&cpuSet));
+    }
+    if (cpus == 0) {
+        cpus = std::thread::hardware_concurrency();
+    }
+    
+    // cgroup v2中进程所在的cgroup（"0::/路径"），配额由该cgroup和所有上级cgroup中最小的一个决定
+    std::ifstream in("/proc/self/cgroup");
+    std::string line;
+    std::string cgroupPath;
+    while (std::getline(in, line)) {
+        if (line.compare(0, 3, "0::") == 0) {
+            cgroupPath = line.substr(3);
+            break;
+        }
+    }
+    while (!cgroupPath.empty()) {
+        size_t quotaCpus = readCpuMax("/sys/fs/cgroup" + (cgroupPath == "/" ? std::string() : cgroupPath) + "/cpu.max");
+        if (quotaCpus > 0 && (cpus == 0 || quotaCpus < cpus)) {
+            cpus = quotaCpus;
+        }
+        if (cgroupPath == "/") {
+            break;
+        }
+        auto slashIndex = cgroupPath.rfind('/');
+        cgroupPath = (slashIndex == 0 || slashIndex == std::string::npos) ? "/" : cgroupPath.substr(0, slashIndex);
+    }
+    return std::max<size_t>(cpus, 1);
+}
+
+void ThreadPool::setCpuAffinity(const cpu_set_t& cpuSet) {
+    {
+        std::unique_lock<std::mutex> lock(queueMutex_);
+        cpuSet_ = cpuSet;
+        ++affinityGeneration_;
+    }
+    // 唤醒等待中的线程绑定自己，正在执行任务的线程执行完成后绑定
+    condition_.notify_all();
+}
+
+std::string ThreadPool::getCpuAffinity() const {
+    std::unique_lock<std::mutex> lock(queueMutex_);
+    return affinityGeneration_ > 0 ? CpuAffinity::format(cpuSet_) : std::string();
 }
 
-void ThreadPool::workerThread() {
+void ThreadPool::applyAffinityLocked(uint64_t& appliedGeneration) noexcept {
+    if (appliedGeneration == affinityGeneration_) {
+        return;
+    }
+    appliedGeneration = affinityGeneration_;
+    if (CpuAffinity::bindCurrentThread(cpuSet_) != 0) {
+        std::cerr << "Failed to bind thread pool worker to CPUs " << CpuAffinity::format(cpuSet_) << std::endl;
+    }
+}
+
+void ThreadPool::notifyWorkers() {
+    if (hasParked_.load()) {
+        condition_.notify_all();
+    } else {
+        condition_.notify_one();
+    }
+}
+
+void ThreadPool::resizeLocked(size_t threads) {
+    // 关闭后不再创建线程，shutdown在不持有锁时遍历threads_
+    while (threads_.size() < threads && !shutdown_.load()) {
+        threads_.emplace_back(&ThreadPool::workerThread, this, threads_.size());
+    }
+    threads = std::min(threads, threads_.size());
+    targetThreads_.store(threads);
+    hasParked_.store(threads_.size() > threads);
+    bulkLimit_ = bulkLimitFor(threads);
+    // 暂停的线程检查自己的序号，新的线程数下可以运行的线程开始取出任务
+    condition_.notify_all();
+}
+
+void ThreadPool::adjustLocked(std::chrono::steady_clock::time_point now) {
+    if (!adaptive_ || now < adjustEnd_ || shutdown_.load()) {
+        return;
+    }
+    auto window = std::chrono::duration_cast<std::chrono::microseconds>(kAdjustInterval + (now - adjustEnd_)).count();
+    size_t threads = targetThreads_.load();
+    int64_t busy = busyMicros_.exchange(0);
+    int64_t blocked = blockedMicros_.exchange(0);
+    blockedPercent_ = busy > 0 ? static_cast<unsigned>(blocked * 100 / busy) : 0;
+    utilization_ = static_cast<unsigned>(std::min<int64_t>(100, busy * 100 / (window * static_cast<int64_t>(threads))));
+    
+    // 整个周期内最短的排队时间仍然超过阈值，或者周期内没有取出任务但队列中的任务已经等待超过阈值，说明一直有排队
+    bool queued = adjustMinDelay_ != std::chrono::microseconds::max()
+        ? adjustMinDelay_ > kGrowDelay
+        : (!tasks_.empty() && now - tasks_.front().enqueued > kGrowDelay);
+    queued = queued || (!bulkTasks_.empty() && bulkActive_ < bulkLimit_ && now - bulkTasks_.front().enqueued > kGrowDelay);
+    // 周期内没有任务完成时无法计算阻塞时间，线程都被长时间的任务占用，按阻塞处理
+    bool blockedHigh = busy == 0 || blockedPercent_ >= kBlockedHigh;
+    bool cpuBound = busy > 0 && blockedPercent_ < kBlockedLow;
+    
+    size_t target = threads;
+    const char* reason = nullptr;
+    if (queued && threads < maxThreads_ && (blockedHigh || threads < cpus_)) {
+        target = threads + 1;
+        reason = blockedHigh ? "grow-blocked" : "grow-cpu";
+    } else if (queued && cpuBound && threads > std::max(minThreads_, cpus_)) {
+        // 任务主要在使用CPU且线程数超过CPU数，再增加线程只会加剧CPU的争用
+        target = threads - 1;
+        reason = "shrink-cpu-bound";
+    } else if (!queued && utilization_ < kIdleUtilization && threads > minThreads_) {
+        target = threads - 1;
+        reason = "shrink-idle";
+    }
+    adjustMinDelay_ = std::chrono::microseconds::max();
+    adjustEnd_ = now + kAdjustInterval;
+    if (reason == nullptr) {
+        return;
+    }
+    
+    if (target > threads) {
+        ++grown_;
+    } else {
+        ++shrunk_;
+    }
+    lastAdjust_ = reason;
+    try {
+        resizeLocked(target);
+    } catch (const std::exception& e) {
+        std::cerr << "Failed to grow thread pool: " << e.what() << std::endl;
+    }
+}
+
+void ThreadPool::workerThread(size_t index) {
+    // 线程的调度统计，用于区分阻塞和等待CPU的时间
+    int schedFd = open("/proc/thread-self/schedstat", O_RDONLY | O_CLOEXEC);
+    uint64_t appliedGeneration = 0;
+    
     while (true) {
         std::function<void()> task;
+        bool isBulk = false;
         
         {
             std::unique_lock<std::mutex> lock(queueMutex_);
             
-            condition_.wait(lock, [this] {
-                return shutdown_.load() || !tasks_.empty();
-            });
+            // 序号不小于线程数的线程暂停。启用自适应线程数时每个调整周期超时一次，空闲时也可以减少线程
+            auto ready = [this, index] {
+                return (index < targetThreads_.load() && hasRunnableTask()) ||
+                       (shutdown_.load() && tasks_.empty() && bulkTasks_.empty());
+            };
+            applyAffinityLocked(appliedGeneration);
+            while (!ready()) {
+                applyAffinityLocked(appliedGeneration);
+                if (!adaptive_) {
+                    condition_.wait(lock);
+                } else if (condition_.wait_for(lock, kAdjustInterval) == std::cv_status::timeout) {
+                    adjustLocked(std::chrono::steady_clock::now());
+                }
+            }
             
-            if (shutdown_.load() && tasks_.empty()) {
+            if (shutdown_.load() && tasks_.empty() && bulkTasks_.empty()) {
                 break;
             }
             
-            if (!tasks_.empty()) {
-                task = std::move(tasks_.front());
+            // 优先取交互任务，连续取了kInteractiveWeight个交互任务后穿插一个批量任务，批量任务不会被饿死
+            bool bulkAllowed = !bulkTasks_.empty() && bulkActive_ < bulkLimit_;
+            isBulk = bulkAllowed && (tasks_.empty() || interactiveStreak_ >= kInteractiveWeight);
+            if (isBulk) {
+                task = std::move(bulkTasks_.front().fn);
+                bulkTasks_.pop();
+                ++bulkActive_;
+                interactiveStreak_ = 0;
+            } else if (!tasks_.empty()) {
+                auto now = std::chrono::steady_clock::now();
+                auto sojourn = std::chrono::duration_cast<std::chrono::microseconds>(now - tasks_.front().enqueued);
+                task = std::move(tasks_.front().fn);
                 tasks_.pop();
+                ++interactiveStreak_;
+                trackQueueDelay(sojourn, now);
+                if (adaptive_) {
+                    adjustMinDelay_ = std::min(adjustMinDelay_, tasks_.empty() ? std::chrono::microseconds(0) : sojourn);
+                }
             }
+            adjustLocked(std::chrono::steady_clock::now());
         }
         
         if (task) {
             activeThreads_.fetch_add(1);
             
+            // 执行时间中既没有使用CPU也没有等待CPU的部分为阻塞（等待磁盘、锁等）的时间
+            int64_t startCpu = 0, startWait = 0, endCpu = 0, endWait = 0;
+            auto startTime = std::chrono::steady_clock::now();
+            sampleThreadTime(schedFd, startCpu, startWait);
             try {
                 task();
             } catch (const std::exception& e) {
@@ -97,10 +392,28 @@ void ThreadPool::workerThread() {
             } catch (...) {
                 std::cerr << "Unknown exception in thread pool task" << std::endl;
             }
+            sampleThreadTime(schedFd, endCpu, endWait);
+            int64_t wall = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - startTime).count();
+            busyMicros_.fetch_add(wall);
+            blockedMicros_.fetch_add(std::max<int64_t>(0, wall - (endCpu - startCpu) - (endWait - startWait)));
             
             activeThreads_.fetch_sub(1);
             completedTasks_.fetch_add(1);
         }
+        
+        // 批量任务执行完成后，等待批量任务的线程可以继续取出
+        if (isBulk) {
+            {
+                std::unique_lock<std::mutex> lock(queueMutex_);
+                --bulkActive_;
+            }
+            condition_.notify_all();
+        }
+    }
+    
+    if (schedFd >= 0) {
+        close(schedFd);
     }
 }
 
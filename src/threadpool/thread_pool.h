@@ -10,9 +10,21 @@
 #include <atomic>
 #include <memory>
 #include <type_traits>
+#include <chrono>
+#include <string>
+
+#include <sched.h>
 
 namespace webserver {
 
+/**
+ * @brief 任务的调度优先级
+ */
+enum class TaskPriority {
+    Interactive,    ///< 交互请求（文件列表、删除、元数据、小文件），优先处理
+    Bulk            ///< 批量传输（大文件上传和下载的后续事件）
+};
+
 /**
  * @brief 现代化的线程池实现
  * 
@@ -22,16 +34,23 @@ namespace webserver {
  * - 异常安全
  * - 优雅关闭
  * - 线程安全的统计信息
+ * - 交互和批量两个队列：优先执行交互任务，按权重穿插执行批量任务，
+ *   并保留部分线程只执行交互任务，所有其他线程都在传输大文件时交互请求也不需要排队
+ * - CoDel风格的过载检测：记录交互任务的排队时间，一个时间窗口内最短的排队时间仍然超过目标时进入过载状态，
+ *   服务器据此对新请求快速返回503并暂停接受连接
+ * - 默认线程数为进程可以使用的CPU数（cgroup v2 cpu.max配额和CPU亲和性中较小的一个）
+ * - 自适应线程数：按排队时间和任务阻塞的时间（墙钟时间减去使用CPU和等待CPU的时间）在[min, max]内调整，
+ *   减少的线程暂停而不退出，之后增加时优先恢复
+ * - 可以把所有线程绑定到一个CPU集合，线程在下一次取任务之前绑定自己，并把内存分配策略设置为本地NUMA节点
  */
 class ThreadPool {
 public:
     /**
      * @brief 构造函数
-     * @param numThreads 线程数量，默认为硬件并发数
+     * @param numThreads 线程数量，0表示按可以使用的CPU数（见availableCpus）
      * @param maxQueueSize 最大队列长度，0表示无限制
      */
-    explicit ThreadPool(size_t numThreads = std::thread::hardware_concurrency(),
-                       size_t maxQueueSize = 0);
+    explicit ThreadPool(size_t numThreads = 0, size_t maxQueueSize = 0);
     
     /**
      * @brief 析构函数，等待所有任务完成并关闭线程池
@@ -64,6 +83,16 @@ public:
     template<typename F>
     void submit(F&& f);
     
+    /**
+     * @brief 按优先级提交任务到线程池（无返回值版本）
+     * @tparam F 可调用对象类型
+     * @param priority 任务优先级
+     * @param f 可调用对象
+     * @throws std::runtime_error 线程池已关闭或队列已满时抛出异常
+     */
+    template<typename F>
+    void submitWithPriority(TaskPriority priority, F&& f);
+    
     /**
      * @brief 关闭线程池
      * @param waitForCompletion 是否等待所有任务完成
@@ -78,9 +107,9 @@ public:
     
     /**
      * @brief 获取线程数量
-     * @return 线程数量
+     * @return 可以执行任务的线程数量，不包括暂停的线程
      */
-    size_t getThreadCount() const noexcept { return threads_.size(); }
+    size_t getThreadCount() const noexcept { return targetThreads_.load(); }
     
     /**
      * @brief 获取队列中待处理任务数量
@@ -99,16 +128,180 @@ public:
      * @return 任务总数
      */
     uint64_t getCompletedTaskCount() const noexcept { return completedTasks_.load(); }
+    
+    /**
+     * @brief 获取最多同时执行的批量任务数量
+     * @return 批量任务线程数，其余线程只执行交互任务
+     */
+    size_t getBulkThreadLimit() const noexcept { return bulkLimit_; }
+
+    /**
+     * @brief 设置过载检测的排队时间目标和时间窗口
+     * @param target 排队时间目标，为0时关闭过载检测
+     * @param interval 时间窗口
+     */
+    void setQueueDelayTarget(std::chrono::microseconds target, std::chrono::microseconds interval);
+    
+    /**
+     * @brief 检查线程池是否过载
+     * @return true表示最近一个时间窗口内排队时间一直超过目标，或者最早的交互任务已经等待超过一个时间窗口
+     * @note 窗口结束后队首没有超过目标时在这里退出过载状态，暂停接受连接后没有任务取出也能恢复
+     */
+    bool isOverloaded();
+    
+    /**
+     * @brief 启用自适应线程数
+     * @param minThreads 最少线程数
+     * @param maxThreads 最多线程数
+     * @throws std::invalid_argument minThreads为0或者大于maxThreads时抛出异常
+     */
+    void setAdaptiveBounds(size_t minThreads, size_t maxThreads);
+    
+    /**
+     * @brief 自适应线程数的状态和调整记录
+     */
+    struct AdaptiveStats {
+        size_t threads;             ///< 可以执行任务的线程数
+        size_t spawnedThreads;      ///< 已经创建的线程数（包括暂停的线程）
+        size_t minThreads;
+        size_t maxThreads;
+        size_t cpus;                ///< 可以使用的CPU数
+        uint64_t grown;             ///< 增加线程的次数
+        uint64_t shrunk;            ///< 减少线程的次数
+        unsigned blockedPercent;    ///< 上一个调整周期内阻塞时间占执行时间的百分比
+        unsigned utilization;       ///< 上一个调整周期内的线程利用率（百分比）
+        const char* lastAdjust;     ///< 上一次调整的原因
+    };
+    
+    /**
+     * @brief 获取自适应线程数的状态
+     * @return 状态的快照
+     */
+    AdaptiveStats getAdaptiveStats() const;
+    
+    /**
+     * @brief 将所有线程（包括之后增加的线程）绑定到CPU集合
+     * @param cpuSet CPU集合
+     */
+    void setCpuAffinity(const cpu_set_t& cpuSet);
+    
+    /**
+     * @brief 获取绑定的CPU集合
+     * @return cpulist格式的CPU集合，没有绑定时为空字符串
+     */
+    std::string getCpuAffinity() const;
+    
+    /**
+     * @brief 进程可以使用的CPU数
+     * @return cgroup v2 cpu.max的配额（向上取整，包括上级cgroup）和CPU亲和性中的CPU数中较小的一个，至少为1
+     */
+    static size_t availableCpus();
+
+    /// 两个队列都有任务时，每执行一个批量任务之前最多连续执行的交互任务数
+    static constexpr size_t kInteractiveWeight = 4;
+    
+    /// 自适应线程数的调整周期
+    static constexpr std::chrono::milliseconds kAdjustInterval{500};
+    
+    /// 调整周期内最短的排队时间超过该值时认为一直有排队
+    static constexpr std::chrono::microseconds kGrowDelay{5000};
+    
+    /// 阻塞时间占比不低于该值（百分比）时增加线程可以提高吞吐，低于kBlockedLow时认为任务主要在使用CPU
+    static constexpr unsigned kBlockedHigh = 50;
+    static constexpr unsigned kBlockedLow = 25;
+    
+    /// 没有排队且线程利用率（百分比）低于该值时减少线程
+    static constexpr unsigned kIdleUtilization = 50;
 
 private:
     /**
      * @brief 工作线程函数
+     * @param index 线程的序号，序号不小于targetThreads_时暂停
+     */
+    void workerThread(size_t index);
+    
+    /**
+     * @brief 修改可以执行任务的线程数，需要时创建新的线程，调用前需要持有queueMutex_
+     * @param threads 新的线程数
+     */
+    void resizeLocked(size_t threads);
+    
+    /**
+     * @brief 到达调整周期时按排队时间和阻塞时间调整线程数，调用前需要持有queueMutex_
+     * @param now 当前时间
+     */
+    void adjustLocked(std::chrono::steady_clock::time_point now);
+    
+    /**
+     * @brief 通知等待的线程有新的任务，有暂停的线程时通知所有线程，避免只唤醒暂停的线程
+     */
+    void notifyWorkers();
+    
+    /**
+     * @brief CPU集合修改后在当前线程中绑定，调用前需要持有queueMutex_
+     * @param appliedGeneration 当前线程已经绑定的版本
+     */
+    void applyAffinityLocked(uint64_t& appliedGeneration) noexcept;
+    
+    /**
+     * @brief 是否有可以取出的任务，调用前需要持有queueMutex_
+     * @return true表示有可以执行的任务
+     */
+    bool hasRunnableTask() const noexcept;
+    
+    /**
+     * @brief 记录取出的交互任务的排队时间并更新过载状态，调用前需要持有queueMutex_
+     * @param sojourn 排队时间
+     * @param now 当前时间
+     */
+    void trackQueueDelay(std::chrono::microseconds sojourn, std::chrono::steady_clock::time_point now) noexcept;
+    
+    /**
+     * @brief 队列中的任务和加入队列的时间
      */
-    void workerThread();
+    struct QueuedTask {
+        std::function<void()> fn;
+        std::chrono::steady_clock::time_point enqueued;
+        
+        template<typename F>
+        explicit QueuedTask(F&& f) : fn(std::forward<F>(f)), enqueued(std::chrono::steady_clock::now()) {}
+    };
     
 private:
     std::vector<std::thread> threads_;                    ///< 工作线程
-    std::queue<std::function<void()>> tasks_;            ///< 任务队列
+    std::queue<QueuedTask> tasks_;                       ///< 交互任务队列
+    std::queue<QueuedTask> bulkTasks_;                   ///< 批量任务队列
+    size_t bulkLimit_{1};                                ///< 最多同时执行的批量任务数
+    size_t bulkActive_{0};                               ///< 正在执行的批量任务数
+    size_t interactiveStreak_{0};                        ///< 上次执行批量任务后连续取出的交互任务数
+    
+    // 过载检测，在持有queueMutex_时修改
+    std::chrono::microseconds delayTarget_{0};           ///< 排队时间目标，0表示关闭
+    std::chrono::microseconds delayInterval_{0};         ///< 时间窗口
+    std::chrono::steady_clock::time_point intervalEnd_;  ///< 当前时间窗口结束的时间
+    std::chrono::microseconds minDelay_{std::chrono::microseconds::max()}; ///< 当前时间窗口内最短的排队时间
+    bool overloaded_{false};                             ///< 上一个时间窗口内排队时间是否一直超过目标
+    
+    // 自适应线程数，在持有queueMutex_时修改
+    std::atomic<size_t> targetThreads_{0};               ///< 可以执行任务的线程数
+    std::atomic<bool> hasParked_{false};                 ///< 是否有暂停的线程
+    bool adaptive_{false};                               ///< 是否启用自适应线程数
+    size_t minThreads_{0};
+    size_t maxThreads_{0};
+    size_t cpus_{1};                                     ///< 可以使用的CPU数
+    std::chrono::steady_clock::time_point adjustEnd_;    ///< 当前调整周期结束的时间
+    std::chrono::microseconds adjustMinDelay_{std::chrono::microseconds::max()}; ///< 当前调整周期内最短的排队时间
+    uint64_t grown_{0};
+    uint64_t shrunk_{0};
+    unsigned blockedPercent_{0};
+    unsigned utilization_{0};
+    const char* lastAdjust_{"none"};
+    std::atomic<int64_t> busyMicros_{0};                 ///< 当前调整周期内执行任务的墙钟时间
+    std::atomic<int64_t> blockedMicros_{0};              ///< 当前调整周期内执行任务时阻塞的时间
+    
+    // CPU绑定，在持有queueMutex_时修改
+    cpu_set_t cpuSet_{};                                 ///< 绑定的CPU集合
+    uint64_t affinityGeneration_{0};                     ///< 每次修改CPU集合时加1，0表示不绑定
     
     mutable std::mutex queueMutex_;                      ///< 队列互斥锁
     std::condition_variable condition_;                   ///< 条件变量
@@ -146,19 +339,24 @@ auto ThreadPool::submit(F&& f, Args&&... args)
             throw std::runtime_error("ThreadPool is shutdown");
         }
         
-        if (maxQueueSize_ > 0 && tasks_.size() >= maxQueueSize_) {
+        if (maxQueueSize_ > 0 && tasks_.size() + bulkTasks_.size() >= maxQueueSize_) {
             throw std::runtime_error("ThreadPool queue is full");
         }
         
         tasks_.emplace([task]() { (*task)(); });
     }
     
-    condition_.notify_one();
+    notifyWorkers();
     return future;
 }
 
 template<typename F>
 void ThreadPool::submit(F&& f) {
+    submitWithPriority(TaskPriority::Interactive, std::forward<F>(f));
+}
+
+template<typename F>
+void ThreadPool::submitWithPriority(TaskPriority priority, F&& f) {
     if (shutdown_.load()) {
         throw std::runtime_error("ThreadPool is shutdown");
     }
@@ -170,14 +368,18 @@ void ThreadPool::submit(F&& f) {
             throw std::runtime_error("ThreadPool is shutdown");
         }
         
-        if (maxQueueSize_ > 0 && tasks_.size() >= maxQueueSize_) {
+        if (maxQueueSize_ > 0 && tasks_.size() + bulkTasks_.size() >= maxQueueSize_) {
             throw std::runtime_error("ThreadPool queue is full");
         }
         
-        tasks_.emplace(std::forward<F>(f));
+        if (priority == TaskPriority::Bulk) {
+            bulkTasks_.emplace(std::forward<F>(f));
+        } else {
+            tasks_.emplace(std::forward<F>(f));
+        }
     }
     
-    condition_.notify_one();
+    notifyWorkers();
 }
 
 } // namespace webserver
\ No newline at end of file
@@ -0,0 +1,664 @@
+#include <fstream>
+#include <sstream>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+
+#include "dedupstore.h"
+#include "pagecache.h"
+#include "../utils/utils.h"
+
+namespace {
+
+// 分块长度：最小 16KB，平均 64KB，最大 256KB
+const size_t CHUNK_MIN_SIZE = 16 * 1024;
+const size_t CHUNK_AVG_SIZE = 64 * 1024;
+const size_t CHUNK_MAX_SIZE = 256 * 1024;
+
+// 归一化分块：平均长度之前使用更难满足的掩码（18 位），之后使用更容易满足的掩码（14 位），使块长度集中在平均长度附近
+const uint64_t MASK_SMALL = ~0ULL << (64 - 18);
+const uint64_t MASK_LARGE = ~0ULL << (64 - 14);
+
+// gear 哈希使用的随机表，使用固定种子生成，保证每次启动切分的结果都相同
+struct GearTable{
+    uint64_t table[256];
+    GearTable(){
+        uint64_t seed = 0x9E3779B97F4A7C15ULL;
+        for(int i = 0; i < 256; ++i){
+            // splitmix64
+            uint64_t z = (seed += 0x9E3779B97F4A7C15ULL);
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+            table[i] = z ^ (z >> 31);
+        }
+    }
+};
+
+const GearTable gear;
+
+std::atomic<unsigned long> tmpFileCounter(0);
+
+std::string toHex(const unsigned char *data, size_t len){
+    const char chars[] = "0123456789abcdef";
+    std::string res;
+    for(size_t i = 0; i < len; ++i){
+        res += chars[data[i] >> 4];
+        res += chars[data[i] & 0xF];
+    }
+    return res;
+}
+
+// 生成一个不会和其他线程冲突的临时文件路径
+std::string tmpPathOf(const std::string &path){
+    // 临时文件以 . 开头，文件列表中不会显示，也不会和用户的文件重名
+    std::string::size_type slashIndex = path.find_last_of('/');
+    return path.substr(0, slashIndex + 1) + "." + path.substr(slashIndex + 1) + ".tmp" + std::to_string(tmpFileCounter.fetch_add(1));
+}
+
+// 将数据完整地写入一个新文件，失败时删除该文件
+int writeWholeFile(const std::string &path, const char *data, size_t len){
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd == -1){
+        return -1;
+    }
+    size_t hasWriteLen = 0;
+    while(hasWriteLen < len){
+        ssize_t ret = write(fd, data + hasWriteLen, len - hasWriteLen);
+        if(ret == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            close(fd);
+            unlink(path.c_str());
+            return -1;
+        }
+        hasWriteLen += ret;
+    }
+    close(fd);
+    return 0;
+}
+
+// 将数据写入临时文件，再 rename 为目标文件，其他线程不会读到写了一部分的文件
+int writeFileAtomic(const std::string &path, const char *data, size_t len){
+    std::string tmpPath = tmpPathOf(path);
+    if(writeWholeFile(tmpPath, data, len) != 0){
+        return -1;
+    }
+    if(rename(tmpPath.c_str(), path.c_str()) != 0){
+        unlink(tmpPath.c_str());
+        return -1;
+    }
+    return 0;
+}
+
+} // namespace
+
+std::mutex DedupStore::lock;
+bool DedupStore::refCountsLoaded = false;
+std::unordered_map<std::string, long long> DedupStore::refCounts;
+long long DedupStore::logicalBytes = 0;
+long long DedupStore::physicalBytes = 0;
+
+DedupWriter::DedupWriter() : m_scanPos(0), m_hash(0), m_size(0){
+
+}
+
+int DedupWriter::update(const char *data, size_t len){
+    m_pending.append(data, len);
+    m_size += len;
+    // 切分出所有可以确定边界的块
+    while(1){
+        size_t chunkLen = findCutPoint(false);
+        if(chunkLen == 0){
+            break;
+        }
+        if(emitChunk(chunkLen) != 0){
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int DedupWriter::finish(const std::string &fileName, const FileDigest *digest){
+    // 剩余的数据作为最后的块
+    while(!m_pending.empty()){
+        if(emitChunk(findCutPoint(true)) != 0){
+            abort();
+            return -1;
+        }
+    }
+
+    Manifest manifest;
+    manifest.size = m_size;
+    manifest.chunks = m_chunks;
+    if(digest != nullptr){
+        manifest.hasDigest = true;
+        manifest.digest = *digest;
+    }
+
+    // 覆盖同名文件时，新清单保存成功后再释放旧清单引用的块
+    Manifest oldManifest;
+    bool hasOld = DedupStore::loadManifest(fileName, oldManifest) == 0;
+    if(DedupStore::saveManifest(fileName, manifest) != 0){
+        abort();
+        return -1;
+    }
+    m_chunks.clear();
+
+    {
+        std::lock_guard<std::mutex> guard(DedupStore::lock);
+        DedupStore::logicalBytes += manifest.size - (hasOld ? oldManifest.size : 0);
+    }
+    if(hasOld){
+        DedupStore::releaseChunks(oldManifest.chunks);
+    }
+    return 0;
+}
+
+void DedupWriter::abort(){
+    DedupStore::releaseChunks(m_chunks);
+    m_chunks.clear();
+    m_pending.clear();
+}
+
+size_t DedupWriter::findCutPoint(bool isLast){
+    size_t pendingLen = m_pending.size();
+    if(pendingLen <= CHUNK_MIN_SIZE){
+        return isLast ? pendingLen : 0;
+    }
+
+    // 跳过最小长度之前的数据，从上次计算到的位置继续计算 gear 哈希
+    size_t limit = std::min(pendingLen, CHUNK_MAX_SIZE);
+    size_t i = std::max(m_scanPos, CHUNK_MIN_SIZE);
+    for(; i < limit; ++i){
+        m_hash = (m_hash << 1) + gear.table[static_cast<unsigned char>(m_pending[i])];
+        if((m_hash & (i < CHUNK_AVG_SIZE ? MASK_SMALL : MASK_LARGE)) == 0){
+            return i + 1;
+        }
+    }
+    m_scanPos = i;
+
+    // 达到最大长度时强制切分
+    if(limit == CHUNK_MAX_SIZE){
+        return CHUNK_MAX_SIZE;
+    }
+    return isLast ? pendingLen : 0;
+}
+
+int DedupWriter::emitChunk(size_t len){
+    Sha256 sha;
+    unsigned char hashBytes[32];
+    sha.update(m_pending.c_str(), len);
+    sha.finish(hashBytes);
+
+    ChunkRef chunk;
+    chunk.hash = toHex(hashBytes, sizeof(hashBytes));
+    chunk.length = len;
+    if(DedupStore::storeChunk(chunk.hash, m_pending.c_str(), len) != 0){
+        std::cout << outHead("error") << "保存块 " << chunk.hash << " 失败 (errno = " << errno << ")" << std::endl;
+        return -1;
+    }
+    m_chunks.push_back(chunk);
+
+    // 开始下一个块
+    m_pending.erase(0, len);
+    m_scanPos = 0;
+    m_hash = 0;
+    return 0;
+}
+
+int DedupStore::loadManifest(const std::string &fileName, Manifest &manifest){
+    std::ifstream ifs(std::string(DEDUP_MANIFEST_DIR) + "/" + fileName, std::ios::in);
+    if(!ifs){
+        return -1;
+    }
+    std::string line;
+    while(std::getline(ifs, line)){
+        std::istringstream iss(line);
+        std::string key;
+        iss >> key;
+        if(key == "size"){
+            iss >> manifest.size;
+        }else if(key == "digest"){
+            std::string shaHex;
+            iss >> std::hex >> manifest.digest.crc32c >> shaHex;
+            if(shaHex.size() == 64){
+                for(int i = 0; i < 32; ++i){
+                    manifest.digest.sha256[i] = static_cast<unsigned char>(std::stoul(shaHex.substr(2 * i, 2), nullptr, 16));
+                }
+                manifest.hasDigest = true;
+            }
+        }else if(key.size() == 64){
+            ChunkRef chunk;
+            chunk.hash = key;
+            iss >> chunk.length;
+            manifest.chunks.push_back(chunk);
+        }
+    }
+    return 0;
+}
+
+int DedupStore::remove(const std::string &fileName){
+    Manifest manifest;
+    if(loadManifest(fileName, manifest) != 0){
+        return -1;
+    }
+    // 保证引用计数已经建立，避免删除清单后扫描时漏掉这些块的引用
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        loadRefCounts();
+    }
+    if(unlink((std::string(DEDUP_MANIFEST_DIR) + "/" + fileName).c_str()) != 0){
+        return -1;
+    }
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        logicalBytes -= manifest.size;
+    }
+    releaseChunks(manifest.chunks);
+    return 0;
+}
+
+int DedupStore::importFile(const std::string &path, const std::string &fileName, const FileDigest *digest){
+    int fd = open(path.c_str(), O_RDONLY);
+    if(fd == -1){
+        return -1;
+    }
+    // 只读取一遍文件，同时切分块和计算校验值（调用者已经计算了校验值时只切分块）
+    DedupWriter writer;
+    DigestBuilder builder;
+    std::vector<char> buf(1 << 20);
+    off_t offset = 0;
+    while(1){
+        ssize_t readLen = pread(fd, buf.data(), buf.size(), offset);
+        if(readLen < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            close(fd);
+            writer.abort();
+            return -1;
+        }
+        if(readLen == 0){
+            break;
+        }
+        if(writer.update(buf.data(), readLen) != 0){
+            close(fd);
+            writer.abort();
+            return -1;
+        }
+        if(digest == nullptr){
+            builder.update(buf.data(), readLen);
+        }
+        offset += readLen;
+    }
+    close(fd);
+    FileDigest computed;
+    if(digest == nullptr){
+        computed = builder.finish();
+        digest = &computed;
+    }
+    return writer.finish(fileName, digest);
+}
+
+std::string DedupStore::chunkPath(const std::string &hash){
+    return std::string(DEDUP_CHUNK_DIR) + "/" + hash.substr(0, 2) + "/" + hash;
+}
+
+std::string DedupStore::statsJson(){
+    std::lock_guard<std::mutex> guard(lock);
+    loadRefCounts();
+    double ratio = physicalBytes > 0 ? static_cast<double>(logicalBytes) / physicalBytes : 1.0;
+    std::ostringstream oss;
+    oss << "{\"enabled\":" << (std::string(StorageEngine::current()->name()) == "dedup" ? "true" : "false")
+        << ",\"logicalBytes\":" << logicalBytes
+        << ",\"physicalBytes\":" << physicalBytes
+        << ",\"chunks\":" << refCounts.size()
+        << ",\"dedupRatio\":" << ratio << "}";
+    return oss.str();
+}
+
+int DedupStore::storeChunk(const std::string &hash, const char *data, size_t len){
+    {
+        // 块已经存在时只增加引用计数，不再写入
+        std::lock_guard<std::mutex> guard(lock);
+        loadRefCounts();
+        std::unordered_map<std::string, long long>::iterator it = refCounts.find(hash);
+        if(it != refCounts.end()){
+            ++it->second;
+            return 0;
+        }
+    }
+
+    // 新的块在锁外写入临时文件，多个连接同时写入相同的块时，rename 后的内容也相同
+    std::string dirPath = std::string(DEDUP_CHUNK_DIR) + "/" + hash.substr(0, 2);
+    if((mkdir(DEDUP_CHUNK_DIR, 0755) != 0 && errno != EEXIST) || (mkdir(dirPath.c_str(), 0755) != 0 && errno != EEXIST)){
+        return -1;
+    }
+    std::string tmpPath = tmpPathOf(chunkPath(hash));
+    if(writeWholeFile(tmpPath, data, len) != 0){
+        return -1;
+    }
+
+    // rename 和增加引用计数在同一个临界区中，避免其他线程释放同一个块时把刚写入的块删除
+    std::lock_guard<std::mutex> guard(lock);
+    if(rename(tmpPath.c_str(), chunkPath(hash).c_str()) != 0){
+        unlink(tmpPath.c_str());
+        return -1;
+    }
+    if(refCounts[hash]++ == 0){
+        physicalBytes += len;
+    }
+    return 0;
+}
+
+void DedupStore::releaseChunks(const std::vector<ChunkRef> &chunks){
+    std::lock_guard<std::mutex> guard(lock);
+    for(size_t i = 0; i < chunks.size(); ++i){
+        std::unordered_map<std::string, long long>::iterator it = refCounts.find(chunks[i].hash);
+        if(it == refCounts.end()){
+            continue;
+        }
+        if(--it->second <= 0){
+            unlink(chunkPath(chunks[i].hash).c_str());
+            physicalBytes -= chunks[i].length;
+            refCounts.erase(it);
+        }
+    }
+}
+
+long long DedupStore::sweepOrphans(){
+    std::lock_guard<std::mutex> guard(lock);
+    loadRefCounts();
+
+    // 块在 rename 和增加引用计数之间持有锁，锁内看到的没有引用计数的块都没有被使用
+    long long removed = 0;
+    long long removedBytes = 0;
+    std::vector<std::string> subDirs;
+    DIR *dir = opendir(DEDUP_CHUNK_DIR);
+    if(dir != nullptr){
+        struct dirent *entry;
+        while((entry = readdir(dir)) != nullptr){
+            if(entry->d_name[0] != '.'){
+                subDirs.push_back(std::string(DEDUP_CHUNK_DIR) + "/" + entry->d_name);
+            }
+        }
+        closedir(dir);
+    }
+    for(size_t i = 0; i < subDirs.size(); ++i){
+        dir = opendir(subDirs[i].c_str());
+        if(dir == nullptr){
+            continue;
+        }
+        struct dirent *entry;
+        while((entry = readdir(dir)) != nullptr){
+            std::string name = entry->d_name;
+            if(name == "." || name == ".."){
+                continue;
+            }
+            bool isTmp = name[0] == '.';
+            if(!isTmp && refCounts.find(name) != refCounts.end()){
+                continue;
+            }
+            struct stat fileStat;
+            std::string path = subDirs[i] + "/" + name;
+            long long size = stat(path.c_str(), &fileStat) == 0 ? fileStat.st_size : 0;
+            if(unlink(path.c_str()) == 0){
+                removedBytes += size;
+                removed += isTmp ? 0 : 1;
+            }
+        }
+        closedir(dir);
+    }
+
+    // 清单的临时文件
+    dir = opendir(DEDUP_MANIFEST_DIR);
+    if(dir != nullptr){
+        struct dirent *entry;
+        while((entry = readdir(dir)) != nullptr){
+            if(entry->d_name[0] == '.' && strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0){
+                unlink((std::string(DEDUP_MANIFEST_DIR) + "/" + entry->d_name).c_str());
+            }
+        }
+        closedir(dir);
+    }
+    if(removedBytes > 0){
+        std::cout << outHead("info") << "删除了 " << removed << " 个没有被引用的块和中断写入的临时文件，共 " << removedBytes << " 字节" << std::endl;
+    }
+    return removed;
+}
+
+void DedupStore::loadRefCounts(){
+    if(refCountsLoaded){
+        return;
+    }
+    refCountsLoaded = true;
+
+    DIR *dir = opendir(DEDUP_MANIFEST_DIR);
+    if(dir == nullptr){
+        return;
+    }
+    struct dirent *entry;
+    while((entry = readdir(dir)) != nullptr){
+        if(entry->d_name[0] == '.'){
+            continue;
+        }
+        Manifest manifest;
+        if(loadManifest(entry->d_name, manifest) != 0){
+            continue;
+        }
+        logicalBytes += manifest.size;
+        for(size_t i = 0; i < manifest.chunks.size(); ++i){
+            if(refCounts[manifest.chunks[i].hash]++ == 0){
+                physicalBytes += manifest.chunks[i].length;
+            }
+        }
+    }
+    closedir(dir);
+    std::cout << outHead("info") << "去重存储加载完成，共 " << refCounts.size() << " 个块，物理字节数 " << physicalBytes << std::endl;
+}
+
+int DedupStore::saveManifest(const std::string &fileName, const Manifest &manifest){
+    if(mkdir(DEDUP_MANIFEST_DIR, 0755) != 0 && errno != EEXIST){
+        return -1;
+    }
+    std::ostringstream oss;
+    oss << "size " << manifest.size << "\n";
+    if(manifest.hasDigest){
+        char crcHex[9];
+        snprintf(crcHex, sizeof(crcHex), "%08x", manifest.digest.crc32c);
+        oss << "digest " << crcHex << " " << toHex(manifest.digest.sha256, sizeof(manifest.digest.sha256)) << "\n";
+    }
+    for(size_t i = 0; i < manifest.chunks.size(); ++i){
+        oss << manifest.chunks[i].hash << " " << manifest.chunks[i].length << "\n";
+    }
+    std::string content = oss.str();
+    return writeFileAtomic(std::string(DEDUP_MANIFEST_DIR) + "/" + fileName, content.c_str(), content.size());
+}
+
+namespace {
+
+// 按清单依次用 sendfile 发送每个块，块文件在发送到时才打开，发送完成后立即关闭
+class DedupReader : public StorageReader{
+public:
+    explicit DedupReader(const Manifest &manifest) : m_manifest(manifest), m_chunkIndex(0), m_chunkOffset(0), m_chunkFd(-1){ }
+    virtual ~DedupReader(){
+        if(m_chunkFd != -1){
+            close(m_chunkFd);
+        }
+    }
+
+    virtual long long length() const override { return m_manifest.size; }
+
+    virtual bool digest(FileDigest &digest) const override {
+        if(m_manifest.hasDigest){
+            digest = m_manifest.digest;
+        }
+        return m_manifest.hasDigest;
+    }
+
+    virtual long long cachedLength(long long maxLen) override {
+        // 出错时按已缓存处理，由 sendTo 返回错误
+        if(openChunk() != 0){
+            return maxLen;
+        }
+        const ChunkRef &chunk = m_manifest.chunks[m_chunkIndex];
+        return PageCache::residentLength(m_chunkFd, m_chunkOffset, std::min<long long>(maxLen, chunk.length - m_chunkOffset));
+    }
+
+    virtual void prefetch(long long len) override {
+        // 只预读当前块，之后的块是其他文件
+        if(openChunk() == 0){
+            const ChunkRef &chunk = m_manifest.chunks[m_chunkIndex];
+            PageCache::prefetch(m_chunkFd, m_chunkOffset, std::min<long long>(len, chunk.length - m_chunkOffset));
+        }
+    }
+
+    virtual long long sendTo(int sockFd, long long maxLen) override {
+        if(openChunk() != 0){
+            return -1;
+        }
+        const ChunkRef &chunk = m_manifest.chunks[m_chunkIndex];
+        off_t offset = m_chunkOffset;
+        ssize_t sentLen = sendfile(sockFd, m_chunkFd, &offset, std::min<long long>(maxLen, chunk.length - m_chunkOffset));
+        if(sentLen == 0){
+            // 块文件比清单中记录的短
+            errno = EIO;
+            return -1;
+        }
+        if(sentLen > 0){
+            m_chunkOffset += sentLen;
+        }
+        return sentLen;
+    }
+
+private:
+    // 跳过已经发送完成的块，打开正在发送的块文件，失败时返回 -1
+    int openChunk(){
+        // 跳过已经发送完成的块
+        while(m_chunkIndex < m_manifest.chunks.size() && m_chunkOffset >= m_manifest.chunks[m_chunkIndex].length){
+            if(m_chunkFd != -1){
+                close(m_chunkFd);
+                m_chunkFd = -1;
+            }
+            ++m_chunkIndex;
+            m_chunkOffset = 0;
+        }
+
+        // 清单中的块长度之和小于文件长度，清单已经损坏
+        if(m_chunkIndex >= m_manifest.chunks.size()){
+            errno = EIO;
+            return -1;
+        }
+
+        if(m_chunkFd == -1){
+            const ChunkRef &chunk = m_manifest.chunks[m_chunkIndex];
+            m_chunkFd = open(DedupStore::chunkPath(chunk.hash).c_str(), O_RDONLY);
+            if(m_chunkFd == -1){
+                std::cout << outHead("error") << "块 " << chunk.hash << " 打开失败" << std::endl;
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+private:
+    Manifest m_manifest;
+    size_t m_chunkIndex;        // 正在发送的块
+    off_t m_chunkOffset;        // 正在发送的块中已经发送的长度
+    int m_chunkFd;              // 正在发送的块文件
+};
+
+// 边接收边切分块，commit 时保存清单
+class DedupFileWriter : public StorageWriter{
+public:
+    explicit DedupFileWriter(const std::string &fileName) : m_fileName(fileName), m_done(false){ }
+    virtual ~DedupFileWriter(){ abort(); }
+
+    virtual int write(const char *data, size_t len) override { return m_writer.update(data, len); }
+
+    virtual int commit(const FileDigest *digest) override {
+        // finish 失败时已经释放了块的引用
+        m_done = true;
+        return m_writer.finish(m_fileName, digest);
+    }
+
+    virtual void abort() override {
+        if(!m_done){
+            m_writer.abort();
+            m_done = true;
+        }
+    }
+
+    virtual long long size() const override { return m_writer.size(); }
+
+private:
+    std::string m_fileName;
+    DedupWriter m_writer;
+    bool m_done;                // 已经 commit 或 abort
+};
+
+}
+
+int DedupStorage::init(){
+    if((mkdir(DEDUP_CHUNK_DIR, 0755) != 0 && errno != EEXIST) || (mkdir(DEDUP_MANIFEST_DIR, 0755) != 0 && errno != EEXIST)){
+        std::cout << outHead("error") << "去重存储目录创建失败 (errno = " << errno << ")" << std::endl;
+        return -1;
+    }
+    // 启动时还没有上传，删除上次运行中断的上传留下的块
+    DedupStore::sweepOrphans();
+    return 0;
+}
+
+void DedupStorage::list(std::vector<std::string> &names){
+    DIR *dir = opendir(DEDUP_MANIFEST_DIR);
+    if(dir == nullptr){
+        return;
+    }
+    struct dirent *stdinfo;
+    while((stdinfo = readdir(dir)) != nullptr){
+        // 跳过 . 和 .. 以及写入清单时的临时文件
+        if(stdinfo->d_name[0] != '.'){
+            names.push_back(stdinfo->d_name);
+        }
+    }
+    closedir(dir);
+}
+
+StorageReader *DedupStorage::openReader(const std::string &fileName){
+    Manifest manifest;
+    if(!isValidName(fileName) || DedupStore::loadManifest(fileName, manifest) != 0){
+        return nullptr;
+    }
+    return new DedupReader(manifest);
+}
+
+StorageWriter *DedupStorage::createWriter(const std::string &fileName){
+    if(!isValidName(fileName)){
+        return nullptr;
+    }
+    return new DedupFileWriter(fileName);
+}
+
+int DedupStorage::importFile(const std::string &path, const std::string &fileName, const FileDigest *digest){
+    if(!isValidName(fileName) || DedupStore::importFile(path, fileName, digest) != 0){
+        return -1;
+    }
+    unlink(path.c_str());
+    return 0;
+}
+
+int DedupStorage::remove(const std::string &fileName){
+    if(!isValidName(fileName)){
+        return -1;
+    }
+    return DedupStore::remove(fileName);
+}
@@ -0,0 +1,129 @@
+/*  文件说明：
+ *  1. 可选的内容寻址去重存储：上传的文件使用 FastCDC 风格的内容定义分块切分，每个块以 SHA-256 命名保存到块存储中，
+ *     已经存在的块不再重复写入，文件名只对应一个记录块列表的清单（manifest）
+ *  2. 块保存在 filedir/.chunks/哈希前两位/哈希 中，清单保存在 filedir/.manifests/文件名 中，写入时都先写临时文件再 rename
+ *  3. 每个块的引用计数保存在内存中，第一次使用时扫描所有清单建立，删除文件时引用计数为 0 的块会被删除。
+ *     写入中断（进程退出时上传还没有完成）留下的块没有清单引用，启动时和临时文件一起被删除
+ *  4. 下载时按清单依次用 sendfile 发送每个块文件
+ *  5. 统计逻辑字节数（所有文件的长度之和）和物理字节数（所有块的长度之和），二者的比值为去重率
+ *  6. 通过存储引擎 dedup 使用，见 storageengine.h
+ */
+#ifndef DEDUPSTORE_H
+#define DEDUPSTORE_H
+#include <string>
+#include <vector>
+#include <mutex>
+#include <unordered_map>
+#include <cstdint>
+#include <sys/types.h>
+
+#include "../checksum/checksum.h"
+#include "storageengine.h"
+
+#define DEDUP_CHUNK_DIR "filedir/.chunks"          // 块存储目录
+#define DEDUP_MANIFEST_DIR "filedir/.manifests"    // 清单目录
+
+// 清单中的一个块
+struct ChunkRef{
+    std::string hash;       // 块内容的 SHA-256（十六进制）
+    long long length = 0;   // 块的长度
+};
+
+// 一个文件的清单
+struct Manifest{
+    long long size = 0;             // 文件长度
+    bool hasDigest = false;         // 是否记录了整个文件的校验值
+    FileDigest digest;              // 整个文件的校验值
+    std::vector<ChunkRef> chunks;   // 按顺序组成文件的所有块
+};
+
+// 上传一个文件时使用的分块写入器，每个正在上传的文件对应一个
+class DedupWriter{
+public:
+    DedupWriter();
+
+    // 追加文件数据，切分出的完整块会立即写入块存储。失败时返回 -1
+    int update(const char *data, size_t len);
+
+    // 数据全部接收后保存剩余的块和清单，清单原子地替换同名文件的清单
+    int finish(const std::string &fileName, const FileDigest *digest);
+
+    // 上传失败时释放已经写入的块的引用
+    void abort();
+
+    // 已经接收的文件长度
+    long long size() const { return m_size; }
+
+private:
+    // 从缓冲区中切分出一个块，返回块的长度，数据不足以确定边界时返回 0
+    size_t findCutPoint(bool isLast);
+
+    // 将缓冲区开头 len 个字节作为一个块保存
+    int emitChunk(size_t len);
+
+private:
+    std::string m_pending;              // 还没有切分的数据
+    size_t m_scanPos;                   // m_pending 中已经计算过 gear 哈希的位置
+    uint64_t m_hash;                    // 当前块的 gear 哈希
+    long long m_size;                   // 已经接收的文件长度
+    std::vector<ChunkRef> m_chunks;     // 已经切分出的块
+};
+
+class DedupStore{
+public:
+    // 读取文件的清单，文件不存在时返回 -1
+    static int loadManifest(const std::string &fileName, Manifest &manifest);
+
+    // 删除文件的清单，并释放它引用的块
+    static int remove(const std::string &fileName);
+
+    // 将一个已经写完的文件切分成块保存为 fileName，同时计算校验值记录到清单中，用于上传会话提交时导入暂存文件
+    static int importFile(const std::string &path, const std::string &fileName, const FileDigest *digest);
+
+    // 块文件的路径
+    static std::string chunkPath(const std::string &hash);
+
+    // 以 JSON 格式返回去重统计信息：逻辑字节数、物理字节数、去重率
+    static std::string statsJson();
+
+    // 删除没有被任何清单引用的块，以及块目录和清单目录中的临时文件，返回删除的块个数。
+    // 只能在没有上传正在进行时调用（启动时），否则会删除其他线程正在写入的临时文件
+    static long long sweepOrphans();
+
+private:
+    friend class DedupWriter;
+
+    // 保存一个块：已经存在时只增加引用计数，否则写入块存储。成功时返回 0
+    static int storeChunk(const std::string &hash, const char *data, size_t len);
+
+    // 释放一组块的引用，引用计数为 0 的块会被删除
+    static void releaseChunks(const std::vector<ChunkRef> &chunks);
+
+    // 第一次使用时扫描所有清单，建立块的引用计数，调用前需要持有 lock
+    static void loadRefCounts();
+
+    // 将清单写入文件，先写临时文件再 rename
+    static int saveManifest(const std::string &fileName, const Manifest &manifest);
+
+private:
+    static std::mutex lock;                                        // 保护引用计数和统计信息
+    static bool refCountsLoaded;
+    static std::unordered_map<std::string, long long> refCounts;   // 块的引用计数
+    static long long logicalBytes;                                 // 所有清单中的文件长度之和
+    static long long physicalBytes;                                // 块存储中所有块的长度之和
+};
+
+// 存储引擎 dedup：文件列表来自清单目录，下载时逐块发送
+class DedupStorage : public StorageEngine{
+public:
+    virtual const char *name() const override { return "dedup"; }
+    virtual int init() override;
+    virtual void list(std::vector<std::string> &names) override;
+    virtual StorageReader *openReader(const std::string &fileName) override;
+    virtual StorageWriter *createWriter(const std::string &fileName) override;
+    virtual int importFile(const std::string &path, const std::string &fileName, const FileDigest *digest) override;
+    virtual int remove(const std::string &fileName) override;
+    virtual std::string localPath(const std::string &) override { return ""; }
+};
+
+#endif
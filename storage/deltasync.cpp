@@ -0,0 +1,347 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <vector>
+#include <cmath>
+#include <cstdio>
+#include <cerrno>
+#include <cstdlib>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "deltasync.h"
+#include "storageengine.h"
+#include "../checksum/checksum.h"
+#include "../utils/utils.h"
+
+namespace {
+
+const uint32_t ADLER_MOD = 65521;
+
+const long long DELTA_MIN_BLOCK = 4 * 1024;
+const long long DELTA_MAX_BLOCK = 1024 * 1024;
+
+std::string toHex(const unsigned char *data, size_t len){
+    const char chars[] = "0123456789abcdef";
+    std::string res;
+    for(size_t i = 0; i < len; ++i){
+        res += chars[data[i] >> 4];
+        res += chars[data[i] & 0xF];
+    }
+    return res;
+}
+
+uint64_t readBigEndian(const char *data, size_t len){
+    uint64_t value = 0;
+    for(size_t i = 0; i < len; ++i){
+        value = (value << 8) | static_cast<unsigned char>(data[i]);
+    }
+    return value;
+}
+
+// 在 DELTA_DIR 中创建一个临时文件，文件名以 . 开头，不会出现在文件列表中
+int createTmpFile(std::string &tmpPath){
+    if(mkdir(DELTA_DIR, 0755) != 0 && errno != EEXIST){
+        return -1;
+    }
+    std::string pattern = std::string(DELTA_DIR) + "/.tmpXXXXXX";
+    std::vector<char> path(pattern.begin(), pattern.end());
+    path.push_back('\0');
+    int fd = mkstemp(path.data());
+    if(fd != -1){
+        tmpPath = path.data();
+        // mkstemp 创建的文件只有所有者可以读写，和上传的其他文件保持相同的权限
+        fchmod(fd, 0644);
+    }
+    return fd;
+}
+
+}
+
+long long DeltaSync::blockSizeFor(long long fileSize){
+    long long blockSize = static_cast<long long>(std::sqrt(static_cast<double>(fileSize)));
+    blockSize = (blockSize + DELTA_MIN_BLOCK - 1) / DELTA_MIN_BLOCK * DELTA_MIN_BLOCK;
+    if(blockSize < DELTA_MIN_BLOCK){
+        blockSize = DELTA_MIN_BLOCK;
+    }
+    if(blockSize > DELTA_MAX_BLOCK){
+        blockSize = DELTA_MAX_BLOCK;
+    }
+    return blockSize;
+}
+
+uint32_t DeltaSync::adler32(const char *data, size_t len){
+    uint32_t a = 1, b = 0;
+    while(len > 0){
+        // 每 5552 个字节取一次模，保证中间结果不会溢出
+        size_t n = len < 5552 ? len : 5552;
+        len -= n;
+        while(n-- > 0){
+            a += static_cast<unsigned char>(*data++);
+            b += a;
+        }
+        a %= ADLER_MOD;
+        b %= ADLER_MOD;
+    }
+    return (b << 16) | a;
+}
+
+std::string DeltaSync::baseToken(long long size, long long mtimeSec, long long mtimeNsec){
+    return std::to_string(size) + "-" + std::to_string(mtimeSec) + "." + std::to_string(mtimeNsec);
+}
+
+std::string DeltaSync::signaturePath(const std::string &fileName){
+    return std::string(DELTA_DIR) + "/" + fileName + ".sig";
+}
+
+int DeltaSync::signatures(const std::string &fileName, std::string &sigText, long long &blockSize, long long &fileLength, std::string &token){
+    std::string filePath = StorageEngine::current()->localPath(fileName);
+    int fd = filePath.empty() ? -1 : open(filePath.c_str(), O_RDONLY);
+    if(fd == -1){
+        return DELTA_NOT_FOUND;
+    }
+    struct stat fileStat;
+    if(fstat(fd, &fileStat) != 0 || !S_ISREG(fileStat.st_mode)){
+        close(fd);
+        return DELTA_NOT_FOUND;
+    }
+    fileLength = fileStat.st_size;
+    blockSize = blockSizeFor(fileLength);
+    token = baseToken(fileStat.st_size, fileStat.st_mtim.tv_sec, fileStat.st_mtim.tv_nsec);
+
+    // 缓存的第一行是计算签名时的版本标识和块大小，和当前文件相同时直接使用
+    std::string cacheHead = token + " " + std::to_string(blockSize) + "\n";
+    std::ifstream ifs(signaturePath(fileName), std::ios::in | std::ios::binary);
+    if(ifs){
+        std::string content((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+        if(content.compare(0, cacheHead.size(), cacheHead) == 0){
+            sigText = content.substr(cacheHead.size());
+            close(fd);
+            return DELTA_OK;
+        }
+    }
+
+    // 逐块计算签名，文件不会被读入内存
+    std::ostringstream oss;
+    std::vector<char> buf(blockSize);
+    off_t offset = 0;
+    while(offset < fileLength){
+        ssize_t readLen = pread(fd, buf.data(), std::min<long long>(blockSize, fileLength - offset), offset);
+        if(readLen < 0 && errno == EINTR){
+            continue;
+        }
+        if(readLen <= 0){
+            close(fd);
+            return DELTA_IO_ERROR;
+        }
+        Sha256 sha;
+        unsigned char strong[32];
+        sha.update(buf.data(), readLen);
+        sha.finish(strong);
+        char weak[9];
+        snprintf(weak, sizeof(weak), "%08x", adler32(buf.data(), readLen));
+        oss << weak << " " << toHex(strong, sizeof(strong)) << "\n";
+        offset += readLen;
+    }
+    close(fd);
+    sigText = oss.str();
+
+    // 写入缓存，失败时不影响本次返回的签名
+    std::string tmpPath;
+    int tmpFd = createTmpFile(tmpPath);
+    if(tmpFd != -1){
+        std::string content = cacheHead + sigText;
+        bool ok = write(tmpFd, content.c_str(), content.size()) == static_cast<ssize_t>(content.size());
+        close(tmpFd);
+        if(!ok || rename(tmpPath.c_str(), signaturePath(fileName).c_str()) != 0){
+            unlink(tmpPath.c_str());
+        }
+    }
+    return DELTA_OK;
+}
+
+void DeltaSync::removeSignatures(const std::string &fileName){
+    unlink(signaturePath(fileName).c_str());
+}
+
+DeltaApplier::DeltaApplier() : m_baseFd(-1), m_tmpFd(-1), m_baseLength(0), m_blockSize(0), m_maxSize(0),
+        m_outOffset(0), m_literalRemain(0), m_literalBytes(0), m_copiedBytes(0){
+}
+
+int DeltaApplier::begin(const std::string &fileName, const std::string &baseToken, long long maxSize){
+    m_fileName = fileName;
+    m_maxSize = maxSize;
+    std::string filePath = StorageEngine::current()->localPath(fileName);
+    m_baseFd = filePath.empty() ? -1 : open(filePath.c_str(), O_RDONLY);
+    if(m_baseFd == -1){
+        return DELTA_NOT_FOUND;
+    }
+    struct stat fileStat;
+    if(fstat(m_baseFd, &fileStat) != 0 || !S_ISREG(fileStat.st_mode)){
+        abort();
+        return DELTA_NOT_FOUND;
+    }
+    // 签名之后文件被修改过，客户端计算的块引用已经无效
+    if(DeltaSync::baseToken(fileStat.st_size, fileStat.st_mtim.tv_sec, fileStat.st_mtim.tv_nsec) != baseToken){
+        abort();
+        return DELTA_BASE_CHANGED;
+    }
+    m_baseLength = fileStat.st_size;
+    m_blockSize = DeltaSync::blockSizeFor(m_baseLength);
+
+    m_tmpFd = createTmpFile(m_tmpPath);
+    if(m_tmpFd == -1){
+        abort();
+        return DELTA_IO_ERROR;
+    }
+    return DELTA_OK;
+}
+
+int DeltaApplier::update(const char *data, size_t len){
+    while(len > 0){
+        // 正在接收 'L' 指令的数据，直接写入
+        if(m_literalRemain > 0){
+            size_t writeLen = std::min<long long>(m_literalRemain, len);
+            int ret = writeLiteral(data, writeLen);
+            if(ret != DELTA_OK){
+                return ret;
+            }
+            m_literalRemain -= writeLen;
+            data += writeLen;
+            len -= writeLen;
+            continue;
+        }
+
+        // 接收指令头：'C' 共 13 个字节，'L' 共 5 个字节
+        m_opHeader += *data++;
+        --len;
+        size_t headerLen = 0;
+        if(m_opHeader[0] == 'C'){
+            headerLen = 13;
+        }else if(m_opHeader[0] == 'L'){
+            headerLen = 5;
+        }else{
+            return DELTA_BAD_REQUEST;
+        }
+        if(m_opHeader.size() < headerLen){
+            continue;
+        }
+
+        if(m_opHeader[0] == 'C'){
+            int ret = copyBlocks(readBigEndian(m_opHeader.c_str() + 1, 8), readBigEndian(m_opHeader.c_str() + 9, 4));
+            if(ret != DELTA_OK){
+                return ret;
+            }
+        }else{
+            m_literalRemain = readBigEndian(m_opHeader.c_str() + 1, 4);
+        }
+        m_opHeader.clear();
+    }
+    return DELTA_OK;
+}
+
+int DeltaApplier::finish(long long expectLength){
+    // 指令流在一个指令的中间结束，或者重建的长度和客户端声明的不同
+    if(!m_opHeader.empty() || m_literalRemain > 0 || m_outOffset != expectLength){
+        abort();
+        return DELTA_BAD_REQUEST;
+    }
+    // 由存储引擎保存新文件（flat 最终调用 installFile），和普通上传一样更新目录占用统计并保存新的校验值，
+    // 文件重建期间被迁移到其他位置时也会保存到引擎当前使用的位置
+    if(fdatasync(m_tmpFd) != 0){
+        abort();
+        return DELTA_IO_ERROR;
+    }
+    close(m_tmpFd);
+    m_tmpFd = -1;
+    if(StorageEngine::current()->importFile(m_tmpPath, m_fileName, nullptr) != 0){
+        abort();
+        return DELTA_IO_ERROR;
+    }
+    m_tmpPath.clear();
+    close(m_baseFd);
+    m_baseFd = -1;
+    // 新文件的签名需要重新计算
+    DeltaSync::removeSignatures(m_fileName);
+    return DELTA_OK;
+}
+
+void DeltaApplier::abort(){
+    if(m_tmpFd != -1){
+        close(m_tmpFd);
+        m_tmpFd = -1;
+    }
+    if(!m_tmpPath.empty()){
+        unlink(m_tmpPath.c_str());
+        m_tmpPath.clear();
+    }
+    if(m_baseFd != -1){
+        close(m_baseFd);
+        m_baseFd = -1;
+    }
+}
+
+int DeltaApplier::copyBlocks(uint64_t startBlock, uint32_t blockCount){
+    long long blockTotal = (m_baseLength + m_blockSize - 1) / m_blockSize;
+    if(blockCount == 0 || startBlock >= static_cast<uint64_t>(blockTotal) || blockCount > blockTotal - startBlock){
+        return DELTA_BAD_REQUEST;
+    }
+    loff_t inOffset = startBlock * m_blockSize;
+    long long copyLen = std::min<long long>(static_cast<long long>(blockCount) * m_blockSize, m_baseLength - inOffset);
+    if(m_outOffset + copyLen > m_maxSize){
+        return DELTA_TOO_LARGE;
+    }
+
+    loff_t outOffset = m_outOffset;
+    long long remain = copyLen;
+    while(remain > 0){
+        ssize_t ret = copy_file_range(m_baseFd, &inOffset, m_tmpFd, &outOffset, remain, 0);
+        if(ret == -1 && errno == EINTR){
+            continue;
+        }
+        if(ret == -1 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)){
+            // 内核或文件系统不支持时，退化为经过用户态的复制
+            std::vector<char> buf(std::min<long long>(remain, 1 << 20));
+            ret = pread(m_baseFd, buf.data(), std::min<long long>(remain, buf.size()), inOffset);
+            if(ret > 0 && pwrite(m_tmpFd, buf.data(), ret, outOffset) != ret){
+                ret = -1;
+            }
+            if(ret > 0){
+                inOffset += ret;
+                outOffset += ret;
+            }
+        }
+        if(ret <= 0){
+            std::cout << outHead("error") << "重建文件 " << m_fileName << " 时复制已有的块失败 (errno = " << errno << ")" << std::endl;
+            return DELTA_IO_ERROR;
+        }
+        remain -= ret;
+    }
+    m_outOffset += copyLen;
+    m_copiedBytes += copyLen;
+    return DELTA_OK;
+}
+
+int DeltaApplier::writeLiteral(const char *data, size_t len){
+    if(m_outOffset + static_cast<long long>(len) > m_maxSize){
+        return DELTA_TOO_LARGE;
+    }
+    size_t hasWriteLen = 0;
+    while(hasWriteLen < len){
+        ssize_t ret = pwrite(m_tmpFd, data + hasWriteLen, len - hasWriteLen, m_outOffset + hasWriteLen);
+        if(ret == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            std::cout << outHead("error") << "重建文件 " << m_fileName << " 时写入新数据失败 (errno = " << errno << ")" << std::endl;
+            return DELTA_IO_ERROR;
+        }
+        hasWriteLen += ret;
+    }
+    m_outOffset += len;
+    m_literalBytes += len;
+    return DELTA_OK;
+}
@@ -0,0 +1,101 @@
+/*  文件说明：
+ *  1. rsync 风格的增量同步：客户端只发送修改过的数据，服务器用已有的文件重建新版本，网络传输和磁盘写入都只和修改量有关
+ *  2. GET /delta/文件名 返回已有文件的块签名：文件按 Delta-Block-Size 切分为块，每块一行 "Adler-32 SHA-256"（十六进制），
+ *     首部 Delta-Base 为文件的版本标识，签名缓存在 filedir/.delta/文件名.sig 中，文件长度或修改时间变化后重新计算
+ *  3. 客户端用滚动 Adler-32 在新文件中查找和已有块相同的位置，再用 SHA-256 确认，之后 POST /delta/文件名 发送指令流：
+ *       'C' + 起始块号（8 字节）+ 块个数（4 字节）  复制已有文件中的连续块
+ *       'L' + 长度（4 字节）+ 数据                   写入新的数据
+ *     整数都是大端序，请求首部需要携带 Delta-Base（签名时返回的版本标识）和 Delta-Length（新文件的长度）
+ *  4. 服务器将新文件写入临时文件，复制块使用 copy_file_range（支持的文件系统上不需要经过用户态，甚至只共享数据块），
+ *     全部完成后落盘，再交给存储引擎的 importFile 原子地替换目标文件（和普通上传一样更新目录占用统计和校验值）
+ */
+#ifndef DELTASYNC_H
+#define DELTASYNC_H
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+#define DELTA_DIR "filedir/.delta"    // 保存签名缓存和重建时的临时文件
+
+// 增量同步的处理结果
+enum DELTA_RESULT{
+    DELTA_OK = 0,
+    DELTA_BAD_REQUEST = -1,     // 指令流格式错误或引用的块不存在
+    DELTA_NOT_FOUND = -2,       // 已有文件不存在
+    DELTA_BASE_CHANGED = -3,    // 已有文件在获取签名之后被修改
+    DELTA_TOO_LARGE = -4,       // 重建的文件超过最大文件大小
+    DELTA_IO_ERROR = -5         // 读写文件失败
+};
+
+class DeltaSync{
+public:
+    // 根据文件长度选择块大小：约为文件长度的平方根，按 4KB 对齐，限制在 4KB 到 1MB 之间
+    static long long blockSizeFor(long long fileSize);
+
+    // Adler-32 校验值（和 zlib 的 adler32 相同），客户端可以按 a -= out, a += in; b -= n * out + 1, b += a 滚动计算
+    static uint32_t adler32(const char *data, size_t len);
+
+    // 获取文件的块签名，签名为每块一行的文本。同时返回块大小、文件长度和版本标识
+    static int signatures(const std::string &fileName, std::string &sigText, long long &blockSize, long long &fileLength, std::string &baseToken);
+
+    // 删除文件的签名缓存
+    static void removeSignatures(const std::string &fileName);
+
+    // 文件的版本标识，由文件长度和修改时间组成
+    static std::string baseToken(long long size, long long mtimeSec, long long mtimeNsec);
+
+    // 签名缓存文件的路径
+    static std::string signaturePath(const std::string &fileName);
+};
+
+// 根据客户端发送的指令流重建文件，一个指令可能跨越多次接收的数据
+class DeltaApplier{
+public:
+    DeltaApplier();
+
+    // 打开已有文件并检查版本标识，创建临时文件。maxSize 为允许的最大文件大小
+    int begin(const std::string &fileName, const std::string &baseToken, long long maxSize);
+
+    // 处理接收到的指令流数据
+    int update(const char *data, size_t len);
+
+    // 指令流接收完成，检查文件长度后落盘并替换目标文件
+    int finish(long long expectLength);
+
+    // 出错时关闭文件并删除临时文件
+    void abort();
+
+    const std::string &fileName() const { return m_fileName; }
+    long long literalBytes() const { return m_literalBytes; }
+    long long copiedBytes() const { return m_copiedBytes; }
+
+private:
+    // 复制已有文件中的 [startBlock, startBlock + blockCount) 块
+    int copyBlocks(uint64_t startBlock, uint32_t blockCount);
+
+    // 将新的数据写到临时文件末尾
+    int writeLiteral(const char *data, size_t len);
+
+private:
+    std::string m_fileName;
+    std::string m_tmpPath;
+    int m_baseFd;
+    int m_tmpFd;
+    long long m_baseLength;
+    long long m_blockSize;
+    long long m_maxSize;
+    long long m_outOffset;          // 临时文件中已经写入的长度
+    std::string m_opHeader;         // 还没有接收完整的指令头
+    long long m_literalRemain;      // 当前 'L' 指令中还没有接收的数据长度
+    long long m_literalBytes;       // 统计：客户端发送的新数据长度
+    long long m_copiedBytes;        // 统计：从已有文件复制的长度
+};
+
+// 正在通过 POST /delta 上传指令流的连接的状态
+struct DeltaProgress{
+    DeltaApplier applier;
+    long long bodyRemain = 0;       // 消息体中还没有接收的字节数
+    long long targetLength = 0;     // 新文件的长度（Delta-Length）
+};
+
+#endif
@@ -0,0 +1,297 @@
+#include <cstdio>
+#include <cstdint>
+#include <cerrno>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "dirtree.h"
+#include "storageengine.h"
+
+#ifndef SYS_openat2
+#define SYS_openat2 437
+#endif
+#ifndef RESOLVE_NO_MAGICLINKS
+#define RESOLVE_NO_MAGICLINKS 0x02
+#endif
+#ifndef RESOLVE_BENEATH
+#define RESOLVE_BENEATH 0x08
+#endif
+
+std::mutex DirTree::lock;
+std::unordered_map<std::string, std::shared_ptr<DirHandle> > DirTree::cache;
+
+namespace {
+
+// openat2 的参数（linux/openat2.h 中的 struct open_how，旧的内核头文件中没有）
+struct OpenHow{
+    uint64_t flags;
+    uint64_t mode;
+    uint64_t resolve;
+};
+
+// 内核不支持 openat2 时置为 false，之后直接使用逐级打开的方法
+bool openat2Supported = true;
+
+}
+
+DirHandle::~DirHandle(){
+    if(fd != -1){
+        close(fd);
+    }
+}
+
+bool DirTree::isValidPath(const std::string &path){
+    if(path.empty()){
+        return false;
+    }
+    std::string::size_type start = 0;
+    while(true){
+        std::string::size_type end = path.find('/', start);
+        if(!StorageEngine::isValidName(path.substr(start, end == std::string::npos ? std::string::npos : end - start))){
+            return false;
+        }
+        if(end == std::string::npos){
+            return true;
+        }
+        start = end + 1;
+    }
+}
+
+void DirTree::splitPath(const std::string &path, std::string &parent, std::string &leaf){
+    std::string::size_type slashIndex = path.rfind('/');
+    if(slashIndex == std::string::npos){
+        parent.clear();
+        leaf = path;
+    }else{
+        parent = path.substr(0, slashIndex);
+        leaf = path.substr(slashIndex + 1);
+    }
+}
+
+int DirTree::resolve(int dirFd, const std::string &relPath, int flags){
+    if(openat2Supported){
+        OpenHow how;
+        how.flags = flags | O_CLOEXEC;
+        how.mode = 0;
+        how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+        int fd = syscall(SYS_openat2, dirFd, relPath.c_str(), &how, sizeof(how));
+        if(fd != -1 || errno != ENOSYS){
+            return fd;
+        }
+        openat2Supported = false;
+    }
+
+    // 逐级打开，中间的每一级都必须是目录且不是符号链接（路径中的 . 和 .. 已经被 isValidPath 排除）
+    int curFd = dirFd;
+    std::string::size_type start = 0;
+    while(true){
+        std::string::size_type end = relPath.find('/', start);
+        std::string name = relPath.substr(start, end == std::string::npos ? std::string::npos : end - start);
+        int nextFd = end == std::string::npos ? openat(curFd, name.c_str(), flags | O_NOFOLLOW | O_CLOEXEC)
+                : openat(curFd, name.c_str(), O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        int savedErrno = errno;
+        if(curFd != dirFd){
+            close(curFd);
+        }
+        if(nextFd == -1 || end == std::string::npos){
+            errno = savedErrno;
+            return nextFd;
+        }
+        curFd = nextFd;
+        start = end + 1;
+    }
+}
+
+std::shared_ptr<DirHandle> DirTree::openDir(const std::string &dirPath){
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        std::unordered_map<std::string, std::shared_ptr<DirHandle> >::const_iterator it = cache.find(dirPath);
+        if(it != cache.end()){
+            return it->second;
+        }
+    }
+
+    std::shared_ptr<DirHandle> handle = std::make_shared<DirHandle>();
+    if(dirPath.empty()){
+        handle->fd = open("filedir", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    }else{
+        if(!isValidPath(dirPath)){
+            return std::shared_ptr<DirHandle>();
+        }
+        // 从最近的父目录开始解析：父目录通常已经在缓存中，只需要打开最后一级
+        std::string parent, leaf;
+        splitPath(dirPath, parent, leaf);
+        std::shared_ptr<DirHandle> parentHandle = openDir(parent);
+        if(!parentHandle){
+            return std::shared_ptr<DirHandle>();
+        }
+        handle->fd = resolve(parentHandle->fd, leaf, O_PATH | O_DIRECTORY);
+    }
+    if(handle->fd == -1){
+        return std::shared_ptr<DirHandle>();
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+    if(cache.size() >= DIR_CACHE_SIZE){
+        // 缓存满时全部移出，正在使用的描述符在引用释放后关闭
+        std::shared_ptr<DirHandle> rootHandle = cache[""];
+        cache.clear();
+        if(rootHandle){
+            cache[""] = rootHandle;
+        }
+    }
+    cache[dirPath] = handle;
+    return handle;
+}
+
+void DirTree::invalidate(const std::string &dirPath){
+    std::lock_guard<std::mutex> guard(lock);
+    std::string prefix = dirPath + "/";
+    for(std::unordered_map<std::string, std::shared_ptr<DirHandle> >::iterator it = cache.begin(); it != cache.end(); ){
+        if(it->first == dirPath || it->first.compare(0, prefix.size(), prefix) == 0){
+            it = cache.erase(it);
+        }else{
+            ++it;
+        }
+    }
+}
+
+int DirTree::openFile(const std::string &path, int flags){
+    if(!isValidPath(path)){
+        errno = EINVAL;
+        return -1;
+    }
+    std::string parent, leaf;
+    splitPath(path, parent, leaf);
+    std::shared_ptr<DirHandle> handle = openDir(parent);
+    if(!handle){
+        return -1;
+    }
+    return resolve(handle->fd, leaf, flags);
+}
+
+int DirTree::makeDir(const std::string &path){
+    if(!isValidPath(path)){
+        errno = EINVAL;
+        return -1;
+    }
+    std::string parent, leaf;
+    splitPath(path, parent, leaf);
+    std::shared_ptr<DirHandle> handle = openDir(parent);
+    if(!handle){
+        return -1;
+    }
+    return mkdirat(handle->fd, leaf.c_str(), 0755);
+}
+
+int DirTree::remove(const std::string &path){
+    if(!isValidPath(path)){
+        errno = EINVAL;
+        return -1;
+    }
+    std::string parent, leaf;
+    splitPath(path, parent, leaf);
+    std::shared_ptr<DirHandle> handle = openDir(parent);
+    if(!handle){
+        return -1;
+    }
+    if(unlinkat(handle->fd, leaf.c_str(), 0) == 0){
+        return 0;
+    }
+    // 目录只有为空时才能删除
+    if(errno != EISDIR || unlinkat(handle->fd, leaf.c_str(), AT_REMOVEDIR) != 0){
+        return -1;
+    }
+    invalidate(path);
+    return 0;
+}
+
+int DirTree::statPath(const std::string &path, struct stat &fileStat){
+    if(!isValidPath(path)){
+        errno = EINVAL;
+        return -1;
+    }
+    std::string parent, leaf;
+    splitPath(path, parent, leaf);
+    std::shared_ptr<DirHandle> handle = openDir(parent);
+    if(!handle){
+        return -1;
+    }
+    return fstatat(handle->fd, leaf.c_str(), &fileStat, AT_SYMLINK_NOFOLLOW);
+}
+
+int DirTree::renameInto(const std::string &srcPath, const std::string &path){
+    if(!isValidPath(path)){
+        errno = EINVAL;
+        return -1;
+    }
+    std::string parent, leaf;
+    splitPath(path, parent, leaf);
+    std::shared_ptr<DirHandle> handle = openDir(parent);
+    if(!handle){
+        return -1;
+    }
+    return renameat(AT_FDCWD, srcPath.c_str(), handle->fd, leaf.c_str());
+}
+
+int DirTree::listDir(const std::string &dirPath, std::vector<std::string> &files, std::vector<std::string> &dirs){
+    std::shared_ptr<DirHandle> handle = openDir(dirPath);
+    if(!handle){
+        return -1;
+    }
+    // O_PATH 描述符不能读取目录项，重新打开一次
+    int fd = openat(handle->fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(fd == -1){
+        return -1;
+    }
+    DIR *dir = fdopendir(fd);
+    if(dir == nullptr){
+        close(fd);
+        return -1;
+    }
+    struct dirent *stdinfo;
+    while((stdinfo = readdir(dir)) != nullptr){
+        // 跳过 . 和 .. 以及隐藏文件（如保存上传会话的 .uploads 目录）
+        if(stdinfo->d_name[0] == '.'){
+            continue;
+        }
+        unsigned char type = stdinfo->d_type;
+        if(type == DT_UNKNOWN){
+            struct stat fileStat;
+            if(fstatat(fd, stdinfo->d_name, &fileStat, AT_SYMLINK_NOFOLLOW) == 0){
+                type = S_ISDIR(fileStat.st_mode) ? DT_DIR : (S_ISREG(fileStat.st_mode) ? DT_REG : DT_UNKNOWN);
+            }
+        }
+        if(type == DT_DIR){
+            dirs.push_back(stdinfo->d_name);
+        }else if(type == DT_REG){
+            files.push_back(stdinfo->d_name);
+        }
+    }
+    closedir(dir);
+    return 0;
+}
+
+void DirTree::listAll(std::vector<std::string> &paths){
+    // pending 中保存还没有读取的目录
+    std::vector<std::string> pending(1, "");
+    while(!pending.empty()){
+        std::string dirPath = pending.back();
+        pending.pop_back();
+        std::vector<std::string> files, dirs;
+        if(listDir(dirPath, files, dirs) != 0){
+            continue;
+        }
+        std::string prefix = dirPath.empty() ? "" : dirPath + "/";
+        for(size_t i = 0; i < files.size(); ++i){
+            paths.push_back(prefix + files[i]);
+        }
+        for(size_t i = 0; i < dirs.size(); ++i){
+            pending.push_back(prefix + dirs[i]);
+        }
+    }
+}
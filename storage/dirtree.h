@@ -0,0 +1,71 @@
+/*  文件说明：
+ *  1. filedir 中的多级目录：路径为相对 filedir 的 "目录/子目录/文件名"，每一级都必须是有效的文件名（不能为空，不能以 . 开头）
+ *  2. 目录使用 O_PATH 打开的描述符表示并缓存，打开文件、创建目录和删除都通过 openat / mkdirat / unlinkat 相对父目录的描述符完成，
+ *     每次请求不需要从 filedir 开始重新查找整个路径
+ *  3. 解析路径使用 openat2 的 RESOLVE_BENEATH：任何 ..、绝对路径或者指向 filedir 之外的符号链接都会失败，
+ *     内核不支持 openat2 时逐级使用 O_NOFOLLOW 打开，不跟随任何符号链接
+ *  4. 缓存的描述符由 shared_ptr 管理，缓存满或者目录被删除时移出缓存，正在使用的描述符在最后一个引用释放后关闭
+ */
+#ifndef DIRTREE_H
+#define DIRTREE_H
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+#include <sys/stat.h>
+
+#define DIR_CACHE_SIZE 4096     // 最多缓存的目录描述符个数
+
+// 一个以 O_PATH 打开的目录
+struct DirHandle{
+    int fd = -1;
+    ~DirHandle();
+};
+
+class DirTree{
+public:
+    // 路径的每一级都是有效的文件名
+    static bool isValidPath(const std::string &path);
+
+    // 打开目录（空字符串表示 filedir），失败时返回空指针
+    static std::shared_ptr<DirHandle> openDir(const std::string &dirPath);
+
+    // 打开文件，flags 同 open，失败时返回 -1
+    static int openFile(const std::string &path, int flags);
+
+    // 创建目录，父目录需要已经存在
+    static int makeDir(const std::string &path);
+
+    // 删除文件或者空目录
+    static int remove(const std::string &path);
+
+    // 获取文件或者目录的属性，不跟随符号链接
+    static int statPath(const std::string &path, struct stat &fileStat);
+
+    // 将 srcPath（相对当前工作目录，如上传的临时文件）原子地 rename 为 path
+    static int renameInto(const std::string &srcPath, const std::string &path);
+
+    // 获取目录中的文件名和子目录名，跳过 . 开头的名字
+    static int listDir(const std::string &dirPath, std::vector<std::string> &files, std::vector<std::string> &dirs);
+
+    // 递归获取所有文件的路径
+    static void listAll(std::vector<std::string> &paths);
+
+    // 将路径分为父目录和最后一级的名字
+    static void splitPath(const std::string &path, std::string &parent, std::string &leaf);
+
+private:
+    // 相对 dirFd 解析 relPath 并打开，限制在 dirFd 之内
+    static int resolve(int dirFd, const std::string &relPath, int flags);
+
+    // 目录被删除后，将它和它的所有子目录移出缓存
+    static void invalidate(const std::string &dirPath);
+
+private:
+    static std::mutex lock;
+    static std::unordered_map<std::string, std::shared_ptr<DirHandle> > cache;     // 目录路径 -> 描述符，包括 filedir（空字符串）
+};
+
+#endif
@@ -0,0 +1,325 @@
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "dirusage.h"
+#include "dirtree.h"
+#include "metaindex.h"
+#include "../utils/utils.h"
+
+std::mutex DirUsage::lock;
+DirUsage::State DirUsage::state = DirUsage::IDLE;
+long long DirUsage::pending = 0;
+std::function<void(const std::string&)> DirUsage::dispatcher;
+std::unordered_map<std::string, DirStat> DirUsage::stats;
+std::unordered_map<std::string, DirUsage::ScanProgress> DirUsage::scanning;
+
+namespace {
+
+// getdents64 返回的目录项（linux_dirent64，glibc 中没有对应的结构体）
+struct LinuxDirent64{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[1];
+};
+
+#define GETDENTS_BUFFER_SIZE (64 * 1024)     // 每次 getdents64 读取的目录项缓冲区大小
+
+// 内核或 glibc 不支持 statx 时置为 false，之后使用 fstatat
+std::atomic<bool> statxSupported(true);
+
+// 获取目录项的长度，type 为 DT_UNKNOWN（部分文件系统不返回类型）时同时获取类型
+int statEntry(int dirFd, const char *name, unsigned char &type, long long &size){
+#ifdef STATX_SIZE
+    if(statxSupported){
+        struct statx stx;
+        unsigned int mask = STATX_SIZE | (type == DT_UNKNOWN ? STATX_TYPE : 0);
+        if(statx(dirFd, name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC, mask, &stx) == 0){
+            if(type == DT_UNKNOWN){
+                type = S_ISDIR(stx.stx_mode) ? DT_DIR : (S_ISREG(stx.stx_mode) ? DT_REG : DT_UNKNOWN);
+            }
+            size = stx.stx_size;
+            return 0;
+        }
+        if(errno != ENOSYS){
+            return -1;
+        }
+        statxSupported = false;
+    }
+#endif
+    struct stat fileStat;
+    if(fstatat(dirFd, name, &fileStat, AT_SYMLINK_NOFOLLOW) != 0){
+        return -1;
+    }
+    if(type == DT_UNKNOWN){
+        type = S_ISDIR(fileStat.st_mode) ? DT_DIR : (S_ISREG(fileStat.st_mode) ? DT_REG : DT_UNKNOWN);
+    }
+    size = fileStat.st_size;
+    return 0;
+}
+
+// 目录的深度，根目录为 0
+long long depthOf(const std::string &dirPath){
+    return dirPath.empty() ? 0 : std::count(dirPath.begin(), dirPath.end(), '/') + 1;
+}
+
+}
+
+int DirUsage::scan(std::function<void(const std::string&)> dispatch){
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if(state == SCANNING){
+            return -1;
+        }
+        stats.clear();
+        scanning.clear();
+        state = SCANNING;
+        pending = 1;
+        dispatcher = dispatch;
+    }
+    std::cout << outHead("info") << "开始扫描目录占用统计" << std::endl;
+    dispatch("");
+    return 0;
+}
+
+void DirUsage::scanDir(const std::string &dirPath){
+    {
+        // 读取目录项期间该目录的修改记录到 scanning 中，扫描结束时再处理
+        std::lock_guard<std::mutex> guard(lock);
+        if(state != SCANNING){
+            return;
+        }
+        ScanProgress &progress = scanning[dirPath];
+        progress.delta = DirStat();
+        progress.changed = false;
+    }
+
+    DirStat own;
+    std::vector<std::string> subDirs;
+    std::string prefix = dirPath.empty() ? "" : dirPath + "/";
+
+    // O_PATH 描述符不能读取目录项，重新打开一次
+    std::shared_ptr<DirHandle> handle = DirTree::openDir(dirPath);
+    int fd = handle ? openat(handle->fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC) : -1;
+    if(fd == -1){
+        std::cout << outHead("warn") << "扫描目录 " << dirPath << " 失败，该目录不计入统计" << std::endl;
+    }else{
+        std::vector<char> buffer(GETDENTS_BUFFER_SIZE);
+        long n;
+        while((n = syscall(SYS_getdents64, fd, buffer.data(), buffer.size())) > 0){
+            for(long offset = 0; offset < n; ){
+                const LinuxDirent64 *entry = reinterpret_cast<const LinuxDirent64*>(buffer.data() + offset);
+                offset += entry->d_reclen;
+                // 跳过 . 和 .. 以及隐藏文件，和文件列表保持一致
+                if(entry->d_name[0] == '.'){
+                    continue;
+                }
+                unsigned char type = entry->d_type;
+                long long size = 0;
+                // 目录不需要 statx，普通文件只获取长度
+                if(type == DT_REG || type == DT_UNKNOWN){
+                    if(statEntry(fd, entry->d_name, type, size) != 0){
+                        continue;
+                    }
+                }
+                if(type == DT_DIR){
+                    subDirs.push_back(prefix + entry->d_name);
+                    ++own.dirs;
+                }else if(type == DT_REG){
+                    own.bytes += size;
+                    ++own.files;
+                }
+            }
+        }
+        close(fd);
+    }
+
+    std::function<void(const std::string&)> dispatch;
+    bool rescan = false;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if(state != SCANNING){
+            return;
+        }
+        std::unordered_map<std::string, ScanProgress>::iterator it = scanning.find(dirPath);
+        if(it == scanning.end()){
+            // 扫描期间目录被删除，不再计入统计，也不再扫描它的子目录
+            subDirs.clear();
+        }else if(it->second.changed && it->second.rescans < DIRUSAGE_MAX_RESCAN){
+            // 读取目录项期间目录被修改，无法确定扫描结果是否已经包含这些修改，重新扫描该目录，pending 不变
+            ++it->second.rescans;
+            rescan = true;
+        }else{
+            // 多次重新扫描后仍然在修改时，把期间的修改计入扫描结果，只在修改的文件恰好已经被扫描到时有偏差
+            if(fd != -1){
+                own.bytes += it->second.delta.bytes;
+                own.files += it->second.delta.files;
+                own.dirs += it->second.delta.dirs;
+                stats[dirPath] = own;
+            }
+            scanning.erase(it);
+        }
+        if(!rescan){
+            // 先计入子目录再减去当前目录，分发之前 pending 不会提前变为 0
+            pending += static_cast<long long>(subDirs.size()) - 1;
+            if(pending == 0){
+                finishLocked();
+            }
+        }
+        dispatch = dispatcher;
+    }
+    if(rescan){
+        dispatch(dirPath);
+        return;
+    }
+    for(size_t i = 0; i < subDirs.size(); ++i){
+        dispatch(subDirs[i]);
+    }
+}
+
+void DirUsage::finishLocked(){
+    // 由深到浅累加，累加到父目录时该目录的所有子目录已经累加完成
+    std::vector<std::pair<long long, std::string> > dirs;
+    dirs.reserve(stats.size());
+    for(std::unordered_map<std::string, DirStat>::const_iterator it = stats.begin(); it != stats.end(); ++it){
+        if(!it->first.empty()){
+            dirs.push_back(std::make_pair(depthOf(it->first), it->first));
+        }
+    }
+    std::sort(dirs.begin(), dirs.end(), [](const std::pair<long long, std::string> &a, const std::pair<long long, std::string> &b){
+        return a.first > b.first;
+    });
+    for(size_t i = 0; i < dirs.size(); ++i){
+        std::string parent, leaf;
+        DirTree::splitPath(dirs[i].second, parent, leaf);
+        const DirStat &child = stats[dirs[i].second];
+        DirStat &parentStat = stats[parent];
+        parentStat.bytes += child.bytes;
+        parentStat.files += child.files;
+        parentStat.dirs += child.dirs;
+    }
+    state = READY;
+    dispatcher = nullptr;
+    const DirStat &root = stats[""];
+    std::cout << outHead("info") << "目录占用统计扫描完成，共 " << root.files << " 个文件，" << root.dirs << " 个目录，" << root.bytes << " 字节" << std::endl;
+}
+
+void DirUsage::applyLocked(const std::string &dirPath, long long bytes, long long files, long long dirs){
+    if(state == IDLE){
+        return;
+    }
+    std::string curPath = dirPath, leaf;
+    while(true){
+        std::unordered_map<std::string, DirStat>::iterator it = stats.find(curPath);
+        if(it != stats.end()){
+            it->second.bytes += bytes;
+            it->second.files += files;
+            it->second.dirs += dirs;
+        }else if(state == SCANNING){
+            // 目录正在扫描，记录修改，扫描结束时重新扫描或者计入结果；还没有开始扫描的目录会在扫描时看到这个修改
+            std::unordered_map<std::string, ScanProgress>::iterator scanIt = scanning.find(curPath);
+            if(scanIt != scanning.end()){
+                scanIt->second.delta.bytes += bytes;
+                scanIt->second.delta.files += files;
+                scanIt->second.delta.dirs += dirs;
+                scanIt->second.changed = true;
+            }
+        }
+        // 扫描期间每个目录只有自己的统计，不需要修改上级目录
+        if(state == SCANNING || curPath.empty()){
+            return;
+        }
+        DirTree::splitPath(std::string(curPath), curPath, leaf);
+    }
+}
+
+bool DirUsage::isReady(){
+    std::lock_guard<std::mutex> guard(lock);
+    return state == READY;
+}
+
+int DirUsage::get(const std::string &dirPath, DirStat &stat){
+    std::lock_guard<std::mutex> guard(lock);
+    if(state != READY){
+        return -1;
+    }
+    std::unordered_map<std::string, DirStat>::const_iterator it = stats.find(dirPath);
+    if(it == stats.end()){
+        return -1;
+    }
+    stat = it->second;
+    return 0;
+}
+
+int DirUsage::usageJson(const std::string &dirPath, std::string &json){
+    DirStat dirStat;
+    if(get(dirPath, dirStat) != 0){
+        return -1;
+    }
+    std::vector<std::string> files, dirs;
+    DirTree::listDir(dirPath, files, dirs);
+    std::sort(dirs.begin(), dirs.end());
+
+    std::string prefix = dirPath.empty() ? "" : dirPath + "/";
+    std::ostringstream oss;
+    oss << "{\"path\":\"" << jsonEscape(dirPath) << "\",\"bytes\":" << dirStat.bytes << ",\"files\":" << dirStat.files
+        << ",\"dirs\":" << dirStat.dirs << ",\"children\":[";
+    bool first = true;
+    for(size_t i = 0; i < dirs.size(); ++i){
+        DirStat childStat;
+        if(get(prefix + dirs[i], childStat) != 0){
+            continue;
+        }
+        oss << (first ? "" : ",") << "{\"name\":\"" << jsonEscape(dirs[i]) << "\",\"bytes\":" << childStat.bytes
+            << ",\"files\":" << childStat.files << ",\"dirs\":" << childStat.dirs << "}";
+        first = false;
+    }
+    oss << "]}";
+    json = oss.str();
+    return 0;
+}
+
+void DirUsage::fileWritten(const std::string &path, long long oldSize, long long newSize){
+    std::string parent, leaf;
+    DirTree::splitPath(path, parent, leaf);
+    std::lock_guard<std::mutex> guard(lock);
+    applyLocked(parent, newSize - std::max(oldSize, 0LL), oldSize < 0 ? 1 : 0, 0);
+}
+
+void DirUsage::fileRemoved(const std::string &path, long long size){
+    std::string parent, leaf;
+    DirTree::splitPath(path, parent, leaf);
+    std::lock_guard<std::mutex> guard(lock);
+    applyLocked(parent, -size, -1, 0);
+}
+
+void DirUsage::dirCreated(const std::string &dirPath){
+    std::string parent, leaf;
+    DirTree::splitPath(dirPath, parent, leaf);
+    std::lock_guard<std::mutex> guard(lock);
+    // 扫描期间父目录还没有扫描时，扫描父目录时会发现这个目录
+    if(state == READY || (state == SCANNING && stats.find(parent) != stats.end())){
+        stats[dirPath] = DirStat();
+    }
+    applyLocked(parent, 0, 0, 1);
+}
+
+void DirUsage::dirRemoved(const std::string &dirPath){
+    std::string parent, leaf;
+    DirTree::splitPath(dirPath, parent, leaf);
+    std::lock_guard<std::mutex> guard(lock);
+    stats.erase(dirPath);
+    scanning.erase(dirPath);
+    applyLocked(parent, 0, 0, -1);
+}
@@ -0,0 +1,79 @@
+/*  文件说明：
+ *  1. filedir 中每个目录的占用统计（递归的文件字节数、文件个数、子目录个数），用于文件列表页面和 GET /api/usage
+ *  2. 启动时并行扫描整个目录树：每个目录是线程池中的一个事件，用 getdents64 读取目录项，只对普通文件调用 statx 获取长度
+ *     （只请求 STATX_SIZE，并且不强制同步远程文件系统的属性），扫描到的子目录作为新的事件分发给线程池
+ *  3. 所有目录扫描完成后，由深到浅把每个目录的统计累加到父目录，之后上传、删除和创建目录时增量更新所在目录和所有上级目录
+ *  4. 扫描期间发生的修改：所在目录已经扫描过时计入该目录，还没有扫描的目录会在扫描时看到这个修改；
+ *     正在读取目录项的目录记录下修改，扫描结束后重新扫描该目录（最多 DIRUSAGE_MAX_RESCAN 次，之后把修改计入扫描结果）
+ *  5. 只用于支持多级目录的 flat 引擎，其他引擎的文件不在 filedir 的目录树中
+ */
+#ifndef DIRUSAGE_H
+#define DIRUSAGE_H
+#include <string>
+#include <vector>
+#include <mutex>
+#include <functional>
+#include <unordered_map>
+
+#define DIRUSAGE_MAX_RESCAN 3     // 扫描期间目录被修改时最多重新扫描的次数
+
+// 一个目录的统计
+struct DirStat{
+    long long bytes = 0;       // 文件的总字节数
+    long long files = 0;       // 文件个数
+    long long dirs = 0;        // 子目录个数
+};
+
+class DirUsage{
+public:
+    // 开始扫描，dispatch 负责把一个目录的扫描（scanDir）交给线程池执行。已经在扫描时返回 -1
+    static int scan(std::function<void(const std::string&)> dispatch);
+
+    // 扫描一个目录，在线程池中调用
+    static void scanDir(const std::string &dirPath);
+
+    // 扫描是否已经完成
+    static bool isReady();
+
+    // 获取目录的递归统计，扫描还没有完成或者目录不存在时返回 -1
+    static int get(const std::string &dirPath, DirStat &stat);
+
+    // 目录及其直接子目录的统计（JSON）：{"path":..., "bytes":..., "files":..., "dirs":..., "children":[...]}
+    static int usageJson(const std::string &dirPath, std::string &json);
+
+    // 文件被写入，oldSize 为被替换的文件的长度，原来没有该文件时为 -1
+    static void fileWritten(const std::string &path, long long oldSize, long long newSize);
+
+    // 文件被删除
+    static void fileRemoved(const std::string &path, long long size);
+
+    // 目录被创建或者删除（只能删除空目录）
+    static void dirCreated(const std::string &dirPath);
+    static void dirRemoved(const std::string &dirPath);
+
+private:
+    // 修改目录的统计，扫描完成后同时修改所有上级目录，调用前需要持有 lock
+    static void applyLocked(const std::string &dirPath, long long bytes, long long files, long long dirs);
+
+    // 所有目录扫描完成后，将每个目录的统计累加到上级目录，调用前需要持有 lock
+    static void finishLocked();
+
+private:
+    enum State{ IDLE, SCANNING, READY };
+
+    // 一个正在读取目录项的目录
+    struct ScanProgress{
+        DirStat delta;          // 本次读取期间该目录的修改
+        bool changed = false;   // 本次读取期间是否有修改
+        int rescans = 0;        // 已经重新扫描的次数
+    };
+
+    static std::mutex lock;
+    static State state;
+    static long long pending;                                       // 已经分发但还没有扫描完成的目录个数
+    static std::function<void(const std::string&)> dispatcher;
+    static std::unordered_map<std::string, DirStat> stats;          // 目录路径 -> 统计（扫描期间只包含目录中直接的文件和子目录）
+    static std::unordered_map<std::string, ScanProgress> scanning;  // 正在读取目录项的目录
+};
+
+#endif
@@ -0,0 +1,504 @@
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <thread>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <ctime>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "metaindex.h"
+#include "storageengine.h"
+#include "../checksum/checksum.h"
+#include "../utils/utils.h"
+
+std::mutex MetaIndex::lock;
+std::map<std::string, MetaEntry> MetaIndex::entries;
+bool MetaIndex::opened = false;
+int MetaIndex::journalFd = -1;
+uint64_t MetaIndex::journalSeq = 0;
+long long MetaIndex::journalRecords = 0;
+uint64_t MetaIndex::updateSeq = 0;
+int MetaIndex::rebuilding = 0;
+std::map<std::string, uint64_t> MetaIndex::removedSeq;
+std::mutex MetaIndex::checkpointLock;
+
+namespace {
+
+const std::string CHECKPOINT_PATH = std::string(META_INDEX_DIR) + "/index";
+const std::string CHECKPOINT_TMP_PATH = std::string(META_INDEX_DIR) + "/.index.tmp";
+
+uint32_t crc32cOf(const char *data, size_t len){
+    Crc32c crc;
+    crc.update(data, len);
+    return crc.value();
+}
+
+// 写入全部数据，失败时返回 -1
+int writeAll(int fd, const char *data, size_t len){
+    size_t hasWriteLen = 0;
+    while(hasWriteLen < len){
+        ssize_t ret = write(fd, data + hasWriteLen, len - hasWriteLen);
+        if(ret == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            return -1;
+        }
+        hasWriteLen += ret;
+    }
+    return 0;
+}
+
+}
+
+// 文件名中可能包含引号、反斜杠和控制字符
+std::string jsonEscape(const std::string &str){
+    std::string res;
+    res.reserve(str.size());
+    for(size_t i = 0; i < str.size(); ++i){
+        unsigned char c = str[i];
+        if(c == '"' || c == '\\'){
+            res += '\\';
+            res += c;
+        }else if(c < 0x20){
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            res += buf;
+        }else{
+            res += c;
+        }
+    }
+    return res;
+}
+
+std::string MetaIndex::journalPath(uint64_t seq){
+    return std::string(META_INDEX_DIR) + "/journal." + std::to_string(seq);
+}
+
+int MetaIndex::open(){
+    if(mkdir(META_INDEX_DIR, 0755) != 0 && errno != EEXIST){
+        std::cout << outHead("error") << "元数据索引目录创建失败 (errno = " << errno << ")" << std::endl;
+        return -1;
+    }
+
+    bool needRebuild = false;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if(opened){
+            return 0;
+        }
+        entries.clear();
+        uint64_t seq = 0;
+        if(loadCheckpoint(seq) == 0){
+            // 按顺序重放检查点之后的所有日志，journalSeq 记录最后一个存在的日志
+            journalSeq = seq;
+            while(replayJournal(seq)){
+                journalSeq = seq++;
+            }
+        }else{
+            needRebuild = true;
+        }
+        opened = true;
+    }
+
+    int ret = needRebuild ? rebuild() : checkpoint();
+    if(ret != 0){
+        return -1;
+    }
+    std::cout << outHead("info") << "元数据索引加载完成，共 " << entries.size() << " 个文件" << std::endl;
+    std::thread(&MetaIndex::backgroundLoop).detach();
+    return 0;
+}
+
+bool MetaIndex::isOpen(){
+    std::lock_guard<std::mutex> guard(lock);
+    return opened;
+}
+
+int MetaIndex::loadCheckpoint(uint64_t &seq){
+    int fd = ::open(CHECKPOINT_PATH.c_str(), O_RDONLY);
+    if(fd == -1){
+        return -1;
+    }
+    struct stat fileStat;
+    if(fstat(fd, &fileStat) != 0 || fileStat.st_size < static_cast<off_t>(sizeof(MetaIndexHeader))){
+        close(fd);
+        return -1;
+    }
+    size_t fileSize = fileStat.st_size;
+    void *addr = mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(addr == MAP_FAILED){
+        return -1;
+    }
+
+    const char *base = static_cast<const char *>(addr);
+    MetaIndexHeader header;
+    memcpy(&header, base, sizeof(header));
+    std::string engineName(header.engine, strnlen(header.engine, sizeof(header.engine)));
+    bool valid = header.magic == META_INDEX_MAGIC && engineName == StorageEngine::current()->name()
+            && header.namesOffset == sizeof(header) + header.count * sizeof(MetaIndexColumn) && header.namesOffset <= fileSize
+            && header.bodyCrc32c == crc32cOf(base + sizeof(header), fileSize - sizeof(header));
+    if(valid){
+        const MetaIndexColumn *columns = reinterpret_cast<const MetaIndexColumn *>(base + sizeof(header));
+        size_t namesLen = fileSize - header.namesOffset;
+        for(uint64_t i = 0; i < header.count; ++i){
+            if(columns[i].nameOffset + columns[i].nameLen > namesLen){
+                valid = false;
+                break;
+            }
+            MetaEntry entry;
+            entry.size = columns[i].size;
+            entry.mtime = columns[i].mtime;
+            entry.crc32c = columns[i].crc32c;
+            entry.hasDigest = columns[i].hasDigest != 0;
+            // 检查点中的文件名已经排序，每次都插入到末尾
+            entries.emplace_hint(entries.end(), std::string(base + header.namesOffset + columns[i].nameOffset, columns[i].nameLen), entry);
+        }
+    }
+    munmap(addr, fileSize);
+    if(!valid){
+        std::cout << outHead("warn") << "元数据索引的检查点无效，从存储引擎重建" << std::endl;
+        entries.clear();
+        return -1;
+    }
+    seq = header.journalSeq;
+    return 0;
+}
+
+bool MetaIndex::replayJournal(uint64_t seq){
+    int fd = ::open(journalPath(seq).c_str(), O_RDONLY);
+    if(fd == -1){
+        return false;
+    }
+    std::string content;
+    char buf[64 * 1024];
+    ssize_t readLen;
+    while((readLen = read(fd, buf, sizeof(buf))) > 0){
+        content.append(buf, readLen);
+    }
+    close(fd);
+
+    // 逐条应用记录，遇到不完整或校验失败的记录（写入时崩溃）时停止
+    size_t offset = 0;
+    while(offset + sizeof(MetaJournalHeader) <= content.size()){
+        MetaJournalHeader header;
+        memcpy(&header, content.data() + offset, sizeof(header));
+        if(header.magic != META_JOURNAL_MAGIC || offset + sizeof(header) + header.nameLen > content.size()){
+            break;
+        }
+        uint32_t recordCrc = header.recordCrc32c;
+        header.recordCrc32c = 0;
+        Crc32c crc;
+        crc.update(reinterpret_cast<const char *>(&header), sizeof(header));
+        crc.update(content.data() + offset + sizeof(header), header.nameLen);
+        if(crc.value() != recordCrc){
+            break;
+        }
+        std::string fileName(content.data() + offset + sizeof(header), header.nameLen);
+        if(header.type == META_JOURNAL_PUT){
+            MetaEntry &entry = entries[fileName];
+            entry.size = header.size;
+            entry.mtime = header.mtime;
+            entry.crc32c = header.crc32c;
+            entry.hasDigest = header.hasDigest != 0;
+        }else{
+            entries.erase(fileName);
+        }
+        offset += sizeof(header) + header.nameLen;
+    }
+    return true;
+}
+
+int MetaIndex::openJournal(uint64_t seq){
+    int fd = ::open(journalPath(seq).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if(fd == -1){
+        std::cout << outHead("error") << "元数据索引的日志创建失败 (errno = " << errno << ")" << std::endl;
+        return -1;
+    }
+    if(journalFd != -1){
+        close(journalFd);
+    }
+    journalFd = fd;
+    journalSeq = seq;
+    journalRecords = 0;
+    return 0;
+}
+
+void MetaIndex::appendJournal(uint8_t type, const std::string &fileName, const MetaEntry &entry){
+    if(journalFd == -1){
+        return;
+    }
+    MetaJournalHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = META_JOURNAL_MAGIC;
+    header.type = type;
+    header.hasDigest = entry.hasDigest ? 1 : 0;
+    header.nameLen = fileName.size();
+    header.crc32c = entry.crc32c;
+    header.size = entry.size;
+    header.mtime = entry.mtime;
+    Crc32c crc;
+    crc.update(reinterpret_cast<const char *>(&header), sizeof(header));
+    crc.update(fileName.c_str(), fileName.size());
+    header.recordCrc32c = crc.value();
+
+    // 一条记录使用一次 write 写入，日志不单独落盘：断电丢失的记录会在下次启动检查时发现并重建
+    std::string record(reinterpret_cast<const char *>(&header), sizeof(header));
+    record += fileName;
+    if(writeAll(journalFd, record.c_str(), record.size()) != 0){
+        std::cout << outHead("error") << "元数据索引的日志写入失败 (errno = " << errno << ")" << std::endl;
+    }
+    ++journalRecords;
+}
+
+bool MetaIndex::readEntry(const std::string &fileName, MetaEntry &entry){
+    StorageReader *reader = StorageEngine::current()->openReader(fileName);
+    if(reader == nullptr){
+        return false;
+    }
+    entry.size = reader->length();
+    FileDigest digest;
+    entry.hasDigest = reader->digest(digest);
+    entry.crc32c = entry.hasDigest ? digest.crc32c : 0;
+    delete reader;
+
+    // 保存为普通文件时使用文件的修改时间，否则使用当前时间
+    entry.mtime = time(nullptr);
+    std::string filePath = StorageEngine::current()->localPath(fileName);
+    struct stat fileStat;
+    if(!filePath.empty() && stat(filePath.c_str(), &fileStat) == 0){
+        entry.mtime = fileStat.st_mtime;
+    }
+    return true;
+}
+
+bool MetaIndex::matchesStorage(const std::string &fileName, const MetaEntry &entry){
+    std::string filePath = StorageEngine::current()->localPath(fileName);
+    struct stat fileStat;
+    if(!filePath.empty() && stat(filePath.c_str(), &fileStat) == 0){
+        return fileStat.st_size == entry.size && fileStat.st_mtime == entry.mtime;
+    }
+    // 打包保存的文件没有自己的修改时间
+    StorageReader *reader = StorageEngine::current()->openReader(fileName);
+    if(reader == nullptr){
+        return false;
+    }
+    bool match = reader->length() == entry.size;
+    delete reader;
+    return match;
+}
+
+void MetaIndex::update(const std::string &fileName){
+    if(!isOpen()){
+        return;
+    }
+    MetaEntry entry;
+    if(!readEntry(fileName, entry)){
+        remove(fileName);
+        return;
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    entry.seq = ++updateSeq;
+    entries[fileName] = entry;
+    removedSeq.erase(fileName);
+    appendJournal(META_JOURNAL_PUT, fileName, entry);
+}
+
+void MetaIndex::remove(const std::string &fileName){
+    std::lock_guard<std::mutex> guard(lock);
+    if(!opened){
+        return;
+    }
+    // 重建期间删除的文件可能已经被扫描到，记录下来合并时丢弃
+    uint64_t seq = ++updateSeq;
+    if(rebuilding > 0){
+        removedSeq[fileName] = seq;
+    }
+    if(entries.erase(fileName) > 0){
+        appendJournal(META_JOURNAL_DELETE, fileName, MetaEntry());
+    }
+}
+
+void MetaIndex::list(std::vector<std::string> &names){
+    std::lock_guard<std::mutex> guard(lock);
+    names.reserve(names.size() + entries.size());
+    for(std::map<std::string, MetaEntry>::const_iterator it = entries.begin(); it != entries.end(); ++it){
+        names.push_back(it->first);
+    }
+}
+
+std::string MetaIndex::listJson(){
+    std::ostringstream oss;
+    oss << "[";
+    std::lock_guard<std::mutex> guard(lock);
+    for(std::map<std::string, MetaEntry>::const_iterator it = entries.begin(); it != entries.end(); ++it){
+        char crcHex[9];
+        snprintf(crcHex, sizeof(crcHex), "%08x", it->second.crc32c);
+        oss << (it == entries.begin() ? "" : ",")
+            << "{\"name\":\"" << jsonEscape(it->first) << "\""
+            << ",\"size\":" << it->second.size
+            << ",\"mtime\":" << it->second.mtime
+            << ",\"crc32c\":" << (it->second.hasDigest ? "\"" + std::string(crcHex) + "\"" : "null") << "}";
+    }
+    oss << "]";
+    return oss.str();
+}
+
+int MetaIndex::rebuild(){
+    // 记录扫描开始时的序号，之后的更新和删除在合并时优先于扫描结果
+    uint64_t startSeq;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        startSeq = updateSeq;
+        ++rebuilding;
+    }
+
+    // 在锁外扫描存储引擎
+    std::vector<std::string> names;
+    StorageEngine::current()->list(names);
+    std::map<std::string, MetaEntry> newEntries;
+    for(size_t i = 0; i < names.size(); ++i){
+        MetaEntry entry;
+        if(readEntry(names[i], entry)){
+            newEntries[names[i]] = entry;
+        }
+    }
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        for(std::map<std::string, MetaEntry>::const_iterator it = entries.begin(); it != entries.end(); ++it){
+            if(it->second.seq > startSeq){
+                newEntries[it->first] = it->second;
+            }
+        }
+        for(std::map<std::string, uint64_t>::const_iterator it = removedSeq.begin(); it != removedSeq.end(); ++it){
+            if(it->second > startSeq){
+                newEntries.erase(it->first);
+            }
+        }
+        entries.swap(newEntries);
+        if(--rebuilding == 0){
+            removedSeq.clear();
+        }
+    }
+    std::cout << outHead("info") << "元数据索引重建完成，共 " << names.size() << " 个文件" << std::endl;
+    return checkpoint();
+}
+
+int MetaIndex::checkpoint(){
+    std::lock_guard<std::mutex> checkpointGuard(checkpointLock);
+
+    // 在锁内复制索引并切换到新的日志，之后的更新写入新的日志，检查点包含切换之前的所有更新
+    std::vector<std::pair<std::string, MetaEntry> > snapshot;
+    uint64_t seq;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if(openJournal(journalSeq + 1) != 0){
+            return -1;
+        }
+        seq = journalSeq;
+        snapshot.assign(entries.begin(), entries.end());
+    }
+
+    MetaIndexHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = META_INDEX_MAGIC;
+    header.count = snapshot.size();
+    header.journalSeq = seq;
+    header.namesOffset = sizeof(header) + snapshot.size() * sizeof(MetaIndexColumn);
+    strncpy(header.engine, StorageEngine::current()->name(), sizeof(header.engine) - 1);
+
+    std::string body(snapshot.size() * sizeof(MetaIndexColumn), '\0');
+    std::string names;
+    for(size_t i = 0; i < snapshot.size(); ++i){
+        MetaIndexColumn column;
+        memset(&column, 0, sizeof(column));
+        column.nameOffset = names.size();
+        column.nameLen = snapshot[i].first.size();
+        column.crc32c = snapshot[i].second.crc32c;
+        column.size = snapshot[i].second.size;
+        column.mtime = snapshot[i].second.mtime;
+        column.hasDigest = snapshot[i].second.hasDigest ? 1 : 0;
+        memcpy(&body[i * sizeof(column)], &column, sizeof(column));
+        names += snapshot[i].first;
+    }
+    body += names;
+    header.bodyCrc32c = crc32cOf(body.c_str(), body.size());
+
+    // 先写临时文件并落盘，再原子地替换检查点
+    int fd = ::open(CHECKPOINT_TMP_PATH.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd == -1){
+        return -1;
+    }
+    if(writeAll(fd, reinterpret_cast<const char *>(&header), sizeof(header)) != 0 || writeAll(fd, body.c_str(), body.size()) != 0
+            || fdatasync(fd) != 0){
+        close(fd);
+        unlink(CHECKPOINT_TMP_PATH.c_str());
+        return -1;
+    }
+    close(fd);
+    if(rename(CHECKPOINT_TMP_PATH.c_str(), CHECKPOINT_PATH.c_str()) != 0){
+        unlink(CHECKPOINT_TMP_PATH.c_str());
+        return -1;
+    }
+
+    // 除了当前的日志之外都已经不再需要（包括检查点损坏时遗留的序号更大的旧日志，避免以后被错误地重放）
+    DIR *dir = opendir(META_INDEX_DIR);
+    if(dir != nullptr){
+        struct dirent *stdinfo;
+        while((stdinfo = readdir(dir)) != nullptr){
+            if(strncmp(stdinfo->d_name, "journal.", 8) == 0 && strtoull(stdinfo->d_name + 8, nullptr, 10) != seq){
+                unlink((std::string(META_INDEX_DIR) + "/" + stdinfo->d_name).c_str());
+            }
+        }
+        closedir(dir);
+    }
+    return 0;
+}
+
+void MetaIndex::backgroundLoop(){
+    // 启动后检查索引和存储引擎中的文件是否一致（上次运行时断电丢失了日志，或者有文件在服务器之外被修改）
+    std::vector<std::string> names;
+    StorageEngine::current()->list(names);
+    std::sort(names.begin(), names.end());
+    std::vector<std::pair<std::string, MetaEntry> > snapshot;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        snapshot.assign(entries.begin(), entries.end());
+    }
+    // 文件名相同时还要比较长度和修改时间（文件在服务器之外被覆盖），在锁外获取文件信息
+    bool consistent = names.size() == snapshot.size();
+    for(size_t i = 0; consistent && i < names.size(); ++i){
+        consistent = names[i] == snapshot[i].first && matchesStorage(names[i], snapshot[i].second);
+    }
+    if(!consistent){
+        std::cout << outHead("warn") << "元数据索引和存储引擎中的文件不一致，重新建立索引" << std::endl;
+        rebuild();
+    }
+
+    std::chrono::steady_clock::time_point lastCheckpoint = std::chrono::steady_clock::now();
+    while(true){
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+        long long records;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            records = journalRecords;
+        }
+        bool timeout = std::chrono::steady_clock::now() - lastCheckpoint >= std::chrono::seconds(META_CHECKPOINT_INTERVAL);
+        if(records >= META_CHECKPOINT_RECORDS || (records > 0 && timeout)){
+            if(checkpoint() != 0){
+                std::cout << outHead("error") << "元数据索引的检查点写入失败 (errno = " << errno << ")" << std::endl;
+            }
+            lastCheckpoint = std::chrono::steady_clock::now();
+        }
+    }
+}
@@ -0,0 +1,141 @@
+/*  文件说明：
+ *  1. 持久化的文件元数据索引：保存所有文件的文件名、长度、修改时间和 CRC32C，文件列表页面和 /api/files 直接从内存中的索引返回，
+ *     不需要每次扫描 filedir（文件很多时扫描目录和获取文件信息都很慢）
+ *  2. 检查点文件 filedir/.meta/index 可以直接 mmap：文件头之后是按文件名排序的定长列（MetaIndexColumn），最后是所有文件名拼接成的字符串区
+ *  3. 上传和删除文件时向日志 filedir/.meta/journal.序号 追加一条记录，每条记录带有 CRC32C，崩溃时末尾不完整的记录会被忽略
+ *  4. 后台线程定期写入新的检查点：在锁内复制索引并切换到新的日志文件，锁外写入临时文件后 rename，之后删除旧的日志。
+ *     检查点记录了它之后的第一个日志序号，启动时加载检查点后按顺序重放之后的日志
+ *  5. 检查点损坏或者属于其他存储引擎时，从存储引擎重建索引；启动后后台线程还会和存储引擎中的文件逐个比较文件名、长度和修改时间，不一致时重建
+ *  6. 每次更新和删除都分配一个递增的序号。重建在锁外扫描存储引擎，完成后和索引合并而不是直接替换：
+ *     序号大于扫描开始时的条目（扫描期间完成的上传）保留索引中的值，扫描期间删除的文件不会被重新加入
+ */
+#ifndef METAINDEX_H
+#define METAINDEX_H
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <cstdint>
+
+#define META_INDEX_DIR "filedir/.meta"             // 检查点和日志所在的目录
+#define META_CHECKPOINT_INTERVAL 60                // 写入检查点的最长间隔（秒）
+#define META_CHECKPOINT_RECORDS 10000              // 日志记录达到该数量后尽快写入检查点
+
+#define META_INDEX_MAGIC 0x3158444Du               // "MDX1"
+#define META_JOURNAL_MAGIC 0x314C4E4Au             // "JNL1"
+
+// 检查点的文件头，整数以本机字节序保存
+struct MetaIndexHeader{
+    uint32_t magic;
+    uint32_t bodyCrc32c;        // 文件头之后所有数据的 CRC32C
+    uint64_t count;             // 文件个数
+    uint64_t journalSeq;        // 检查点之后的第一个日志序号
+    uint64_t namesOffset;       // 文件名区相对文件开头的偏移
+    char engine[16];            // 建立索引时使用的存储引擎
+};
+
+// 检查点中每个文件对应的一列，按文件名排序
+struct MetaIndexColumn{
+    uint64_t nameOffset;        // 文件名在文件名区中的偏移
+    uint32_t nameLen;
+    uint32_t crc32c;
+    int64_t size;
+    int64_t mtime;
+    uint32_t hasDigest;
+    uint32_t reserved;
+};
+
+// 日志记录的类型
+enum META_JOURNAL_TYPE{
+    META_JOURNAL_PUT = 1,
+    META_JOURNAL_DELETE = 2
+};
+
+// 日志记录头，之后是文件名
+struct MetaJournalHeader{
+    uint32_t magic;
+    uint32_t recordCrc32c;      // 记录头（该字段为 0）和文件名的 CRC32C
+    uint8_t type;
+    uint8_t hasDigest;
+    uint16_t nameLen;
+    uint32_t crc32c;
+    int64_t size;
+    int64_t mtime;
+};
+
+// 内存中一个文件的元数据
+struct MetaEntry{
+    long long size = 0;
+    long long mtime = 0;
+    uint32_t crc32c = 0;
+    bool hasDigest = false;
+    uint64_t seq = 0;           // 最后一次更新的序号，只保存在内存中，重建时用于合并
+};
+
+// 转义 JSON 字符串中的引号、反斜杠和控制字符，供 /api 的响应使用
+std::string jsonEscape(const std::string &str);
+
+class MetaIndex{
+public:
+    // 加载检查点并重放日志，失败时从存储引擎重建，之后启动后台的检查和检查点线程。在选择存储引擎之后调用
+    static int open();
+
+    // 是否启用了元数据索引
+    static bool isOpen();
+
+    // 文件上传完成后调用，从存储引擎读取文件的长度和校验值更新索引；文件已经不存在时从索引中删除
+    static void update(const std::string &fileName);
+
+    // 文件删除后调用
+    static void remove(const std::string &fileName);
+
+    // 按文件名顺序获取所有文件名
+    static void list(std::vector<std::string> &names);
+
+    // 所有文件的元数据，JSON 数组，每项包含 name、size、mtime、crc32c
+    static std::string listJson();
+
+    // 从存储引擎重新建立索引，并写入检查点
+    static int rebuild();
+
+    // 立即写入检查点
+    static int checkpoint();
+
+private:
+    // 加载检查点，成功时返回 0
+    static int loadCheckpoint(uint64_t &journalSeq);
+
+    // 重放一个日志文件，返回是否存在
+    static bool replayJournal(uint64_t seq);
+
+    // 打开新的日志文件用于追加，调用前需要持有 lock
+    static int openJournal(uint64_t seq);
+
+    // 向日志追加一条记录，调用前需要持有 lock
+    static void appendJournal(uint8_t type, const std::string &fileName, const MetaEntry &entry);
+
+    // 从存储引擎读取文件的元数据
+    static bool readEntry(const std::string &fileName, MetaEntry &entry);
+
+    // 索引中的长度和修改时间是否和存储引擎中的文件一致，不是普通文件时只比较长度
+    static bool matchesStorage(const std::string &fileName, const MetaEntry &entry);
+
+    // 后台线程：检查索引和存储引擎是否一致，之后定期写入检查点
+    static void backgroundLoop();
+
+    static std::string journalPath(uint64_t seq);
+
+private:
+    static std::mutex lock;                                 // 保护以下所有成员
+    static std::map<std::string, MetaEntry> entries;        // 文件名 -> 元数据，按文件名排序
+    static bool opened;
+    static int journalFd;
+    static uint64_t journalSeq;                             // 当前日志的序号
+    static long long journalRecords;                        // 上次检查点之后的日志记录数
+    static uint64_t updateSeq;                              // 最后分配的更新序号
+    static int rebuilding;                                  // 正在进行的重建数
+    static std::map<std::string, uint64_t> removedSeq;      // 重建期间删除的文件 -> 删除时的序号
+    static std::mutex checkpointLock;                       // 同时只写入一个检查点
+};
+
+#endif
@@ -0,0 +1,597 @@
+#include <iostream>
+#include <algorithm>
+#include <thread>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+
+#include "packedstore.h"
+#include "pagecache.h"
+#include "../utils/utils.h"
+
+namespace {
+
+// 读取记录头时顺便读取之后的 256 个字节，通常已经包含整个文件名，更长的文件名再读一次
+const size_t RECORD_HEAD_READ_SIZE = sizeof(PackedRecordHeader) + 256;
+
+long long recordSize(size_t nameLen, size_t dataLen){
+    return sizeof(PackedRecordHeader) + nameLen + dataLen;
+}
+
+// 读取 offset 处的记录头和文件名，记录不完整或格式错误时返回 -1
+int readRecordHead(int fd, long long offset, long long fileSize, PackedRecordHeader &header, std::string &fileName){
+    char buf[RECORD_HEAD_READ_SIZE];
+    ssize_t readLen = pread(fd, buf, sizeof(buf), offset);
+    if(readLen < static_cast<ssize_t>(sizeof(PackedRecordHeader))){
+        return -1;
+    }
+    memcpy(&header, buf, sizeof(header));
+    if(header.magic != PACKED_RECORD_MAGIC || (header.type != PACKED_PUT && header.type != PACKED_DELETE)
+            || header.nameLen == 0 || offset + recordSize(header.nameLen, header.dataLen) > fileSize){
+        return -1;
+    }
+    if(sizeof(header) + header.nameLen <= static_cast<size_t>(readLen)){
+        fileName.assign(buf + sizeof(header), header.nameLen);
+        return 0;
+    }
+    // 文件名超过了第一次读取的长度，单独读取完整的文件名
+    fileName.resize(header.nameLen);
+    if(pread(fd, &fileName[0], header.nameLen, offset + sizeof(header)) != static_cast<ssize_t>(header.nameLen)){
+        return -1;
+    }
+    return 0;
+}
+
+// 下载段中的小文件：用 sendfile 从段文件中数据所在的偏移发送
+class PackedReader : public StorageReader{
+public:
+    PackedReader(const std::shared_ptr<PackedSegment> &segment, long long dataOffset, long long length, bool hasDigest, const FileDigest &digest)
+        : m_segment(segment), m_dataOffset(dataOffset), m_length(length), m_sentLen(0), m_hasDigest(hasDigest), m_digest(digest){ }
+
+    virtual long long length() const override { return m_length; }
+
+    virtual bool digest(FileDigest &digest) const override {
+        if(m_hasDigest){
+            digest = m_digest;
+        }
+        return m_hasDigest;
+    }
+
+    virtual long long cachedLength(long long maxLen) override {
+        return PageCache::residentLength(m_segment->fd, m_dataOffset + m_sentLen, std::min<long long>(maxLen, m_length - m_sentLen));
+    }
+
+    virtual void prefetch(long long len) override {
+        PageCache::prefetch(m_segment->fd, m_dataOffset + m_sentLen, std::min<long long>(len, m_length - m_sentLen));
+    }
+
+    virtual long long sendTo(int sockFd, long long maxLen) override {
+        off_t offset = m_dataOffset + m_sentLen;
+        ssize_t sentLen = sendfile(sockFd, m_segment->fd, &offset, std::min<long long>(maxLen, m_length - m_sentLen));
+        if(sentLen > 0){
+            m_sentLen += sentLen;
+        }
+        return sentLen;
+    }
+
+private:
+    std::shared_ptr<PackedSegment> m_segment;   // 持有段文件，段被整理删除后仍然可以读取
+    long long m_dataOffset;
+    long long m_length;
+    long long m_sentLen;
+    bool m_hasDigest;
+    FileDigest m_digest;
+};
+
+// 上传文件：不超过 PACKED_MAX_FILE_SIZE 时数据保存在内存中，commit 时作为一条记录追加；超过后转为普通文件上传
+class PackedWriter : public StorageWriter{
+public:
+    PackedWriter(PackedStorage &storage, FlatStorage &flat, const std::string &fileName)
+        : m_storage(storage), m_flat(flat), m_fileName(fileName), m_flatWriter(nullptr), m_size(0){ }
+    virtual ~PackedWriter(){ abort(); }
+
+    virtual int write(const char *data, size_t len) override {
+        if(m_flatWriter == nullptr && m_data.size() + len > PACKED_MAX_FILE_SIZE){
+            // 超过小文件的长度，已经接收的数据转入普通文件
+            m_flatWriter = m_flat.createWriter(m_fileName);
+            if(m_flatWriter == nullptr || m_flatWriter->write(m_data.c_str(), m_data.size()) != 0){
+                return -1;
+            }
+            std::string().swap(m_data);
+        }
+        m_size += len;
+        if(m_flatWriter != nullptr){
+            return m_flatWriter->write(data, len);
+        }
+        m_data.append(data, len);
+        return 0;
+    }
+
+    virtual int commit(const FileDigest *digest) override {
+        if(m_flatWriter == nullptr){
+            return m_storage.put(m_fileName, m_data.c_str(), m_data.size(), digest);
+        }
+        int ret = m_flatWriter->commit(digest);
+        delete m_flatWriter;
+        m_flatWriter = nullptr;
+        if(ret == 0){
+            m_storage.removePacked(m_fileName);
+        }
+        return ret;
+    }
+
+    virtual void abort() override {
+        if(m_flatWriter != nullptr){
+            m_flatWriter->abort();
+            delete m_flatWriter;
+            m_flatWriter = nullptr;
+        }
+        m_data.clear();
+    }
+
+    virtual long long size() const override { return m_size; }
+
+private:
+    PackedStorage &m_storage;
+    FlatStorage &m_flat;
+    std::string m_fileName;
+    std::string m_data;
+    StorageWriter *m_flatWriter;
+    long long m_size;
+};
+
+}
+
+PackedSegment::~PackedSegment(){
+    if(fd != -1){
+        close(fd);
+    }
+}
+
+PackedStorage::PackedStorage() : m_initialized(false){
+
+}
+
+std::string PackedStorage::segmentPath(uint32_t id){
+    char name[32];
+    snprintf(name, sizeof(name), "/%08u.seg", id);
+    return std::string(PACKED_SEGMENT_DIR) + name;
+}
+
+int PackedStorage::init(){
+    std::lock_guard<std::mutex> guard(m_lock);
+    if(m_initialized){
+        return 0;
+    }
+    if(mkdir(PACKED_SEGMENT_DIR, 0755) != 0 && errno != EEXIST){
+        std::cout << outHead("error") << "段文件目录创建失败 (errno = " << errno << ")" << std::endl;
+        return -1;
+    }
+
+    // 按段号顺序打开所有段文件，之后依次扫描，后面的记录覆盖前面的记录
+    DIR *dir = opendir(PACKED_SEGMENT_DIR);
+    if(dir == nullptr){
+        return -1;
+    }
+    struct dirent *stdinfo;
+    while((stdinfo = readdir(dir)) != nullptr){
+        unsigned int id = 0;
+        char suffix[8] = {0};
+        if(sscanf(stdinfo->d_name, "%8u.%3s", &id, suffix) != 2 || strcmp(suffix, "seg") != 0 || id == 0){
+            continue;
+        }
+        std::shared_ptr<PackedSegment> segment = std::make_shared<PackedSegment>();
+        segment->id = id;
+        segment->fd = open(segmentPath(id).c_str(), O_RDWR);
+        if(segment->fd == -1){
+            std::cout << outHead("error") << "段文件 " << segmentPath(id) << " 打开失败 (errno = " << errno << ")" << std::endl;
+            closedir(dir);
+            return -1;
+        }
+        m_segments[id] = segment;
+    }
+    closedir(dir);
+
+    for(std::map<uint32_t, std::shared_ptr<PackedSegment> >::iterator it = m_segments.begin(); it != m_segments.end(); ++it){
+        bool isLast = it->first == m_segments.rbegin()->first;
+        if(loadSegment(it->second, isLast) != 0){
+            return -1;
+        }
+    }
+    if(!m_segments.empty() && m_segments.rbegin()->second->size < PACKED_SEGMENT_SIZE){
+        m_active = m_segments.rbegin()->second;
+    }
+    std::cout << outHead("info") << "段文件加载完成，共 " << m_segments.size() << " 个段，" << m_index.size() << " 个小文件" << std::endl;
+
+    std::thread(&PackedStorage::compactLoop, this).detach();
+    m_initialized = true;
+    return 0;
+}
+
+int PackedStorage::loadSegment(const std::shared_ptr<PackedSegment> &segment, bool isLast){
+    struct stat fileStat;
+    if(fstat(segment->fd, &fileStat) != 0){
+        return -1;
+    }
+    long long offset = 0;
+    PackedRecordHeader header;
+    std::string fileName;
+    while(offset < fileStat.st_size && readRecordHead(segment->fd, offset, fileStat.st_size, header, fileName) == 0){
+        long long recordLen = recordSize(header.nameLen, header.dataLen);
+        dropEntry(fileName);
+        if(header.type == PACKED_PUT){
+            PackedEntry entry;
+            entry.segmentId = segment->id;
+            entry.length = header.dataLen;
+            entry.recordOffset = offset;
+            m_index[fileName] = entry;
+            segment->liveBytes += recordLen;
+        }
+        offset += recordLen;
+    }
+
+    if(offset < fileStat.st_size){
+        if(isLast){
+            // 写入最后一条记录时崩溃，截断不完整的记录，之后的追加从完整的记录之后开始
+            std::cout << outHead("error") << "段文件 " << segmentPath(segment->id) << " 末尾有 " << fileStat.st_size - offset << " 字节不完整的记录，已经截断" << std::endl;
+            if(ftruncate(segment->fd, offset) != 0){
+                return -1;
+            }
+        }else{
+            std::cout << outHead("error") << "段文件 " << segmentPath(segment->id) << " 在偏移 " << offset << " 处的记录损坏，之后的记录被忽略" << std::endl;
+        }
+    }
+    segment->size = isLast ? offset : fileStat.st_size;
+    return 0;
+}
+
+void PackedStorage::dropEntry(const std::string &fileName){
+    std::unordered_map<std::string, PackedEntry>::iterator it = m_index.find(fileName);
+    if(it == m_index.end()){
+        return;
+    }
+    std::map<uint32_t, std::shared_ptr<PackedSegment> >::iterator segIt = m_segments.find(it->second.segmentId);
+    if(segIt != m_segments.end()){
+        segIt->second->liveBytes -= recordSize(fileName.size(), it->second.length);
+    }
+    m_index.erase(it);
+}
+
+int PackedStorage::openNewSegment(){
+    uint32_t id = m_segments.empty() ? 1 : m_segments.rbegin()->first + 1;
+    std::shared_ptr<PackedSegment> segment = std::make_shared<PackedSegment>();
+    segment->id = id;
+    segment->fd = open(segmentPath(id).c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+    if(segment->fd == -1){
+        std::cout << outHead("error") << "段文件 " << segmentPath(id) << " 创建失败 (errno = " << errno << ")" << std::endl;
+        return -1;
+    }
+    m_segments[id] = segment;
+    m_active = segment;
+    return 0;
+}
+
+int PackedStorage::appendRecord(uint8_t type, const std::string &fileName, const char *data, size_t len, const FileDigest *digest){
+    // 记录头中文件名的长度只有 16 位
+    if(fileName.size() > UINT16_MAX){
+        return -1;
+    }
+    if(!m_active || m_active->size >= PACKED_SEGMENT_SIZE){
+        if(openNewSegment() != 0){
+            return -1;
+        }
+    }
+
+    PackedRecordHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = PACKED_RECORD_MAGIC;
+    header.type = type;
+    header.nameLen = fileName.size();
+    header.dataLen = len;
+    if(digest != nullptr){
+        header.hasDigest = 1;
+        header.crc32c = digest->crc32c;
+        memcpy(header.sha256, digest->sha256, sizeof(header.sha256));
+    }
+
+    // 记录头、文件名和数据一次写入，记录很小，持有锁写入可以保证段中的记录是连续的
+    std::string record(reinterpret_cast<const char *>(&header), sizeof(header));
+    record += fileName;
+    record.append(data, len);
+    long long offset = m_active->size;
+    size_t hasWriteLen = 0;
+    while(hasWriteLen < record.size()){
+        ssize_t ret = pwrite(m_active->fd, record.c_str() + hasWriteLen, record.size() - hasWriteLen, offset + hasWriteLen);
+        if(ret == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            std::cout << outHead("error") << "向段文件 " << segmentPath(m_active->id) << " 追加记录失败 (errno = " << errno << ")" << std::endl;
+            // 去掉写了一部分的记录，否则之后的记录在重启时无法读取
+            if(ftruncate(m_active->fd, offset) != 0){
+                m_active.reset();
+            }
+            return -1;
+        }
+        hasWriteLen += ret;
+    }
+    m_active->size += record.size();
+
+    dropEntry(fileName);
+    if(type == PACKED_PUT){
+        PackedEntry entry;
+        entry.segmentId = m_active->id;
+        entry.length = len;
+        entry.recordOffset = offset;
+        m_index[fileName] = entry;
+        m_active->liveBytes += record.size();
+    }
+    return 0;
+}
+
+int PackedStorage::put(const std::string &fileName, const char *data, size_t len, const FileDigest *digest){
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        if(appendRecord(PACKED_PUT, fileName, data, len, digest) != 0){
+            return -1;
+        }
+    }
+    // 同名的大文件被小文件替换
+    m_flat.remove(fileName);
+    return 0;
+}
+
+void PackedStorage::removePacked(const std::string &fileName){
+    std::lock_guard<std::mutex> guard(m_lock);
+    if(m_index.find(fileName) != m_index.end()){
+        appendRecord(PACKED_DELETE, fileName, "", 0, nullptr);
+    }
+}
+
+void PackedStorage::list(std::vector<std::string> &names){
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        names.reserve(m_index.size());
+        for(std::unordered_map<std::string, PackedEntry>::const_iterator it = m_index.begin(); it != m_index.end(); ++it){
+            names.push_back(it->first);
+        }
+    }
+    // 大文件保存在 filedir 中，替换过程中同一个文件可能短暂地同时存在于两处。packed 不支持目录，跳过子目录中的文件
+    std::vector<std::string> flatNames;
+    m_flat.list(flatNames);
+    for(size_t i = 0; i < flatNames.size(); ++i){
+        if(flatNames[i].find('/') == std::string::npos){
+            names.push_back(flatNames[i]);
+        }
+    }
+    std::sort(names.begin(), names.end());
+    names.erase(std::unique(names.begin(), names.end()), names.end());
+}
+
+StorageReader *PackedStorage::openReader(const std::string &fileName){
+    if(!isValidName(fileName)){
+        return nullptr;
+    }
+    PackedEntry entry;
+    std::shared_ptr<PackedSegment> segment;
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        std::unordered_map<std::string, PackedEntry>::const_iterator it = m_index.find(fileName);
+        if(it == m_index.end()){
+            return m_flat.openReader(fileName);
+        }
+        entry = it->second;
+        segment = m_segments[entry.segmentId];
+    }
+
+    // 校验值保存在记录头中，和数据在同一个页中，通常已经在页缓存里
+    PackedRecordHeader header;
+    std::string recordName;
+    if(readRecordHead(segment->fd, entry.recordOffset, entry.recordOffset + recordSize(fileName.size(), entry.length), header, recordName) != 0){
+        std::cout << outHead("error") << "段文件 " << segmentPath(segment->id) << " 中文件 " << fileName << " 的记录头读取失败" << std::endl;
+        return nullptr;
+    }
+    FileDigest digest;
+    digest.crc32c = header.crc32c;
+    memcpy(digest.sha256, header.sha256, sizeof(digest.sha256));
+    return new PackedReader(segment, entry.recordOffset + sizeof(header) + header.nameLen, entry.length, header.hasDigest != 0, digest);
+}
+
+StorageWriter *PackedStorage::createWriter(const std::string &fileName){
+    if(!isValidName(fileName)){
+        return nullptr;
+    }
+    return new PackedWriter(*this, m_flat, fileName);
+}
+
+int PackedStorage::importFile(const std::string &path, const std::string &fileName, const FileDigest *digest){
+    struct stat fileStat;
+    if(!isValidName(fileName) || stat(path.c_str(), &fileStat) != 0){
+        return -1;
+    }
+    if(fileStat.st_size > PACKED_MAX_FILE_SIZE){
+        if(m_flat.importFile(path, fileName, digest) != 0){
+            return -1;
+        }
+        removePacked(fileName);
+        return 0;
+    }
+
+    // 小文件读入内存后追加到段中
+    std::string data(fileStat.st_size, '\0');
+    int fd = open(path.c_str(), O_RDONLY);
+    if(fd == -1){
+        return -1;
+    }
+    ssize_t readLen = pread(fd, &data[0], data.size(), 0);
+    close(fd);
+    if(readLen != static_cast<ssize_t>(data.size())){
+        return -1;
+    }
+    FileDigest computed;
+    if(digest == nullptr){
+        DigestBuilder builder;
+        builder.update(data.c_str(), data.size());
+        computed = builder.finish();
+        digest = &computed;
+    }
+    if(put(fileName, data.c_str(), data.size(), digest) != 0){
+        return -1;
+    }
+    unlink(path.c_str());
+    return 0;
+}
+
+int PackedStorage::remove(const std::string &fileName){
+    if(!isValidName(fileName)){
+        return -1;
+    }
+    bool removed = false;
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        if(m_index.find(fileName) != m_index.end()){
+            removed = appendRecord(PACKED_DELETE, fileName, "", 0, nullptr) == 0;
+        }
+    }
+    if(m_flat.remove(fileName) == 0){
+        removed = true;
+    }
+    return removed ? 0 : -1;
+}
+
+std::string PackedStorage::localPath(const std::string &fileName){
+    if(!isValidName(fileName)){
+        return "";
+    }
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        if(m_index.find(fileName) != m_index.end()){
+            return "";
+        }
+    }
+    return m_flat.localPath(fileName);
+}
+
+void PackedStorage::compactLoop(){
+    while(1){
+        std::this_thread::sleep_for(std::chrono::seconds(PACKED_COMPACT_INTERVAL));
+
+        // 当前段之外，有效数据不足一半的段需要整理
+        std::vector<std::shared_ptr<PackedSegment> > candidates;
+        {
+            std::lock_guard<std::mutex> guard(m_lock);
+            for(std::map<uint32_t, std::shared_ptr<PackedSegment> >::iterator it = m_segments.begin(); it != m_segments.end(); ++it){
+                if(it->second != m_active && it->second->liveBytes * 2 < it->second->size){
+                    candidates.push_back(it->second);
+                }
+            }
+        }
+        for(size_t i = 0; i < candidates.size(); ++i){
+            compactSegment(candidates[i]);
+        }
+    }
+}
+
+void PackedStorage::compactSegment(const std::shared_ptr<PackedSegment> &segment){
+    // 比该段更早的段，删除记录只有在这些段中还有同名文件的旧记录时才需要保留
+    std::vector<std::shared_ptr<PackedSegment> > olderSegments;
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        for(std::map<uint32_t, std::shared_ptr<PackedSegment> >::iterator it = m_segments.begin(); it != m_segments.end() && it->first < segment->id; ++it){
+            olderSegments.push_back(it->second);
+        }
+    }
+    std::unordered_set<std::string> olderNames;
+    bool olderScanned = false;
+
+    // 段已经不再写入，扫描时不需要持有锁
+    long long offset = 0;
+    long long copiedCount = 0;
+    long long droppedTombstones = 0;
+    std::set<std::shared_ptr<PackedSegment> > written;     // 复制的记录写入的段，删除该段之前需要落盘
+    PackedRecordHeader header;
+    std::string fileName;
+    while(offset < segment->size && readRecordHead(segment->fd, offset, segment->size, header, fileName) == 0){
+        long long recordLen = recordSize(header.nameLen, header.dataLen);
+        if(header.type == PACKED_PUT){
+            // 只复制索引仍然指向这里的记录，数据在锁外读取，追加前再检查一次
+            std::string data(header.dataLen, '\0');
+            bool isLive = false;
+            {
+                std::lock_guard<std::mutex> guard(m_lock);
+                std::unordered_map<std::string, PackedEntry>::const_iterator it = m_index.find(fileName);
+                isLive = it != m_index.end() && it->second.segmentId == segment->id && it->second.recordOffset == offset;
+            }
+            if(isLive && pread(segment->fd, &data[0], data.size(), offset + sizeof(header) + header.nameLen) == static_cast<ssize_t>(data.size())){
+                FileDigest digest;
+                digest.crc32c = header.crc32c;
+                memcpy(digest.sha256, header.sha256, sizeof(digest.sha256));
+                std::lock_guard<std::mutex> guard(m_lock);
+                std::unordered_map<std::string, PackedEntry>::const_iterator it = m_index.find(fileName);
+                if(it != m_index.end() && it->second.segmentId == segment->id && it->second.recordOffset == offset
+                        && appendRecord(PACKED_PUT, fileName, data.c_str(), data.size(), header.hasDigest ? &digest : nullptr) == 0){
+                    written.insert(m_active);
+                    ++copiedCount;
+                }
+            }
+        }else{
+            // 第一次遇到删除记录时扫描更早的段中所有文件数据记录的文件名
+            if(!olderScanned){
+                collectPutNames(olderSegments, olderNames);
+                olderScanned = true;
+            }
+            // 更早的段中还有该文件的旧记录，文件仍然是删除状态时需要保留删除记录，否则重启时旧记录会重新出现
+            if(olderNames.count(fileName) > 0){
+                std::lock_guard<std::mutex> guard(m_lock);
+                if(m_index.find(fileName) == m_index.end() && appendRecord(PACKED_DELETE, fileName, "", 0, nullptr) == 0){
+                    written.insert(m_active);
+                }
+            }else{
+                ++droppedTombstones;
+            }
+        }
+        offset += recordLen;
+    }
+
+    // 复制的记录落盘之后才能删除原来的段，否则崩溃后两边的记录可能都不存在
+    for(std::set<std::shared_ptr<PackedSegment> >::iterator it = written.begin(); it != written.end(); ++it){
+        if(fdatasync((*it)->fd) != 0){
+            std::cout << outHead("error") << "段文件 " << segmentPath((*it)->id) << " 落盘失败 (errno = " << errno << ")，保留段文件 " << segmentPath(segment->id) << std::endl;
+            return;
+        }
+    }
+
+    // 所有有效记录都已经复制走时才删除该段
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        if(segment->liveBytes > 0){
+            std::cout << outHead("error") << "段文件 " << segmentPath(segment->id) << " 整理失败，保留该段" << std::endl;
+            return;
+        }
+        m_segments.erase(segment->id);
+    }
+    unlink(segmentPath(segment->id).c_str());
+    std::cout << outHead("info") << "段文件 " << segmentPath(segment->id) << " 整理完成，复制了 " << copiedCount << " 个文件，丢弃了 "
+              << droppedTombstones << " 条删除记录" << std::endl;
+}
+
+void PackedStorage::collectPutNames(const std::vector<std::shared_ptr<PackedSegment> > &segments, std::unordered_set<std::string> &names){
+    for(size_t i = 0; i < segments.size(); ++i){
+        long long offset = 0;
+        PackedRecordHeader header;
+        std::string fileName;
+        while(offset < segments[i]->size && readRecordHead(segments[i]->fd, offset, segments[i]->size, header, fileName) == 0){
+            if(header.type == PACKED_PUT){
+                names.insert(fileName);
+            }
+            offset += recordSize(header.nameLen, header.dataLen);
+        }
+    }
+}
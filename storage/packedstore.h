@@ -0,0 +1,116 @@
+/*  文件说明：
+ *  1. 存储引擎 packed：不超过 PACKED_MAX_FILE_SIZE 的小文件作为记录追加到 filedir/.segments 中的段文件，
+ *     大文件仍然保存为 filedir 中的普通文件（和 flat 相同），避免大量小文件的 inode 和目录项开销
+ *  2. 段文件只追加：每条记录由记录头、文件名和文件数据组成，删除文件时追加一条删除记录，同名文件的新记录覆盖旧记录
+ *  3. 内存中保存 文件名 -> (段号, 记录偏移, 长度) 的索引，启动时按段号顺序扫描所有段的记录头重建，
+ *     最后一个段末尾不完整的记录（写入时崩溃）会被截断
+ *  4. 下载时用 sendfile 直接从段文件中数据所在的偏移发送，段文件保持打开，不需要 open/fstat/close；
+ *     校验值保存在记录头中，打开时读取
+ *  5. 后台线程定期整理段文件：失效数据超过一半的段中仍然有效的记录被复制到当前段的末尾，复制的记录落盘后删除该段；
+ *     更早的段中已经没有同名文件的记录时，删除记录直接丢弃。正在下载的连接持有段文件的引用，段文件删除后仍然可以继续读取
+ */
+#ifndef PACKEDSTORE_H
+#define PACKEDSTORE_H
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <set>
+#include <memory>
+#include <mutex>
+#include <cstdint>
+
+#include "storageengine.h"
+
+#define PACKED_SEGMENT_DIR "filedir/.segments"          // 段文件目录
+#define PACKED_MAX_FILE_SIZE (64 * 1024)                // 不超过该长度的文件保存到段文件中
+#define PACKED_SEGMENT_SIZE (64 * 1024 * 1024)          // 段文件达到该长度后开始写入新的段
+#define PACKED_COMPACT_INTERVAL 30                      // 后台整理的间隔（秒）
+
+// 段文件中记录的类型
+enum PACKED_RECORD_TYPE{
+    PACKED_PUT = 1,     // 文件数据
+    PACKED_DELETE = 2   // 删除文件
+};
+
+// 段文件中每条记录的记录头，之后依次是文件名和文件数据。整数以本机字节序保存
+struct PackedRecordHeader{
+    uint32_t magic;             // 固定为 PACKED_RECORD_MAGIC，用于检查记录是否完整
+    uint8_t type;               // PACKED_RECORD_TYPE
+    uint8_t hasDigest;          // 是否保存了校验值
+    uint16_t nameLen;           // 文件名长度
+    uint32_t dataLen;           // 文件数据长度，删除记录为 0
+    uint32_t crc32c;            // 文件的 CRC32C
+    unsigned char sha256[32];   // 文件的 SHA-256
+};
+
+#define PACKED_RECORD_MAGIC 0x31464B50u     // "PKF1"
+
+// 一个段文件，下载的连接和索引共同持有，最后一个引用释放时关闭文件
+struct PackedSegment{
+    uint32_t id = 0;
+    int fd = -1;
+    long long size = 0;         // 已经写入的长度
+    long long liveBytes = 0;    // 仍然有效的记录的长度
+    ~PackedSegment();
+};
+
+// 索引中的一项，记录文件数据在段文件中的位置
+struct PackedEntry{
+    uint32_t segmentId;
+    uint32_t length;
+    long long recordOffset;     // 记录头在段文件中的偏移
+};
+
+class PackedStorage : public StorageEngine{
+public:
+    PackedStorage();
+
+    virtual const char *name() const override { return "packed"; }
+    virtual int init() override;
+    virtual void list(std::vector<std::string> &names) override;
+    virtual StorageReader *openReader(const std::string &fileName) override;
+    virtual StorageWriter *createWriter(const std::string &fileName) override;
+    virtual int importFile(const std::string &path, const std::string &fileName, const FileDigest *digest) override;
+    virtual int remove(const std::string &fileName) override;
+    virtual std::string localPath(const std::string &fileName) override;
+
+    // 将一个小文件作为记录追加到当前段，同名的普通文件会被删除。供写入器使用
+    int put(const std::string &fileName, const char *data, size_t len, const FileDigest *digest);
+
+    // 大文件保存为普通文件之后，删除段中同名的旧记录。供写入器使用
+    void removePacked(const std::string &fileName);
+
+private:
+    // 追加一条记录并更新索引，调用前需要持有 m_lock
+    int appendRecord(uint8_t type, const std::string &fileName, const char *data, size_t len, const FileDigest *digest);
+
+    // 创建新的段作为当前段，调用前需要持有 m_lock
+    int openNewSegment();
+
+    // 扫描一个段文件中的所有记录，重建索引。isLast 为 true 时截断末尾不完整的记录
+    int loadSegment(const std::shared_ptr<PackedSegment> &segment, bool isLast);
+
+    // 从索引中删除文件，释放旧记录占用的有效长度，调用前需要持有 m_lock
+    void dropEntry(const std::string &fileName);
+
+    // 后台线程：定期整理失效数据超过一半的段
+    void compactLoop();
+    void compactSegment(const std::shared_ptr<PackedSegment> &segment);
+
+    // 收集这些段中所有文件数据记录的文件名，整理时用于判断删除记录是否还需要保留
+    static void collectPutNames(const std::vector<std::shared_ptr<PackedSegment> > &segments, std::unordered_set<std::string> &names);
+
+    static std::string segmentPath(uint32_t id);
+
+private:
+    FlatStorage m_flat;                                                 // 大文件使用普通文件保存
+    std::mutex m_lock;                                                  // 保护索引和段
+    std::unordered_map<std::string, PackedEntry> m_index;               // 文件名 -> 记录位置
+    std::map<uint32_t, std::shared_ptr<PackedSegment> > m_segments;     // 所有段，按段号排序
+    std::shared_ptr<PackedSegment> m_active;                            // 正在追加的段
+    bool m_initialized;
+};
+
+#endif
@@ -0,0 +1,84 @@
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "pagecache.h"
+
+namespace {
+
+#define PAGE_CACHE_PAGE_SIZE 4096
+
+// 内核或者文件系统不支持 RWF_NOWAIT 时置为 false，之后不再检查
+std::atomic<bool> nowaitSupported(true);
+
+}
+
+bool PageCache::isResident(int fd, long long offset){
+#ifdef RWF_NOWAIT
+    if(!nowaitSupported){
+        return true;
+    }
+    char byte;
+    struct iovec iov;
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    if(preadv2(fd, &iov, 1, offset, RWF_NOWAIT) >= 0){
+        return true;
+    }
+    if(errno != ENOSYS && errno != EOPNOTSUPP){
+        // EAGAIN 表示不在页缓存中。EIO 等其他错误只和这个文件有关，同样按不在缓存中处理，由预读或者发送时报告错误
+        return false;
+    }
+    // 内核或者文件系统不支持 RWF_NOWAIT，之后不再检查
+    nowaitSupported = false;
+#else
+    (void)fd;
+    (void)offset;
+#endif
+    return true;
+}
+
+long long PageCache::residentLength(int fd, long long offset, long long len){
+    if(len <= 0 || !isResident(fd, offset)){
+        return 0;
+    }
+    if(isResident(fd, offset + len - 1)){
+        return len;
+    }
+    // 第一页在缓存中而最后一页不在，按页二分查找第一个不在缓存中的页
+    long long low = offset / PAGE_CACHE_PAGE_SIZE, high = (offset + len - 1) / PAGE_CACHE_PAGE_SIZE;
+    while(high - low > 1){
+        long long mid = low + (high - low) / 2;
+        if(isResident(fd, mid * PAGE_CACHE_PAGE_SIZE)){
+            low = mid;
+        }else{
+            high = mid;
+        }
+    }
+    return high * PAGE_CACHE_PAGE_SIZE - offset;
+}
+
+void PageCache::prefetch(int fd, long long offset, long long len){
+    if(len <= 0){
+        return;
+    }
+    // 后面的数据由内核异步预读，第一个窗口同步读取，返回时网络线程可以直接发送
+    posix_fadvise(fd, offset, len, POSIX_FADV_WILLNEED);
+    std::vector<char> buffer(std::min<long long>(len, PAGE_CACHE_WINDOW_SIZE));
+    size_t readLen = 0;
+    while(readLen < buffer.size()){
+        ssize_t ret = pread(fd, buffer.data() + readLen, buffer.size() - readLen, offset + readLen);
+        if(ret <= 0){
+            if(ret == -1 && errno == EINTR){
+                continue;
+            }
+            break;
+        }
+        readLen += ret;
+    }
+}
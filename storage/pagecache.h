@@ -0,0 +1,28 @@
+/*  文件说明：
+ *  1. 下载时判断文件数据是否在页缓存中，以及把即将发送的数据读入页缓存
+ *  2. 判断方法：用 preadv2 的 RWF_NOWAIT 读取 1 字节，数据不在页缓存中时立即返回 EAGAIN 而不会读磁盘。
+ *     先检查窗口的第一页和最后一页，最后一页不在缓存中时二分查找连续缓存的前缀（预读总是连续地填充页缓存）
+ *  3. 网络线程只用 sendfile 发送已经缓存的部分，不在缓存中的部分交给 I/O 线程池调用 prefetch：
+ *     posix_fadvise(WILLNEED) 让内核异步预读后面较大的范围，再同步读取第一个窗口，返回时这部分数据已经在页缓存中
+ *  4. 内核或者文件系统不支持 RWF_NOWAIT 时，所有数据都按已缓存处理，和直接 sendfile 相同
+ */
+#ifndef PAGECACHE_H
+#define PAGECACHE_H
+
+#define PAGE_CACHE_WINDOW_SIZE (256 * 1024)             // 每次检查和发送的最大长度
+#define PAGE_CACHE_PREFETCH_SIZE (4 * 1024 * 1024)      // 每次预读的长度
+
+class PageCache{
+public:
+    // 文件 fd 中从 offset 开始最多 len 字节里，从 offset 开始连续在页缓存中的字节数
+    static long long residentLength(int fd, long long offset, long long len);
+
+    // 将文件 fd 中从 offset 开始的 len 字节读入页缓存，至少第一个窗口读入后才返回
+    static void prefetch(int fd, long long offset, long long len);
+
+private:
+    // offset 所在的页是否在页缓存中（offset 超过文件末尾或者不支持 RWF_NOWAIT 时返回 true，读取出错时返回 false）
+    static bool isResident(int fd, long long offset);
+};
+
+#endif
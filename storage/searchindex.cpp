@@ -0,0 +1,251 @@
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <cctype>
+
+#include "searchindex.h"
+#include "metaindex.h"
+#include "storageengine.h"
+#include "../utils/utils.h"
+
+std::mutex SearchIndex::lock;
+bool SearchIndex::built = false;
+bool SearchIndex::building = false;
+std::vector<std::pair<bool, std::string> > SearchIndex::pendingOps;
+std::mutex SearchIndex::buildLock;
+std::vector<std::string> SearchIndex::fileNames;
+std::vector<std::string> SearchIndex::lowerNames;
+std::vector<uint32_t> SearchIndex::freeIds;
+std::vector<uint32_t> SearchIndex::sorted;
+std::unordered_map<uint32_t, std::vector<uint32_t> > SearchIndex::postings;
+
+namespace {
+
+std::string toLower(const std::string &str){
+    std::string res(str);
+    for(size_t i = 0; i < res.size(); ++i){
+        res[i] = tolower(static_cast<unsigned char>(res[i]));
+    }
+    return res;
+}
+
+}
+
+void SearchIndex::trigramsOf(const std::string &lowerName, std::vector<uint32_t> &trigrams){
+    trigrams.clear();
+    for(size_t i = 0; i + 3 <= lowerName.size(); ++i){
+        trigrams.push_back(static_cast<uint32_t>(static_cast<unsigned char>(lowerName[i])) << 16
+                | static_cast<uint32_t>(static_cast<unsigned char>(lowerName[i + 1])) << 8
+                | static_cast<unsigned char>(lowerName[i + 2]));
+    }
+    std::sort(trigrams.begin(), trigrams.end());
+    trigrams.erase(std::unique(trigrams.begin(), trigrams.end()), trigrams.end());
+}
+
+std::vector<uint32_t>::iterator SearchIndex::lowerBound(const std::string &lowerName, const std::string &fileName){
+    return std::lower_bound(sorted.begin(), sorted.end(), 0u, [&](uint32_t id, uint32_t){
+        int ret = lowerNames[id].compare(lowerName);
+        return ret < 0 || (ret == 0 && fileNames[id] < fileName);
+    });
+}
+
+void SearchIndex::build(){
+    std::lock_guard<std::mutex> buildGuard(buildLock);
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if(built){
+            return;
+        }
+        // 从这里开始记录上传和删除，获取的文件列表可能包含也可能不包含它们，替换索引后重新应用一次
+        building = true;
+    }
+
+    // 在锁外获取文件列表并生成索引
+    std::vector<std::string> newFileNames;
+    if(MetaIndex::isOpen()){
+        MetaIndex::list(newFileNames);
+    }else{
+        StorageEngine::current()->list(newFileNames);
+    }
+
+    // 一次性建立：编号递增，倒排列表直接追加；最后对编号数组排序一次，避免逐个插入时反复移动数组
+    std::vector<std::string> newLowerNames(newFileNames.size());
+    std::vector<uint32_t> newSorted(newFileNames.size());
+    std::unordered_map<uint32_t, std::vector<uint32_t> > newPostings;
+    std::vector<uint32_t> trigrams;
+    for(uint32_t id = 0; id < newFileNames.size(); ++id){
+        newLowerNames[id] = toLower(newFileNames[id]);
+        newSorted[id] = id;
+        trigramsOf(newLowerNames[id], trigrams);
+        for(size_t i = 0; i < trigrams.size(); ++i){
+            newPostings[trigrams[i]].push_back(id);
+        }
+    }
+    std::sort(newSorted.begin(), newSorted.end(), [&](uint32_t a, uint32_t b){
+        int ret = newLowerNames[a].compare(newLowerNames[b]);
+        return ret < 0 || (ret == 0 && newFileNames[a] < newFileNames[b]);
+    });
+
+    // 替换索引，再按顺序应用建立期间的上传和删除（文件已经存在时加入、不存在时删除都不会改变索引）
+    std::lock_guard<std::mutex> guard(lock);
+    fileNames.swap(newFileNames);
+    lowerNames.swap(newLowerNames);
+    sorted.swap(newSorted);
+    postings.swap(newPostings);
+    freeIds.clear();
+    for(size_t i = 0; i < pendingOps.size(); ++i){
+        if(pendingOps[i].first){
+            addLocked(pendingOps[i].second);
+        }else{
+            removeLocked(pendingOps[i].second);
+        }
+    }
+    std::vector<std::pair<bool, std::string> >().swap(pendingOps);
+    building = false;
+    built = true;
+    std::cout << outHead("info") << "文件名搜索索引建立完成，共 " << sorted.size() << " 个文件，" << postings.size() << " 个三元组" << std::endl;
+}
+
+void SearchIndex::addLocked(const std::string &fileName){
+    std::string lowerName = toLower(fileName);
+    std::vector<uint32_t>::iterator pos = lowerBound(lowerName, fileName);
+    if(pos != sorted.end() && fileNames[*pos] == fileName){
+        return;
+    }
+    uint32_t id;
+    if(freeIds.empty()){
+        id = fileNames.size();
+        fileNames.push_back(fileName);
+        lowerNames.push_back(lowerName);
+    }else{
+        id = freeIds.back();
+        freeIds.pop_back();
+        fileNames[id] = fileName;
+        lowerNames[id] = lowerName;
+    }
+    sorted.insert(pos, id);
+
+    // 编号可能是复用的，不一定比列表中已有的编号大，插入到有序的位置
+    std::vector<uint32_t> trigrams;
+    trigramsOf(lowerName, trigrams);
+    for(size_t i = 0; i < trigrams.size(); ++i){
+        std::vector<uint32_t> &ids = postings[trigrams[i]];
+        ids.insert(std::lower_bound(ids.begin(), ids.end(), id), id);
+    }
+}
+
+void SearchIndex::removeLocked(const std::string &fileName){
+    std::string lowerName = toLower(fileName);
+    std::vector<uint32_t>::iterator pos = lowerBound(lowerName, fileName);
+    if(pos == sorted.end() || fileNames[*pos] != fileName){
+        return;
+    }
+    uint32_t id = *pos;
+    sorted.erase(pos);
+
+    std::vector<uint32_t> trigrams;
+    trigramsOf(lowerName, trigrams);
+    for(size_t i = 0; i < trigrams.size(); ++i){
+        std::unordered_map<uint32_t, std::vector<uint32_t> >::iterator postIt = postings.find(trigrams[i]);
+        if(postIt == postings.end()){
+            continue;
+        }
+        std::vector<uint32_t> &ids = postIt->second;
+        std::vector<uint32_t>::iterator idIt = std::lower_bound(ids.begin(), ids.end(), id);
+        if(idIt != ids.end() && *idIt == id){
+            ids.erase(idIt);
+        }
+        if(ids.empty()){
+            postings.erase(postIt);
+        }
+    }
+    fileNames[id].clear();
+    lowerNames[id].clear();
+    freeIds.push_back(id);
+}
+
+void SearchIndex::add(const std::string &fileName){
+    std::lock_guard<std::mutex> guard(lock);
+    // 索引还没有开始建立时不需要更新，建立时会包含这个文件
+    if(built){
+        addLocked(fileName);
+    }else if(building){
+        pendingOps.push_back(std::make_pair(true, fileName));
+    }
+}
+
+void SearchIndex::remove(const std::string &fileName){
+    std::lock_guard<std::mutex> guard(lock);
+    if(built){
+        removeLocked(fileName);
+    }else if(building){
+        pendingOps.push_back(std::make_pair(false, fileName));
+    }
+}
+
+void SearchIndex::search(const std::string &query, long long offset, long long limit, std::vector<std::string> &matches, long long &total){
+    std::string lowerQuery = toLower(query);
+    total = 0;
+    // 没有提前建立索引时由第一次搜索建立（/api/search 在 I/O 线程池中处理）
+    build();
+    std::lock_guard<std::mutex> guard(lock);
+    if(lowerQuery.empty()){
+        return;
+    }
+
+    // 结果个数不会超过文件个数，将 offset 调整到 [0, 文件个数]，limit 调整到 [0, SEARCH_MAX_LIMIT]，offset + limit 不会溢出
+    offset = std::min<long long>(std::max<long long>(offset, 0), sorted.size());
+    limit = std::min<long long>(std::max<long long>(limit, 0), SEARCH_MAX_LIMIT);
+    long long end = offset + limit;
+
+    // 前缀匹配：排序数组中从 lowerQuery 开始的连续一段，两次二分查找得到范围
+    std::vector<uint32_t>::iterator first = lowerBound(lowerQuery, "");
+    std::vector<uint32_t>::iterator last = std::partition_point(first, sorted.end(), [&](uint32_t id){
+        return lowerNames[id].compare(0, lowerQuery.size(), lowerQuery) == 0;
+    });
+    long long prefixCount = last - first;
+    for(long long i = offset; i < prefixCount && i < end; ++i){
+        matches.push_back(fileNames[first[i]]);
+    }
+    total = prefixCount;
+    if(lowerQuery.size() < 3){
+        return;
+    }
+
+    // 子串匹配：从最短的三元组列表中找出包含查询串但不以它开头的文件，只保存当前页的结果
+    std::vector<uint32_t> trigrams;
+    trigramsOf(lowerQuery, trigrams);
+    const std::vector<uint32_t> *shortest = nullptr;
+    for(size_t i = 0; i < trigrams.size(); ++i){
+        std::unordered_map<uint32_t, std::vector<uint32_t> >::const_iterator postIt = postings.find(trigrams[i]);
+        if(postIt == postings.end()){
+            return;
+        }
+        if(shortest == nullptr || postIt->second.size() < shortest->size()){
+            shortest = &postIt->second;
+        }
+    }
+    for(size_t i = 0; i < shortest->size(); ++i){
+        const std::string &lowerName = lowerNames[(*shortest)[i]];
+        size_t pos = lowerName.find(lowerQuery);
+        if(pos == 0 || pos == std::string::npos){
+            continue;
+        }
+        if(total >= offset && total < end){
+            matches.push_back(fileNames[(*shortest)[i]]);
+        }
+        ++total;
+    }
+}
+std::string SearchIndex::searchJson(const std::string &query, long long offset, long long limit){
+    std::vector<std::string> matches;
+    long long total = 0;
+    search(query, offset, limit, matches, total);
+    std::ostringstream oss;
+    oss << "{\"query\":\"" << jsonEscape(query) << "\",\"total\":" << total << ",\"offset\":" << std::max<long long>(offset, 0) << ",\"matches\":[";
+    for(size_t i = 0; i < matches.size(); ++i){
+        oss << (i == 0 ? "" : ",") << "\"" << jsonEscape(matches[i]) << "\"";
+    }
+    oss << "]}";
+    return oss.str();
+}
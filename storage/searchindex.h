@@ -0,0 +1,65 @@
+/*  文件说明：
+ *  1. 文件名搜索（GET /api/search?q=）使用的内存索引，从元数据索引（没有启用时从存储引擎）建立，之后上传和删除文件时增量更新。
+ *     服务器启动时在 I/O 线程池中建立（build），没有提前建立时由第一次搜索建立。建立时在锁外获取文件列表并生成索引，
+ *     期间完成的上传和删除先记录下来，替换索引后再依次应用，搜索和上传不会等待整个建立过程
+ *  2. 搜索不区分 ASCII 字母的大小写。所有文件的编号保存在按小写文件名排序的数组中，前缀匹配是其中连续的一段，
+ *     结果个数和分页只需要两次二分查找；上传和删除时在数组中插入或删除一个编号（移动 4 字节的元素）
+ *  3. 子串搜索使用三元组（连续 3 个字节）倒排索引：每个三元组对应包含它的文件编号的有序列表，
+ *     搜索时取查询串中最短的列表作为候选，再逐个检查是否包含查询串
+ *  4. 查询串少于 3 个字节时无法使用三元组，只按前缀匹配
+ *  5. 结果中前缀匹配的文件排在前面（按文件名排序），之后是其他包含查询串的文件（按文件编号，即大致的上传顺序），
+ *     用 offset 和 limit 分页，子串匹配只保存当前页的结果。offset 和 limit 调整到有效范围内，很大的值不会溢出
+ */
+#ifndef SEARCHINDEX_H
+#define SEARCHINDEX_H
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <cstdint>
+
+#define SEARCH_DEFAULT_LIMIT 50      // 每页默认的结果个数
+#define SEARCH_MAX_LIMIT 1000        // 每页最多的结果个数
+
+class SearchIndex{
+public:
+    // 建立索引，已经建立时直接返回。耗时和文件个数成正比，在 I/O 线程池或者后台线程中调用
+    static void build();
+
+    // 文件上传完成后调用，文件名已经存在时不变
+    static void add(const std::string &fileName);
+
+    // 文件删除后调用
+    static void remove(const std::string &fileName);
+
+    // 搜索包含 query 的文件名，返回第 offset 个开始的最多 limit 个结果，total 为所有结果的个数
+    static void search(const std::string &query, long long offset, long long limit, std::vector<std::string> &matches, long long &total);
+
+    // 搜索结果的 JSON：{"query":..., "total":..., "offset":..., "matches":[...]}
+    static std::string searchJson(const std::string &query, long long offset, long long limit);
+
+private:
+    // 加入或删除一个文件名，调用前需要持有 lock
+    static void addLocked(const std::string &fileName);
+    static void removeLocked(const std::string &fileName);
+
+    // sorted 中第一个不小于 (lowerName, fileName) 的位置
+    static std::vector<uint32_t>::iterator lowerBound(const std::string &lowerName, const std::string &fileName);
+
+    // 字符串中所有三元组（去重）
+    static void trigramsOf(const std::string &lowerName, std::vector<uint32_t> &trigrams);
+
+private:
+    static std::mutex lock;                                             // 保护以下所有成员
+    static bool built;
+    static bool building;                                               // 正在建立索引，期间的更新记录到 pendingOps
+    static std::vector<std::pair<bool, std::string> > pendingOps;       // 建立期间的更新：(是否为上传, 文件名)
+    static std::mutex buildLock;                                        // 同时只有一个线程建立索引
+    static std::vector<std::string> fileNames;                          // 文件编号 -> 文件名，删除后为空
+    static std::vector<std::string> lowerNames;                         // 文件编号 -> 小写文件名
+    static std::vector<uint32_t> freeIds;                               // 删除的文件释放的编号
+    static std::vector<uint32_t> sorted;                                // 按 (小写文件名, 文件名) 排序的文件编号
+    static std::unordered_map<uint32_t, std::vector<uint32_t> > postings;   // 三元组 -> 有序的文件编号列表
+};
+
+#endif
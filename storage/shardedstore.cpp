@@ -0,0 +1,202 @@
+#include <iostream>
+#include <algorithm>
+#include <thread>
+#include <cstdio>
+#include <cerrno>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "shardedstore.h"
+#include "../utils/utils.h"
+
+namespace {
+
+// 一级或二级子目录名：两位十六进制数
+std::string shardDirName(unsigned int byte){
+    char buf[3];
+    snprintf(buf, sizeof(buf), "%02x", byte & 0xFF);
+    return buf;
+}
+
+// 读取目录中的所有子目录名或文件名，跳过 . 开头的名字
+void readDirNames(const std::string &dirPath, bool wantDir, std::vector<std::string> &names){
+    DIR *dir = opendir(dirPath.c_str());
+    if(dir == nullptr){
+        return;
+    }
+    struct dirent *stdinfo;
+    while((stdinfo = readdir(dir)) != nullptr){
+        if(stdinfo->d_name[0] != '.' && (stdinfo->d_type == DT_DIR) == wantDir){
+            names.push_back(stdinfo->d_name);
+        }
+    }
+    closedir(dir);
+}
+
+bool fileExists(const std::string &path){
+    struct stat fileStat;
+    return stat(path.c_str(), &fileStat) == 0;
+}
+
+}
+
+ShardedStorage::ShardedStorage() : m_initialized(false), m_migrating(false){
+}
+
+int ShardedStorage::init(){
+    if(m_initialized){
+        return 0;
+    }
+    if(mkdir(SHARDED_ROOT_DIR, 0755) != 0 && errno != EEXIST){
+        std::cout << outHead("error") << "子目录的根目录创建失败 (errno = " << errno << ")" << std::endl;
+        return -1;
+    }
+    m_initialized = true;
+
+    // 后台迁移 filedir 中原有的文件，迁移期间下载和删除同时查找两个位置
+    m_migrating = true;
+    std::thread([this](){
+        long long count = migrate();
+        m_migrating = false;
+        std::cout << outHead("info") << "文件迁移到子目录完成，共迁移 " << count << " 个文件" << std::endl;
+    }).detach();
+    return 0;
+}
+
+std::string ShardedStorage::shardPath(const std::string &fileName){
+    Crc32c crc;
+    crc.update(fileName.c_str(), fileName.size());
+    uint32_t hash = crc.value();
+    return std::string(SHARDED_ROOT_DIR) + "/" + shardDirName(hash >> 24) + "/" + shardDirName(hash >> 16) + "/" + fileName;
+}
+
+int ShardedStorage::createShardDir(const std::string &fileName){
+    std::string filePath = shardPath(fileName);
+    std::string secondDir = filePath.substr(0, filePath.rfind('/'));
+    std::string firstDir = secondDir.substr(0, secondDir.rfind('/'));
+    if((mkdir(firstDir.c_str(), 0755) != 0 && errno != EEXIST) || (mkdir(secondDir.c_str(), 0755) != 0 && errno != EEXIST)){
+        return -1;
+    }
+    return 0;
+}
+
+long long ShardedStorage::migrate(){
+    long long count = 0;
+    std::vector<std::string> names;
+    readDirNames("filedir", false, names);
+    for(size_t i = 0; i < names.size(); ++i){
+        if(!isValidName(names[i]) || createShardDir(names[i]) != 0){
+            continue;
+        }
+        std::string oldPath = "filedir/" + names[i];
+        // link 不会覆盖已有的文件：子目录中已经有同名文件时说明迁移期间重新上传过，原来的文件已经过期。
+        // 子目录可能在创建之后被删除同一子目录中最后一个文件的请求删除，这时重新创建
+        int ret = link(oldPath.c_str(), shardPath(names[i]).c_str());
+        for(int retry = 0; ret != 0 && errno == ENOENT && retry < SHARDED_CREATE_RETRY && createShardDir(names[i]) == 0; ++retry){
+            ret = link(oldPath.c_str(), shardPath(names[i]).c_str());
+        }
+        if(ret != 0 && errno != EEXIST){
+            continue;
+        }
+        unlink(oldPath.c_str());
+        ++count;
+        if(count % 10000 == 0){
+            std::cout << outHead("info") << "已经迁移 " << count << " 个文件到子目录" << std::endl;
+        }
+    }
+    return count;
+}
+
+void ShardedStorage::list(std::vector<std::string> &names){
+    std::vector<std::string> firstDirs;
+    readDirNames(SHARDED_ROOT_DIR, true, firstDirs);
+    for(size_t i = 0; i < firstDirs.size(); ++i){
+        std::string firstPath = std::string(SHARDED_ROOT_DIR) + "/" + firstDirs[i];
+        std::vector<std::string> secondDirs;
+        readDirNames(firstPath, true, secondDirs);
+        for(size_t j = 0; j < secondDirs.size(); ++j){
+            readDirNames(firstPath + "/" + secondDirs[j], false, names);
+        }
+    }
+
+    // 迁移期间加上还没有迁移的文件，同一个文件可能短暂地同时出现在两个位置
+    if(!m_migrating){
+        return;
+    }
+    size_t shardedCount = names.size();
+    readDirNames("filedir", false, names);
+    if(names.size() > shardedCount){
+        std::sort(names.begin(), names.end());
+        names.erase(std::unique(names.begin(), names.end()), names.end());
+    }
+}
+
+int ShardedStorage::listDir(const std::string &dirPath, std::vector<std::string> &files, std::vector<std::string> &dirs){
+    return StorageEngine::listDir(dirPath, files, dirs);
+}
+
+int ShardedStorage::makeDir(const std::string &dirPath){
+    return StorageEngine::makeDir(dirPath);
+}
+
+int ShardedStorage::openFile(const std::string &fileName){
+    return open(localPath(fileName).c_str(), O_RDONLY);
+}
+
+int ShardedStorage::remove(const std::string &fileName){
+    if(!isValidName(fileName)){
+        return -1;
+    }
+    // 先删除原来的路径再删除子目录中的文件，迁移线程在两次删除之间 link 的文件也会被删除
+    int oldRet = unlink(("filedir/" + fileName).c_str());
+    int newRet = unlink(shardPath(fileName).c_str());
+    if(newRet == 0){
+        removeEmptyShardDir(fileName);
+    }
+    return (oldRet == 0 || newRet == 0) ? 0 : -1;
+}
+
+void ShardedStorage::removeEmptyShardDir(const std::string &fileName){
+    // 子目录中还有文件时 rmdir 失败（ENOTEMPTY），不需要先读取目录
+    std::string filePath = shardPath(fileName);
+    std::string secondDir = filePath.substr(0, filePath.rfind('/'));
+    std::string firstDir = secondDir.substr(0, secondDir.rfind('/'));
+    if(rmdir(secondDir.c_str()) == 0){
+        rmdir(firstDir.c_str());
+    }
+}
+
+std::string ShardedStorage::localPath(const std::string &fileName){
+    if(!isValidName(fileName)){
+        return "";
+    }
+    std::string filePath = shardPath(fileName);
+    if(m_migrating && !fileExists(filePath) && fileExists("filedir/" + fileName)){
+        return "filedir/" + fileName;
+    }
+    return filePath;
+}
+
+int ShardedStorage::installFile(const std::string &tmpPath, const std::string &fileName, std::string &filePath){
+    filePath = shardPath(fileName);
+    // 子目录在 createShardDir 和 rename 之间可能被删除（同一子目录中的最后一个文件被删除），这时重新创建
+    int ret = -1;
+    for(int retry = 0; ret != 0 && retry <= SHARDED_CREATE_RETRY; ++retry){
+        if(createShardDir(fileName) != 0){
+            return -1;
+        }
+        ret = rename(tmpPath.c_str(), filePath.c_str());
+        if(ret != 0 && errno != ENOENT){
+            return -1;
+        }
+    }
+    if(ret != 0){
+        return -1;
+    }
+    // 新文件保存在子目录中，还没有迁移的旧文件已经过期
+    unlink(("filedir/" + fileName).c_str());
+    return 0;
+}
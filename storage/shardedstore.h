@@ -0,0 +1,56 @@
+/*  文件说明：
+ *  1. 存储引擎 sharded：和 flat 一样每个文件是一个普通文件，但按文件名 CRC32C 的前两个字节分散到两级子目录中，
+ *     例如 filedir/.shards/3f/a2/文件名，文件很多时每个目录中只有少量目录项，打开文件时的路径查找不会随文件数变慢
+ *  2. 子目录在第一次写入时创建，删除子目录中的最后一个文件时一起删除，文件名到子目录的映射只由文件名决定，不需要额外的索引。
+ *     文件列表只读取存在的子目录，列出文件的代价和文件个数成正比，而不是和 65536 个可能的子目录成正比
+ *  3. 选择该引擎后，后台线程将 filedir 中原有的文件逐个迁移到子目录中（在线迁移，不影响正在进行的上传和下载）：
+ *     先 link 到子目录再删除原来的路径，子目录中已经有同名文件（迁移期间重新上传过）时直接删除原来的文件
+ *  4. 迁移完成之前，文件列表、下载和删除同时查找子目录和 filedir，优先使用子目录中的文件
+ *  5. 不支持多级目录，filedir 中原有的子目录不会被迁移
+ */
+#ifndef SHARDEDSTORE_H
+#define SHARDEDSTORE_H
+#include <string>
+#include <vector>
+#include <atomic>
+
+#include "storageengine.h"
+
+#define SHARDED_ROOT_DIR "filedir/.shards"     // 子目录的根目录
+#define SHARDED_CREATE_RETRY 3                  // 写入时子目录被并发删除后重新创建的次数
+
+class ShardedStorage : public FlatStorage{
+public:
+    ShardedStorage();
+
+    virtual const char *name() const override { return "sharded"; }
+    virtual int init() override;
+    virtual void list(std::vector<std::string> &names) override;
+    virtual int listDir(const std::string &dirPath, std::vector<std::string> &files, std::vector<std::string> &dirs) override;
+    virtual int makeDir(const std::string &dirPath) override;
+    virtual int remove(const std::string &fileName) override;
+    virtual std::string localPath(const std::string &fileName) override;
+    virtual int installFile(const std::string &tmpPath, const std::string &fileName, std::string &filePath) override;
+
+    // 文件在子目录中的路径
+    static std::string shardPath(const std::string &fileName);
+
+    // 将 filedir 中原有的文件迁移到子目录中，返回迁移的文件个数
+    static long long migrate();
+
+protected:
+    virtual int openFile(const std::string &fileName) override;
+
+private:
+    // 创建文件所在的两级子目录
+    static int createShardDir(const std::string &fileName);
+
+    // 删除文件之后，子目录已经为空时删除子目录
+    static void removeEmptyShardDir(const std::string &fileName);
+
+private:
+    bool m_initialized;
+    std::atomic<bool> m_migrating;      // 后台迁移是否还在进行
+};
+
+#endif
@@ -0,0 +1,287 @@
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cerrno>
+#include <cstdlib>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+
+#include "storageengine.h"
+#include "dedupstore.h"
+#include "packedstore.h"
+#include "shardedstore.h"
+#include "dirtree.h"
+#include "dirusage.h"
+#include "pagecache.h"
+#include "../utils/utils.h"
+
+namespace {
+
+// 普通文件的下载：打开文件后用 sendfile 从上次的偏移继续发送
+class FlatReader : public StorageReader{
+public:
+    FlatReader(int fd, long long length) : m_fd(fd), m_length(length), m_offset(0){ }
+    virtual ~FlatReader(){ close(m_fd); }
+
+    virtual long long length() const override { return m_length; }
+
+    virtual bool digest(FileDigest &digest) const override {
+        return DigestStore::load(m_fd, digest) == 0;
+    }
+
+    virtual long long cachedLength(long long maxLen) override {
+        return PageCache::residentLength(m_fd, m_offset, std::min<long long>(maxLen, m_length - m_offset));
+    }
+
+    virtual void prefetch(long long len) override {
+        PageCache::prefetch(m_fd, m_offset, std::min<long long>(len, m_length - m_offset));
+    }
+
+    virtual long long sendTo(int sockFd, long long maxLen) override {
+        // sendfile 会更新 m_offset
+        return sendfile(sockFd, m_fd, &m_offset, std::min<long long>(maxLen, m_length - m_offset));
+    }
+
+private:
+    int m_fd;
+    long long m_length;
+    off_t m_offset;
+};
+
+// 普通文件的上传：写入 filedir 中以 . 开头的临时文件，完成后 rename 为目标文件，上传过程中不会出现只写了一部分的文件
+class FlatWriter : public StorageWriter{
+public:
+    FlatWriter(FlatStorage *storage, const std::string &fileName, const std::string &tmpPath, int fd)
+        : m_storage(storage), m_fileName(fileName), m_tmpPath(tmpPath), m_fd(fd), m_size(0){ }
+    virtual ~FlatWriter(){ abort(); }
+
+    virtual int write(const char *data, size_t len) override {
+        size_t hasWriteLen = 0;
+        while(hasWriteLen < len){
+            ssize_t ret = ::write(m_fd, data + hasWriteLen, len - hasWriteLen);
+            if(ret == -1){
+                if(errno == EINTR){
+                    continue;
+                }
+                return -1;
+            }
+            hasWriteLen += ret;
+        }
+        m_size += len;
+        return 0;
+    }
+
+    virtual int commit(const FileDigest *digest) override {
+        close(m_fd);
+        m_fd = -1;
+        std::string filePath;
+        if(m_storage->installFile(m_tmpPath, m_fileName, filePath) != 0){
+            abort();
+            return -1;
+        }
+        m_tmpPath.clear();
+        if(digest != nullptr && DigestStore::save(filePath, *digest) != 0){
+            std::cout << outHead("error") << "文件 " << m_fileName << " 的校验值保存失败 (errno = " << errno << ")" << std::endl;
+        }
+        return 0;
+    }
+
+    virtual void abort() override {
+        if(m_fd != -1){
+            close(m_fd);
+            m_fd = -1;
+        }
+        if(!m_tmpPath.empty()){
+            unlink(m_tmpPath.c_str());
+            m_tmpPath.clear();
+        }
+    }
+
+    virtual long long size() const override { return m_size; }
+
+private:
+    FlatStorage *m_storage;
+    std::string m_fileName;
+    std::string m_tmpPath;
+    int m_fd;
+    long long m_size;
+};
+
+FlatStorage flatStorage;
+DedupStorage dedupStorage;
+PackedStorage packedStorage;
+ShardedStorage shardedStorage;
+
+}
+
+StorageEngine *StorageEngine::engine = &flatStorage;
+
+StorageEngine *StorageEngine::current(){
+    return engine;
+}
+
+int StorageEngine::select(const std::string &engineName){
+    StorageEngine *selected = nullptr;
+    if(engineName == "flat"){
+        selected = &flatStorage;
+    }else if(engineName == "dedup"){
+        selected = &dedupStorage;
+    }else if(engineName == "packed"){
+        selected = &packedStorage;
+    }else if(engineName == "sharded"){
+        selected = &shardedStorage;
+    }else{
+        std::cout << outHead("error") << "未知的存储引擎 " << engineName << std::endl;
+        return -1;
+    }
+    if(selected->init() != 0){
+        std::cout << outHead("error") << "存储引擎 " << engineName << " 初始化失败" << std::endl;
+        return -1;
+    }
+    engine = selected;
+    std::cout << outHead("info") << "使用存储引擎 " << engineName << std::endl;
+    return 0;
+}
+
+bool StorageEngine::isValidName(const std::string &fileName){
+    if(fileName.empty() || fileName[0] == '.'){
+        return false;
+    }
+    return fileName.find('/') == std::string::npos && fileName.find('\\') == std::string::npos;
+}
+
+int StorageEngine::listDir(const std::string &dirPath, std::vector<std::string> &files, std::vector<std::string> &){
+    if(!dirPath.empty()){
+        return -1;
+    }
+    list(files);
+    return 0;
+}
+
+int StorageEngine::makeDir(const std::string &){
+    return -1;
+}
+
+int FlatStorage::init(){
+    return 0;
+}
+
+void FlatStorage::list(std::vector<std::string> &names){
+    DirTree::listAll(names);
+}
+
+int FlatStorage::listDir(const std::string &dirPath, std::vector<std::string> &files, std::vector<std::string> &dirs){
+    return DirTree::listDir(dirPath, files, dirs);
+}
+
+int FlatStorage::makeDir(const std::string &dirPath){
+    if(DirTree::makeDir(dirPath) != 0){
+        return -1;
+    }
+    DirUsage::dirCreated(dirPath);
+    return 0;
+}
+
+int FlatStorage::openFile(const std::string &fileName){
+    // 相对缓存的父目录描述符打开，路径不会解析到 filedir 之外
+    return DirTree::openFile(fileName, O_RDONLY);
+}
+
+StorageReader *FlatStorage::openReader(const std::string &fileName){
+    if(localPath(fileName).empty()){
+        return nullptr;
+    }
+    int fd = openFile(fileName);
+    if(fd == -1){
+        return nullptr;
+    }
+    struct stat fileStat;
+    if(fstat(fd, &fileStat) != 0 || !S_ISREG(fileStat.st_mode)){
+        close(fd);
+        return nullptr;
+    }
+    return new FlatReader(fd, fileStat.st_size);
+}
+
+StorageWriter *FlatStorage::createWriter(const std::string &fileName){
+    if(localPath(fileName).empty()){
+        return nullptr;
+    }
+    // 上传到子目录时目录需要已经存在，否则写完后才会在 rename 时失败
+    std::string parent, leaf;
+    DirTree::splitPath(fileName, parent, leaf);
+    if(!parent.empty() && !DirTree::openDir(parent)){
+        return nullptr;
+    }
+    char tmpPath[] = "filedir/.uploadXXXXXX";
+    int fd = mkstemp(tmpPath);
+    if(fd == -1){
+        return nullptr;
+    }
+    // mkstemp 创建的文件只有所有者可以读写，和其他上传的文件保持相同的权限
+    fchmod(fd, 0644);
+    return new FlatWriter(this, fileName, tmpPath, fd);
+}
+
+int FlatStorage::importFile(const std::string &path, const std::string &fileName, const FileDigest *digest){
+    if(localPath(fileName).empty()){
+        return -1;
+    }
+    // 调用者没有边写入边计算校验值时读取文件计算一次（文件刚刚写入，通常还在页缓存中），之后原子地 rename 为目标文件
+    FileDigest computed;
+    bool hasDigest = digest != nullptr;
+    if(!hasDigest){
+        int fd = open(path.c_str(), O_RDONLY);
+        hasDigest = fd != -1 && DigestStore::compute(fd, computed) == 0;
+        if(fd != -1){
+            close(fd);
+        }
+    }
+    std::string filePath;
+    if(installFile(path, fileName, filePath) != 0){
+        return -1;
+    }
+    if(hasDigest){
+        DigestStore::save(filePath, digest != nullptr ? *digest : computed);
+    }
+    return 0;
+}
+
+int FlatStorage::remove(const std::string &fileName){
+    // 删除之前获取长度和类型，用于更新目录占用统计
+    struct stat fileStat;
+    if(DirTree::statPath(fileName, fileStat) != 0 || DirTree::remove(fileName) != 0){
+        return -1;
+    }
+    if(S_ISDIR(fileStat.st_mode)){
+        DirUsage::dirRemoved(fileName);
+    }else if(S_ISREG(fileStat.st_mode)){
+        DirUsage::fileRemoved(fileName, fileStat.st_size);
+    }
+    return 0;
+}
+
+std::string FlatStorage::localPath(const std::string &fileName){
+    if(!DirTree::isValidPath(fileName)){
+        return "";
+    }
+    return "filedir/" + fileName;
+}
+
+int FlatStorage::installFile(const std::string &tmpPath, const std::string &fileName, std::string &filePath){
+    filePath = "filedir/" + fileName;
+    // 被替换的文件和新文件的长度，用于更新目录占用统计
+    struct stat oldStat, newStat;
+    long long oldSize = DirTree::statPath(fileName, oldStat) == 0 && S_ISREG(oldStat.st_mode) ? oldStat.st_size : -1;
+    long long newSize = stat(tmpPath.c_str(), &newStat) == 0 ? newStat.st_size : 0;
+    if(DirTree::renameInto(tmpPath, fileName) != 0){
+        return -1;
+    }
+    DirUsage::fileWritten(fileName, oldSize, newSize);
+    return 0;
+}
@@ -0,0 +1,130 @@
+/*  文件说明：
+ *  1. 存储引擎接口：HandleRecv 和 HandleSend 中的上传、下载、删除和文件列表都通过当前的存储引擎完成，不直接操作 filedir
+ *  2. 可选的存储引擎：
+ *       flat   ：每个文件保存为 filedir 中的一个普通文件（默认）
+ *       dedup  ：内容定义分块的去重存储，见 dedupstore.h
+ *       packed ：小文件追加到大的段文件中，大文件仍然保存为普通文件，见 packedstore.h
+ *       sharded：和 flat 相同，但文件按文件名的哈希分散到两级子目录中，见 shardedstore.h
+ *  3. 存储引擎在服务器启动时选择，之后所有工作线程共享同一个引擎，引擎的实现需要是线程安全的
+ *  4. 下载和上传分别通过 StorageReader 和 StorageWriter 完成，每个连接持有一个，保存该连接的发送或写入进度
+ *  5. 只有 flat 支持多级目录，文件名可以是 "目录/文件名" 形式的路径，见 dirtree.h；其他引擎的文件名只有一级
+ */
+#ifndef STORAGEENGINE_H
+#define STORAGEENGINE_H
+#include <string>
+#include <vector>
+#include <cstddef>
+
+#include "../checksum/checksum.h"
+
+// 下载一个文件时使用，每个正在下载的连接对应一个
+class StorageReader{
+public:
+    virtual ~StorageReader(){ }
+
+    // 文件长度
+    virtual long long length() const = 0;
+
+    // 上传时保存的校验值，没有或已经失效时返回 false
+    virtual bool digest(FileDigest &digest) const = 0;
+
+    // 从上次发送到的位置开始最多 maxLen 字节中，连续在页缓存中的字节数，用于避免网络线程等待磁盘。无法判断时返回 maxLen
+    virtual long long cachedLength(long long maxLen){ return maxLen; }
+
+    // 将上次发送到的位置之后的 len 字节读入页缓存，会等待磁盘，在 I/O 线程池中调用
+    virtual void prefetch(long long){ }
+
+    // 从上次发送到的位置继续向套接字发送最多 maxLen 字节的文件数据，返回本次发送的字节数，出错时返回 -1（发送缓冲区满时 errno 为 EAGAIN）
+    virtual long long sendTo(int sockFd, long long maxLen) = 0;
+};
+
+// 上传一个文件时使用，数据全部写入并 commit 之后文件才会出现，同名文件在 commit 时被原子地替换
+class StorageWriter{
+public:
+    virtual ~StorageWriter(){ }
+
+    // 追加文件数据，失败时返回 -1
+    virtual int write(const char *data, size_t len) = 0;
+
+    // 数据全部写入后保存文件，digest 为上传时计算的校验值（可以为 nullptr）
+    virtual int commit(const FileDigest *digest) = 0;
+
+    // 上传失败时丢弃已经写入的数据
+    virtual void abort() = 0;
+
+    // 已经写入的长度
+    virtual long long size() const = 0;
+};
+
+class StorageEngine{
+public:
+    virtual ~StorageEngine(){ }
+
+    // 引擎的名字，和 select 的参数相同
+    virtual const char *name() const = 0;
+
+    // 创建目录、加载索引等，选择引擎时调用一次，成功时返回 0
+    virtual int init() = 0;
+
+    // 获取所有文件名（支持目录时为所有文件的路径）
+    virtual void list(std::vector<std::string> &names) = 0;
+
+    // 获取一个目录中的文件名和子目录名，dirPath 为空时表示根目录。不支持目录的引擎只能获取根目录
+    virtual int listDir(const std::string &dirPath, std::vector<std::string> &files, std::vector<std::string> &dirs);
+
+    // 创建目录，不支持目录的引擎返回 -1
+    virtual int makeDir(const std::string &dirPath);
+
+    // 打开文件用于下载，文件不存在时返回 nullptr。返回的对象由调用者 delete
+    virtual StorageReader *openReader(const std::string &fileName) = 0;
+
+    // 创建上传文件的写入器，失败时返回 nullptr。返回的对象由调用者 delete
+    virtual StorageWriter *createWriter(const std::string &fileName) = 0;
+
+    // 将一个已经写完的文件（如上传会话的暂存文件）保存为 fileName，原文件会被移动或删除。
+    // digest 为调用者边写入边计算的校验值，为 nullptr 时由引擎读取文件计算
+    virtual int importFile(const std::string &path, const std::string &fileName, const FileDigest *digest) = 0;
+
+    // 删除文件（支持目录时也可以删除空目录），文件不存在时返回 -1
+    virtual int remove(const std::string &fileName) = 0;
+
+    // 文件完整地保存为 filedir 中的普通文件时返回它的路径，否则返回空字符串。增量同步只能用于这样的文件
+    virtual std::string localPath(const std::string &fileName) = 0;
+
+public:
+    // 当前使用的存储引擎，没有选择时为 flat
+    static StorageEngine *current();
+
+    // 根据名字选择存储引擎并初始化，名字无效或初始化失败时返回 -1，当前引擎不变
+    static int select(const std::string &engineName);
+
+    // 文件名不能为空，不能包含路径分隔符，不能以 . 开头（. 开头的名字留给存储引擎内部使用）
+    static bool isValidName(const std::string &fileName);
+
+private:
+    static StorageEngine *engine;
+};
+
+// 每个文件保存为 filedir 中的一个普通文件，上传时先写入临时文件，完成后 rename，校验值保存在文件的扩展属性中
+class FlatStorage : public StorageEngine{
+public:
+    virtual const char *name() const override { return "flat"; }
+    virtual int init() override;
+    virtual void list(std::vector<std::string> &names) override;
+    virtual int listDir(const std::string &dirPath, std::vector<std::string> &files, std::vector<std::string> &dirs) override;
+    virtual int makeDir(const std::string &dirPath) override;
+    virtual StorageReader *openReader(const std::string &fileName) override;
+    virtual StorageWriter *createWriter(const std::string &fileName) override;
+    virtual int importFile(const std::string &path, const std::string &fileName, const FileDigest *digest) override;
+    virtual int remove(const std::string &fileName) override;
+    virtual std::string localPath(const std::string &fileName) override;
+
+    // 将已经写完的临时文件原子地 rename 为文件 fileName，filePath 返回文件最终的路径。供写入器使用
+    virtual int installFile(const std::string &tmpPath, const std::string &fileName, std::string &filePath);
+
+protected:
+    // 以只读方式打开文件用于下载，失败时返回 -1
+    virtual int openFile(const std::string &fileName);
+};
+
+#endif
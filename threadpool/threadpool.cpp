@@ -1,50 +1,131 @@
+#include <sstream>
+#include <fstream>
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cerrno>
+#include <cstdlib>
+
+#include <cstdio>
+
+#include <time.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
+
 #include "threadpool.h"
 
-ThreadPool::ThreadPool(int threadNum) : m_threadNum(threadNum){
+std::mutex ThreadPool::poolsLock;
+std::vector<ThreadPool*> ThreadPool::pools;
+
+namespace {
+
+// 当前时间（微秒）
+long long nowMicros(){
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// 当前线程使用 CPU 的时间和在运行队列中等待 CPU 的时间（微秒）。schedFd 为线程的 /proc/thread-self/schedstat，
+// 不可用时等待时间为 0，CPU 被其他线程占满时等待 CPU 的时间会被算作阻塞
+void sampleThreadTime(int schedFd, long long &cpuMicros, long long &waitMicros){
+    char buffer[128];
+    ssize_t n = schedFd == -1 ? -1 : pread(schedFd, buffer, sizeof(buffer) - 1, 0);
+    if(n > 0){
+        buffer[n] = '\0';
+        long long cpuNanos = 0, waitNanos = 0;
+        if(sscanf(buffer, "%lld %lld", &cpuNanos, &waitNanos) == 2){
+            cpuMicros = cpuNanos / 1000;
+            waitMicros = waitNanos / 1000;
+            return;
+        }
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    cpuMicros = ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+    waitMicros = 0;
+}
+
+// 保留四分之一（至少一个）线程只处理交互事件，只有一个线程时无法保留
+int bulkLimitFor(int threads){
+    return threads > 1 ? threads - std::max(1, threads / 4) : 1;
+}
+
+// 读取 cgroup v2 的 cpu.max（"配额 周期" 或 "max 周期"），返回配额可以使用的 CPU 数，没有限制或者读取失败时返回 0
+int readCpuMax(const std::string &path){
+    std::ifstream in(path);
+    std::string quota;
+    long long period = 0;
+    if(!(in >> quota >> period) || quota == "max" || period <= 0){
+        return 0;
+    }
+    long long quotaMicros = std::atoll(quota.c_str());
+    if(quotaMicros <= 0){
+        return 0;
+    }
+    return static_cast<int>(std::max(1LL, (quotaMicros + period - 1) / period));
+}
+
+}
+
+ThreadPool::ThreadPool(int threadNum, const std::string &name, int maxQueueSize)
+        : m_threadNum(threadNum), m_spawned(0), m_nextIndex(0), m_name(name), m_maxQueueSize(maxQueueSize > 0 ? maxQueueSize : 0),
+          m_bulkActive(0), m_interactiveStreak(0), m_delayTarget(0), m_delayInterval(0), m_intervalEnd(0), m_minDelay(LLONG_MAX),
+          m_overloaded(false), m_shedMarked(0), m_adaptive(false), m_minThreads(0), m_maxThreads(0), m_cpus(availableCpus()),
+          m_adjustEnd(0), m_adjustMinDelay(LLONG_MAX), m_grown(0), m_shrunk(0), m_blockedPercent(0), m_utilization(0), m_lastAdjust("none"),
+          m_busyMicros(0), m_blockedMicros(0), m_affinityGeneration(0), m_peakQueueSize(0), m_rejected(0), m_active(0), m_completed(0){
+    // 没有指定线程数时按可以使用的 CPU 数创建
+    if(m_threadNum <= 0){
+        m_threadNum = m_cpus;
+    }
+    m_bulkLimit = bulkLimitFor(m_threadNum);
+    CPU_ZERO(&m_cpuSet);
+
     // 初始化互斥量
     int ret = pthread_mutex_init(&queueLocker, nullptr);
     if(ret != 0){
         throw std::runtime_error("初始化互斥量失败");
     }
 
-    // 初始化信号量
-    ret = sem_init(&queueEventNum, 0, 0);
+    // 初始化条件变量，等待超时使用单调时钟
+    pthread_condattr_t condAttr;
+    pthread_condattr_init(&condAttr);
+    pthread_condattr_setclock(&condAttr, CLOCK_MONOTONIC);
+    ret = pthread_cond_init(&queueCond, &condAttr);
+    pthread_condattr_destroy(&condAttr);
     if(ret != 0){
-        throw std::runtime_error("初始化信号量失败");
+        throw std::runtime_error("初始化条件变量失败");
     }
 
     // 初始化线程池中的所有线程
-    m_threads = new pthread_t[m_threadNum];
     for(int i = 0; i < m_threadNum; ++i){
-        ret = pthread_create(m_threads + i, nullptr, worker, this);
+        pthread_mutex_lock(&queueLocker);
+        ret = spawnWorkerLocked();
+        pthread_mutex_unlock(&queueLocker);
         if(ret != 0){
-            delete[] m_threads;
             throw std::runtime_error("线程创建失败");
         }
-        ret = pthread_detach(m_threads[i]);
-        ++tnum;
         usleep(1000);     // 为了在线程中记录线程序号
-        if(ret != 0){
-            delete[] m_threads;
-            throw std::runtime_error("设置脱离线程失败");
-        }
     }
+
+    std::lock_guard<std::mutex> guard(poolsLock);
+    pools.push_back(this);
 }
 
 
 ThreadPool::~ThreadPool(){
+    {
+        std::lock_guard<std::mutex> guard(poolsLock);
+        pools.erase(std::remove(pools.begin(), pools.end(), this), pools.end());
+    }
+
     // 释放互斥量
     pthread_mutex_destroy(&queueLocker);
     
-    // 释放信号量
-    sem_destroy(&queueEventNum);
-    
-    // 释放动态创建的保存线程 id 的数组
-    delete[] m_threads;
-
+    // 释放条件变量
+    pthread_cond_destroy(&queueCond);
 }
 
-int ThreadPool::appendEvent(EventBase* event, const std::string eventType){
+int ThreadPool::appendEvent(EventBase* event, const std::string eventType, EventPriority priority){
     int ret = 0;
     // 事件队列加锁
     ret = pthread_mutex_lock(&queueLocker);
@@ -52,19 +133,38 @@ int ThreadPool::appendEvent(EventBase* event, const std::string eventType){
         std::cout << outHead("error") << "事件队列加锁失败" << std::endl;
         return -1;
     }
-    // 向队列中添加事件
-    m_workQueue.push(event);
-    std::cout << outHead("info") << eventType << "添加成功，线程池事件队列中剩余的事件个数：" << m_workQueue.size() << std::endl;
+    // 队列已满时拒绝添加
+    size_t queued = m_workQueue.size() + m_bulkQueue.size();
+    if(m_maxQueueSize != 0 && queued >= m_maxQueueSize){
+        ++m_rejected;
+        pthread_mutex_unlock(&queueLocker);
+        std::cout << outHead("warn") << m_name << " 线程池事件队列已满（" << m_maxQueueSize << "），" << eventType << "添加失败" << std::endl;
+        return -4;
+    }
+    // 按优先级向队列中添加事件，同时记录加入的时间
+    QueuedEvent queuedEvent;
+    queuedEvent.event = event;
+    queuedEvent.enqueueTime = nowMicros();
+    if(priority == PRIORITY_BULK){
+        m_bulkQueue.push(queuedEvent);
+    }else{
+        m_workQueue.push(queuedEvent);
+    }
+    m_peakQueueSize = std::max(m_peakQueueSize, queued + 1);
+    std::cout << outHead("info") << eventType << "添加成功，" << m_name << " 线程池事件队列中剩余的事件个数：" << m_workQueue.size()
+              << "（交互），" << m_bulkQueue.size() << "（批量）" << std::endl;
+    // 有暂停的线程时只通知一个线程可能唤醒暂停的线程，需要通知所有线程
+    bool hasParked = m_spawned > m_threadNum;
     // 事件队列解锁
     pthread_mutex_unlock(&queueLocker);
     if(ret != 0){
         std::cout << outHead("error") << "事件队列解锁失败" << std::endl;
         return -2;
     }
-    // 事件队列的信号量加一
-    sem_post(&queueEventNum);
+    // 通知一个等待的线程
+    ret = hasParked ? pthread_cond_broadcast(&queueCond) : pthread_cond_signal(&queueCond);
     if(ret != 0){
-        std::cout << outHead("error") << "事件队列信号量 post 失败" << std::endl;
+        std::cout << outHead("error") << "事件队列条件变量通知失败" << std::endl;
         return -3;
     }
     
@@ -79,26 +179,79 @@ void *ThreadPool::worker(void *arg){
 }
 
 
+int ThreadPool::spawnWorkerLocked(){
+    pthread_t thread;
+    ++tnum;
+    if(pthread_create(&thread, nullptr, worker, this) != 0){
+        --tnum;
+        return -1;
+    }
+    pthread_detach(thread);
+    ++m_spawned;
+    return 0;
+}
+
 void ThreadPool::run(){
     int threadN = tnum;
+    // 线程在线程池中的序号，序号不小于线程数时暂停
+    pthread_mutex_lock(&queueLocker);
+    int index = m_nextIndex++;
+    int appliedGeneration = 0;
+    pthread_mutex_unlock(&queueLocker);
+    // 线程的调度统计，用于区分阻塞和等待 CPU 的时间
+    int schedFd = open("/proc/thread-self/schedstat", O_RDONLY | O_CLOEXEC);
     std::cout << outHead("info") << "线程 " << threadN << " 正在执行" << std::endl;
     while(1){
-        // 等待事件队列中有新的事件
-        int ret = sem_wait(&queueEventNum);
-        if(ret != 0){
-            std::cout << outHead("error") << "等待队列事件失败" << std::endl;
-            return;
-        }
-        std::cout << outHead("log") << "线程 " << threadN << " 收到事件" << std::endl;
         // 互斥访问队列
-        ret = pthread_mutex_lock(&queueLocker);
+        int ret = pthread_mutex_lock(&queueLocker);
         if(ret != 0){
             std::cout << outHead("error") << "ThreadPool:run() : 事件队列加锁失败" << std::endl;
             return;
         }
-        // 获取最前面的事件
-        EventBase* curEvent = m_workQueue.front();
-        m_workQueue.pop();
+        // 等待事件队列中有可以取出的事件，启用自适应线程数时每个调整周期超时一次，空闲时也可以减少线程
+        applyAffinityLocked(appliedGeneration);
+        while(index >= m_threadNum || !hasRunnableLocked()){
+            applyAffinityLocked(appliedGeneration);
+            if(!m_adaptive){
+                pthread_cond_wait(&queueCond, &queueLocker);
+                continue;
+            }
+            struct timespec deadline;
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            long long nsec = deadline.tv_nsec + POOL_ADJUST_INTERVAL * 1000LL;
+            deadline.tv_sec += nsec / 1000000000;
+            deadline.tv_nsec = nsec % 1000000000;
+            if(pthread_cond_timedwait(&queueCond, &queueLocker, &deadline) == ETIMEDOUT){
+                adjustLocked(nowMicros());
+            }
+        }
+        std::cout << outHead("log") << "线程 " << threadN << " 收到事件" << std::endl;
+
+        // 优先取交互事件，连续取了 INTERACTIVE_WEIGHT 个交互事件后，有批量事件并且没有超过批量事件的线程数时取一个批量事件
+        bool bulkAllowed = !m_bulkQueue.empty() && m_bulkActive < m_bulkLimit;
+        bool isBulk = bulkAllowed && (m_workQueue.empty() || m_interactiveStreak >= INTERACTIVE_WEIGHT);
+        EventBase* curEvent = nullptr;
+        if(isBulk){
+            curEvent = m_bulkQueue.front().event;
+            m_bulkQueue.pop();
+            ++m_bulkActive;
+            m_interactiveStreak = 0;
+        }else{
+            long long now = nowMicros();
+            long long sojourn = now - m_workQueue.front().enqueueTime;
+            curEvent = m_workQueue.front().event;
+            m_workQueue.pop();
+            ++m_interactiveStreak;
+            // 排队太久的事件标记为丢弃，由事件决定如何处理（新的请求返回 503）
+            if(trackDelayLocked(sojourn, now) && curEvent != nullptr){
+                curEvent->markShed();
+                ++m_shedMarked;
+            }
+            if(m_adaptive){
+                m_adjustMinDelay = std::min(m_adjustMinDelay, m_workQueue.empty() ? 0 : sojourn);
+            }
+        }
+        adjustLocked(nowMicros());
         
         // 解锁访问队列
         ret = pthread_mutex_unlock(&queueLocker);
@@ -107,13 +260,258 @@ void ThreadPool::run(){
             return;
         }
 
-        if(curEvent == nullptr){
-            continue;
+        if(curEvent != nullptr){
+            std::cout << outHead("info") << "线程 " << threadN << " 开始处理事件" << std::endl;
+            ++m_active;
+            // 处理时间中既没有使用 CPU 也没有等待 CPU 的部分为阻塞（等待磁盘、锁等）的时间
+            long long startCpu, startWait, endCpu, endWait;
+            long long startTime = nowMicros();
+            sampleThreadTime(schedFd, startCpu, startWait);
+            curEvent->process();
+            sampleThreadTime(schedFd, endCpu, endWait);
+            long long wall = nowMicros() - startTime;
+            m_busyMicros += wall;
+            m_blockedMicros += std::max(0LL, wall - (endCpu - startCpu) - (endWait - startWait));
+            --m_active;
+            ++m_completed;
+            std::cout << outHead("info") << "线程 " << threadN << " 处理事件完成" << std::endl;
+            // 事件执行完需要销毁
+            delete curEvent;
+        }
+
+        // 批量事件执行完成后，等待批量事件的线程可以继续取出
+        if(isBulk){
+            pthread_mutex_lock(&queueLocker);
+            --m_bulkActive;
+            bool hasParked = m_spawned > m_threadNum;
+            pthread_mutex_unlock(&queueLocker);
+            if(hasParked){
+                pthread_cond_broadcast(&queueCond);
+            }else{
+                pthread_cond_signal(&queueCond);
+            }
         }
-        std::cout << outHead("info") << "线程 " << threadN << " 开始处理事件" << std::endl;
-        curEvent->process();
-        std::cout << outHead("info") << "线程 " << threadN << " 处理事件完成" << std::endl;
-        // 事件执行完需要销毁
-        delete curEvent;
     }
 }
+
+bool ThreadPool::hasRunnableLocked() const {
+    return !m_workQueue.empty() || (!m_bulkQueue.empty() && m_bulkActive < m_bulkLimit);
+}
+
+bool ThreadPool::trackDelayLocked(long long sojourn, long long now){
+    if(m_delayTarget <= 0){
+        return false;
+    }
+    // 取出后队列为空，说明积压已经排空，不是持续的排队
+    m_minDelay = std::min(m_minDelay, m_workQueue.empty() ? 0 : sojourn);
+    if(now >= m_intervalEnd){
+        // 整个时间窗口内最短的排队时间都超过目标，说明队列一直没有排空，进入过载状态，否则退出过载状态
+        bool overloaded = m_minDelay != LLONG_MAX && m_minDelay > m_delayTarget;
+        if(overloaded != m_overloaded){
+            std::cout << outHead(overloaded ? "warn" : "info") << m_name << " 线程池" << (overloaded ? "进入" : "退出") << "过载状态，窗口内最短排队时间 "
+                      << m_minDelay << " 微秒" << std::endl;
+        }
+        m_overloaded = overloaded;
+        m_minDelay = LLONG_MAX;
+        m_intervalEnd = now + m_delayInterval;
+    }
+    return sojourn > (m_overloaded ? m_delayTarget : m_delayInterval);
+}
+
+void ThreadPool::setQueueDelayTarget(long long targetMicros, long long intervalMicros){
+    pthread_mutex_lock(&queueLocker);
+    m_delayTarget = targetMicros > 0 ? targetMicros : 0;
+    m_delayInterval = std::max(intervalMicros, m_delayTarget);
+    m_intervalEnd = nowMicros() + m_delayInterval;
+    m_minDelay = LLONG_MAX;
+    m_overloaded = false;
+    pthread_mutex_unlock(&queueLocker);
+}
+
+void ThreadPool::resizeLocked(int threads){
+    while(m_spawned < threads){
+        if(spawnWorkerLocked() != 0){
+            std::cout << outHead("error") << m_name << " 线程池创建线程失败" << std::endl;
+            threads = std::max(m_spawned, 1);
+            break;
+        }
+    }
+    m_threadNum = threads;
+    m_bulkLimit = bulkLimitFor(threads);
+    // 暂停的线程检查自己的序号，新的线程数下可以运行的线程开始取出事件
+    pthread_cond_broadcast(&queueCond);
+}
+
+void ThreadPool::adjustLocked(long long now){
+    if(!m_adaptive || now < m_adjustEnd){
+        return;
+    }
+    long long window = POOL_ADJUST_INTERVAL + (now - m_adjustEnd);
+    long long busy = m_busyMicros.exchange(0);
+    long long blocked = m_blockedMicros.exchange(0);
+    m_blockedPercent = busy > 0 ? static_cast<int>(blocked * 100 / busy) : 0;
+    m_utilization = static_cast<int>(std::min(100LL, busy * 100 / (window * m_threadNum)));
+
+    // 整个周期内最短的排队时间仍然超过阈值，或者周期内没有取出事件但队列中的事件已经等待超过阈值，说明一直有排队
+    bool queued = m_adjustMinDelay != LLONG_MAX ? m_adjustMinDelay > POOL_GROW_DELAY
+            : (!m_workQueue.empty() && now - m_workQueue.front().enqueueTime > POOL_GROW_DELAY);
+    queued = queued || (!m_bulkQueue.empty() && m_bulkActive < m_bulkLimit && now - m_bulkQueue.front().enqueueTime > POOL_GROW_DELAY);
+    // 周期内没有事件处理完成时无法计算阻塞时间，线程都被长时间的事件占用，按阻塞处理
+    bool blockedHigh = busy == 0 || m_blockedPercent >= POOL_BLOCKED_HIGH;
+    bool cpuBound = busy > 0 && m_blockedPercent < POOL_BLOCKED_LOW;
+
+    int target = m_threadNum;
+    const char *reason = nullptr;
+    if(queued && m_threadNum < m_maxThreads && (blockedHigh || m_threadNum < m_cpus)){
+        target = m_threadNum + 1;
+        reason = blockedHigh ? "grow-blocked" : "grow-cpu";
+    }else if(queued && cpuBound && m_threadNum > std::max(m_minThreads, m_cpus)){
+        target = m_threadNum - 1;
+        reason = "shrink-cpu-bound";
+    }else if(!queued && m_utilization < POOL_IDLE_UTILIZATION && m_threadNum > m_minThreads){
+        target = m_threadNum - 1;
+        reason = "shrink-idle";
+    }
+    m_adjustMinDelay = LLONG_MAX;
+    m_adjustEnd = now + POOL_ADJUST_INTERVAL;
+    if(reason == nullptr){
+        return;
+    }
+    std::cout << outHead("info") << m_name << " 线程池线程数 " << m_threadNum << " -> " << target << "（" << reason << "），阻塞时间占比 "
+              << m_blockedPercent << "%，利用率 " << m_utilization << "%" << std::endl;
+    if(target > m_threadNum){
+        ++m_grown;
+    }else{
+        ++m_shrunk;
+    }
+    m_lastAdjust = reason;
+    resizeLocked(target);
+}
+
+int ThreadPool::setAdaptive(int minThreads, int maxThreads){
+    if(minThreads < 1 || maxThreads < minThreads){
+        return -1;
+    }
+    pthread_mutex_lock(&queueLocker);
+    m_adaptive = true;
+    m_minThreads = minThreads;
+    m_maxThreads = maxThreads;
+    m_adjustEnd = nowMicros() + POOL_ADJUST_INTERVAL;
+    m_adjustMinDelay = LLONG_MAX;
+    m_busyMicros = 0;
+    m_blockedMicros = 0;
+    // 同时唤醒等待中的线程，之后按调整周期超时等待
+    resizeLocked(std::min(std::max(m_threadNum, minThreads), maxThreads));
+    pthread_mutex_unlock(&queueLocker);
+    return 0;
+}
+
+void ThreadPool::setCpuAffinity(const cpu_set_t &cpuSet){
+    pthread_mutex_lock(&queueLocker);
+    m_cpuSet = cpuSet;
+    ++m_affinityGeneration;
+    pthread_mutex_unlock(&queueLocker);
+    // 唤醒等待中的线程绑定自己，正在处理事件的线程处理完成后绑定
+    pthread_cond_broadcast(&queueCond);
+    std::cout << outHead("info") << m_name << " 线程池绑定到 CPU " << CpuAffinity::format(cpuSet) << std::endl;
+}
+
+void ThreadPool::applyAffinityLocked(int &appliedGeneration){
+    if(appliedGeneration == m_affinityGeneration){
+        return;
+    }
+    appliedGeneration = m_affinityGeneration;
+    if(CpuAffinity::bindCurrentThread(m_cpuSet) != 0){
+        std::cout << outHead("warn") << m_name << " 线程池的线程绑定 CPU 失败" << std::endl;
+    }
+}
+
+int ThreadPool::availableCpus(){
+    int cpus = 0;
+    cpu_set_t cpuSet;
+    CPU_ZERO(&cpuSet);
+    if(sched_getaffinity(0, sizeof(cpuSet), &cpuSet) == 0){
+        cpus = CPU_COUNT(&cpuSet);
+    }
+    if(cpus <= 0){
+        cpus = static_cast<int>(sysconf(_SC_NPROCESSORS_ONLN));
+    }
+
+    // cgroup v2 中进程所在的 cgroup（"0::/路径"），配额由该 cgroup 和所有上级 cgroup 中最小的一个决定
+    std::ifstream in("/proc/self/cgroup");
+    std::string line, cgroupPath;
+    while(std::getline(in, line)){
+        if(line.compare(0, 3, "0::") == 0){
+            cgroupPath = line.substr(3);
+            break;
+        }
+    }
+    while(!cgroupPath.empty()){
+        int quotaCpus = readCpuMax("/sys/fs/cgroup" + (cgroupPath == "/" ? std::string() : cgroupPath) + "/cpu.max");
+        if(quotaCpus > 0 && (cpus <= 0 || quotaCpus < cpus)){
+            cpus = quotaCpus;
+        }
+        if(cgroupPath == "/"){
+            break;
+        }
+        std::string::size_type slashIndex = cgroupPath.rfind('/');
+        cgroupPath = slashIndex == 0 || slashIndex == std::string::npos ? "/" : cgroupPath.substr(0, slashIndex);
+    }
+    return std::max(cpus, 1);
+}
+
+bool ThreadPool::overloaded(){
+    pthread_mutex_lock(&queueLocker);
+    long long now = nowMicros();
+    long long headDelay = m_workQueue.empty() ? 0 : now - m_workQueue.front().enqueueTime;
+    // 过载状态只在取出交互事件时更新，暂停接受连接后可能不再有事件取出。时间窗口已经结束并且队列为空或者队首没有超过目标时直接退出过载状态
+    if(m_overloaded && now >= m_intervalEnd && headDelay <= m_delayTarget){
+        std::cout << outHead("info") << m_name << " 线程池退出过载状态，队首排队时间 " << headDelay << " 微秒" << std::endl;
+        m_overloaded = false;
+        m_minDelay = LLONG_MAX;
+        m_intervalEnd = now + m_delayInterval;
+    }
+    bool res = m_delayTarget > 0 && (m_overloaded || headDelay > m_delayInterval);
+    pthread_mutex_unlock(&queueLocker);
+    return res;
+}
+
+std::string ThreadPool::statsJson(){
+    std::ostringstream oss;
+    oss << "[";
+    std::lock_guard<std::mutex> guard(poolsLock);
+    for(size_t i = 0; i < pools.size(); ++i){
+        ThreadPool *pool = pools[i];
+        pthread_mutex_lock(&pool->queueLocker);
+        size_t queued = pool->m_workQueue.size();
+        size_t bulkQueued = pool->m_bulkQueue.size();
+        int bulkActive = pool->m_bulkActive;
+        size_t peak = pool->m_peakQueueSize;
+        long long rejected = pool->m_rejected;
+        bool overloaded = pool->m_overloaded;
+        long long shedMarked = pool->m_shedMarked;
+        int threads = pool->m_threadNum;
+        int spawned = pool->m_spawned;
+        bool adaptive = pool->m_adaptive;
+        int minThreads = pool->m_minThreads;
+        int maxThreads = pool->m_maxThreads;
+        long long grown = pool->m_grown;
+        long long shrunk = pool->m_shrunk;
+        int blockedPercent = pool->m_blockedPercent;
+        int utilization = pool->m_utilization;
+        const char *lastAdjust = pool->m_lastAdjust;
+        int bulkLimit = pool->m_bulkLimit;
+        std::string cpuSet = pool->m_affinityGeneration > 0 ? CpuAffinity::format(pool->m_cpuSet) : "";
+        pthread_mutex_unlock(&pool->queueLocker);
+        oss << (i == 0 ? "" : ",") << "{\"name\":\"" << pool->m_name << "\",\"threads\":" << threads << ",\"spawnedThreads\":" << spawned
+            << ",\"cpus\":" << pool->m_cpus << ",\"adaptive\":" << (adaptive ? "true" : "false") << ",\"minThreads\":" << minThreads
+            << ",\"maxThreads\":" << maxThreads << ",\"grown\":" << grown << ",\"shrunk\":" << shrunk << ",\"blockedPercent\":" << blockedPercent
+            << ",\"utilization\":" << utilization << ",\"lastAdjust\":\"" << lastAdjust << "\",\"cpuSet\":\"" << cpuSet << "\""
+            << ",\"maxQueue\":" << pool->m_maxQueueSize << ",\"queued\":" << queued << ",\"bulkQueued\":" << bulkQueued
+            << ",\"bulkActive\":" << bulkActive << ",\"bulkLimit\":" << bulkLimit << ",\"peakQueued\":" << peak
+            << ",\"active\":" << pool->m_active << ",\"completed\":" << pool->m_completed << ",\"rejected\":" << rejected
+            << ",\"overloaded\":" << (overloaded ? "true" : "false") << ",\"shed\":" << shedMarked << "}";
+    }
+    oss << "]";
+    return oss.str();
+}
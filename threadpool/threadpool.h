@@ -2,26 +2,78 @@
  *  1. 用于创建线程池
  *  2. 每个线程中等待事件队列中添加新事件（EventBase 指针指向的派生类）
  *  3. 有新事件时，分配给一个线程处理，线程中调用事件的 process() 方法处理该事件
+ *  4. 服务器中有两个线程池：network 处理套接字事件，io 执行会阻塞的文件系统操作。io 线程池的队列有上限，
+ *     队列满时 appendEvent 失败，由调用者决定如何处理
+ *  5. 每个线程池记录队列长度、峰值、正在执行的事件个数、完成和拒绝的事件个数，通过 GET /stats/pools 返回
+ *  6. 事件按优先级分为交互队列和批量队列：线程优先取交互事件，每连续取 INTERACTIVE_WEIGHT 个交互事件后，批量队列不为空时取一个批量事件，
+ *     批量事件不会被饿死；同时执行的批量事件最多为 线程数 - 保留线程数，保留的线程只处理交互事件，
+ *     所有其他线程都在传输大文件时，文件列表、删除等请求仍然不需要排队
+ *  7. 过载控制（CoDel）：取出交互事件时记录它在队列中等待的时间，一个时间窗口（interval）内最短的等待时间仍然超过目标（target）时，
+ *     说明队列一直没有排空，线程池进入过载状态。过载时等待超过 target 的事件、不过载时等待超过 interval 的事件被标记为丢弃，
+ *     事件中新的请求直接返回 503（Retry-After），主线程在过载时暂停接受新连接
+ *  8. 线程数的默认值按进程可以使用的 CPU 数确定：cgroup v2 的 cpu.max 配额（向上取整）和 CPU 亲和性中较小的一个，容器中不会按宿主机的核数创建线程
+ *  9. 自适应线程数：每个调整周期根据交互事件的排队时间和线程阻塞的时间（处理事件的墙钟时间减去线程使用 CPU 和在运行队列中等待 CPU 的时间，来自 /proc/thread-self/schedstat）在 [min, max] 内调整，
+ *     一直有排队且线程大部分时间阻塞在 I/O 上（或者线程数少于 CPU 数）时增加一个线程，一直有排队但线程主要在使用 CPU 且线程数超过 CPU 数时
+ *     减少一个线程（再增加只会加剧 CPU 的争用），没有排队且线程利用率低时减少一个线程。减少的线程不退出，只是不再取出事件，之后增加时优先恢复这些线程
+ *  10. 可以把所有线程（包括之后增加的线程）绑定到一个 CPU 集合，线程在下一次取事件之前绑定自己，并把内存分配策略设置为本地节点
  */
 #ifndef THREADPOOL_H
 #define THREADPOOL_H
 #include <queue>
+#include <vector>
+#include <string>
+#include <atomic>
+#include <mutex>
 #include <stdexcept>
 
 #include <pthread.h>
-#include <semaphore.h>
 
 #include "../event/myevent.h"
+#include "../affinity/cpuaffinity.h"
+
+#define INTERACTIVE_WEIGHT 4     // 两个队列都有事件时，每处理一个批量事件之前最多连续处理的交互事件个数
+#define POOL_ADJUST_INTERVAL 500000   // 自适应线程数的调整周期（微秒）
+#define POOL_GROW_DELAY 5000          // 调整周期内最短的排队时间超过该值（微秒）时认为一直有排队
+#define POOL_BLOCKED_HIGH 50          // 阻塞时间占处理时间的百分比不低于该值时，增加线程可以提高吞吐
+#define POOL_BLOCKED_LOW 25           // 阻塞时间占处理时间的百分比低于该值时认为线程主要在使用 CPU
+#define POOL_IDLE_UTILIZATION 50      // 没有排队且线程利用率（百分比）低于该值时减少线程
+
+// 队列中的事件和加入队列的时间（微秒）
+struct QueuedEvent{
+    EventBase *event;
+    long long enqueueTime;
+};
 
 static int tnum = 0;
 class ThreadPool{
 public:
     // 初始化线程池、互斥访问时间队列的互斥量、表示队列中事件的信号量
-    ThreadPool(int threadNum);
+    // name 为线程池的名字（用于日志和统计），maxQueueSize 为队列中最多的事件个数，0 表示不限制
+    ThreadPool(int threadNum, const std::string &name = "network", int maxQueueSize = 0);
     ~ThreadPool();
 public:
-    // 向事件队列中添加一个待处理的事件，线程池中的线程会循环处理其中的事件
-    int appendEvent(EventBase* event, const std::string eventType);
+    // 向事件队列中添加一个待处理的事件，线程池中的线程会循环处理其中的事件，priority 决定放入交互队列还是批量队列
+    // 队列已满时返回 -4，事件没有加入队列，由调用者释放
+    int appendEvent(EventBase* event, const std::string eventType, EventPriority priority = PRIORITY_INTERACTIVE);
+
+    // 设置过载控制：排队时间的目标和时间窗口（微秒），target 为 0 时不做过载控制
+    void setQueueDelayTarget(long long targetMicros, long long intervalMicros);
+
+    // 线程池是否过载：最近一个时间窗口内排队时间一直超过目标，或者队列最前面的交互事件已经等待超过一个时间窗口
+    // 时间窗口结束后队首没有超过目标时在这里退出过载状态，暂停接受连接后没有事件取出也能恢复
+    bool overloaded();
+
+    // 启用自适应线程数，线程数在 [minThreads, maxThreads] 内调整。当前线程数不在范围内时立即调整到范围内，失败时返回 -1
+    int setAdaptive(int minThreads, int maxThreads);
+
+    // 将线程池的所有线程绑定到 cpuSet
+    void setCpuAffinity(const cpu_set_t &cpuSet);
+
+    // 进程可以使用的 CPU 数：cgroup v2 cpu.max 的配额（向上取整）和 CPU 亲和性中的 CPU 个数中较小的一个，至少为 1
+    static int availableCpus();
+
+    // 所有线程池的统计信息（JSON 数组）
+    static std::string statsJson();
 
 private:
     // 创建线程时指定的运行函数，参数传递 this，实现在子线程中可以访问到该对象的成员
@@ -30,13 +82,74 @@ private:
     // 在线程中执行该函数等待处理事件队列中的事件
     void run();
 
+    // 创建一个工作线程，调用前需要持有 queueLocker（构造函数中除外）
+    int spawnWorkerLocked();
+
+    // 修改可以取出事件的线程数，需要时创建新的线程，调用前需要持有 queueLocker
+    void resizeLocked(int threads);
+
+    // 到达调整周期时按排队时间和阻塞时间调整线程数，调用前需要持有 queueLocker
+    void adjustLocked(long long now);
+
+    // CPU 集合修改后在线程中绑定，appliedGeneration 为线程已经绑定的版本。调用前需要持有 queueLocker
+    void applyAffinityLocked(int &appliedGeneration);
+
+    // 当前是否有可以取出的事件，调用前需要持有 queueLocker
+    bool hasRunnableLocked() const;
+
+    // 取出交互事件时记录排队时间，更新过载状态，返回该事件是否需要丢弃。调用前需要持有 queueLocker
+    bool trackDelayLocked(long long sojourn, long long now);
+
 private:
-    int m_threadNum;                  // 线程池中的线程个数
-    pthread_t *m_threads;             // 保存线程池中的所有线程
+    int m_threadNum;                  // 可以取出事件的线程个数，序号不小于该值的线程暂停
+    int m_spawned;                    // 已经创建的线程个数
+    int m_nextIndex;                  // 下一个开始运行的线程的序号
+    std::string m_name;               // 线程池的名字
+    size_t m_maxQueueSize;            // 队列中最多的事件个数（两个队列的总数），0 表示不限制
+    int m_bulkLimit;                  // 最多同时执行的批量事件个数，其余线程保留给交互事件
     
-    std::queue<EventBase*> m_workQueue;  // 保存所有待处理的事件
+    std::queue<QueuedEvent> m_workQueue;  // 保存待处理的交互事件
+    std::queue<QueuedEvent> m_bulkQueue;  // 保存待处理的批量事件
+    int m_bulkActive;                    // 正在执行的批量事件个数
+    int m_interactiveStreak;             // 上次取出批量事件之后连续取出的交互事件个数
     pthread_mutex_t queueLocker;     // 用于互斥访问事件队列的锁
-    sem_t queueEventNum;             // 表示队列中事件个数变化的信号量
+    pthread_cond_t queueCond;        // 有新的事件或者批量事件执行完成时通知等待的线程
+
+    // 过载控制的状态，在持有 queueLocker 时修改
+    long long m_delayTarget;          // 排队时间的目标（微秒），0 表示不做过载控制
+    long long m_delayInterval;        // 时间窗口（微秒）
+    long long m_intervalEnd;          // 当前时间窗口结束的时间
+    long long m_minDelay;             // 当前时间窗口内最短的排队时间
+    bool m_overloaded;                // 上一个时间窗口内排队时间是否一直超过目标
+    long long m_shedMarked;           // 被标记为丢弃的事件个数
+
+    // 自适应线程数的状态，在持有 queueLocker 时修改
+    bool m_adaptive;                  // 是否启用自适应线程数
+    int m_minThreads;
+    int m_maxThreads;
+    int m_cpus;                       // 可以使用的 CPU 数
+    long long m_adjustEnd;            // 当前调整周期结束的时间
+    long long m_adjustMinDelay;       // 当前调整周期内交互事件最短的排队时间
+    long long m_grown;                // 增加线程的次数
+    long long m_shrunk;               // 减少线程的次数
+    int m_blockedPercent;             // 上一个调整周期内阻塞时间占处理时间的百分比
+    int m_utilization;                // 上一个调整周期内线程利用率（百分比）
+    const char *m_lastAdjust;         // 上一次调整的原因
+    std::atomic<long long> m_busyMicros;     // 当前调整周期内处理事件的墙钟时间
+    std::atomic<long long> m_blockedMicros;  // 当前调整周期内处理事件时没有使用 CPU 的时间
+
+    // 绑定的 CPU 集合，在持有 queueLocker 时修改
+    cpu_set_t m_cpuSet;
+    int m_affinityGeneration;         // 每次修改 CPU 集合时加 1，0 表示不绑定
+
+    // 统计信息，队列长度的峰值和拒绝的个数在持有 queueLocker 时修改
+    size_t m_peakQueueSize;
+    long long m_rejected;
+    std::atomic<int> m_active;             // 正在执行的事件个数
+    std::atomic<long long> m_completed;    // 执行完成的事件个数
+
+    static std::mutex poolsLock;
+    static std::vector<ThreadPool*> pools;   // 所有线程池，用于返回统计信息
 
 };
 
@@ -0,0 +1,350 @@
+#include <fstream>
+#include <random>
+#include <thread>
+#include <chrono>
+#include <cstdio>
+#include <cerrno>
+#include <ctime>
+#include <algorithm>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "uploadsession.h"
+#include "../utils/utils.h"
+#include "../checksum/checksum.h"
+#include "../storage/storageengine.h"
+#include "../storage/metaindex.h"
+#include "../storage/searchindex.h"
+
+std::mutex UploadSession::holderLock;
+std::map<std::string, int> UploadSession::holders;
+std::mutex UploadSession::digestLock;
+std::map<std::string, std::shared_ptr<SessionDigest>> UploadSession::digests;
+
+int UploadSession::create(const std::string &fileName, long long length, UploadSessionInfo &info){
+    return createSession(fileName, length, 0, info);
+}
+
+int UploadSession::createParallel(const std::string &fileName, long long length, long long partSize, UploadSessionInfo &info){
+    if(partSize <= 0){
+        return -1;
+    }
+    return createSession(fileName, length, partSize, info);
+}
+
+int UploadSession::createSession(const std::string &fileName, long long length, long long partSize, UploadSessionInfo &info){
+    if(!isValidFileName(fileName) || length < 0){
+        return -1;
+    }
+
+    // 保存会话的目录不存在时创建
+    if(mkdir(UPLOAD_SESSION_DIR, 0755) != 0 && errno != EEXIST){
+        std::cout << outHead("error") << "创建上传会话目录失败 (errno = " << errno << ")" << std::endl;
+        return -2;
+    }
+
+    // 生成随机的会话 id
+    std::random_device rd;
+    const char hexChars[] = "0123456789abcdef";
+    std::string id;
+    for(int i = 0; i < 4; ++i){
+        unsigned int value = rd();
+        for(int j = 0; j < 8; ++j){
+            id += hexChars[value & 0xf];
+            value >>= 4;
+        }
+    }
+
+    // 先创建空的暂存文件，再写入会话信息。会话信息先写到临时文件再 rename，保证重启后读到的会话信息总是完整的
+    int partFd = open(partPath(id).c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if(partFd == -1){
+        std::cout << outHead("error") << "创建上传会话 " << id << " 的暂存文件失败 (errno = " << errno << ")" << std::endl;
+        return -3;
+    }
+    // 并行分片会话预先分配整个文件，各个分片并发写入时不会因为文件扩展而产生碎片；文件系统不支持时退化为稀疏文件
+    if(partSize > 0 && length > 0 && posix_fallocate(partFd, 0, length) != 0 && ftruncate(partFd, length) != 0){
+        std::cout << outHead("error") << "上传会话 " << id << " 的暂存文件预分配失败 (errno = " << errno << ")" << std::endl;
+        close(partFd);
+        unlink(partPath(id).c_str());
+        return -3;
+    }
+    close(partFd);
+
+    std::string tmpInfoPath = infoPath(id) + ".tmp";
+    std::ofstream ofs(tmpInfoPath, std::ios::out | std::ios::trunc);
+    ofs << fileName << "\n" << length << "\n" << partSize << "\n";
+    ofs.close();
+    if(!ofs || rename(tmpInfoPath.c_str(), infoPath(id).c_str()) != 0){
+        std::cout << outHead("error") << "保存上传会话 " << id << " 的信息失败" << std::endl;
+        unlink(tmpInfoPath.c_str());
+        unlink(partPath(id).c_str());
+        return -4;
+    }
+
+    info.id = id;
+    info.fileName = fileName;
+    info.length = length;
+    info.offset = 0;
+    info.partSize = partSize;
+    return 0;
+}
+
+int UploadSession::load(const std::string &id, UploadSessionInfo &info){
+    if(!isValidId(id)){
+        return -1;
+    }
+
+    std::ifstream ifs(infoPath(id), std::ios::in);
+    std::string fileName;
+    long long length = -1;
+    long long partSize = 0;
+    if(!ifs || !std::getline(ifs, fileName) || !(ifs >> length) || length < 0){
+        return -1;
+    }
+    if(!(ifs >> partSize)){
+        partSize = 0;
+    }
+
+    // 已经提交的偏移就是暂存文件的长度，因此不需要额外记录，重启后也不会和数据不一致
+    struct stat partStat;
+    if(stat(partPath(id).c_str(), &partStat) != 0){
+        return -1;
+    }
+
+    info.id = id;
+    info.fileName = fileName;
+    info.length = length;
+    info.offset = partSize > 0 ? 0 : partStat.st_size;
+    info.partSize = partSize;
+    return 0;
+}
+
+int UploadSession::openPart(const UploadSessionInfo &info){
+    return open(partPath(info.id).c_str(), O_WRONLY);
+}
+
+int UploadSession::markPartDone(const UploadSessionInfo &info, long long partNumber){
+    // 每个分片号占一行，以 O_APPEND 写入，多个连接同时完成分片时也不会相互覆盖
+    int doneFd = open(donePath(info.id).c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if(doneFd == -1){
+        return -1;
+    }
+    std::string line = std::to_string(partNumber) + "\n";
+    ssize_t ret = write(doneFd, line.c_str(), line.size());
+    close(doneFd);
+    return ret == static_cast<ssize_t>(line.size()) ? 0 : -1;
+}
+
+int UploadSession::loadDoneParts(const UploadSessionInfo &info, std::set<long long> &doneParts){
+    std::ifstream ifs(donePath(info.id), std::ios::in);
+    long long partNumber = 0;
+    while(ifs >> partNumber){
+        doneParts.insert(partNumber);
+    }
+    return 0;
+}
+
+std::string UploadSession::formatParts(const std::set<long long> &doneParts){
+    std::string result;
+    std::set<long long>::const_iterator it = doneParts.begin();
+    while(it != doneParts.end()){
+        long long first = *it;
+        long long last = first;
+        while(++it != doneParts.end() && *it == last + 1){
+            last = *it;
+        }
+        if(!result.empty()){
+            result += ",";
+        }
+        result += std::to_string(first);
+        if(last != first){
+            result += "-" + std::to_string(last);
+        }
+    }
+    return result;
+}
+
+void UploadSession::hashWritten(const std::string &id, long long offset, const char *data, long long len){
+    std::shared_ptr<SessionDigest> digest;
+    {
+        std::lock_guard<std::mutex> guard(digestLock);
+        std::shared_ptr<SessionDigest> &slot = digests[id];
+        if(!slot){
+            slot = std::make_shared<SessionDigest>();
+        }
+        digest = slot;
+    }
+    std::lock_guard<std::mutex> guard(digest->lock);
+    if(!digest->valid || offset > digest->hashedLen){
+        // 前面还有没有写入的数据（乱序的分片，或者重启前写入的数据），这部分在提交时从文件中读取
+        return;
+    }
+    if(offset < digest->hashedLen){
+        digest->valid = false;
+        return;
+    }
+    digest->builder.update(data, len);
+    digest->hashedLen += len;
+}
+
+std::shared_ptr<SessionDigest> UploadSession::takeDigest(const std::string &id){
+    std::lock_guard<std::mutex> guard(digestLock);
+    std::map<std::string, std::shared_ptr<SessionDigest>>::iterator it = digests.find(id);
+    if(it == digests.end()){
+        return nullptr;
+    }
+    std::shared_ptr<SessionDigest> digest = it->second;
+    digests.erase(it);
+    return digest;
+}
+
+int UploadSession::complete(const UploadSessionInfo &info){
+    // 写入时连续计算到的位置之后的数据（顺序追加时没有）从暂存文件中读取，补齐校验值后交给存储引擎，引擎不再读取文件计算
+    // 此时暂存文件刚刚写入，通常还在页缓存中。普通文件存储中暂存文件会原子地 rename 为目标文件，其他连接不会读到只写了一部分的文件
+    std::shared_ptr<SessionDigest> sessionDigest = takeDigest(info.id);
+    DigestBuilder builder;
+    long long hashedLen = 0;
+    if(sessionDigest){
+        std::lock_guard<std::mutex> guard(sessionDigest->lock);
+        if(sessionDigest->valid){
+            builder = sessionDigest->builder;
+            hashedLen = sessionDigest->hashedLen;
+        }
+    }
+    FileDigest digest;
+    bool hasDigest = false;
+    if(hashedLen == info.length){
+        hasDigest = true;
+    }else{
+        int fd = open(partPath(info.id).c_str(), O_RDONLY);
+        hasDigest = fd != -1 && DigestStore::computeFrom(fd, hashedLen, builder) == 0;
+        if(fd != -1){
+            close(fd);
+        }
+    }
+    if(hasDigest){
+        digest = builder.finish();
+    }
+    if(StorageEngine::current()->importFile(partPath(info.id), info.fileName, hasDigest ? &digest : nullptr) != 0){
+        std::cout << outHead("error") << "上传会话 " << info.id << " 的暂存文件保存失败 (errno = " << errno << ")" << std::endl;
+        return -1;
+    }
+    unlink(infoPath(info.id).c_str());
+    unlink(donePath(info.id).c_str());
+    MetaIndex::update(info.fileName);
+    SearchIndex::add(info.fileName);
+    return 0;
+}
+
+bool UploadSession::acquire(const std::string &id, bool exclusive){
+    std::lock_guard<std::mutex> guard(holderLock);
+    std::map<std::string, int>::iterator it = holders.find(id);
+    if(it == holders.end()){
+        holders[id] = exclusive ? -1 : 1;
+        return true;
+    }
+    if(exclusive || it->second < 0){
+        return false;
+    }
+    ++it->second;
+    return true;
+}
+
+void UploadSession::release(const std::string &id, bool exclusive){
+    std::lock_guard<std::mutex> guard(holderLock);
+    std::map<std::string, int>::iterator it = holders.find(id);
+    if(it == holders.end()){
+        return;
+    }
+    if(exclusive || --it->second <= 0){
+        holders.erase(it);
+    }
+}
+
+int UploadSession::removeExpired(long long ttlSeconds){
+    DIR *dir = opendir(UPLOAD_SESSION_DIR);
+    if(dir == nullptr){
+        return 0;
+    }
+    // 会话的所有文件都以会话 id 开头（包括写入会话信息时遗留的 .info.tmp），按 id 取最后一次修改的时间
+    std::map<std::string, time_t> lastWrite;
+    struct dirent *entry;
+    while((entry = readdir(dir)) != nullptr){
+        std::string name = entry->d_name;
+        std::string id = name.substr(0, 32);
+        struct stat fileStat;
+        if(name.size() <= 32 || name[32] != '.' || !isValidId(id)
+                || stat((std::string(UPLOAD_SESSION_DIR) + "/" + name).c_str(), &fileStat) != 0){
+            continue;
+        }
+        time_t &last = lastWrite[id];
+        last = std::max(last, fileStat.st_mtime);
+    }
+    closedir(dir);
+
+    int removed = 0;
+    time_t now = time(nullptr);
+    for(std::map<std::string, time_t>::const_iterator it = lastWrite.begin(); it != lastWrite.end(); ++it){
+        if(now - it->second <= ttlSeconds){
+            continue;
+        }
+        // 在锁内检查并删除，删除期间其他连接无法占用该会话，占用之后加载会话时会返回不存在
+        std::lock_guard<std::mutex> guard(holderLock);
+        if(holders.find(it->first) != holders.end()){
+            continue;
+        }
+        unlink(infoPath(it->first).c_str());
+        unlink((infoPath(it->first) + ".tmp").c_str());
+        unlink(partPath(it->first).c_str());
+        unlink(donePath(it->first).c_str());
+        takeDigest(it->first);
+        ++removed;
+    }
+    return removed;
+}
+
+void UploadSession::startCleanup(long long ttlSeconds){
+    std::thread([ttlSeconds](){
+        while(true){
+            int removed = removeExpired(ttlSeconds);
+            if(removed > 0){
+                std::cout << outHead("info") << "删除了 " << removed << " 个过期的上传会话" << std::endl;
+            }
+            std::this_thread::sleep_for(std::chrono::seconds(UPLOAD_SESSION_CLEANUP_INTERVAL));
+        }
+    }).detach();
+}
+
+bool UploadSession::isValidFileName(const std::string &fileName){
+    if(fileName.empty() || fileName[0] == '.'){
+        return false;
+    }
+    return fileName.find('/') == std::string::npos && fileName.find('\\') == std::string::npos;
+}
+
+std::string UploadSession::infoPath(const std::string &id){
+    return std::string(UPLOAD_SESSION_DIR) + "/" + id + ".info";
+}
+
+std::string UploadSession::partPath(const std::string &id){
+    return std::string(UPLOAD_SESSION_DIR) + "/" + id + ".part";
+}
+
+std::string UploadSession::donePath(const std::string &id){
+    return std::string(UPLOAD_SESSION_DIR) + "/" + id + ".done";
+}
+
+bool UploadSession::isValidId(const std::string &id){
+    if(id.size() != 32){
+        return false;
+    }
+    for(char c : id){
+        if(!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f'))){
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,124 @@
+/*  文件说明：
+ *  1. 可续传上传协议中的上传会话，会话信息和暂存数据都保存在磁盘上，服务器重启后可以继续上传
+ *  2. POST /uploads/文件名 创建会话（首部 Upload-Length 指定文件总长度），返回的 Location 为 /uploads/会话id
+ *  3. HEAD /uploads/会话id 查询已经提交的偏移（Upload-Offset），即暂存文件的实际长度
+ *  4. PATCH /uploads/会话id 携带 Upload-Offset 首部，将消息体追加到暂存文件；全部接收后原子地 rename 到 filedir 中
+ *  5. 会话保存在 filedir/.uploads 中：会话id.info 保存文件名和总长度，会话id.part 保存已经接收的数据
+ *  6. 创建会话时指定 Upload-Part-Size 则为并行分片会话：暂存文件预先分配为总长度，客户端可以通过多个连接并发地
+ *     PUT /uploads/会话id/分片号（从 1 开始），每个分片由处理该连接的线程用 pwrite 写到最终的偏移；
+ *     完成的分片号追加到 会话id.done 中，最后 POST /uploads/会话id/complete 提交分片清单，检查所有分片都已完成后 rename
+ *     HEAD 和清单不完整时的 409 通过 Upload-Parts-Done 首部返回已经完成的分片号（区间列表，如 1-3,5），客户端只重传缺少的分片
+ *  7. 会话在内存中有一个持有计数：PATCH 和提交分片清单独占会话（在独占期间检查偏移，两个连接不会同时追加到同一个偏移），
+ *     并行分片的 PUT 共享会话。已经被占用时请求返回 409，客户端稍后重试
+ *  8. 超过 UPLOAD_SESSION_TTL 秒没有任何写入的会话被后台线程删除（没有被占用时），客户端放弃的上传不会一直占用磁盘
+ *  9. 写入暂存文件的数据从文件开头连续时边写入边计算校验值（只保存在内存中），提交时只读取没有计算过的部分：
+ *     顺序追加的会话不再重读文件；乱序完成的分片或服务器重启之后，从连续计算到的位置读取到文件末尾补齐
+ */
+#ifndef UPLOADSESSION_H
+#define UPLOADSESSION_H
+#include <string>
+#include <set>
+#include <map>
+#include <memory>
+#include <mutex>
+
+#include "../checksum/checksum.h"
+
+#define UPLOAD_SESSION_DIR "filedir/.uploads"    // 保存上传会话的目录，和 filedir 在同一个文件系统中，保证 rename 是原子的
+#define UPLOAD_SESSION_TTL (24 * 3600)           // 会话最后一次写入之后保留的秒数
+#define UPLOAD_SESSION_CLEANUP_INTERVAL 600      // 检查过期会话的间隔（秒）
+
+// 一个上传会话的信息
+struct UploadSessionInfo{
+    std::string id;             // 会话 id，由 32 个十六进制字符组成
+    std::string fileName;       // 上传完成后在 filedir 中保存的文件名
+    long long length = 0;       // 文件的总长度
+    long long offset = 0;       // 已经提交的长度，即暂存文件的实际长度（只用于顺序追加的会话）
+    long long partSize = 0;     // 并行分片会话中每个分片的长度（最后一个分片可以更短），为 0 表示顺序追加的会话
+
+    // 并行分片会话的分片个数
+    long long partCount() const { return partSize > 0 ? (length + partSize - 1) / partSize : 0; }
+};
+
+// 会话边写入边计算的校验值，只覆盖暂存文件中从开头连续写入的 hashedLen 个字节
+struct SessionDigest{
+    std::mutex lock;            // 并行分片的多个连接可能同时写入
+    DigestBuilder builder;
+    long long hashedLen = 0;    // 已经计算的长度
+    bool valid = true;          // 已经计算过的位置被重新写入（如重传的分片）时失效，提交时读取整个文件
+};
+
+// 正在通过 PATCH 追加数据的连接的状态，一个 PATCH 的消息体可能需要多次 HandleRecv 事件才能接收完成
+struct UploadProgress{
+    UploadSessionInfo info;     // 对应的上传会话
+    int partFd = -1;            // 打开的暂存文件
+    long long writeOffset = 0;  // 下一个字节在暂存文件中的偏移，使用 pwrite 写入
+    long long bodyRemain = 0;   // 当前 PATCH 或 PUT 消息体中还没有接收的字节数
+    long long partNumber = 0;   // 并行分片会话中正在写入的分片号，PATCH 时为 0
+};
+
+class UploadSession{
+public:
+    // 创建一个新的上传会话，成功时返回 0，并将会话信息保存到 info 中
+    static int create(const std::string &fileName, long long length, UploadSessionInfo &info);
+
+    // 创建一个并行分片会话，暂存文件预先分配为总长度，每个分片可以由不同的连接并发写入
+    static int createParallel(const std::string &fileName, long long length, long long partSize, UploadSessionInfo &info);
+
+    // 根据会话 id 从磁盘中加载会话信息，offset 为暂存文件的当前长度。会话不存在时返回 -1
+    static int load(const std::string &id, UploadSessionInfo &info);
+
+    // 以只写的方式打开会话的暂存文件，返回文件描述符，失败时返回 -1。数据使用 pwrite 写到指定偏移
+    static int openPart(const UploadSessionInfo &info);
+
+    // 记录一个并行分片已经写入完成
+    static int markPartDone(const UploadSessionInfo &info, long long partNumber);
+
+    // 获取并行分片会话中已经完成的分片号
+    static int loadDoneParts(const UploadSessionInfo &info, std::set<long long> &doneParts);
+
+    // 将已经完成的分片号格式化为区间列表，如 "1-3,5,8-9"，客户端据此只重传缺少的分片
+    static std::string formatParts(const std::set<long long> &doneParts);
+
+    // 记录写入暂存文件 offset 处的 len 个字节：正好接在已经计算的位置之后时继续计算校验值
+    static void hashWritten(const std::string &id, long long offset, const char *data, long long len);
+
+    // 会话的数据全部接收完成后，将暂存文件原子地重命名为最终的文件，并删除会话信息
+    static int complete(const UploadSessionInfo &info);
+
+    // 检查文件名是否可以作为 filedir 中的文件名（不包含路径分隔符，不是隐藏文件）
+    static bool isValidFileName(const std::string &fileName);
+
+    // 占用会话，exclusive 为 true 时独占（PATCH、提交分片清单），否则共享（PUT 分片）。会话已经被占用且不能共享时返回 false
+    static bool acquire(const std::string &id, bool exclusive);
+
+    // 释放 acquire 占用的会话
+    static void release(const std::string &id, bool exclusive);
+
+    // 删除超过 ttlSeconds 秒没有写入且没有被占用的会话，返回删除的会话个数
+    static int removeExpired(long long ttlSeconds);
+
+    // 启动定期删除过期会话的后台线程
+    static void startCleanup(long long ttlSeconds);
+
+private:
+    static std::string infoPath(const std::string &id);
+    static std::string partPath(const std::string &id);
+    static std::string donePath(const std::string &id);
+
+    // 创建暂存文件并保存会话信息，两种会话共用
+    static int createSession(const std::string &fileName, long long length, long long partSize, UploadSessionInfo &info);
+
+    // 会话 id 只能由十六进制字符组成，避免通过 id 访问其他目录
+    static bool isValidId(const std::string &id);
+
+    // 取出并删除会话在内存中的校验值，没有时返回 nullptr
+    static std::shared_ptr<SessionDigest> takeDigest(const std::string &id);
+
+    static std::mutex holderLock;                       // 保护 holders
+    static std::map<std::string, int> holders;          // 会话 id -> 共享的个数，独占时为 -1
+    static std::mutex digestLock;                       // 保护 digests
+    static std::map<std::string, std::shared_ptr<SessionDigest>> digests;   // 会话 id -> 边写入边计算的校验值
+};
+
+#endif
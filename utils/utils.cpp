@@ -85,4 +85,13 @@ void setNonBlocking(int fd) {
     }
 }
 
-} // namespace webserver
\ No newline at end of file
+} // namespace webserver
+std::string outHead(const std::string logType) {
+    if (logType == "error") {
+        return webserver::createLogPrefix(webserver::LogLevel::ERROR);
+    }
+    if (logType == "warn") {
+        return webserver::createLogPrefix(webserver::LogLevel::WARNING);
+    }
+    return webserver::createLogPrefix(webserver::LogLevel::INFO);
+}
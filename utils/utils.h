@@ -9,6 +9,7 @@
 #include <sys/time.h>
 #include <sys/epoll.h>
 #include <fcntl.h>
+#include <unistd.h>
 
 namespace webserver {
 
@@ -122,4 +123,11 @@ private:
     int fd_;
 };
 
-} // namespace webserver
\ No newline at end of file
+} // namespace webserver
+
+/**
+ * @brief 生成带时间戳的日志前缀（旧接口，事件处理和存储等模块使用）
+ * @param logType 日志类型："info"、"warn"、"error"，其他类型按"info"输出
+ * @return 格式化的日志前缀字符串，格式同webserver::createLogPrefix
+ */
+std::string outHead(const std::string logType);